@@ -36,6 +36,8 @@
 #include <sys/ioctl.h>
 #include <sys/file.h>
 
+#include <pthread.h>
+
 FILE *logfile=NULL;
 char *logfile_path=NULL;
 
@@ -46,6 +48,16 @@ u8 is_skip=0;
 #  include <sys/sysctl.h>
 #endif /* __APPLE__ || __FreeBSD__ || __OpenBSD__ */
 
+#ifdef __linux__
+#  include <sys/prctl.h>
+#endif /* __linux__ */
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif /* ^__AVX2__ */
+
 /* For systems that have sched_setaffinity; right now just Linux, but one
    can hope... */
 
@@ -67,7 +79,7 @@ u8 is_skip=0;
    really makes no sense to haul them around as function parameters. */
   
 
-u8 virgin_bit_mini[MAP_SIZE>>3]; 
+u8* virgin_bit_mini; 
 
 u8* stage_name_old;
 
@@ -119,6 +131,7 @@ EXP_ST u8  skip_deterministic=1,        /* Skip deterministic stages?       */
            skip_requested,            /* Skip request, via SIGUSR1        */
            run_over10m,               /* Run time over 10 minutes?        */
            persistent_mode,           /* Running in persistent mode?      */
+           snapshot_mode,             /* Restoring from a snapshot?       */
            deferred_mode,             /* Deferred forkserver mode?        */
            fast_cal;                  /* Try to calibrate faster?         */
 
@@ -135,13 +148,27 @@ static s32 forksrv_pid,               /* PID of the fork server           */
 EXP_ST u8* trace_bits;                /* SHM with instrumentation bitmap  */
 EXP_ST u8* laf_trace_bits;                /* SHM with instrumentation bitmap  */
 
-EXP_ST u8  virgin_bits[MAP_SIZE],     /* Regions yet untouched by fuzzing */
-           virgin_tmout[MAP_SIZE],    /* Bits we haven't seen in tmouts   */
-           virgin_crash[MAP_SIZE];    /* Bits we haven't seen in crashes  */
+static u32 map_size = MAP_SIZE;       /* Bytes in trace_bits, laf map     */
+
+EXP_ST u8  *virgin_bits,              /* Regions yet untouched by fuzzing */
+           *virgin_tmout,             /* Bits we haven't seen in tmouts   */
+           *virgin_crash;             /* Bits we haven't seen in crashes  */
+
+EXP_ST u8* laf_virgin_bits; 
+
+static u32 virgin_edges,              /* Bytes touched in virgin_bits     */
+           virgin_laf_bits;           /* Bits set in laf_virgin_bits      */
 
-EXP_ST u8  laf_virgin_bits[MAP_SIZE]; 
+static u8  trace_classified;          /* trace_bits hit counts bucketed?  */
 
-u64 chose_nums[MAP_SIZE];
+static u8  laf_sparse;                /* Binary lists touched laf bytes   */
+static u8  laf_self_clean;            /* Binary clears the laf map itself */
+static u32* laf_touch;                /* Touched-byte list after laf map  */
+
+static u8  map_dirty;                 /* Binary flags dirty map lines     */
+static u8* trace_dirty;               /* Dirty line flags after trace map */
+
+u64* chose_nums;
 u64 min_chose_nums;
 
 //静态分析得到的边信息
@@ -150,22 +177,53 @@ struct branch_msg{
     // branch id: 65538意味着没有进行插桩，但存在子分支转移
     //            65537意味着不存在子分支转移
     //            65539意味这该子分支转移已经被发现
-    int son1_branch_id;
-    int son2_branch_id;
-    int count;
-    struct branch_msg *next;
+    u32 son1_branch_id;
+    u32 son2_branch_id;
 
 };  
  
 int byte_deter_branch_count=0;
 
-struct branch_msg branch_msg_list[MAP_SIZE];
+/* Static branch graph loaded with -b, in CSR form: the records of edge e
+   are branch_msg_list[branch_msg_off[e] .. branch_msg_off[e + 1]). Both
+   arrays may point into an mmap'd cache file. */
+
+static u32* branch_msg_off;           /* map_size + 1 record offsets      */
+static struct branch_msg* branch_msg_list; /* Child records, by edge      */
+static u32  branch_msg_cnt;           /* Number of child records          */
+
+/* Frontier tracking (-p frontier): an edge is on the frontier if it has been
+   covered, but some of its static children are still virgin. The reverse
+   graph maps a child back to its parents so that the set can be updated as
+   virgin_bits clear. */
 
+static u8   frontier_mode,            /* Frontier-guided scheduling?      */
+            frontier_changed;         /* Frontier moved since last cull?  */
+static u8*  frontier_bits;            /* Frontier edges, as trace_mini    */
+static u32* frontier_pending;         /* Virgin children left, per edge   */
+static u32* frontier_parent_off;      /* map_size + 1 parent offsets      */
+static u32* frontier_parents;         /* Parent edges, by child           */
+static u32  frontier_edges;           /* Edges currently on the frontier  */
 
-static u8  var_bytes[MAP_SIZE];       /* Bytes that appear to be variable */
+
+static u8* var_bytes;                 /* Bytes that appear to be variable */
+
+static u8 *first_trace,               /* First trace seen by calibration  */
+          *clean_trace;               /* Trace of the trimmed test case   */
 
 static s32 shm_id;                    /* ID of the SHM region             */
 static s32 laf_shm_id;                    /* ID of the SHM region             */
+static s32 shm_fuzz_id = -1;          /* ID of the test case SHM region   */
+static s32 shm_batch_id = -1;         /* ID of the batch SHM region       */
+static s32 shm_cmplog_id = -1;        /* ID of the cmplog SHM region      */
+
+static u8* shm_fuzz;                  /* Test case SHM: u32 len, data     */
+static u8* shm_batch;                 /* Batch SHM, see BATCH_* in config */
+
+static struct cmplog_map* cmplog;     /* Comparison log, see config.h     */
+
+static u32 batch_cnt,                 /* Inputs in the batch being run    */
+           batch_seen;                /* Inputs done at the last SIGALRM  */
 
 static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
                    clear_screen = 1,  /* Window resized?                  */
@@ -176,6 +234,7 @@ EXP_ST u32 queued_paths,              /* Total number of queued testcases */
            queued_at_start,           /* Total number of initial inputs   */
            queued_discovered,         /* Items discovered during this run */
            queued_imported,           /* Items imported via -S            */
+           sync_skipped,              /* Imports ruled out by cov files   */
            queued_favored,  
            queued_with_cov,           /* Paths with new coverage bytes    */
            pending_not_fuzzed,        /* Queued but not done yet          */
@@ -218,6 +277,23 @@ static s32 splicing_with = -1;        /* Splicing with which test case?   */
 
 static u32 master_id, master_max;     /* Master instance job splitting    */
 
+static u32 group_size,                /* Workers in our -j group          */
+           group_worker;              /* Our index in the group           */
+
+static u8  *group_base,               /* Sync ID the worker IDs build on  */
+           *group_virgin,             /* Virgin maps shared by the group  */
+           *group_cpus;               /* CPU cores taken by the group     */
+
+static u32 *group_claims,             /* Claim words, see group_claim()   */
+           *group_held,               /* Claim word of the current entry  */
+           group_round;               /* Round we are claiming entries in */
+
+static u8  group_claimed,             /* Claimed anything this pass?      */
+           group_waited,              /* Skipped an entry being fuzzed?   */
+           group_ahead;               /* Skipped one from a later round?  */
+
+static s32 *group_pids;               /* Other workers (worker 0 only)    */
+
 static u32 syncing_case;              /* Syncing with case #...           */
 
 static u32 stage_cur_byte,            /* Byte offset of current stage op  */
@@ -230,6 +306,8 @@ static u8  stage_val_type;            /* Value type (STAGE_VAL_*)         */
 static u64 stage_finds[36],           /* Patterns found per fuzz stage    */
            stage_cycles[36];          /* Execs per fuzz stage             */
 
+static u64 byte_execs_saved;          /* byte_ascii execs pruned away     */
+
 static u32 rand_cnt;                  /* Random number counter            */
 
 static u64 total_cal_us,              /* Total calibration time (us)      */
@@ -257,47 +335,107 @@ struct queue_entry {
   u8* fname;                          /* File name for the test case      */
   u32 len;                            /* Input length                     */
 
+  u32 id;                             /* Index into queue_buf[] and qhot  */
+
   u8  cal_failed,                     /* Calibration failed?              */
       trim_done,                      /* Trimmed?                         */
-      was_fuzzed,                     /* Had any fuzzing done yet?        */
       passed_det,                     /* Deterministic stages passed?     */
       has_new_cov,                    /* Triggers new coverage?           */ 
       var_behavior,                   /* Variable behavior?               */
-      favored,                        /* Currently favored?               */
+      cmplog_done,                    /* Went through the cmplog stage?   */
       fs_redundant; 
   u8 find_new_laf_branch;
 
   // father_diff：与父种子不同的字段起始位置，father_diff_count：与父种子不同的字段数量
   int father_diff,father_diff_count,char_str_count;  
 
-  u32 bitmap_size,                    /* Number of bits set in bitmap     */
-      exec_cksum; 
+  u32 exec_cksum; 
 
-  u64 exec_us,                        /* Execution time (us)              */
-      handicap,                       /* Number of queue cycles behind    */
-      depth,                          /* Path depth                       */
+  u64 handicap,                       /* Number of queue cycles behind    */
       path_total,
       extra_edge_num;
   int    extra_laf_count;
  
-  u8 *byte_analyse;
+  u8* eff;                            /* Effect map, 2 bits/byte (EFF_*)  */
 
   u8* trace_mini;                     /* Trace bytes, if kept             */  
   u32 tc_ref;                         /* Trace bytes ref count            */
 
-  struct queue_entry *next,           /* Next element, if any             */
-                     *next_100,       /* 100 elements ahead               */
-                     *father;
+  u8  fav_forced,                     /* Favored as an unfuzzed laf find  */
+      fav_counted;                    /* trace_mini counted in fav_cover  */
+
+  u32 frontier_hits,                  /* Frontier edges in the trace      */
+      fuzz_level,                     /* Times picked by fuzz_one()       */
+      rare_edge;                      /* Least hit edge in the trace      */
+
+  struct queue_entry *father;         /* Entry this one was derived from  */
+
+  u64 io_seq;                         /* Write job that creates fname     */
+
+  u32 group_src,                      /* -j worker that found the entry   */
+      group_id;                       /* Its ID in that worker's queue    */
 
 };
 
-static struct queue_entry *queue,     /* Fuzzing queue (linked list)      */
+static struct queue_entry *queue,     /* First entry of the queue         */
                           *queue_cur, /* Current offset within the queue  */
-                          *queue_top, /* Top of the list                  */
-                          *q_prev100; /* Previous 100 marker              */
+                          *queue_top; /* Most recently added entry        */
+
+/* The queue is an array of entries indexed by id (queue_buf[q->id] == q).
+   The fields that scheduling and culling look at for every entry are kept
+   out of struct queue_entry, in parallel arrays indexed the same way. */
+
+static struct queue_entry** queue_buf;/* Queue entries, by id             */
+static u32 queue_buf_size;            /* Allocated slots in the arrays    */
+
+static struct {
+
+  u8*  favored;                       /* Currently favored?               */
+  u8*  was_fuzzed;                    /* Had any fuzzing done yet?        */
+  u32* bitmap_size;                   /* Number of bits set in bitmap     */
+  u64* exec_us;                       /* Execution time (us)              */
+  u64* depth;                         /* Path depth                       */
 
-static struct queue_entry*
-  top_rated[MAP_SIZE];                /* Top entries for bitmap bytes     */
+} qhot;
+
+static struct queue_entry**
+  top_rated;                          /* Top entries for bitmap bytes     */
+
+/* State of the incremental favored set, see cull_queue_orig(). */
+
+static u32 *fav_cover,                /* Favored entries hitting the edge */
+           *cull_dirty,               /* Edges to re-check on next cull   */
+           cull_dirty_cnt,            /* Entries in cull_dirty[]          */
+           cull_seen,                 /* Queue entries already considered */
+           *fav_forced_ids,           /* Entries with fav_forced set      */
+           fav_forced_cnt,            /* Entries in fav_forced_ids[]      */
+           fav_forced_size;           /* Allocated fav_forced_ids[] slots */
+
+static u8  *cull_in_dirty,            /* Edge is in cull_dirty[]?         */
+           cull_rebuilding;           /* Full rebuild in progress?        */
+
+static u64 cull_cycle = ~0ULL;        /* Queue cycle of last full rebuild */
+
+/* Seed scheduler, selected with -p. skip_seed() decides whether fuzz_one()
+   passes over the current entry, energy() adjusts the score computed by
+   calculate_score() and new_find() is told about every entry that makes it
+   into the queue, with its trace still in trace_bits. Schedulers that set
+   track_hits get per-edge execution counts in chose_nums[]. */
+
+struct seed_sched {
+
+  u8* name;                           /* Name used with -p                */
+  u8  track_hits;                     /* Needs chose_nums[]?              */
+
+  u8   (*skip_seed)(struct queue_entry* q);
+  u32  (*energy)(struct queue_entry* q, u32 perf_score);
+  void (*new_find)(struct queue_entry* q);
+
+};
+
+static struct seed_sched* sched;      /* Active seed scheduler            */
+static u8* sched_name;                /* Scheduler requested with -p      */
+static u64 hits_counted_at;           /* total_execs of last hit count    */
 
 struct extra_data {
   u8* data;                           /* Dictionary token data            */
@@ -341,6 +479,7 @@ enum {
            STAGE_CLUSTER,
            STAGE_BYTE_DETE,
            STAGE_BYTE_CHANGE,
+           STAGE_CMPLOG,
 };
 
 /* Stage value types */
@@ -351,6 +490,16 @@ enum {
   /* 02 */ STAGE_VAL_BE
 };
 
+/* What changing an input byte was seen to do, as kept in effect maps.
+   Higher values win. */
+
+enum {
+  /* 00 */ EFF_UNTESTED,
+  /* 01 */ EFF_DEAD,                  /* Same path as the entry itself    */
+  /* 02 */ EFF_PATH,                  /* Different path, or new edges     */
+  /* 03 */ EFF_LAF                    /* New laf bits                     */
+};
+
 /* Execution status fault codes */
 
 enum {
@@ -377,14 +526,11 @@ static u64 get_cur_time(void) {
 }
 
 
+/* Discovered edges, kept up to date by has_new_bits(). */
+
 int get_branch_size(){
-  int i=0,count=0;
-  for(;i<MAP_SIZE;i++){
-     if(virgin_bits[i]!=255){
-       count+=1;
-     }
-  }
-  return count;
+
+  return virgin_edges;
 
 }
 
@@ -403,258 +549,416 @@ static u64 get_cur_time_us(void) {
 }
 
 
-/* Generate a random number (from 0 to limit - 1). This may
-   have slight bias. */
+/* Random numbers come from xoshiro256**, generated RAND_BUF at a time;
+   the state is reseeded from /dev/urandom every RESEED_RNG refills or so.
+   random() is left to the odd non-fuzzing use. */
 
-static inline u32 UR(u32 limit) {
+static u64 rand_state[4];             /* xoshiro256** state               */
+static u64 rand_buf[RAND_BUF];        /* Numbers not handed out yet       */
+static u32 rand_pos = RAND_BUF;       /* Next one in rand_buf[]           */
+
+/* hash.h only has ROL64 on x86_64, so we bring our own. */
+
+static inline u64 rotl64(u64 x, u32 r) {
+
+  return (x << r) | (x >> (64 - r));
+
+}
+
+static void rand_refill(void) {
+
+  u64* st = rand_state;
+  u32  i;
 
   if (unlikely(!rand_cnt--)) {
 
-    u32 seed[2];
+    u32 seed;
 
+    ck_read(dev_urandom_fd, rand_state, sizeof(rand_state), "/dev/urandom");
     ck_read(dev_urandom_fd, &seed, sizeof(seed), "/dev/urandom");
 
-    srandom(seed[0]);
-    rand_cnt = (RESEED_RNG / 2) + (seed[1] % RESEED_RNG);
+    if (!(st[0] | st[1] | st[2] | st[3])) st[0] = 1;
+
+    rand_cnt = (RESEED_RNG / 2) + (seed % RESEED_RNG);
 
   }
 
-  return random() % limit;
+  for (i = 0; i < RAND_BUF; i++) {
+
+    u64 t = st[1] << 17;
+
+    rand_buf[i] = rotl64(st[1] * 5, 7) * 9;
+
+    st[2] ^= st[0];
+    st[3] ^= st[1];
+    st[1] ^= st[2];
+    st[0] ^= st[3];
+    st[2] ^= t;
+    st[3]  = rotl64(st[3], 45);
+
+  }
+
+  rand_pos = 0;
+
+}
+
+
+/* Generate a random number (from 0 to limit - 1). This may
+   have slight bias. */
+
+static inline u32 UR(u32 limit) {
+
+  if (unlikely(rand_pos == RAND_BUF)) rand_refill();
+
+  return ((rand_buf[rand_pos++] >> 32) * limit) >> 32;
 
 }
 
 
 //##########################################################均值漂移算法-start 
 
+/* Mean-shift clustering of the offsets where a havoc output differs from
+   its parent. Diff offsets are appended in ascending order, so the kernel
+   window of every point is found with a binary search and contains at most
+   2 * cluster_width + 1 entries. Clusters are kept as [start, end) ranges
+   into the offset array. Everything lives in one scratch arena that is
+   allocated on first use and reused for every exec. */
+
 #define CLUSTER_EPSILON 1.5 
 
-#define ORIGIN_POINT 1
-#define SHIFT_POINT 2
-#define STOP_POINT 3
 #define MAX_POINT 4000 
 
-//停止移动的阈值（当最大的移动距离小于该值时，停止进行均值移动）
+/* Stop shifting once the largest squared move drops to this value. */
+
 #define EPSILON_SQR  1
 
 #define cluster_width 10
 
 #define kernel_bandwidth 20
 
-int clusters_size=0;  
-
-struct Points{
-    int values[MAX_POINT]; 
-    int size;
-};
+/* Singleton clusters closer than this to a neighbour get merged into it. */
 
-struct Cluster {
+#define CLUSTER_MERGE_DIST 4
 
-    double mode;
+struct diff_cluster {
 
-    int size; 
+  double mode;                        /* Largest shifted value in cluster */
+  u32 size;                           /* Number of member points          */
+  u32 start, end;                     /* [start, end) into ms.points      */
 
-    int original_points[MAX_POINT];
-    int shifted_points[MAX_POINT];
 };
 
-struct Points origin_points;
+static struct {
 
-struct Points shift_points; 
+  u32* points;                        /* Sorted diff offsets              */
+  s32* shifted;                       /* Current shifted position         */
+  u32* order;                         /* Points sorted by shifted position */
+  u8*  stopped;                       /* Point converged?                 */
+  struct diff_cluster* clusters;      /* Resulting clusters               */
 
-struct Points stop_points; 
+  u32  size,                          /* Number of diff offsets           */
+       clusters_size;                 /* Number of clusters               */
 
-struct Cluster clusters[MAX_POINT];
+  double kernel[cluster_width + 1];   /* Gaussian weight by distance      */
 
-void init_clusters(){
-    for(int i=0;i<clusters_size;i++){
-        for(int ii=0;ii<clusters[i].size;ii++){
-            clusters[i].original_points[ii]=0;
-            clusters[i].shifted_points[ii]=0;
-        }
-        clusters[i].size=0;
-    }
-    clusters_size=0;
-}
+} ms;
 
+static void ms_init_arena(void) {
 
-void init_point(int points_size){
-    if(points_size==ORIGIN_POINT){
-        for(int i=0;i<origin_points.size;i++){
-            origin_points.values[i]=0; 
-        }
-        origin_points.size=0;
-    }else if(points_size==SHIFT_POINT){
+  u8* arena;
+  u32 i;
 
-        for(int i=0;i<shift_points.size;i++){
-            shift_points.values[i]=0; 
-        }
-        shift_points.size=0;
-    }else{
+  if (ms.points) return;
 
-        for(int i=0;i<stop_points.size;i++){
-            stop_points.values[i]=0; 
-        }
-        stop_points.size=0;
-    }
+  arena = ck_alloc(MAX_POINT * (sizeof(struct diff_cluster) + sizeof(u32) * 2 +
+                                sizeof(s32) + sizeof(u8)));
 
-}
+  ms.clusters = (struct diff_cluster*)arena;
+  ms.points   = (u32*)(ms.clusters + MAX_POINT);
+  ms.order    = ms.points + MAX_POINT;
+  ms.shifted  = (s32*)(ms.order + MAX_POINT);
+  ms.stopped  = (u8*)(ms.shifted + MAX_POINT);
+
+  for (i = 0; i <= cluster_width; i++)
+    ms.kernel[i] = exp(-1.0 / 2.0 * (i * i) /
+                       (kernel_bandwidth * kernel_bandwidth));
 
-void add_point(int points_type,int v){
-    if(points_type==ORIGIN_POINT){
-        origin_points.values[origin_points.size]=v;
-        origin_points.size++;
-    }else if(points_type==SHIFT_POINT){
-        shift_points.values[shift_points.size]=v;
-        shift_points.size++;
-    }else{
-        stop_points.values[stop_points.size]=v;
-        stop_points.size++;
-    }
 }
 
-int euclidean_distance(int point_a, int point_b) { 
-    if (point_a > point_b)
-        return point_a - point_b;
-    return point_b - point_a;
+static inline void ms_reset(void) {
+
+  ms_init_arena();
+  ms.size = 0;
+  ms.clusters_size = 0;
+
 }
 
-double gaussian_kernel(int distance) {
-    double temp = exp(-1.0 / 2.0 * (distance * distance) / (kernel_bandwidth * kernel_bandwidth));
-    return temp;
+/* Append a diff offset. Offsets must arrive in ascending order. Returns 0
+   once the arena is full. */
+
+static inline u8 ms_add_point(u32 off) {
+
+  if (ms.size == MAX_POINT) return 0;
+  ms.points[ms.size++] = off;
+  return 1;
+
 }
 
-int euclidean_distance_sqr(int point_a, int point_b) {
-    return (point_a - point_b) * (point_a - point_b);
+/* Bitmask of the bytes that differ between two 64-byte blocks. */
+
+static inline u64 ms_diff_mask64(u8* a, u8* b) {
+
+#if defined(__AVX2__)
+
+  u32 lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+             _mm256_loadu_si256((__m256i*)a), _mm256_loadu_si256((__m256i*)b)));
+  u32 hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+             _mm256_loadu_si256((__m256i*)(a + 32)),
+             _mm256_loadu_si256((__m256i*)(b + 32))));
+
+  return ~(((u64)hi << 32) | lo);
+
+#elif defined(__SSE2__)
+
+  u64 eq = 0;
+  u32 i;
+
+  for (i = 0; i < 4; i++)
+    eq |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((__m128i*)(a + i * 16)),
+            _mm_loadu_si128((__m128i*)(b + i * 16)))) << (i * 16);
+
+  return ~eq;
+
+#else
+
+  u64 ret = 0;
+  u32 i;
+
+  /* Cheap word compare first; most blocks are identical. */
+
+  if (!memcmp(a, b, 64)) return 0;
+
+  for (i = 0; i < 64; i++)
+    if (a[i] != b[i]) ret |= 1ULL << i;
+
+  return ret;
+
+#endif /* ^__AVX2__ */
+
 }
 
-//计算单点的漂移值
-int single_shift_point(int point) {
-    double total_weight = 0;
-    double shifted_point = 0;
-    for (int i = 0; i < origin_points.size; i++) {
-        const double temp_point = origin_points.values[i]; 
-        double distance = euclidean_distance(point, temp_point);
-        //只计算范围内的点与point的均值
-        if (distance > cluster_width) { 
-            continue;
-        }
-        //不同的点权重不一样，使用高斯核函数计算权重
-        double weight = gaussian_kernel(distance); 
-        shifted_point += (temp_point * weight);
-        total_weight += weight;
+/* Append every offset below len where a and b differ, 64 bytes at a time.
+   Returns 0 once the arena is full. */
+
+static u8 ms_add_diffs(u8* a, u8* b, u32 len) {
+
+  u32 base = 0;
+
+  for (; base + 64 <= len; base += 64) {
+
+    u64 mask = ms_diff_mask64(a + base, b + base);
+
+    while (mask) {
+
+      if (!ms_add_point(base + __builtin_ctzll(mask))) return 0;
+      mask &= mask - 1;
+
     }
 
-    double total_weight_inv = 1.0 / total_weight;
-    shifted_point *= total_weight_inv;
-    return (int)shifted_point;
+  }
+
+  for (; base < len; base++)
+    if (a[base] != b[base] && !ms_add_point(base)) return 0;
+
+  return 1;
+
 }
 
-void start_ShiftPoint(){
- 
-    init_point(STOP_POINT);
-    init_point(SHIFT_POINT); 
+/* Index of the first point >= val. */
 
-    for (int i = 0; i < origin_points.size; i++) { 
-        add_point(SHIFT_POINT,origin_points.values[i]);
-    }  
+static inline u32 ms_lower_bound(s32 val) {
 
-    int max_shift_distance;
+  u32 lo = 0, hi = ms.size;
 
-    int shift_point = 0;
-    do {
-        max_shift_distance = 0;
-        for (int i = 0; i < origin_points.size; i++) {
-            if (stop_points.values[i] == 0) { 
-                //计算均值
-                shift_point=single_shift_point(shift_points.values[i]);
-                //计算当前点移动的距离
-                int shift_distance_sqr = euclidean_distance_sqr(shift_point, shift_points.values[i]);
+  if (val <= 0) return 0;
+
+  while (lo < hi) {
+
+    u32 mid = (lo + hi) >> 1;
+
+    if (ms.points[mid] < (u32)val) lo = mid + 1; else hi = mid;
+
+  }
+
+  return lo;
 
-                if (shift_distance_sqr > max_shift_distance) {
-                    max_shift_distance = shift_distance_sqr;
-                }
-                if (shift_distance_sqr <= EPSILON_SQR) {
-                    stop_points.values[i] = 1;
-                    add_point(STOP_POINT,1);
-                }
-                shift_points.values[i] = shift_point; 
-            }
-        }  
-    } while (max_shift_distance > EPSILON_SQR);   
 }
 
-void printf_points(int points_type){
-    if(points_type==ORIGIN_POINT){
-        printf("origin points:\n");
-        for(int i=0;i<origin_points.size;i++){
-            printf("%d,",origin_points.values[i]);
-        }
-        printf("\n");
-    }else if(points_type==SHIFT_POINT){
-        printf("shift points:\n");
-        for(int i=0;i<shift_points.size;i++){
-            printf("%d,",shift_points.values[i]);
-        }
-        printf("\n");
-    } 
+/* Gaussian-weighted mean of the points within cluster_width of pos. */
+
+static inline s32 ms_shift_point(s32 pos) {
+
+  double total_weight = 0, shifted = 0;
+  u32 i = ms_lower_bound(pos - cluster_width);
+
+  for (; i < ms.size && (s32)ms.points[i] <= pos + cluster_width; i++) {
+
+    s32 dist = (s32)ms.points[i] - pos;
+    double weight = ms.kernel[dist < 0 ? -dist : dist];
+
+    shifted      += ms.points[i] * weight;
+    total_weight += weight;
+
+  }
+
+  if (!total_weight) return pos;
+
+  return (s32)(shifted / total_weight);
+
 }
 
-void printf_cluster(){
+static void ms_shift_points(void) {
 
-    printf("cluster:\n");
+  u32 i;
+  s32 max_shift;
+
+  for (i = 0; i < ms.size; i++) {
+    ms.shifted[i] = ms.points[i];
+    ms.stopped[i] = 0;
+  }
+
+  do {
+
+    max_shift = 0;
+
+    for (i = 0; i < ms.size; i++) {
+
+      s32 pos, dist_sqr;
+
+      if (ms.stopped[i]) continue;
+
+      pos      = ms_shift_point(ms.shifted[i]);
+      dist_sqr = (pos - ms.shifted[i]) * (pos - ms.shifted[i]);
+
+      if (dist_sqr > max_shift) max_shift = dist_sqr;
+      if (dist_sqr <= EPSILON_SQR) ms.stopped[i] = 1;
+
+      ms.shifted[i] = pos;
 
-    for(int i=0;i<clusters_size;i++){
-        if(clusters[i].size==1){
-            printf(",%d",clusters[i].original_points[0]);
-        }else{
-            printf(",(%d,%d)",clusters[i].original_points[0],clusters[i].original_points[clusters[i].size-1]);
-        }
     }
-    printf("\n");
+
+  } while (max_shift > EPSILON_SQR);
+
 }
 
-void start_cluster()
-{  
+/* Group points whose shifted positions fall within CLUSTER_EPSILON of a
+   cluster mode. Points are visited in order of their shifted position, so
+   only the most recent cluster can ever match; the shifted positions of
+   sorted offsets are nearly sorted already, which keeps the insertion sort
+   close to linear. Each cluster then spans the offsets between its first
+   and last member, and clusters are reordered by that first member. */
 
-    for (int i = 0; i < shift_points.size; i++) { 
-         
-        int c = 0;
-        for (; c < clusters_size; c++) { 
-            if (euclidean_distance(shift_points.values[i], clusters[c].mode) <= CLUSTER_EPSILON) {
-                break;
-            }
-        } 
-        if (c == clusters_size) { 
-            clusters[clusters_size].mode=shift_points.values[i]; 
-            clusters_size+=1;
-        }  
-        if (clusters[c].mode < shift_points.values[i])
-            clusters[c].mode = shift_points.values[i];
- 
-        clusters[c].original_points[clusters[c].size]=origin_points.values[i];
-        clusters[c].shifted_points[clusters[c].size]=shift_points.values[i];
-        clusters[c].size+=1;
+static void ms_group_points(void) {
+
+  u32 i, j;
+
+  for (i = 0; i < ms.size; i++) {
+
+    u32 idx = i;
+
+    for (j = i; j && ms.shifted[ms.order[j - 1]] > ms.shifted[idx]; j--)
+      ms.order[j] = ms.order[j - 1];
+
+    ms.order[j] = idx;
+
+  }
+
+  ms.clusters_size = 0;
+
+  for (i = 0; i < ms.size; i++) {
+
+    struct diff_cluster* c = ms.clusters + ms.clusters_size - 1;
+    u32 idx = ms.order[i];
+    double pos = ms.shifted[idx];
+
+    if (ms.clusters_size && pos - c->mode <= CLUSTER_EPSILON) {
+
+      c->mode = pos;
+      c->size++;
+      if (idx < c->start) c->start = idx;
+      if (idx >= c->end) c->end = idx + 1;
+      continue;
+
+    }
+
+    c = ms.clusters + ms.clusters_size++;
+    c->mode  = pos;
+    c->size  = 1;
+    c->start = idx;
+    c->end   = idx + 1;
+
+  }
+
+  for (i = 1; i < ms.clusters_size; i++) {
+
+    struct diff_cluster tmp = ms.clusters[i];
+
+    for (j = i; j && ms.clusters[j - 1].start > tmp.start; j--)
+      ms.clusters[j] = ms.clusters[j - 1];
+
+    ms.clusters[j] = tmp;
+
+  }
 
-    }  
 }
 
-void trmi_cluster(){
-    for(int i=0;i<clusters_size;i++){
-        if(clusters[i].size==1){
-            if((i>0)&&(clusters[i-1].size>0)&&(clusters[i].original_points[0]-clusters[i-1].original_points[clusters[i-1].size-1])<4){
-                clusters[i-1].original_points[clusters[i-1].size]=clusters[i].original_points[0];
-                clusters[i-1].size+=1;
-                clusters[i].size=0;
-            }else if((i<clusters_size-1)&&(clusters[i+1].original_points[0]-clusters[i].original_points[0])<4){
-                for(int ii=0;ii<clusters[i+1].size;ii++){
-                    clusters[i+1].original_points[ii+1]=clusters[i+1].original_points[ii];
-                }
-                clusters[i+1].original_points[0]=clusters[i].original_points[0];
-                clusters[i+1].size+=1;
-                clusters[i].size=0;
-            }
-        }
+/* Fold singleton clusters into a close neighbour. Emptied clusters are left
+   in place with start == end. */
+
+static void ms_merge_singletons(void) {
+
+  u32 i;
+
+  for (i = 0; i < ms.clusters_size; i++) {
+
+    struct diff_cluster* c = ms.clusters + i;
+    s32 off;
+
+    if (c->size != 1) continue;
+
+    off = ms.points[c->start];
+
+    if (i && c[-1].size &&
+        off - (s32)ms.points[c[-1].end - 1] < CLUSTER_MERGE_DIST) {
+
+      if (c[-1].end < c->end) c[-1].end = c->end;
+      c[-1].size++;
+      c->end = c->start;
+      c->size = 0;
+
+    } else if (i + 1 < ms.clusters_size &&
+               (s32)ms.points[c[1].start] - off < CLUSTER_MERGE_DIST) {
+
+      if (c[1].start > c->start) c[1].start = c->start;
+      c[1].size++;
+      c->end = c->start;
+      c->size = 0;
+
     }
+
+  }
+
+}
+
+/* Run the whole pipeline over the points collected since ms_reset(). */
+
+static void ms_cluster(void) {
+
+  ms_shift_points();
+  ms_group_points();
+  ms_merge_singletons();
+
 }
 
 //##########################################################均值漂移算法-end
@@ -690,7 +994,7 @@ static void bind_to_free_cpu(void) {
   struct dirent* de;
   cpu_set_t c;
 
-  u8 cpu_used[4096] = { 0 };
+  u8 cpu_used[GROUP_CPUS] = { 0 };
   u32 i;
 
   if (cpu_core_count < 2) return;
@@ -766,7 +1070,15 @@ static void bind_to_free_cpu(void) {
 
   closedir(d);
 
-  for (i = 0; i < cpu_core_count; i++) if (!cpu_used[i]) break;
+  /* Workers of a -j group scan /proc at about the same time, before any of
+     them is bound, so they also have to take cores from each other. */
+
+  for (i = 0; i < cpu_core_count && i < GROUP_CPUS; i++)
+    if (!cpu_used[i] &&
+        (!group_cpus || __sync_bool_compare_and_swap(group_cpus + i, 0, 1)))
+      break;
+
+  if (i == GROUP_CPUS) i = cpu_core_count;
 
   if (i == cpu_core_count) {
 
@@ -983,528 +1295,690 @@ static u8* DTD(u64 cur_ms, u64 event_ms) {
 }
 
 
-/* Mark deterministic checks as done for a particular queue entry. We use the
-   .state file to avoid repeating deterministic fuzzing when resuming aborted
-   scans. */
+/* Background writer. New queue entries, crashes, hangs and the .state
+   markers are written by a separate thread, so that bursts of finds or a
+   slow output filesystem do not hold up the fuzzing loop. Jobs sit in a
+   ring of WRITE_QUEUE_MAX slots and are numbered from 1; a marker that gets
+   created and removed again before the thread gets to it is dropped. The
+   thread makes nothing but plain system calls: buffers are freed, and
+   errors reported, by the main thread when it reclaims a slot. Until the
+   thread is up (or if it cannot be started), jobs run inline. */
 
-static void mark_as_det_done(struct queue_entry* q) {
+enum {
+  /* 00 */ IO_NOP,
+  /* 01 */ IO_FILE,                   /* Create fn with data (O_EXCL)     */
+  /* 02 */ IO_TOUCH,                  /* Create empty fn (O_EXCL)         */
+  /* 03 */ IO_UNLINK,                 /* Remove fn                        */
+  /* 04 */ IO_SYMLINK                 /* Link fn to data, else touch it   */
+};
 
-  u8* fn = strrchr(q->fname, '/');
-  s32 fd;
+#define IO_F_TRUNC   1                /* IO_FILE may replace fn           */
+#define IO_F_FSYNC   2                /* fsync() before the job is done   */
 
-  fn = alloc_printf("%s/queue/.state/deterministic_done/%s", out_dir, fn + 1);
+struct io_job {
+  u8  op, flags;
+  u8  *fn, *data;
+  u32 len;
+  s32 err;                            /* errno, set by the writer         */
+};
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (fd < 0) PFATAL("Unable to create '%s'", fn);
-  close(fd);
+static struct io_job io_ring[WRITE_QUEUE_MAX];
 
-  ck_free(fn);
+static u64 io_head,                   /* Jobs queued so far               */
+           io_next,                   /* Jobs taken by the writer         */
+           io_done,                   /* Jobs finished by the writer      */
+           io_reclaimed;              /* Slots handed back to the ring    */
 
-  q->passed_det = 1;
+static pthread_t io_thread;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  io_work = PTHREAD_COND_INITIALIZER,
+                       io_idle = PTHREAD_COND_INITIALIZER;
 
-}
+static u8 io_running, io_stop;
 
-void printf_u8(struct extra_data temp){
-  int ii=temp.len-1; 
-  for(;ii>=0;ii--){
+static u8 crash_fsync;                /* AFL_CRASH_FSYNC set?             */
 
-    printf("%X",temp.data[ii]);
-  }
-  printf("\n");
-}
 
-// void *analyse_dict(u8 value){
-   
-//   int extras_count=0;
-//   for(;extras_count<extras_cnt;extras_count+=1){ 
-//     printf_u8(extras[extras_count]);
-//     int index=extras[extras_count].len-1;
-//     for(;;index--){
-//       if(extras[extras_count].data[index]==value){
-//         struct extra_data temp;
-//         temp.len=index+1;
-//         u8 *v=malloc(temp.len);
-//         temp.data=v;
-//         int ii=0;
-//         for(;ii<temp.len;ii++){
-//           v[ii]=extras[extras_count].data[ii];
-//         }
-//         printf("success:");
-//         printf_u8(temp);
+/* Carry out one job. Returns 0 or an errno value. */
 
-//       }
-//       if(index==1){
-//         break;
-//       }
-//     } 
-//   }   
-//   printf("----------------------------------------------------\n");
-//   exit(0);
-// }
+static s32 io_run(struct io_job* j) {
 
+  s32 fd;
+  u32 off = 0;
 
-/* Mark as variable. Create symlinks if possible to make it easier to examine
-   the files. */
+  switch (j->op) {
 
-static void mark_as_variable(struct queue_entry* q) {
+    case IO_NOP: return 0;
 
-  u8 *fn = strrchr(q->fname, '/') + 1, *ldest;
+    case IO_UNLINK: return unlink(j->fn) ? errno : 0;
 
-  ldest = alloc_printf("../../%s", fn);
-  fn = alloc_printf("%s/queue/.state/variable_behavior/%s", out_dir, fn);
+    case IO_SYMLINK: if (!symlink(j->data, j->fn)) return 0;
+                     /* Fall through */
 
-  if (symlink(ldest, fn)) {
+    case IO_TOUCH:
 
-    s32 fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    close(fd);
+      fd = open(j->fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+      if (fd < 0) return errno;
+      close(fd);
+      return 0;
 
   }
 
-  ck_free(ldest);
-  ck_free(fn);
+  fd = open(j->fn, O_WRONLY | O_CREAT |
+            ((j->flags & IO_F_TRUNC) ? O_TRUNC : O_EXCL), 0600);
 
-  q->var_behavior = 1;
+  if (fd < 0) return errno;
 
-}
+  while (off < j->len) {
 
+    s32 res = write(fd, j->data + off, j->len - off);
 
-/* Mark / unmark as redundant (edge-only). This is not used for restoring state,
-   but may be useful for post-processing datasets. */
+    if (res <= 0) {
+      s32 err = res < 0 ? errno : EIO;
+      close(fd);
+      return err;
+    }
 
-static void mark_as_redundant(struct queue_entry* q, u8 state) {
+    off += res;
 
-  u8* fn;
-  s32 fd;
+  }
 
-  if (state == q->fs_redundant) return;
+  if ((j->flags & IO_F_FSYNC) && fsync(fd)) {
+    s32 err = errno;
+    close(fd);
+    return err;
+  }
 
-  q->fs_redundant = state;
+  close(fd);
+  return 0;
 
-  fn = strrchr(q->fname, '/');
-  fn = alloc_printf("%s/queue/.state/redundant_edges/%s", out_dir, fn + 1);
+}
 
-  if (state) {
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    close(fd);
+/* Free the slots of finished jobs, dying on the first failed one. Called
+   with io_lock held. */
 
-  } else {
+static void io_reclaim(void) {
 
-    if (unlink(fn)) PFATAL("Unable to remove '%s'", fn);
+  while (io_reclaimed < io_done) {
 
-  }
+    struct io_job* j = &io_ring[io_reclaimed++ % WRITE_QUEUE_MAX];
 
-  ck_free(fn);
+    if (j->err) {
 
-} 
+      pthread_mutex_unlock(&io_lock);
 
+      errno = j->err;
 
-/* Append new test case to the queue. */
+      if (j->op == IO_UNLINK) PFATAL("Unable to remove '%s'", j->fn);
+      PFATAL("Unable to create '%s'", j->fn);
 
-static void add_to_queue(u8* fname, u32 len, u8 passed_det) {
+    }
 
-  struct queue_entry* q = ck_alloc(sizeof(struct queue_entry));
+    ck_free(j->fn);
+    ck_free(j->data);
 
-  // q->all_son_seed=0;
-  q->fname        = fname;
-  q->len          = len;
-  q->depth        = cur_depth + 1;
-  q->passed_det   = passed_det;   
-  q->father_diff=stage_cur_byte;
-  q->father_diff_count=stage_cur_count;
-  q->find_new_laf_branch=find_new_laf_branch;
-  q->extra_laf_count=extra_laf_count_orig;
-  q->byte_analyse=NULL;
+  }
 
-  if(queue_cur){
+}
 
-    // queue_cur->all_son_seed+=1;
-    q->father=queue_cur;
-  } 
-  if((q->father)&&(q->father_diff_count==1)&&(q->father->father_diff<q->father_diff)&&(q->father->father_diff+3>q->father_diff)){
-    q->char_str_count=q->father->char_str_count-q->father->father_diff+q->father_diff;
-  }else{
-    q->char_str_count=1;
-  }
-  char_str_count=q->char_str_count;
 
-  if (q->depth > max_depth) max_depth = q->depth; 
+/* The writer thread itself. */
 
-  if (queue_top) {
-    queue_top->next = q;
-    queue_top = q;
+static void* io_writer(void* unused) {
 
-  } else q_prev100 = queue = queue_top = q;
+  pthread_mutex_lock(&io_lock);
 
-  queued_paths++;
-  pending_not_fuzzed++;
+  while (1) {
 
-  cycles_wo_finds = 0;
+    struct io_job* j;
+    s32 err;
 
-  if (!(queued_paths % 100)) {
+    while (io_next == io_head && !io_stop)
+      pthread_cond_wait(&io_work, &io_lock);
 
-    q_prev100->next_100 = q;
-    q_prev100 = q;
+    if (io_next == io_head) break;
 
-  }
+    j = &io_ring[io_next++ % WRITE_QUEUE_MAX];
 
-  last_path_time = get_cur_time();
+    pthread_mutex_unlock(&io_lock);
+    err = io_run(j);
+    pthread_mutex_lock(&io_lock);
 
-}
+    j->err = err;
+    io_done++;
 
+    pthread_cond_broadcast(&io_idle);
 
-/* Destroy the entire queue. */
+  }
 
-EXP_ST void destroy_queue(void) {
+  pthread_mutex_unlock(&io_lock);
 
-  struct queue_entry *q = queue, *n;
+  return NULL;
 
-  while (q) {
+}
 
-    n = q->next;
-    ck_free(q->fname);
-    ck_free(q->trace_mini);   
-    ck_free(q);
-    q = n;
 
-  }
+/* Queue a job, taking over fn and data (both ck_alloc()ed, data may be
+   NULL). Returns its number, for io_wait(). */
 
-}
+static u64 io_queue(u8 op, u8 flags, u8* fn, u8* data, u32 len) {
 
+  struct io_job* j;
+  u64 i;
 
-/* Write bitmap to file. The bitmap is useful mostly for the secret
-   -B option, to focus a separate fuzzing session on a particular
-   interesting input without rediscovering all the others. */
+  if (!io_running) {
 
-EXP_ST void write_bitmap(void) {
+    struct io_job tmp = { op, flags, fn, data, len, 0 };
 
-  u8* fname;
-  s32 fd;
+    tmp.err = io_run(&tmp);
 
-  if (!bitmap_changed) return;
-  bitmap_changed = 0;
+    if (tmp.err) {
+      errno = tmp.err;
+      if (op == IO_UNLINK) PFATAL("Unable to remove '%s'", fn);
+      PFATAL("Unable to create '%s'", fn);
+    }
 
-  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
-  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ck_free(fn);
+    ck_free(data);
+    return 0;
 
-  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+  }
 
-  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+  pthread_mutex_lock(&io_lock);
 
-  close(fd);
-  ck_free(fname);
+  /* A marker created and removed (or the other way round) before the
+     writer got to it cancels out. */
 
-}
+  if (op == IO_TOUCH || op == IO_UNLINK) {
 
+    for (i = io_next; i < io_head; i++) {
 
-/* Read bitmap from file. This is for the -B option again. */
+      j = &io_ring[i % WRITE_QUEUE_MAX];
 
-EXP_ST void read_bitmap(u8* fname) {
+      if (j->op == (op == IO_TOUCH ? IO_UNLINK : IO_TOUCH) &&
+          !strcmp(j->fn, fn)) {
 
-  s32 fd = open(fname, O_RDONLY);
+        j->op = IO_NOP;
+        pthread_mutex_unlock(&io_lock);
+        ck_free(fn);
+        return i + 1;
 
-  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+      }
 
-  ck_read(fd, virgin_bits, MAP_SIZE, fname);
+    }
 
-  close(fd);
+  }
 
-}
+  io_reclaim();
 
-static void update_virgin_mini() {
+  while (io_head - io_reclaimed == WRITE_QUEUE_MAX) {
+    pthread_cond_wait(&io_idle, &io_lock);
+    io_reclaim();
+  }
 
-  u32 i = 0,end=MAP_SIZE>>3;
+  j = &io_ring[io_head % WRITE_QUEUE_MAX];
 
-  for(i=0;i<end;i++){
-    virgin_bit_mini[i]=0;
-  } 
+  j->op    = op;
+  j->flags = flags;
+  j->fn    = fn;
+  j->data  = data;
+  j->len   = len;
+  j->err   = 0;
 
-  i=0;
-  
-  while (i < MAP_SIZE) {
- 
-    if (virgin_bits[i]!=255){
+  i = ++io_head;
 
-      virgin_bit_mini[i >> 3] |= 1 << (i & 7); 
-    }   
-    i++;
+  pthread_cond_signal(&io_work);
+  pthread_mutex_unlock(&io_lock);
 
-  }
+  return i;
 
 }
 
-static inline u8 laf_test_has_new_branch() {  
-  find_new_laf_branch=0; 
 
-#ifdef __x86_64__
+/* Queue a test case write from a buffer we do not own. */
 
-  u64* current = (u64*)laf_trace_bits;
-  u64* virgin  = (u64*)laf_virgin_bits;
+static u64 io_queue_copy(u8 flags, u8* fn, void* mem, u32 len) {
 
-  u32  i = (MAP_SIZE >> 3);
+  u8* data = ck_alloc_nozero(len);
 
-#else
+  memcpy(data, mem, len);
 
-  u32* current = (u32*)laf_trace_bits;
-  u32* virgin  = (u32*)laf_virgin_bits;
+  return io_queue(IO_FILE, flags, fn, data, len);
 
-  u32  i = (MAP_SIZE >> 2);
+}
 
-#endif /* ^__x86_64__ */
- 
 
-  while (i--) {
+/* Wait until job seq (and everything queued before it) is on disk. */
 
-    if (unlikely(*current) && unlikely((*current | *virgin)^*virgin)) {  
-      find_new_laf_branch=1;
-      return 1; 
+static void io_wait(u64 seq) {
 
-    }
+  if (!io_running || !seq) return;
 
-    current++;
-    virgin++;
+  pthread_mutex_lock(&io_lock);
 
-  } 
+  while (io_done < seq) pthread_cond_wait(&io_idle, &io_lock);
 
-  return 0;
-}
+  io_reclaim();
 
-static inline u8 laf_has_new_branch() {  
+  pthread_mutex_unlock(&io_lock);
 
-  extra_laf_count_orig=0;
+}
 
-  find_new_laf_branch=0; 
 
-#ifdef __x86_64__
+/* Start the writer. Called once the output directories are in place. */
 
-  u64* current = (u64*)laf_trace_bits;
-  u64* virgin  = (u64*)laf_virgin_bits; 
-  u64 temp;
+static void start_io_thread(void) {
 
-  u32  i = 0;
-  u32 size=(MAP_SIZE >> 3);
+  crash_fsync = !!getenv("AFL_CRASH_FSYNC");
 
-#else
+  if (getenv("AFL_NO_ASYNC_IO")) return;
 
-  u32* current = (u32*)laf_trace_bits;
-  u32* virgin  = (u32*)laf_virgin_bits;
-  u32 temp;
+  if (pthread_create(&io_thread, NULL, io_writer, NULL)) {
+    WARNF("Unable to start the writer thread, writing inline.");
+    return;
+  }
 
-  u32  i = 0;
-  u32  size = (MAP_SIZE >> 2);
+  io_running = 1;
 
-#endif /* ^__x86_64__ */
- 
+}
 
-  while (i<size-1) {
 
-    /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
-       that have not been already cleared from the virgin map - since this will
-       almost always be the case. */
-      
-    if (unlikely(*current) && unlikely((*current | *virgin)^*virgin)) {  
+/* Write out whatever is pending and stop the writer. */
 
-      if(i<65536/32){
-        find_new_laf_branch|=0b1;
-      }else if(i<65536/16){
-        find_new_laf_branch|=0b10;
-      }else{
-        find_new_laf_branch|=0b100;
-      }
-      extra_laf_count_orig+=1;
-      *virgin |= *current;
+static void stop_io_thread(void) {
 
-    }
+  if (!io_running) return;
 
-    current++;
-    virgin++;
-    
-    i++;
+  pthread_mutex_lock(&io_lock);
+  io_stop = 1;
+  pthread_cond_signal(&io_work);
+  pthread_mutex_unlock(&io_lock);
 
-  } 
+  pthread_join(io_thread, NULL);
 
+  pthread_mutex_lock(&io_lock);
+  io_reclaim();
+  pthread_mutex_unlock(&io_lock);
 
-  if(find_new_laf_branch!=0)
-    return 1;
+  io_running = 0;
 
-  return 0;
+}
 
-}   
 
-/* Check if the current execution path brings anything new to the table.
-   Update virgin bits to reflect the finds. Returns 1 if the only change is
-   the hit-count for a particular tuple; 2 if there are new tuples seen. 
-   Updates the map, so subsequent calls will always return 0.
+/* Mark deterministic checks as done for a particular queue entry. We use the
+   .state file to avoid repeating deterministic fuzzing when resuming aborted
+   scans. */
 
-   This function is called after every exec() on a fairly large buffer, so
-   it needs to be fast. We do this in 32-bit and 64-bit flavors. */ 
+static void mark_as_det_done(struct queue_entry* q) {
 
-static inline u8 has_new_bits(u8* virgin_map) { 
- 
+  u8* fn = strrchr(q->fname, '/');
 
-  u8 is_update=0;
-  find_new_branch=0;
+  fn = alloc_printf("%s/queue/.state/deterministic_done/%s", out_dir, fn + 1);
 
-  laf_has_new_branch();
+  io_queue(IO_TOUCH, 0, fn, NULL, 0);
 
-#ifdef __x86_64__
+  q->passed_det = 1;
 
-  u64* current = (u64*)trace_bits;
-  u64* virgin  = (u64*)virgin_map;
+}
 
-  u32  i = (MAP_SIZE >> 3);
+void printf_u8(struct extra_data temp){
+  int ii=temp.len-1; 
+  for(;ii>=0;ii--){
 
-#else
+    printf("%X",temp.data[ii]);
+  }
+  printf("\n");
+}
+
+// void *analyse_dict(u8 value){
+   
+//   int extras_count=0;
+//   for(;extras_count<extras_cnt;extras_count+=1){ 
+//     printf_u8(extras[extras_count]);
+//     int index=extras[extras_count].len-1;
+//     for(;;index--){
+//       if(extras[extras_count].data[index]==value){
+//         struct extra_data temp;
+//         temp.len=index+1;
+//         u8 *v=malloc(temp.len);
+//         temp.data=v;
+//         int ii=0;
+//         for(;ii<temp.len;ii++){
+//           v[ii]=extras[extras_count].data[ii];
+//         }
+//         printf("success:");
+//         printf_u8(temp);
 
-  u32* current = (u32*)trace_bits;
-  u32* virgin  = (u32*)virgin_map;
+//       }
+//       if(index==1){
+//         break;
+//       }
+//     } 
+//   }   
+//   printf("----------------------------------------------------\n");
+//   exit(0);
+// }
 
-  u32  i = (MAP_SIZE >> 2);
 
-#endif /* ^__x86_64__ */
+/* Mark as variable. Create symlinks if possible to make it easier to examine
+   the files. */
 
-  u8   ret = 0;
+static void mark_as_variable(struct queue_entry* q) {
 
-  while (i--) {
+  u8 *fn = strrchr(q->fname, '/') + 1, *ldest;
 
-    /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
-       that have not been already cleared from the virgin map - since this will
-       almost always be the case. */
+  ldest = alloc_printf("../../%s", fn);
+  fn = alloc_printf("%s/queue/.state/variable_behavior/%s", out_dir, fn);
 
-    if (unlikely(*current) && unlikely(*current & *virgin)) {
+  io_queue(IO_SYMLINK, 0, fn, ldest, 0);
 
-      if (likely(ret < 2)) {
+  q->var_behavior = 1;
 
-        u8* cur = (u8*)current;
-        u8* vir = (u8*)virgin;
+}
 
-        /* Looks like we have not found any new bytes yet; see if any non-zero
-           bytes in current[] are pristine in virgin[]. */
 
-#ifdef __x86_64__
+/* Mark / unmark as redundant (edge-only). This is not used for restoring state,
+   but may be useful for post-processing datasets. */
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
-            (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
-            (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff)){
+static void mark_as_redundant(struct queue_entry* q, u8 state) {
 
-              ret = 2;
-              find_new_branch=1;
-              if(is_update==0){ 
-                update_virgin_mini();
-                is_update=1;
-              }
-        } 
-        else ret = 1;
+  u8* fn;
 
-#else
+  if (state == q->fs_redundant) return;
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff)) ret = 2;
-        else ret = 1;
+  q->fs_redundant = state;
 
-#endif /* ^__x86_64__ */
+  fn = strrchr(q->fname, '/');
+  fn = alloc_printf("%s/queue/.state/redundant_edges/%s", out_dir, fn + 1);
 
-      }
+  io_queue(state ? IO_TOUCH : IO_UNLINK, 0, fn, NULL, 0);
 
-      *virgin &= ~*current;
+} 
 
-    }
 
-    current++;
-    virgin++;
+/* Make room for one more entry in queue_buf[] and the qhot arrays. New
+   slots come back zeroed from ck_realloc(). */
 
-  }
+static void grow_queue(void) {
 
-  if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+  if (queued_paths < queue_buf_size) return;
 
-  if((find_new_branch!=0)||(find_new_laf_branch!=0))
-    return 2;
+  queue_buf_size = queue_buf_size ? queue_buf_size * 2 : 1024;
 
-  return ret;
+  queue_buf        = ck_realloc(queue_buf, queue_buf_size *
+                                sizeof(struct queue_entry*));
+  qhot.favored     = ck_realloc(qhot.favored, queue_buf_size);
+  qhot.was_fuzzed  = ck_realloc(qhot.was_fuzzed, queue_buf_size);
+  qhot.bitmap_size = ck_realloc(qhot.bitmap_size, queue_buf_size * sizeof(u32));
+  qhot.exec_us     = ck_realloc(qhot.exec_us, queue_buf_size * sizeof(u64));
+  qhot.depth       = ck_realloc(qhot.depth, queue_buf_size * sizeof(u64));
 
 }
 
-static inline u8 test_has_new_bits(u8* virgin_map) {
 
-  u8 state=laf_test_has_new_branch();
-  if(state!=0){ 
-    return 2;
-  }
+/* Per-offset history for the byte_ascii stage (see fuzz_byte_adaptive()
+   and BYTE_SEEN_MAX): the values that queue entries have at each offset,
+   and how many sweeps there have come up empty in a row. */
 
-#ifdef __x86_64__
+static u8 byte_seen[BYTE_SEEN_MAX][32]; /* Values queue entries had there  */
+static u8 byte_idle[BYTE_SEEN_MAX];     /* Sweeps in a row with no finds   */
 
-  u64* current = (u64*)trace_bits;
-  u64* virgin  = (u64*)virgin_map;
+static void note_byte_values(u8* mem, u32 len) {
 
-  u32  i = (MAP_SIZE >> 3);
+  u32 i;
 
-#else
+  for (i = 0; i < len && i < BYTE_SEEN_MAX; i++)
+    byte_seen[i][mem[i] >> 3] |= 1 << (mem[i] & 7);
 
-  u32* current = (u32*)trace_bits;
-  u32* virgin  = (u32*)virgin_map;
+}
 
-  u32  i = (MAP_SIZE >> 2);
 
-#endif /* ^__x86_64__ */
+/* Effect maps record, per input byte of a queue entry, what the probes of
+   byte_deter and byte_ascii saw when changing it. They are set up when an
+   entry first needs one, out of slabs of EFF_SLAB_SIZE (queue entries are
+   never freed, and neither are their maps). An entry of the same length as
+   its father starts from the father's map, except at the bytes in which the
+   two differ: those are untested again. So are the bytes the father found
+   dead, since the child takes a different path and may well read them. */
 
-  u8   ret = 0;
+static u8* eff_slab;                  /* Free part of the current slab    */
+static u32 eff_slab_left;             /* Bytes left in it                 */
 
-  while (i--) {
+static u64 eff_skipped;               /* Probes skipped on dead bytes     */
 
-    /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
-       that have not been already cleared from the virgin map - since this will
-       almost always be the case. */
+static u8* eff_map(struct queue_entry* q) {
 
-    if (unlikely(*current) && unlikely(*current & *virgin)) {
+  struct queue_entry* f = q->father;
+  u32 size = (q->len + 3) >> 2, i;
 
-      if (likely(ret < 2)) {
+  if (q->eff) return q->eff;
 
-        u8* cur = (u8*)current;
-        u8* vir = (u8*)virgin;
+  if (size > EFF_SLAB_SIZE / 4) q->eff = ck_alloc(size);
+  else {
 
-        /* Looks like we have not found any new bytes yet; see if any non-zero
-           bytes in current[] are pristine in virgin[]. */
+    if (size > eff_slab_left) {
+      eff_slab      = ck_alloc(EFF_SLAB_SIZE);
+      eff_slab_left = EFF_SLAB_SIZE;
+    }
 
-#ifdef __x86_64__
+    q->eff = eff_slab;
+    eff_slab      += size;
+    eff_slab_left -= size;
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
-            (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
-            (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff)) 
-        {
-          ret = 2;
-          find_new_branch=1;
-          return ret;
-        }
-        else ret = 1;
+  }
 
-#else
+  if (f && f->eff && f->len == q->len && q->father_diff >= 0) {
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff)) ret = 2;
-        else ret = 1;
+    u32 from = q->father_diff, to = from + MAX(q->father_diff_count, 1);
 
-#endif /* ^__x86_64__ */
+    for (i = 0; i < q->len; i++) {
 
-      }
- 
+      u8 st = (f->eff[i >> 2] >> ((i & 3) << 1)) & 3;
+
+      if (st > EFF_DEAD && (i < from || i >= to))
+        q->eff[i >> 2] |= st << ((i & 3) << 1);
 
     }
 
-    current++;
-    virgin++;
+  }
+
+  return q->eff;
+
+}
+
+static inline u8 eff_get(struct queue_entry* q, u32 off) {
+
+  if (!q->eff || off >= q->len) return EFF_UNTESTED;
+
+  return (q->eff[off >> 2] >> ((off & 3) << 1)) & 3;
+
+}
+
+static void eff_note(struct queue_entry* q, u32 off, u8 st) {
+
+  u8* map;
+
+  if (off >= q->len || eff_get(q, off) >= st) return;
+
+  map = eff_map(q);
+  map[off >> 2] = (map[off >> 2] & ~(3 << ((off & 3) << 1))) |
+                  (st << ((off & 3) << 1));
+
+}
+
+/* Verdict on the run that just went through common_fuzz_stuff(), for a
+   variant of queue_cur. Hangs and crashes leave the trace unclassified;
+   those certainly took another path. */
+
+static u8 eff_verdict(void) {
+
+  if (find_new_laf_branch) return EFF_LAF;
+
+  if (find_new_branch || !trace_classified ||
+      hash32(trace_bits, map_size, HASH_CONST) != queue_cur->exec_cksum)
+    return EFF_PATH;
+
+  return EFF_DEAD;
+
+}
+
+
+/* Append new test case to the queue. */
+
+static void add_to_queue(u8* fname, u32 len, u8 passed_det) {
+
+  struct queue_entry* q = ck_alloc(sizeof(struct queue_entry));
+
+  grow_queue();
+
+  q->id = queued_paths;
+  queue_buf[q->id] = q;
+
+  q->group_src = group_worker;
+  q->group_id  = q->id;
+
+  // q->all_son_seed=0;
+  q->fname        = fname;
+  q->len          = len;
+  qhot.depth[q->id]        = cur_depth + 1;
+  q->passed_det   = passed_det;   
+  q->father_diff=stage_cur_byte;
+  q->father_diff_count=stage_cur_count;
+  q->find_new_laf_branch=find_new_laf_branch;
+  q->extra_laf_count=extra_laf_count_orig;
+
+  if(queue_cur){
 
+    // queue_cur->all_son_seed+=1;
+    q->father=queue_cur;
+  } 
+  if((q->father)&&(q->father_diff_count==1)&&(q->father->father_diff<q->father_diff)&&(q->father->father_diff+3>q->father_diff)){
+    q->char_str_count=q->father->char_str_count-q->father->father_diff+q->father_diff;
+  }else{
+    q->char_str_count=1;
   }
- 
+  char_str_count=q->char_str_count;
 
-  return ret;
+  if (qhot.depth[q->id] > max_depth) max_depth = qhot.depth[q->id]; 
+
+  if (!queue) queue = q;
+  queue_top = q;
+
+  queued_paths++;
+  pending_not_fuzzed++;
+
+  cycles_wo_finds = 0;
+
+  last_path_time = get_cur_time();
+
+}
+
+
+/* Destroy the entire queue. */
+
+EXP_ST void destroy_queue(void) {
+
+  u32 i;
+
+  for (i = 0; i < queued_paths; i++) {
+
+    ck_free(queue_buf[i]->fname);
+    ck_free(queue_buf[i]->trace_mini);   
+    ck_free(queue_buf[i]);
+
+  }
+
+  ck_free(queue_buf);
+  ck_free(qhot.favored);
+  ck_free(qhot.was_fuzzed);
+  ck_free(qhot.bitmap_size);
+  ck_free(qhot.exec_us);
+  ck_free(qhot.depth);
+
+}
+
+
+/* Write bitmap to file. The bitmap is useful mostly for the secret
+   -B option, to focus a separate fuzzing session on a particular
+   interesting input without rediscovering all the others. */
+
+EXP_ST void write_bitmap(void) {
+
+  u8* fname;
+  s32 fd;
+
+  if (!bitmap_changed) return;
+  bitmap_changed = 0;
+
+  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+
+  ck_write(fd, virgin_bits, map_size, fname);
+
+  close(fd);
+  ck_free(fname);
+
+}
+
+
+/* Read bitmap from file. This is for the -B option again. In a -j group,
+   the other workers may have found things already, so the bitmap is only
+   merged in. */
+
+EXP_ST void read_bitmap(u8* fname) {
+
+  struct stat st;
+  s32 fd = open(fname, O_RDONLY);
+  u8* tmp;
+  u32 i;
+
+  if (fd < 0 || fstat(fd, &st)) PFATAL("Unable to open '%s'", fname);
+
+  if (st.st_size != map_size)
+    FATAL("Bitmap '%s' is for a %llu-byte map, target uses %u bytes", fname,
+          (u64)st.st_size, map_size);
+
+  if (!group_virgin) {
+    ck_read(fd, virgin_bits, map_size, fname);
+    close(fd);
+    return;
+  }
+
+  tmp = ck_alloc_nozero(map_size);
+  ck_read(fd, tmp, map_size, fname);
+  close(fd);
+
+  for (i = 0; i < map_size; i++)
+    if (tmp[i] != 0xff) __sync_fetch_and_and(virgin_bits + i, tmp[i]);
+
+  ck_free(tmp);
 
 }
 
+static void update_virgin_mini() {
+
+  u32 i = 0,end=map_size>>3;
+
+  for(i=0;i<end;i++){
+    virgin_bit_mini[i]=0;
+  } 
+
+  i=0;
+  
+  while (i < map_size) {
+ 
+    if (virgin_bits[i]!=255){
 
+      virgin_bit_mini[i >> 3] |= 1 << (i & 7); 
+    }   
+    i++;
+
+  }
+
+}
 
 /* Count the number of bits set in the provided bitmap. Used for the status
    screen several times every second, does not have to be fast. */
@@ -1512,7 +1986,7 @@ static inline u8 test_has_new_bits(u8* virgin_map) {
 static u32 count_bits(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1547,7 +2021,7 @@ static u32 count_bits(u8* mem) {
 static u32 count_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1573,7 +2047,7 @@ static u32 count_bytes(u8* mem) {
 static u32 count_non_255_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1596,6 +2070,25 @@ static u32 count_non_255_bytes(u8* mem) {
 }
 
 
+/* Full recount of the discovered edge and laf bit counters. They are
+   maintained incrementally, so this only runs after loading a bitmap and
+   as a periodic consistency check. */
+
+static void recount_coverage(u8 verify) {
+
+  u32 edges = count_non_255_bytes(virgin_bits),
+      laf   = count_bits(laf_virgin_bits);
+
+  if (verify && (edges != virgin_edges || laf != virgin_laf_bits))
+    WARNF("Coverage counters out of sync (edges %u/%u, laf bits %u/%u)",
+          virgin_edges, edges, virgin_laf_bits, laf);
+
+  virgin_edges    = edges;
+  virgin_laf_bits = laf;
+
+}
+
+
 /* Destructively simplify trace by eliminating hit count information
    and replacing it with 0x80 or 0x01 depending on whether the tuple
    is hit or not. Called on every new crash or timeout, should be
@@ -1608,11 +2101,24 @@ static const u8 simplify_lookup[256] = {
 
 };
 
+/* Flag every line of trace_bits as dirty, for when something other than the
+   target has filled it in. */
+
+static inline void mark_trace_dirty(void) {
+
+  if (map_dirty) memset(trace_dirty, 1, (map_size >> MAP_LINE_SHIFT));
+
+}
+
+
+/* Simplify trace_bits for the hang and crash checks. This leaves no byte
+   at zero, so every line counts as dirty afterwards. */
+
 #ifdef __x86_64__
 
 static void simplify_trace(u64* mem) {
 
-  u32 i = MAP_SIZE >> 3;
+  u32 i = map_size >> 3;
 
   while (i--) {
 
@@ -1637,13 +2143,15 @@ static void simplify_trace(u64* mem) {
 
   }
 
+  mark_trace_dirty();
+
 }
 
 #else
 
 static void simplify_trace(u32* mem) {
 
-  u32 i = MAP_SIZE >> 2;
+  u32 i = map_size >> 2;
 
   while (i--) {
 
@@ -1663,6 +2171,8 @@ static void simplify_trace(u32* mem) {
     mem++;
   }
 
+  mark_trace_dirty();
+
 }
 
 #endif /* ^__x86_64__ */
@@ -1686,7 +2196,7 @@ static const u8 count_class_lookup8[256] = {
 
 };
 
-static u16 count_class_lookup16[MAP_SIZE];
+static u16 count_class_lookup16[65536];
 
 
 EXP_ST void init_count_class16(void) {
@@ -1706,7 +2216,7 @@ EXP_ST void init_count_class16(void) {
 
 static inline void classify_counts(u64* mem) {
 
-  u32 i = MAP_SIZE >> 3;
+  u32 i = map_size >> 3;
 
   while (i--) {
 
@@ -1733,7 +2243,7 @@ static inline void classify_counts(u64* mem) {
 
 static inline void classify_counts(u32* mem) {
 
-  u32 i = MAP_SIZE >> 2;
+  u32 i = map_size >> 2;
 
   while (i--) {
 
@@ -1757,3818 +2267,5504 @@ static inline void classify_counts(u32* mem) {
 #endif /* ^__x86_64__ */
 
 
-/* Get rid of shared memory (atexit handler). */
-static void remove_laf_shm(void) {
+/* Build the reverse branch graph and the initial frontier from the current
+   virgin_bits. Called once at startup, after setup_shm(). */
 
-  shmctl(laf_shm_id, IPC_RMID, NULL);
+static void setup_frontier(void) {
 
-}
+  u32 e, i;
 
-static void remove_shm(void) {
+  if (strcmp(sched->name, "frontier")) return;
 
-  shmctl(shm_id, IPC_RMID, NULL);
-  remove_laf_shm();
+  if (!branch_msg_off) FATAL("The frontier schedule needs a branch graph (-b)");
 
-}
+  frontier_bits       = ck_alloc(map_size >> 3);
+  frontier_pending    = ck_alloc(map_size * sizeof(u32));
+  frontier_parent_off = ck_alloc((map_size + 1) * sizeof(u32));
+  frontier_parents    = ck_alloc(MAX(branch_msg_cnt * 2, 1) * sizeof(u32));
 
+  /* Children at or past map_size are the special "not instrumented", "no
+     child" and "found" markers and are left out. */
 
+  for (e = 0; e < map_size; e++)
+    for (i = branch_msg_off[e]; i < branch_msg_off[e + 1]; i++) {
 
-/* Compact trace bytes into a smaller bitmap. We effectively just drop the
-   count information here. This is called only sporadically, for some
-   new paths. */
+      u32 s1 = branch_msg_list[i].son1_branch_id,
+          s2 = branch_msg_list[i].son2_branch_id;
 
-static void minimize_bits(u8* dst, u8* src) {
+      if (s1 < map_size) {
+        frontier_parent_off[s1 + 1]++;
+        if (virgin_bits[s1] == 0xff) frontier_pending[e]++;
+      }
 
-  u32 i = 0;
+      if (s2 < map_size) {
+        frontier_parent_off[s2 + 1]++;
+        if (virgin_bits[s2] == 0xff) frontier_pending[e]++;
+      }
 
-  while (i < MAP_SIZE) {
+    }
 
-    if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
-    i++;
+  for (e = 0; e < map_size; e++)
+    frontier_parent_off[e + 1] += frontier_parent_off[e];
 
-  }
+  {
 
-} 
- 
+    u32* fill = ck_alloc(map_size * sizeof(u32));
 
-/* When we bump into a new path, we call this to see if the path appears
-   more "favorable" than any of the existing ones. The purpose of the
-   "favorables" is to have a minimal set of paths that trigger all the bits
-   seen in the bitmap so far, and focus on fuzzing them at the expense of
-   the rest.
+    for (e = 0; e < map_size; e++)
+      for (i = branch_msg_off[e]; i < branch_msg_off[e + 1]; i++) {
 
-   The first step of the process is to maintain a list of top_rated[] entries
-   for every byte in the bitmap. We win that slot if there is no previous
-   contender, or if the contender has a more favorable speed x size factor. */
+        u32 s1 = branch_msg_list[i].son1_branch_id,
+            s2 = branch_msg_list[i].son2_branch_id;
 
-static void update_bitmap_score(struct queue_entry* q) { 
-   
+        if (s1 < map_size)
+          frontier_parents[frontier_parent_off[s1] + fill[s1]++] = e;
 
-  u32 i;
-  if((q->has_new_cov==0)&&(q!=queue))
-    return; 
-  u64 fav_factor = q->exec_us * q->len;
+        if (s2 < map_size)
+          frontier_parents[frontier_parent_off[s2] + fill[s2]++] = e;
 
-  /* For every byte set in trace_bits[], see if there is a previous winner,
-     and how it compares to us. */ 
-  for (i = 0; i < MAP_SIZE; i++)
+      }
 
-    if (trace_bits[i]) {                   
+    ck_free(fill);
 
-       if (top_rated[i]) {
+  }
 
-         /* Faster-executing or smaller test cases are favored. */
+  for (e = 0; e < map_size; e++)
+    if (virgin_bits[e] != 0xff && frontier_pending[e]) {
+      frontier_bits[e >> 3] |= 1 << (e & 7);
+      frontier_edges++;
+    }
 
-         if (fav_factor > top_rated[i]->exec_us * top_rated[i]->len) continue;
+  frontier_mode = 1;
 
-         /* Looks like we're going to win. Decrease ref count for the
-            previous winner, discard its trace_bits[] if necessary. */
+  OKF("Frontier scheduling enabled (%u edges on the frontier).",
+      frontier_edges);
 
-         if (!--top_rated[i]->tc_ref) {
-           ck_free(top_rated[i]->trace_mini);
-           top_rated[i]->trace_mini = 0;  
-         }
+}
 
-       }
 
-       /* Insert ourselves as the new winner. */
-       top_rated[i] = q;
+/* Edge e was just covered for the first time: it joins the frontier if it
+   still has virgin children, and parents that were waiting only on e
+   drop off. */
 
-       q->tc_ref++;
+static void frontier_add_edge(u32 e) {
 
-       if (!q->trace_mini) {
-         q->trace_mini = ck_alloc(MAP_SIZE >> 3);
-         minimize_bits(q->trace_mini, trace_bits);  
-       }
+  u32 i;
 
-       score_changed = 1;
+  if (frontier_pending[e]) {
+    frontier_bits[e >> 3] |= 1 << (e & 7);
+    frontier_edges++;
+  }
 
-     }
+  for (i = frontier_parent_off[e]; i < frontier_parent_off[e + 1]; i++) {
 
-} 
+    u32 p = frontier_parents[i];
 
+    if (!--frontier_pending[p] && (frontier_bits[p >> 3] & (1 << (p & 7)))) {
+      frontier_bits[p >> 3] &= ~(1 << (p & 7));
+      frontier_edges--;
+    }
 
-static void cull_queue_orig(void) {
+  }
 
-  struct queue_entry* q;
-  static u8 temp_v[MAP_SIZE >> 3];
-  u32 i;
+  frontier_changed = 1;
 
-  if (dumb_mode || !score_changed) return;
+}
 
-  score_changed = 0;
 
-  memset(temp_v, 255, MAP_SIZE >> 3);
+/* Number of frontier edges in a trace_mini bitmap. */
 
-  queued_favored  = 0;
-  pending_favored = 0;
- 
-  q = queue;
-
-  while (q) {
-    q->favored = 0;
-    if((q->was_fuzzed==0)&&(q->find_new_laf_branch!=0)){
-      pending_favored++;
-      q->favored = 1;
-      u32 j = MAP_SIZE >> 3;
-      if(q->trace_mini){
-
-        while (j--){
-          if (q->trace_mini[j])
-              temp_v[j] &= ~q->trace_mini[j];
-        }
-      }
-    }
-    q = q->next;
-  }
+static u32 count_frontier_hits(u8* mini) {
 
-  /* Let's see if anything in the bitmap isn't captured in temp_v.
-     f yes, and if it has a top_rated[] contender, let's use it. */
- 
-  for (i = 0; i < MAP_SIZE; i++){ 
-    if(top_rated[i]){  
-      if ((temp_v[i >> 3] & (1 << (i & 7)))) {
- 
-        u32 j = MAP_SIZE >> 3;
+  u64* m = (u64*)mini;
+  u64* f = (u64*)frontier_bits;
+  u32  i, ret = 0;
 
-        /* Remove all bits belonging to the current entry from temp_v. */
+  for (i = 0; i < (map_size >> 6); i++)
+    if (m[i] & f[i]) ret += __builtin_popcountll(m[i] & f[i]);
 
-        while (j--) 
-          if (top_rated[i]->trace_mini[j])
-            temp_v[j] &= ~top_rated[i]->trace_mini[j];
+  return ret;
 
-        top_rated[i]->favored = 1; 
-        queued_favored++; 
+}
 
-        if (!top_rated[i]->was_fuzzed) pending_favored++;
 
-      }
-    }
-  }
- 
+/* Verdict bits returned by check_coverage(). */
 
-  q = queue; 
+#define COV_NEW_HITS  1               /* New hit count on a known edge    */
+#define COV_NEW_EDGE  2               /* Edge not seen before             */
+#define COV_NEW_LAF   4               /* laf bit not seen before          */
 
-  q = queue;
+#ifdef __x86_64__
+typedef u64 map_word;
+#else
+typedef u32 map_word;
+#endif /* ^__x86_64__ */
 
-  while (q) {
-    mark_as_redundant(q, !q->favored);
-    q = q->next;
-  }
+/* Bytes scanned per step; blocks where both maps are empty are skipped. */
 
-} 
+#define COV_BLOCK 32
 
-EXP_ST void setup_laf_shm(void) {
+static u8 laf_zero_block[COV_BLOCK];
 
-  u8* shm_str; 
-  memset(laf_virgin_bits, 0, MAP_SIZE);
+/* Count the bytes of one bitmap word that are pristine in the virgin map
+   but get touched by the current trace. */
 
-  laf_shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+static inline u32 count_cleared_bytes(u8* cur, u8* vir) {
 
-  if (laf_shm_id < 0) PFATAL("setup_lafshm() failed"); 
+  u32 i, ret = 0;
 
-  shm_str = alloc_printf("%d", laf_shm_id);
+  for (i = 0; i < sizeof(map_word); i++)
+    if (cur[i] && vir[i] == 0xff) ret++;
 
-  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
-     we don't want them to detect instrumentation, since we won't be sending
-     fork server commands. This should be replaced with better auto-detection
-     later on, perhaps? */
-
-  if (!dumb_mode) setenv(LAF_SHM_ENV_VAR, shm_str, 1);
-
-  ck_free(shm_str);
-
-  laf_trace_bits = shmat(laf_shm_id, NULL, 0);
-  
-  if (!laf_trace_bits) PFATAL("setup_lafshm() failed");
+  return ret;
 
 }
 
-/* Configure shared memory and virgin_bits. This is called at startup. */
+/* Bucket the hit counts of one bitmap word. Works on a value rather than
+   through a u16 pointer, so the caller's map_word view stays coherent. */
 
-EXP_ST void setup_shm(void) {
+static inline map_word classify_word(map_word w) {
 
-  setup_laf_shm();
+  map_word ret = 0;
+  u32 i;
 
-  u8* shm_str;
+  for (i = 0; i < sizeof(map_word) * 8; i += 16)
+    ret |= (map_word)count_class_lookup16[(u16)(w >> i)] << i;
 
-  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+  return ret;
 
-  memset(virgin_tmout, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
+}
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+static inline u8 block_is_empty(u8* trace, u8* laf) {
 
-  if (shm_id < 0) PFATAL("shmget() failed");
+#if defined(__SSE2__)
 
-  atexit(remove_shm);
+  __m128i v = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((__m128i*)trace),
+                             _mm_loadu_si128((__m128i*)(trace + 16))),
+                _mm_or_si128(_mm_loadu_si128((__m128i*)laf),
+                             _mm_loadu_si128((__m128i*)(laf + 16))));
 
-  shm_str = alloc_printf("%d", shm_id);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff;
 
-  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
-     we don't want them to detect instrumentation, since we won't be sending
-     fork server commands. This should be replaced with better auto-detection
-     later on, perhaps? */
+#else
 
-  if (!dumb_mode) setenv(SHM_ENV_VAR, shm_str, 1);
+  map_word* t = (map_word*)trace;
+  map_word* l = (map_word*)laf;
+  map_word  v = 0;
+  u32 i;
 
-  ck_free(shm_str);
+  for (i = 0; i < COV_BLOCK / sizeof(map_word); i++) v |= t[i] | l[i];
 
-  trace_bits = shmat(shm_id, NULL, 0);
-  
-  if (!trace_bits) PFATAL("shmat() failed");
+  return !v;
 
+#endif /* ^__SSE2__ */
 
 }
 
+/* Compare one word of laf_trace_bits against laf_virgin_bits, recording
+   the laf region class of any new bits in find_new_laf_branch. */
 
+static inline u8 check_laf_word(u32 w, u8 update) {
 
-/* Load postprocessor, if available. */
+  map_word cur = ((map_word*)laf_trace_bits)[w];
+  map_word* vir = (map_word*)laf_virgin_bits + w;
+  map_word seen = *vir;
+  u32 byte_off = w * sizeof(map_word);
 
-static void setup_post(void) {
+  if (likely(!(cur & ~seen))) return 0;
 
-  void* dh;
-  u8* fn = getenv("AFL_POST_LIBRARY");
-  u32 tlen = 6;
+  /* Other workers of a -j group set bits too: set ours atomically, and go
+     by what was there before, so that only one of us claims them. */
 
-  if (!fn) return;
+  if (update && group_virgin) {
+    seen = __sync_fetch_and_or(vir, cur);
+    if (!(cur & ~seen)) return 0;
+  }
 
-  ACTF("Loading postprocessor from '%s'...", fn);
+  if (byte_off < map_size / 4) find_new_laf_branch |= 0b1;
+  else if (byte_off < map_size / 2) find_new_laf_branch |= 0b10;
+  else find_new_laf_branch |= 0b100;
 
-  dh = dlopen(fn, RTLD_NOW);
-  if (!dh) FATAL("%s", dlerror());
+  extra_laf_count_orig++;
 
-  post_handler = dlsym(dh, "afl_postprocess");
-  if (!post_handler) FATAL("Symbol 'afl_postprocess' not found.");
+  if (update) {
 
-  /* Do a quick test. It's better to segfault now than later =) */
+#ifdef __x86_64__
+    virgin_laf_bits += __builtin_popcountll(cur & ~seen);
+#else
+    virgin_laf_bits += __builtin_popcount(cur & ~seen);
+#endif /* ^__x86_64__ */
 
-  post_handler("hello", &tlen);
+    if (!group_virgin) *vir |= cur;
 
-  OKF("Postprocessor installed successfully.");
+  }
+
+  return COV_NEW_LAF;
 
 }
 
+/* One streaming pass over trace_bits and laf_trace_bits. Classifies the hit
+   counts if run_target() left them raw, compares both maps against their
+   virgin maps and, if update is set, clears the virgin bits that were hit.
+   The laf region class of new laf bits (0b1 switch, 0b10 compare, 0b100
+   string compare) goes to find_new_laf_branch. If the binary keeps a list
+   of touched laf bytes, only the listed laf words are looked at, and if it
+   also flags dirty trace lines, clean lines are skipped. Returns COV_* bits.
 
-/* Read all testcases from the input directory, then queue them for testing.
-   Called at startup. */
+   This is called after every exec() on two fairly large buffers, so it
+   needs to be fast. */
 
-static void read_testcases(void) {
+static u8 check_coverage(u8* virgin_map, u8 update) {
 
-  struct dirent **nl;
-  s32 nl_cnt;
-  u32 i;
-  u8* fn;
+  u8   ret = 0, classify = !trace_classified, count_hits = 0;
+  u32  off, i;
 
-  /* Auto-detect non-in-place resumption attempts. */
+  /* Per-edge execution counts for the scheduler; several checks can run
+     on the same trace, so only the first one counts. */
 
-  fn = alloc_printf("%s/queue", in_dir);
-  if (!access(fn, F_OK)) in_dir = fn; else ck_free(fn);
+  if (sched->track_hits && hits_counted_at != total_execs) {
+    count_hits = 1;
+    hits_counted_at = total_execs;
+  }
 
-  ACTF("Scanning '%s'...", in_dir);
+  find_new_branch     = 0;
+  find_new_laf_branch = 0;
+  extra_laf_count_orig = 0;
 
-  /* We use scandir() + alphasort() rather than readdir() because otherwise,
-     the ordering  of test cases would vary somewhat randomly and would be
-     difficult to control. */
+  for (off = 0; off < map_size; off += COV_BLOCK) {
 
-  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+    map_word* current = (map_word*)(trace_bits + off);
+    map_word* virgin  = (map_word*)(virgin_map + off);
+    map_word* laf_cur = (map_word*)(laf_trace_bits + off);
 
-  if (nl_cnt < 0) {
+    if (map_dirty && laf_sparse && off >= MAP_LINE &&
+        !trace_dirty[off / MAP_LINE]) continue;
 
-    if (errno == ENOENT || errno == ENOTDIR)
+    /* Optimize for both maps being empty here, which is nearly always
+       the case. */
 
-      SAYF("\n" cLRD "[-] " cRST
-           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
-           "    one or more test case to start with - ideally, a small file under 1 kB\n"
-           "    or so. The cases must be stored as regular files directly in the input\n"
-           "    directory.\n");
+    if (likely(block_is_empty(trace_bits + off, laf_sparse ?
+                              laf_zero_block : laf_trace_bits + off)))
+      continue;
 
-    PFATAL("Unable to open '%s'", in_dir);
+    for (i = 0; i < COV_BLOCK / sizeof(map_word); i++) {
 
-  }
+      if (current[i]) {
 
-  if (shuffle_queue && nl_cnt > 1) {
+        if (classify) current[i] = classify_word(current[i]);
 
-    ACTF("Shuffling queue...");
-    shuffle_ptrs((void**)nl, nl_cnt);
+        if (count_hits) {
 
-  }
+          u8* cur_b = (u8*)(current + i);
+          u32 j;
 
-  for (i = 0; i < nl_cnt; i++) {
+          for (j = 0; j < sizeof(map_word); j++)
+            if (cur_b[j]) chose_nums[off + i * sizeof(map_word) + j]++;
 
-    struct stat st;
+        }
 
-    u8* fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
-    u8* dfn = alloc_printf("%s/.state/deterministic_done/%s", in_dir, nl[i]->d_name);
+        if (unlikely(current[i] & virgin[i])) {
 
-    u8  passed_det = 0;
+          map_word v = virgin[i];
 
-    free(nl[i]); /* not tracked */
- 
-    if (lstat(fn, &st) || access(fn, R_OK))
-      PFATAL("Unable to access '%s'", fn);
+          /* Workers of a -j group share the virgin maps. Clear our bits
+             atomically and go by what was there before, so that each find
+             is claimed by one worker only. */
 
-    /* This also takes care of . and .. */
+          if (update && group_virgin) {
 
-    if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn, "/README.txt")) {
+            if (!(ret & COV_NEW_EDGE) &&
+                count_cleared_bytes((u8*)(current + i), (u8*)&v))
+              update_virgin_mini();
 
-      ck_free(fn);
-      ck_free(dfn);
-      continue;
+            v = __sync_fetch_and_and(&virgin[i], ~current[i]);
 
-    }
+          }
 
-    if (st.st_size > MAX_FILE) 
-      FATAL("Test case '%s' is too big (%s, limit is %s)", fn,
-            DMS(st.st_size), DMS(MAX_FILE));
+          if (likely(!(ret & COV_NEW_EDGE)) && (current[i] & v)) {
 
-    /* Check for metadata that indicates that deterministic fuzzing
-       is complete for this entry. We don't want to repeat deterministic
-       fuzzing when resuming aborted scans, because it would be pointless
-       and probably very time-consuming. */
+            /* See if any non-zero bytes in current[] are pristine in
+               virgin[]. */
 
-    if (!access(dfn, F_OK)) passed_det = 1;
-    ck_free(dfn);
+            if (count_cleared_bytes((u8*)(current + i), (u8*)&v)) {
 
-    add_to_queue(fn, st.st_size, passed_det);
+              ret |= COV_NEW_EDGE;
+              find_new_branch = 1;
 
-  }
+              /* virgin_bit_mini has to reflect the map as it was before
+                 this find. */
 
-  free(nl); /* not tracked */
+              if (update && !group_virgin) update_virgin_mini();
 
-  if (!queued_paths) {
+            } else ret |= COV_NEW_HITS;
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Looks like there are no valid test cases in the input directory! The fuzzer\n"
-         "    needs one or more test case to start with - ideally, a small file under\n"
-         "    1 kB or so. The cases must be stored as regular files directly in the\n"
-         "    input directory.\n");
+          }
 
-    FATAL("No usable test cases in '%s'", in_dir);
+          if (update && (current[i] & v)) {
 
-  }
+            if (virgin_map == virgin_bits) {
 
-  last_path_time = 0;
-  queued_at_start = queued_paths;
+              u8* cur_b = (u8*)(current + i);
+              u8* vir_b = (u8*)&v;
+              u32 j, cleared = count_cleared_bytes(cur_b, vir_b);
 
-}
+              virgin_edges += cleared;
 
+              if (frontier_mode && cleared)
+                for (j = 0; j < sizeof(map_word); j++)
+                  if (cur_b[j] && vir_b[j] == 0xff)
+                    frontier_add_edge(off + i * sizeof(map_word) + j);
 
-/* Helper function for load_extras. */
+            }
 
-static int compare_extras_len(const void* p1, const void* p2) {
-  struct extra_data *e1 = (struct extra_data*)p1,
-                    *e2 = (struct extra_data*)p2;
+            if (!group_virgin) virgin[i] &= ~current[i];
 
-  return e1->len - e2->len;
-}
+          }
 
-static int compare_extras_use_d(const void* p1, const void* p2) {
-  struct extra_data *e1 = (struct extra_data*)p1,
-                    *e2 = (struct extra_data*)p2;
+        }
 
-  return e2->hit_cnt - e1->hit_cnt;
-}
+      }
 
+      if (!laf_sparse && laf_cur[i])
+        ret |= check_laf_word(off / sizeof(map_word) + i, update);
 
-/* Read extras from a file, sort by size. */
+    }
 
-static void load_extras_file(u8* fname, u32* min_len, u32* max_len,
-                             u32 dict_level) {
+  }
 
-  FILE* f;
-  u8  buf[MAX_LINE];
-  u8  *lptr;
-  u32 cur_line = 0; 
+  /* With a touched-byte list, only the listed laf words can be non-zero.
+     A stamp per word keeps duplicates from being counted twice. */
 
-  f = fopen(fname, "r");
+  if (laf_sparse) {
 
-  if (!f) PFATAL("Unable to open '%s'", fname);
+    static u32 *stamp, stamp_size, cur_stamp;
+    u32 cnt = laf_touch[0];
 
-  while ((lptr = fgets(buf, MAX_LINE, f))) {
+    if (unlikely(cnt > LAF_TOUCH_MAX)) {
 
-    u8 *rptr, *wptr;
-    u32 klen = 0;
+      for (i = 0; i < map_size / sizeof(map_word); i++)
+        if (((map_word*)laf_trace_bits)[i]) ret |= check_laf_word(i, update);
 
-    cur_line++;
+    } else {
 
-    /* Trim on left and right. */
+      if (unlikely(stamp_size != map_size)) {
+        ck_free(stamp);
+        stamp = ck_alloc(map_size / sizeof(map_word) * sizeof(u32));
+        stamp_size = map_size;
+        cur_stamp = 0;
+      }
 
-    while (isspace(*lptr)) lptr++;
+      if (unlikely(!++cur_stamp)) {
+        memset(stamp, 0, map_size / sizeof(map_word) * sizeof(u32));
+        cur_stamp = 1;
+      }
 
-    rptr = lptr + strlen(lptr) - 1;
-    while (rptr >= lptr && isspace(*rptr)) rptr--;
-    rptr++;
-    *rptr = 0;
+      ret |= check_laf_word(0, update);
+      stamp[0] = cur_stamp;
 
-    /* Skip empty lines and comments. */
+      for (i = 0; i < cnt; i++) {
 
-    if (!*lptr || *lptr == '#') continue;
+        u32 w = (laf_touch[i + 1] % map_size) / sizeof(map_word);
 
-    /* All other lines must end with '"', which we can consume. */
+        if (stamp[w] == cur_stamp) continue;
+        stamp[w] = cur_stamp;
 
-    rptr--;
+        ret |= check_laf_word(w, update);
 
-    if (rptr < lptr || *rptr != '"')
-      FATAL("Malformed name=\"value\" pair in line %u.", cur_line);
+      }
 
-    *rptr = 0;
+    }
 
-    /* Skip alphanumerics and dashes (label). */
+  }
 
-    while (isalnum(*lptr) || *lptr == '_') lptr++;
+  trace_classified = 1;
 
-    /* If @number follows, parse that. */
+  if (update && ret && virgin_map == virgin_bits) bitmap_changed = 1;
 
-    if (*lptr == '@') {
+  return ret;
 
-      lptr++;
-      if (atoi(lptr) > dict_level) continue;
-      while (isdigit(*lptr)) lptr++;
+}
 
-    }
 
-    /* Skip whitespace and = signs. */
+/* Classify hit counts unless check_coverage() already did. Needed before
+   anything hashes or compares trace_bits directly. */
 
-    while (isspace(*lptr) || *lptr == '=') lptr++;
+static inline void classify_trace(void) {
 
-    /* Consume opening '"'. */
+  if (trace_classified) return;
 
-    if (*lptr != '"')
-      FATAL("Malformed name=\"keyword\" pair in line %u.", cur_line);
+  if (map_dirty) {
 
-    lptr++;
+    u32 i, j;
 
-    if (!*lptr) FATAL("Empty keyword in line %u.", cur_line);
+    for (i = 0; i < (map_size >> MAP_LINE_SHIFT); i++) {
 
-    /* Okay, let's allocate memory and copy data between "...", handling
-       \xNN escaping, \\, and \". */
+      map_word* cur = (map_word*)(trace_bits + i * MAP_LINE);
 
-    extras = ck_realloc_block(extras, (extras_cnt + 1) *
-               sizeof(struct extra_data));
+      if (i && !trace_dirty[i]) continue;
 
-    wptr = extras[extras_cnt].data = ck_alloc(rptr - lptr);
+      for (j = 0; j < MAP_LINE / sizeof(map_word); j++)
+        if (cur[j]) cur[j] = classify_word(cur[j]);
 
-    while (*lptr) {
+    }
 
-      char* hexdigits = "0123456789abcdef";
+  } else {
 
-      switch (*lptr) {
+#ifdef __x86_64__
+    classify_counts((u64*)trace_bits);
+#else
+    classify_counts((u32*)trace_bits);
+#endif /* ^__x86_64__ */
 
-        case 1 ... 31:
-        case 128 ... 255:
-          FATAL("Non-printable characters in line %u.", cur_line);
+  }
 
-        case '\\':
+  trace_classified = 1;
 
-          lptr++;
+}
 
-          if (*lptr == '\\' || *lptr == '"') {
-            *(wptr++) = *(lptr++);
-            klen++;
-            break;
-          }
 
-          if (*lptr != 'x' || !isxdigit(lptr[1]) || !isxdigit(lptr[2]))
-            FATAL("Invalid escaping (not \\xNN) in line %u.", cur_line);
+/* Check if the current execution path brings anything new to the table.
+   Update virgin bits to reflect the finds. Returns 1 if the only change is
+   the hit-count for a particular tuple; 2 if there are new tuples or new
+   laf bits seen. Updates the map, so subsequent calls will always return
+   0. */
 
-          *(wptr++) =
-            ((strchr(hexdigits, tolower(lptr[1])) - hexdigits) << 4) |
-            (strchr(hexdigits, tolower(lptr[2])) - hexdigits);
+static inline u8 has_new_bits(u8* virgin_map) {
 
-          lptr += 3;
-          klen++;
+  u8 ret = check_coverage(virgin_map, 1);
 
-          break;
+  if (ret & (COV_NEW_EDGE | COV_NEW_LAF)) return 2;
 
-        default:
+  return ret & COV_NEW_HITS;
 
-          *(wptr++) = *(lptr++);
-          klen++;
+}
 
-      }
 
-    }
+/* Same verdict as has_new_bits(), but leaves the virgin maps alone. */
 
-    extras[extras_cnt].len = klen;
+static inline u8 test_has_new_bits(u8* virgin_map) {
 
-    if (extras[extras_cnt].len > MAX_DICT_FILE)
-      FATAL("Keyword too big in line %u (%s, limit is %s)", cur_line,
-            DMS(klen), DMS(MAX_DICT_FILE));
+  u8 ret = check_coverage(virgin_map, 0);
 
-    if (*min_len > klen) *min_len = klen;
-    if (*max_len < klen) *max_len = klen;
+  if (ret & (COV_NEW_EDGE | COV_NEW_LAF)) return 2;
 
-    extras_cnt++;
+  return ret & COV_NEW_HITS;
 
-  }
+}
 
-  fclose(f);
 
-  
+/* Header of a queue/.state/coverage/ file. It is followed by the packed
+   edges, then by the packed non-zero laf bytes. The flags carry the entry's
+   find_new_laf_branch bits, plus COV_FLAG_NEW_COV. */
 
-}
+#define COV_FLAG_NEW_COV  0x100
 
+struct cov_file_hdr {
+  u32 magic, map_size, cksum, exec_us, flags, edges, laf_bytes;
+};
 
-/* Read extras from the extras directory and sort them by size. */
+/* Collect the non-zero bytes of a map into buf as (offset << 8 | value). */
 
-static void load_extras(u8* dir) {
+static u32 pack_map(u32* buf, u8* map) {
 
-  DIR* d;
-  struct dirent* de;
-  u32 min_len = MAX_DICT_FILE, max_len = 0, dict_level = 0;
-  u8* x;
+  u32 i, j, n = 0;
 
-  /* If the name ends with @, extract level and continue. */
+  for (i = 0; i < map_size; i += sizeof(map_word)) {
 
-  if ((x = strchr(dir, '@'))) {
+    if (!*(map_word*)(map + i)) continue;
 
-    *x = 0;
-    dict_level = atoi(x + 1);
+    for (j = i; j < i + sizeof(map_word); j++)
+      if (map[j]) buf[n++] = (j << 8) | map[j];
 
   }
 
-  ACTF("Loading extra dictionary from '%s' (level %u)...", dir, dict_level);
+  return n;
 
-  d = opendir(dir);
+}
 
-  if (!d) {
+/* Write the coverage file for a freshly calibrated entry, straight from the
+   classified trace_bits and laf_trace_bits of its last run. Only useful to
+   other instances, so nothing is written outside of -M / -S. */
 
-    if (errno == ENOTDIR) {
-      load_extras_file(dir, &min_len, &max_len, dict_level);
-      goto check_and_sort;
-    }
+static void save_coverage(struct queue_entry* q) {
 
-    PFATAL("Unable to open '%s'", dir);
-
-  }
+  static u32* buf;
+  static u32  buf_size;
 
-  if (x) FATAL("Dictionary levels not supported for directories.");
+  struct cov_file_hdr h;
+  u8 *fn, *data;
+  u32 len;
 
-  while ((de = readdir(d))) {
+  if (!sync_id || crash_mode) return;
 
-    struct stat st;
-    u8* fn = alloc_printf("%s/%s", dir, de->d_name);
-    s32 fd;
+  if (buf_size != map_size) {
+    ck_free(buf);
+    buf = ck_alloc_nozero(2 * map_size * sizeof(u32));
+    buf_size = map_size;
+  }
 
-    if (lstat(fn, &st) || access(fn, R_OK))
-      PFATAL("Unable to access '%s'", fn);
+  h.magic     = COV_FILE_MAGIC;
+  h.map_size  = map_size;
+  h.cksum     = q->exec_cksum;
+  h.exec_us   = MIN(qhot.exec_us[q->id], 0xffffffff);
+  h.flags     = q->find_new_laf_branch | (q->has_new_cov ? COV_FLAG_NEW_COV : 0);
+  h.edges     = pack_map(buf, trace_bits);
+  h.laf_bytes = pack_map(buf + h.edges, laf_trace_bits);
 
-    /* This also takes care of . and .. */
-    if (!S_ISREG(st.st_mode) || !st.st_size) {
+  fn = strrchr(q->fname, '/');
+  fn = alloc_printf("%s/queue/.state/coverage/%s", out_dir, fn + 1);
 
-      ck_free(fn);
-      continue;
+  len  = (h.edges + h.laf_bytes) * sizeof(u32);
+  data = ck_alloc_nozero(sizeof(h) + len);
 
-    }
+  memcpy(data, &h, sizeof(h));
+  memcpy(data + sizeof(h), buf, len);
 
-    if (st.st_size > MAX_DICT_FILE)
-      FATAL("Extra '%s' is too big (%s, limit is %s)", fn,
-            DMS(st.st_size), DMS(MAX_DICT_FILE));
+  io_queue(IO_FILE, IO_F_TRUNC, fn, data, sizeof(h) + len);
 
-    if (min_len > st.st_size) min_len = st.st_size;
-    if (max_len < st.st_size) max_len = st.st_size;
+}
 
-    extras = ck_realloc_block(extras, (extras_cnt + 1) *
-               sizeof(struct extra_data));
+/* Load the coverage file of a queue entry of another instance into h and
+   a freshly allocated list of packed bytes. Returns NULL if the file is not
+   there, is cut short, or was written for another map size. */
 
-    extras[extras_cnt].data = ck_alloc(st.st_size);
-    extras[extras_cnt].len  = st.st_size;
+static u32* read_cov_file(u8* fuzzer, u8* fname, struct cov_file_hdr* h) {
 
-    fd = open(fn, O_RDONLY);
+  struct stat st;
+  u8* fn;
+  u32* buf;
+  u32 n;
+  s32 fd;
 
-    if (fd < 0) PFATAL("Unable to open '%s'", fn);
+  fn = alloc_printf("%s/%s/queue/.state/coverage/%s", sync_dir, fuzzer, fname);
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
 
-    ck_read(fd, extras[extras_cnt].data, st.st_size, fn);
+  if (fd < 0) return NULL;
 
+  if (fstat(fd, &st) || read(fd, h, sizeof(*h)) != sizeof(*h) ||
+      h->magic != COV_FILE_MAGIC || h->map_size != map_size ||
+      h->edges > map_size || h->laf_bytes > map_size ||
+      st.st_size != sizeof(*h) + (h->edges + h->laf_bytes) * sizeof(u32)) {
     close(fd);
-    ck_free(fn);
+    return NULL;
+  }
 
-    extras_cnt++;
+  n   = h->edges + h->laf_bytes;
+  buf = ck_alloc_nozero(n * sizeof(u32) + 1);
 
+  if (read(fd, buf, n * sizeof(u32)) != n * sizeof(u32)) {
+    ck_free(buf);
+    buf = NULL;
   }
 
-  closedir(d);
+  close(fd);
+  return buf;
 
-check_and_sort:
+}
 
-  if (!extras_cnt) FATAL("No usable files in '%s'", dir);
+/* Check a queue entry of another instance against our virgin maps, going
+   by its coverage file. Returns 0 only if the file is there, matches our
+   map size, and shows nothing new; the case then needs no execution. */
 
-  qsort(extras, extras_cnt, sizeof(struct extra_data), compare_extras_len);
+static u8 cov_file_has_new_bits(u8* fuzzer, u8* fname) {
 
-  OKF("Loaded %u extra tokens, size range %s to %s.", extras_cnt,
-      DMS(min_len), DMS(max_len));
+  struct cov_file_hdr h;
+  u32* buf;
+  u32 i;
+  u8 ret = 0;
 
-  if (max_len > 32)
-    WARNF("Some tokens are relatively large (%s) - consider trimming.",
-          DMS(max_len));
+  if (crash_mode || !(buf = read_cov_file(fuzzer, fname, &h))) return 1;
 
-  if (extras_cnt > MAX_DET_EXTRAS)
-    WARNF("More than %u tokens - will use them probabilistically.",
-          MAX_DET_EXTRAS);
+  for (i = 0; i < h.edges + h.laf_bytes && !ret; i++) {
+
+    u32 off = (buf[i] >> 8) & (map_size - 1);
+    u8  val = buf[i];
+
+    if (i < h.edges) ret = !!(val & virgin_bits[off]);
+    else ret = !!(val & ~laf_virgin_bits[off]);
+
+  }
+
+  ck_free(buf);
+  return ret;
 
 }
 
 
+/* Get rid of shared memory (atexit handler). */
+static void remove_laf_shm(void) {
 
+  shmctl(laf_shm_id, IPC_RMID, NULL);
 
-/* Helper function for maybe_add_auto() */
+}
 
-static inline u8 memcmp_nocase(u8* m1, u8* m2, u32 len) {
+static void remove_shm(void) {
 
-  while (len--) if (tolower(*(m1++)) ^ tolower(*(m2++))) return 1;
-  return 0;
+  shmctl(shm_id, IPC_RMID, NULL);
+  remove_laf_shm();
+  if (shm_fuzz_id >= 0) shmctl(shm_fuzz_id, IPC_RMID, NULL);
+  if (shm_batch_id >= 0) shmctl(shm_batch_id, IPC_RMID, NULL);
+  if (shm_cmplog_id >= 0) shmctl(shm_cmplog_id, IPC_RMID, NULL);
 
 }
 
 
-/* Maybe add automatic extra. */
 
-static void maybe_add_auto(u8* mem, u32 len) {
+/* Compact trace bytes into a smaller bitmap. We effectively just drop the
+   count information here. This is called only sporadically, for some
+   new paths. */
 
-  u32 i;
+static void minimize_bits(u8* dst, u8* src) {
 
-  /* Allow users to specify that they don't want auto dictionaries. */
+  u32 i = 0;
 
-  if (!MAX_AUTO_EXTRAS || !USE_AUTO_EXTRAS) return;
+  while (i < map_size) {
 
-  /* Skip runs of identical bytes. */
+    if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
+    i++;
 
-  for (i = 1; i < len; i++)
-    if (mem[0] ^ mem[i]) break;
+  }
 
-  if (i == len) return;
+} 
+ 
 
-  /* Reject builtin interesting values. */
+/* Queue an edge for the next cull_queue_orig(), because its top_rated[]
+   winner changed or no favored entry covers it anymore. */
 
-  if (len == 2) {
+static inline void cull_mark_dirty(u32 e) {
 
-    i = sizeof(interesting_16) >> 1;
+  if (cull_in_dirty[e]) return;
 
-    while (i--) 
-      if (*((u16*)mem) == interesting_16[i] ||
-          *((u16*)mem) == SWAP16(interesting_16[i])) return;
+  cull_in_dirty[e] = 1;
+  cull_dirty[cull_dirty_cnt++] = e;
 
-  }
+}
 
-  if (len == 4) {
 
-    i = sizeof(interesting_32) >> 2;
+/* Add or remove the bits of a favored entry's trace_mini in fav_cover[].
+   Edges that nobody covers anymore are queued for the next cull. */
 
-    while (i--) 
-      if (*((u32*)mem) == interesting_32[i] ||
-          *((u32*)mem) == SWAP32(interesting_32[i])) return;
+static void fav_count(struct queue_entry* q, u8 on) {
 
-  }
+  u32 i;
 
-  /* Reject anything that matches existing extras. Do a case-insensitive
-     match. We optimize by exploiting the fact that extras[] are sorted
-     by size. */
+  if (on == q->fav_counted || !q->trace_mini) return;
 
-  for (i = 0; i < extras_cnt; i++)
-    if (extras[i].len >= len) break;
+  q->fav_counted = on;
 
-  for (; i < extras_cnt && extras[i].len == len; i++)
-    if (!memcmp_nocase(extras[i].data, mem, len)) return;
+  for (i = 0; i < map_size; i++) {
 
-  /* Last but not least, check a_extras[] for matches. There are no
-     guarantees of a particular sort order. */
+    if (!(q->trace_mini[i >> 3] & (1 << (i & 7)))) {
+      if (!q->trace_mini[i >> 3]) i |= 7;
+      continue;
+    }
 
-  auto_changed = 1;
+    if (on) fav_cover[i]++;
+    else if (!--fav_cover[i]) cull_mark_dirty(i);
 
-  for (i = 0; i < a_extras_cnt; i++) {
+  }
 
-    if (a_extras[i].len == len && !memcmp_nocase(a_extras[i].data, mem, len)) {
+}
 
-      a_extras[i].hit_cnt++;
-      goto sort_a_extras;
 
-    }
+/* Flip the favored status of an entry, keeping queued_favored and
+   pending_favored in step. The redundant marker is touched right away,
+   unless a full rebuild will sort it out at the end. */
 
-  }
+static void fav_set(struct queue_entry* q, u8 on) {
 
-  /* At this point, looks like we're dealing with a new entry. So, let's
-     append it if we have room. Otherwise, let's randomly evict some other
-     entry from the bottom half of the list. */
+  if (on == qhot.favored[q->id]) {
+    if (on) fav_count(q, 1);
+    return;
+  }
 
-  if (a_extras_cnt < MAX_AUTO_EXTRAS) {
+  qhot.favored[q->id] = on;
 
-    a_extras = ck_realloc_block(a_extras, (a_extras_cnt + 1) *
-                                sizeof(struct extra_data));
+  if (on) {
 
-    a_extras[a_extras_cnt].data = ck_memdup(mem, len);
-    a_extras[a_extras_cnt].len  = len;
-    a_extras_cnt++;
+    queued_favored++;
+    if (!qhot.was_fuzzed[q->id]) pending_favored++;
 
   } else {
 
-    i = MAX_AUTO_EXTRAS / 2 +
-        UR((MAX_AUTO_EXTRAS + 1) / 2);
+    queued_favored--;
+    if (!qhot.was_fuzzed[q->id] && pending_favored) pending_favored--;
 
-    ck_free(a_extras[i].data);
+  }
 
-    a_extras[i].data    = ck_memdup(mem, len);
-    a_extras[i].len     = len;
-    a_extras[i].hit_cnt = 0;
+  fav_count(q, on);
 
-  }
+  if (!cull_rebuilding) mark_as_redundant(q, !on);
 
-sort_a_extras:
+}
 
-  /* First, sort all auto extras by use count, descending order. */
 
-  qsort(a_extras, a_extras_cnt, sizeof(struct extra_data),
-        compare_extras_use_d);
+/* Called before an entry loses its trace_mini. Entries that are only
+   favored for the edges they were top rated on leave the set. */
 
-  /* Then, sort the top USE_AUTO_EXTRAS entries by size. */
+static void fav_drop_trace(struct queue_entry* q) {
 
-  qsort(a_extras, MIN(USE_AUTO_EXTRAS, a_extras_cnt),
-        sizeof(struct extra_data), compare_extras_len);
+  if (qhot.favored[q->id] && !q->fav_forced) fav_set(q, 0);
+  else fav_count(q, 0);
 
 }
 
 
-/* Save automatically generated extras. */
+/* When we bump into a new path, we call this to see if the path appears
+   more "favorable" than any of the existing ones. The purpose of the
+   "favorables" is to have a minimal set of paths that trigger all the bits
+   seen in the bitmap so far, and focus on fuzzing them at the expense of
+   the rest.
 
-static void save_auto(void) {
+   The first step of the process is to maintain a list of top_rated[] entries
+   for every byte in the bitmap. We win that slot if there is no previous
+   contender, or if the contender has a more favorable speed x size factor. */
+
+static void update_bitmap_score(struct queue_entry* q) { 
+   
 
   u32 i;
+  if((q->has_new_cov==0)&&(q!=queue))
+    return; 
+  u64 fav_factor = qhot.exec_us[q->id] * q->len;
 
-  if (!auto_changed) return;
-  auto_changed = 0;
+  /* For every byte set in trace_bits[], see if there is a previous winner,
+     and how it compares to us. */ 
+  for (i = 0; i < map_size; i++)
 
-  for (i = 0; i < MIN(USE_AUTO_EXTRAS, a_extras_cnt); i++) {
+    if (trace_bits[i]) {                   
 
-    u8* fn = alloc_printf("%s/queue/.state/auto_extras/auto_%06u", out_dir, i);
-    s32 fd;
+       if (top_rated[i]) {
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+         /* Faster-executing or smaller test cases are favored. */
 
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
+         if (fav_factor > qhot.exec_us[top_rated[i]->id] * top_rated[i]->len) continue;
 
-    ck_write(fd, a_extras[i].data, a_extras[i].len, fn);
+         /* Looks like we're going to win. Decrease ref count for the
+            previous winner, discard its trace_bits[] if necessary. */
 
-    close(fd);
-    ck_free(fn);
+         if (!--top_rated[i]->tc_ref) {
+           fav_drop_trace(top_rated[i]);
+           ck_free(top_rated[i]->trace_mini);
+           top_rated[i]->trace_mini = 0;  
+         }
 
-  }
+       }
 
-}
+       /* Insert ourselves as the new winner. */
+       top_rated[i] = q;
+       cull_mark_dirty(i);
 
+       q->tc_ref++;
 
-/* Load automatically generated extras. */
+       if (!q->trace_mini) {
+         q->trace_mini = ck_alloc(map_size >> 3);
+         minimize_bits(q->trace_mini, trace_bits);  
+         if (frontier_mode) q->frontier_hits = count_frontier_hits(q->trace_mini);
+       }
 
-static void load_auto(void) {
+       score_changed = 1;
 
-  u32 i;
+     }
 
-  for (i = 0; i < USE_AUTO_EXTRAS; i++) {
+} 
 
-    u8  tmp[MAX_AUTO_EXTRA + 1];
-    u8* fn = alloc_printf("%s/.state/auto_extras/auto_%06u", in_dir, i);
-    s32 fd, len;
 
-    fd = open(fn, O_RDONLY, 0600);
+/* The second part of the mechanism discussed above is a routine that
+   maintains the favored set: entries that were not fuzzed yet and found new
+   laf bits, plus, greedily, the top_rated[] winner of every edge that no
+   favored entry covers yet. Non-favored entries are skipped most of the
+   time by the seed scheduler.
 
-    if (fd < 0) {
+   The set is kept up to date incrementally: only edges whose top_rated[]
+   winner changed, or that lost their last favored cover, are looked at.
+   Entries that are no longer the best choice stay favored until the next
+   queue cycle, when the set is rebuilt from scratch. */
 
-      if (errno != ENOENT) PFATAL("Unable to open '%s'", fn);
-      ck_free(fn);
-      break;
+static void cull_queue_orig(void) {
 
-    }
+  struct queue_entry* q;
+  u32 i, j, n, pass;
+  u8  rebuild = (queue_cycle != cull_cycle);
 
-    /* We read one byte more to cheaply detect tokens that are too
-       long (and skip them). */
+  if (dumb_mode || (!score_changed && !rebuild)) return;
 
-    len = read(fd, tmp, MAX_AUTO_EXTRA + 1);
+  score_changed = 0;
 
-    if (len < 0) PFATAL("Unable to read from '%s'", fn);
+  /* The frontier only shrinks for an edge once its children are found, so
+     the per-seed hit counts go stale; refresh them for seeds that still
+     have their trace. */
 
-    if (len >= MIN_AUTO_EXTRA && len <= MAX_AUTO_EXTRA)
-      maybe_add_auto(tmp, len);
+  if (frontier_changed) {
 
-    close(fd);
-    ck_free(fn);
+    for (i = 0; i < queued_paths; i++) {
+      q = queue_buf[i];
+      if (q->trace_mini) q->frontier_hits = count_frontier_hits(q->trace_mini);
+    }
+
+    frontier_changed = 0;
 
   }
 
-  if (i) OKF("Loaded %u auto-discovered dictionary tokens.", i);
-  else OKF("No auto-generated dictionary tokens to reuse.");
+  /* Once per queue cycle, start over. Redundant markers are then only
+     updated at the end, for the entries whose status actually changed. */
 
-}
+  if (rebuild) {
 
+    cull_rebuilding = 1;
 
-/* Destroy extras. */
+    memset(fav_cover, 0, map_size * sizeof(u32));
+    memset(qhot.favored, 0, queued_paths);
 
-static void destroy_extras(void) {
+    for (i = 0; i < queued_paths; i++) {
+      queue_buf[i]->fav_counted = 0;
+      queue_buf[i]->fav_forced  = 0;
+    }
 
-  u32 i;
+    fav_forced_cnt  = 0;
+    queued_favored  = 0;
+    pending_favored = 0;
+    cull_seen       = 0;
 
-  for (i = 0; i < extras_cnt; i++) 
-    ck_free(extras[i].data);
+  }
 
-  ck_free(extras);
+  /* Entries with new laf bits that were not fuzzed yet are always favored.
+     Those that have been fuzzed since the last cull lose that status. */
 
-  for (i = 0; i < a_extras_cnt; i++) 
-    ck_free(a_extras[i].data);
+  for (i = 0, j = 0; i < fav_forced_cnt; i++) {
 
-  ck_free(a_extras);
+    q = queue_buf[fav_forced_ids[i]];
 
-}
+    if (!qhot.was_fuzzed[q->id]) {
+      fav_forced_ids[j++] = q->id;
+      continue;
+    }
 
+    q->fav_forced = 0;
+    fav_set(q, 0);
 
-/* Spin up fork server (instrumented mode only). The idea is explained here:
+  }
 
-   http://lcamtuf.blogspot.com/2014/10/fuzzing-binaries-without-execve.html
+  fav_forced_cnt = j;
 
-   In essence, the instrumentation allows us to skip execve(), and just keep
-   cloning a stopped child. So, we just execute once, and then send commands
-   through a pipe. The other part of this logic is in afl-as.h. */
+  for (i = cull_seen; i < queued_paths; i++) {
 
-EXP_ST void init_forkserver(char** argv) {
+    q = queue_buf[i];
 
-  static struct itimerval it;
-  int st_pipe[2], ctl_pipe[2];
-  int status;
-  s32 rlen;
+    if (qhot.was_fuzzed[i] || !q->find_new_laf_branch) continue;
 
-  ACTF("Spinning up the fork server...");
+    if (fav_forced_cnt == fav_forced_size) {
+      fav_forced_size = fav_forced_size ? fav_forced_size * 2 : 64;
+      fav_forced_ids  = ck_realloc(fav_forced_ids,
+                                   fav_forced_size * sizeof(u32));
+    }
 
-  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
+    fav_forced_ids[fav_forced_cnt++] = i;
+    q->fav_forced = 1;
+    fav_set(q, 1);
 
-  forksrv_pid = fork();
+  }
 
-  if (forksrv_pid < 0) PFATAL("fork() failed");
+  cull_seen = queued_paths;
 
-  if (!forksrv_pid) {
+  /* Take the top_rated[] winner of every edge that no favored entry covers
+     - all edges on a rebuild, only the queued ones otherwise. In frontier
+     mode, the winners of frontier edges get to go first, so the seeds that
+     reach the frontier are the ones that end up covering the rest. */
 
-    struct rlimit r;
+  n = rebuild ? map_size : cull_dirty_cnt;
 
-    /* Umpf. On OpenBSD, the default fd limit for root users is set to
-       soft 128. Let's try to fix that... */
+  for (pass = !frontier_mode; pass < 2; pass++) {
 
-    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2) {
+    for (i = 0; i < n; i++) {
 
-      r.rlim_cur = FORKSRV_FD + 2;
-      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
+      u32 e = rebuild ? i : cull_dirty[i];
+      u8  on_frontier;
 
-    }
+      if (!top_rated[e] || fav_cover[e]) continue;
 
-    if (mem_limit) {
+      on_frontier = frontier_mode && (frontier_bits[e >> 3] & (1 << (e & 7)));
+      if (on_frontier != !pass) continue;
 
-      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+      fav_set(top_rated[e], 1);
 
-#ifdef RLIMIT_AS
+    }
 
-      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+  }
 
-#else
+  for (i = 0; i < cull_dirty_cnt; i++) cull_in_dirty[cull_dirty[i]] = 0;
+  cull_dirty_cnt = 0;
 
-      /* This takes care of OpenBSD, which doesn't have RLIMIT_AS, but
-         according to reliable sources, RLIMIT_DATA covers anonymous
-         maps - so we should be getting good protection against OOM bugs. */
+  if (rebuild) {
 
-      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+    cull_rebuilding = 0;
+    cull_cycle      = queue_cycle;
 
-#endif /* ^RLIMIT_AS */
+    for (i = 0; i < queued_paths; i++)
+      mark_as_redundant(queue_buf[i], !qhot.favored[i]);
 
+  }
 
-    }
+}
 
-    /* Dumping cores is slow and can lead to anomalies if SIGKILL is delivered
-       before the dump is complete. */
+EXP_ST void setup_laf_shm(void) {
 
-    r.rlim_max = r.rlim_cur = 0;
+  u8* shm_str; 
 
-    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+  if (laf_trace_bits) {
+    shmdt(laf_trace_bits);
+    remove_laf_shm();
+  }
 
-    /* Isolate the process and configure standard descriptors. If out_file is
-       specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+  /* The touched-byte list used by AFL_LAF_TOUCH binaries follows the map. */
 
-    setsid();
+  laf_shm_id = shmget(IPC_PRIVATE, map_size + LAF_TOUCH_SIZE,
+                      IPC_CREAT | IPC_EXCL | 0600);
 
-    dup2(dev_null_fd, 1);
-    dup2(dev_null_fd, 2);
+  if (laf_shm_id < 0) PFATAL("setup_lafshm() failed"); 
 
-    if (out_file) {
+  shm_str = alloc_printf("%d", laf_shm_id);
 
-      dup2(dev_null_fd, 0);
+  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
+     we don't want them to detect instrumentation, since we won't be sending
+     fork server commands. This should be replaced with better auto-detection
+     later on, perhaps? */
 
-    } else {
+  if (!dumb_mode) setenv(LAF_SHM_ENV_VAR, shm_str, 1);
 
-      dup2(out_fd, 0);
-      close(out_fd);
+  ck_free(shm_str);
 
-    }
+  laf_trace_bits = shmat(laf_shm_id, NULL, 0);
+  
+  if (!laf_trace_bits) PFATAL("setup_lafshm() failed");
 
-    /* Set up control and status pipes, close the unneeded original fds. */
+  laf_touch = (u32*)(laf_trace_bits + map_size);
 
-    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
-    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
+}
 
-    close(ctl_pipe[0]);
-    close(ctl_pipe[1]);
-    close(st_pipe[0]);
-    close(st_pipe[1]);
+/* Allocate everything that is sized by the map, for the current map_size.
+   Nothing may have been recorded yet if this is a resize. */
 
-    close(out_dir_fd);
-    close(dev_null_fd);
-    close(dev_urandom_fd);
-    close(fileno(plot_file));
+static void setup_maps(void) {
 
-    /* This should improve performance a bit, since it stops the linker from
-       doing extra work post-fork(). */
+  if (!group_virgin) {
+    ck_free(virgin_bits);
+    ck_free(virgin_tmout);
+    ck_free(virgin_crash);
+    ck_free(laf_virgin_bits);
+  }
 
-    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
+  ck_free(virgin_bit_mini);
+  ck_free(chose_nums);
+  ck_free(var_bytes);
+  ck_free(first_trace);
+  ck_free(clean_trace);
+  ck_free(top_rated);
+  ck_free(fav_cover);
+  ck_free(cull_dirty);
+  ck_free(cull_in_dirty);
 
-    /* Set sane defaults for ASAN if nothing else specified. */
+  /* A -j group keeps its virgin maps in the shared region set up by
+     setup_group(), which has room for any map size and starts out with
+     nothing seen. */
 
-    setenv("ASAN_OPTIONS", "abort_on_error=1:"
-                           "detect_leaks=0:"
-                           "symbolize=0:"
-                           "allocator_may_return_null=1", 0);
+  if (group_virgin) {
 
-    /* MSAN is tricky, because it doesn't support abort_on_error=1 at this
-       point. So, we do this in a very hacky way. */
+    virgin_bits     = group_virgin;
+    virgin_tmout    = group_virgin + MAP_SIZE_MAX;
+    virgin_crash    = group_virgin + 2 * MAP_SIZE_MAX;
+    laf_virgin_bits = group_virgin + 3 * MAP_SIZE_MAX;
 
-    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
-                           "symbolize=0:"
-                           "abort_on_error=1:"
-                           "allocator_may_return_null=1:"
-                           "msan_track_origins=0", 0);
+  } else {
 
-    execv(target_path, argv);
+    virgin_bits     = ck_alloc(map_size);
+    virgin_tmout    = ck_alloc(map_size);
+    virgin_crash    = ck_alloc(map_size);
+    laf_virgin_bits = ck_alloc(map_size);
 
-    /* Use a distinctive bitmap signature to tell the parent about execv()
-       falling through. */
+  }
 
-    *(u32*)trace_bits = EXEC_FAIL_SIG;
-    exit(0);
+  virgin_bit_mini = ck_alloc(map_size >> 3);
+  chose_nums      = ck_alloc(map_size * sizeof(u64));
+  var_bytes       = ck_alloc(map_size);
+  first_trace     = ck_alloc(map_size);
+  clean_trace     = ck_alloc(map_size);
+  top_rated       = ck_alloc(map_size * sizeof(struct queue_entry*));
+  fav_cover       = ck_alloc(map_size * sizeof(u32));
+  cull_dirty      = ck_alloc(map_size * sizeof(u32));
+  cull_in_dirty   = ck_alloc(map_size);
 
-  }
+  if (in_bitmap) {
+    read_bitmap(in_bitmap);
+    recount_coverage(0);
+  } else if (!group_virgin) memset(virgin_bits, 255, map_size);
 
-  /* Close the unneeded endpoints. */
+  if (!group_virgin) {
+    memset(virgin_tmout, 255, map_size);
+    memset(virgin_crash, 255, map_size);
+  }
 
-  close(ctl_pipe[0]);
-  close(st_pipe[1]);
+}
 
-  fsrv_ctl_fd = ctl_pipe[1];
-  fsrv_st_fd  = st_pipe[0];
+/* Configure shared memory and virgin_bits. This is called at startup, and
+   again if the fork server asks for a different map size. */
 
-  /* Wait for the fork server to come up, but don't wait too long. */
+EXP_ST void setup_shm(void) {
 
-  it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
-  it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
+  static u8 exit_hook;
+  u8* shm_str;
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  setup_maps();
+  setup_laf_shm();
 
-  rlen = read(fsrv_st_fd, &status, 4);
+  if (trace_bits) {
+    shmdt(trace_bits);
+    shmctl(shm_id, IPC_RMID, NULL);
+  }
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+  /* Binaries built with AFL_MAP_DIRTY flag the lines they write to in a
+     byte map right after the trace map. */
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  shm_id = shmget(IPC_PRIVATE, map_size + (map_size >> MAP_LINE_SHIFT),
+                  IPC_CREAT | IPC_EXCL | 0600);
 
-  /* If we have a four-byte "hello" message from the server, we're all set.
-     Otherwise, try to figure out what went wrong. */
+  if (shm_id < 0) PFATAL("shmget() failed");
 
-  if (rlen == 4) {
-    OKF("All right - fork server is up.");
-    return;
+  if (!exit_hook) {
+    atexit(remove_shm);
+    exit_hook = 1;
   }
 
-  if (child_timed_out)
-    FATAL("Timeout while initializing fork server (adjusting -t may help)");
+  /* Binaries check this to see if their maps fit. */
 
-  if (waitpid(forksrv_pid, &status, 0) <= 0)
-    PFATAL("waitpid() failed");
+  shm_str = alloc_printf("%u", map_size);
+  setenv(MAP_SIZE_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
 
-  if (WIFSIGNALED(status)) {
+  shm_str = alloc_printf("%d", shm_id);
 
-    if (mem_limit && mem_limit < 500 && uses_asan) {
+  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
+     we don't want them to detect instrumentation, since we won't be sending
+     fork server commands. This should be replaced with better auto-detection
+     later on, perhaps? */
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! Since it seems to be built with ASAN and you have a\n"
-           "    restrictive memory limit configured, this is expected; please read\n"
-           "    %s/notes_for_asan.txt for help.\n", doc_path);
+  if (!dumb_mode) setenv(SHM_ENV_VAR, shm_str, 1);
 
-    } else if (!mem_limit) {
+  ck_free(shm_str);
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! There are several probable explanations:\n\n"
+  trace_bits = shmat(shm_id, NULL, 0);
+  
+  if (!trace_bits) PFATAL("shmat() failed");
 
-           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
-           "      need to fix the underlying problem or find a better replacement.\n\n"
+  trace_dirty = trace_bits + map_size;
 
-#ifdef __APPLE__
+}
 
-           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-           "      break afl-fuzz performance optimizations when running platform-specific\n"
-           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
 
-#endif /* __APPLE__ */
+/* Set up the region used to hand test cases to binaries that read them
+   with __AFL_FUZZ_TESTCASE_BUF / __AFL_FUZZ_TESTCASE_LEN. It holds the
+   length as a u32, followed by up to MAX_FILE bytes of data. */
 
-           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+static void setup_shm_fuzz(void) {
 
-    } else {
+  u8* shm_str;
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! There are several probable explanations:\n\n"
+  shm_fuzz_id = shmget(IPC_PRIVATE, MAX_FILE + sizeof(u32),
+                       IPC_CREAT | IPC_EXCL | 0600);
 
-           "    - The current memory limit (%s) is too restrictive, causing the\n"
-           "      target to hit an OOM condition in the dynamic linker. Try bumping up\n"
-           "      the limit with the -m setting in the command line. A simple way confirm\n"
-           "      this diagnosis would be:\n\n"
+  if (shm_fuzz_id < 0) PFATAL("shmget() failed");
 
-#ifdef RLIMIT_AS
-           "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#else
-           "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#endif /* ^RLIMIT_AS */
+  shm_str = alloc_printf("%d", shm_fuzz_id);
+  setenv(SHM_FUZZ_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
 
-           "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-           "      estimate the required amount of virtual memory for the binary.\n\n"
+  shm_fuzz = shmat(shm_fuzz_id, NULL, 0);
 
-           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
-           "      need to fix the underlying problem or find a better replacement.\n\n"
+  if (shm_fuzz == (void*)-1) PFATAL("shmat() failed");
 
-#ifdef __APPLE__
+}
 
-           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-           "      break afl-fuzz performance optimizations when running platform-specific\n"
-           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
 
-#endif /* __APPLE__ */
+/* Set up the region used to run several test cases per fork server round
+   trip in persistent binaries that read them from shared memory. Whether
+   the runtime actually supports it is known only once it sets the ready
+   flag in the header. */
 
-           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-           DMS(mem_limit << 20), mem_limit - 1);
+static void setup_shm_batch(void) {
 
-    }
+  u8* shm_str;
 
-    FATAL("Fork server crashed with signal %d", WTERMSIG(status));
+  shm_batch_id = shmget(IPC_PRIVATE, BATCH_SIZE, IPC_CREAT | IPC_EXCL | 0600);
 
-  }
+  if (shm_batch_id < 0) PFATAL("shmget() failed");
 
-  if (*(u32*)trace_bits == EXEC_FAIL_SIG)
-    FATAL("Unable to execute target application ('%s')", argv[0]);
+  shm_str = alloc_printf("%d", shm_batch_id);
+  setenv(SHM_BATCH_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
 
-  if (mem_limit && mem_limit < 500 && uses_asan) {
+  shm_batch = shmat(shm_batch_id, NULL, 0);
 
-    SAYF("\n" cLRD "[-] " cRST
-           "Hmm, looks like the target binary terminated before we could complete a\n"
-           "    handshake with the injected code. Since it seems to be built with ASAN and\n"
-           "    you have a restrictive memory limit configured, this is expected; please\n"
-           "    read %s/notes_for_asan.txt for help.\n", doc_path);
+  if (shm_batch == (void*)-1) PFATAL("shmat() failed");
 
-  } else if (!mem_limit) {
+}
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Hmm, looks like the target binary terminated before we could complete a\n"
-         "    handshake with the injected code. Perhaps there is a horrible bug in the\n"
-         "    fuzzer. Poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
 
-  } else {
+/* Set up the region that binaries built with AFL_CMPLOG log comparison
+   operands to. Logging stays off except for the one run per queue entry
+   made by the cmplog stage. */
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Hmm, looks like the target binary terminated before we could complete a\n"
-         "    handshake with the injected code. There are %s probable explanations:\n\n"
+static void setup_shm_cmplog(void) {
 
-         "%s"
-         "    - The current memory limit (%s) is too restrictive, causing an OOM\n"
-         "      fault in the dynamic linker. This can be fixed with the -m option. A\n"
-         "      simple way to confirm the diagnosis may be:\n\n"
+  u8* shm_str;
 
-#ifdef RLIMIT_AS
-         "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#else
-         "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#endif /* ^RLIMIT_AS */
+  shm_cmplog_id = shmget(IPC_PRIVATE, sizeof(struct cmplog_map),
+                         IPC_CREAT | IPC_EXCL | 0600);
 
-         "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-         "      estimate the required amount of virtual memory for the binary.\n\n"
+  if (shm_cmplog_id < 0) PFATAL("shmget() failed");
 
-         "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-         "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-         getenv(DEFER_ENV_VAR) ? "three" : "two",
-         getenv(DEFER_ENV_VAR) ?
-         "    - You are using deferred forkserver, but __AFL_INIT() is never\n"
-         "      reached before the program terminates.\n\n" : "",
-         DMS(mem_limit << 20), mem_limit - 1);
+  shm_str = alloc_printf("%d", shm_cmplog_id);
+  setenv(CMPLOG_SHM_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
 
-  }
+  cmplog = shmat(shm_cmplog_id, NULL, 0);
 
-  FATAL("Fork server handshake failed");
+  if (cmplog == (void*)-1) PFATAL("shmat() failed");
+
+  cmplog->on = 0;
 
 }
 
 
-/* Execute target application, monitoring for timeouts. Return status
-   information. The called program will update trace_bits[]. */
 
-static u8 run_target(char** argv, u32 timeout) {
+/* Load postprocessor, if available. */
 
-  static struct itimerval it;
-  static u32 prev_timed_out = 0;
+static void setup_post(void) {
 
-  int status = 0;
-  u32 tb4;
+  void* dh;
+  u8* fn = getenv("AFL_POST_LIBRARY");
+  u32 tlen = 6;
 
-  child_timed_out = 0;
+  if (!fn) return;
 
-  /* After this memset, trace_bits[] are effectively volatile, so we
-     must prevent any earlier operations from venturing into that
-     territory. */
+  ACTF("Loading postprocessor from '%s'...", fn);
 
-  memset(trace_bits, 0, MAP_SIZE);
-  memset(laf_trace_bits, 0, MAP_SIZE);
-  MEM_BARRIER();
+  dh = dlopen(fn, RTLD_NOW);
+  if (!dh) FATAL("%s", dlerror());
 
-  /* If we're running in "dumb" mode, we can't rely on the fork server
-     logic compiled into the target program, so we will just keep calling
-     execve(). There is a bit of code duplication between here and 
-     init_forkserver(), but c'est la vie. */
+  post_handler = dlsym(dh, "afl_postprocess");
+  if (!post_handler) FATAL("Symbol 'afl_postprocess' not found.");
 
-  if (dumb_mode == 1 || no_forkserver) {
+  /* Do a quick test. It's better to segfault now than later =) */
 
-    child_pid = fork();
+  post_handler("hello", &tlen);
 
-    if (child_pid < 0) PFATAL("fork() failed");
+  OKF("Postprocessor installed successfully.");
 
-    if (!child_pid) {
+}
 
-      struct rlimit r;
 
-      if (mem_limit) {
+/* Read all testcases from the input directory, then queue them for testing.
+   Called at startup. */
 
-        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+static void read_testcases(void) {
 
-#ifdef RLIMIT_AS
+  struct dirent **nl;
+  s32 nl_cnt;
+  u32 i;
+  u8* fn;
 
-        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+  /* Auto-detect non-in-place resumption attempts. */
 
-#else
+  fn = alloc_printf("%s/queue", in_dir);
+  if (!access(fn, F_OK)) in_dir = fn; else ck_free(fn);
 
-        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+  ACTF("Scanning '%s'...", in_dir);
 
-#endif /* ^RLIMIT_AS */
+  /* We use scandir() + alphasort() rather than readdir() because otherwise,
+     the ordering  of test cases would vary somewhat randomly and would be
+     difficult to control. */
 
-      }
+  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
 
-      r.rlim_max = r.rlim_cur = 0;
+  if (nl_cnt < 0) {
 
-      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+    if (errno == ENOENT || errno == ENOTDIR)
 
-      /* Isolate the process and configure standard descriptors. If out_file is
-         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+      SAYF("\n" cLRD "[-] " cRST
+           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
+           "    one or more test case to start with - ideally, a small file under 1 kB\n"
+           "    or so. The cases must be stored as regular files directly in the input\n"
+           "    directory.\n");
 
-      setsid();
+    PFATAL("Unable to open '%s'", in_dir);
 
-      dup2(dev_null_fd, 1);
-      dup2(dev_null_fd, 2);
+  }
 
-      if (out_file) {
+  /* In a -j group, each worker starts from its own share of the test
+     cases. With fewer cases than workers, some get the same one. */
 
-        dup2(dev_null_fd, 0);
+  if (group_size && !in_place_resume) {
 
-      } else {
+    u32 cand = 0, seen = 0, j = 0;
 
-        dup2(out_fd, 0);
-        close(out_fd);
+    for (i = 0; i < nl_cnt; i++)
+      if (nl[i]->d_name[0] != '.') cand++;
+
+    for (i = 0; i < nl_cnt; i++) {
 
+      u8 keep = 0;
+
+      if (nl[i]->d_name[0] != '.') {
+        keep = cand >= group_size ? seen % group_size == group_worker
+                                  : seen == group_worker % cand;
+        seen++;
       }
 
-      /* On Linux, would be faster to use O_CLOEXEC. Maybe TODO. */
+      if (keep) nl[j++] = nl[i]; else free(nl[i]); /* not tracked */
 
-      close(dev_null_fd);
-      close(out_dir_fd);
-      close(dev_urandom_fd);
-      close(fileno(plot_file));
+    }
 
-      /* Set sane defaults for ASAN if nothing else specified. */
+    nl_cnt = j;
 
-      setenv("ASAN_OPTIONS", "abort_on_error=1:"
-                             "detect_leaks=0:"
-                             "symbolize=0:"
-                             "allocator_may_return_null=1", 0);
+  }
 
-      setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
-                             "symbolize=0:"
-                             "msan_track_origins=0", 0);
+  if (shuffle_queue && nl_cnt > 1) {
 
-      execv(target_path, argv);
+    ACTF("Shuffling queue...");
+    shuffle_ptrs((void**)nl, nl_cnt);
 
-      /* Use a distinctive bitmap value to tell the parent about execv()
-         falling through. */
+  }
 
-      *(u32*)trace_bits = EXEC_FAIL_SIG;
-      exit(0);
+  for (i = 0; i < nl_cnt; i++) {
 
-    }
+    struct stat st;
 
-  } 
-  else {
+    u8* fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
+    u8* dfn = alloc_printf("%s/.state/deterministic_done/%s", in_dir, nl[i]->d_name);
 
-    s32 res;
+    u8  passed_det = 0;
 
-    /* In non-dumb mode, we have the fork server up and running, so simply
-       tell it to have at it, and then read back PID. */
+    free(nl[i]); /* not tracked */
+ 
+    if (lstat(fn, &st) || access(fn, R_OK))
+      PFATAL("Unable to access '%s'", fn);
 
-    if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4) {
+    /* This also takes care of . and .. */
 
-      if (stop_soon) return 0;
-      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+    if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn, "/README.txt")) {
+
+      ck_free(fn);
+      ck_free(dfn);
+      continue;
 
     }
 
-    if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4) {
+    if (st.st_size > MAX_FILE) 
+      FATAL("Test case '%s' is too big (%s, limit is %s)", fn,
+            DMS(st.st_size), DMS(MAX_FILE));
 
-      if (stop_soon) return 0;
-      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+    /* Check for metadata that indicates that deterministic fuzzing
+       is complete for this entry. We don't want to repeat deterministic
+       fuzzing when resuming aborted scans, because it would be pointless
+       and probably very time-consuming. */
 
-    }
+    if (!access(dfn, F_OK)) passed_det = 1;
+    ck_free(dfn);
 
-    if (child_pid <= 0) FATAL("Fork server is misbehaving (OOM?)");
+    add_to_queue(fn, st.st_size, passed_det);
 
   }
 
-  /* Configure timeout, as requested by user, then wait for child to terminate. */
+  free(nl); /* not tracked */
 
-  it.it_value.tv_sec = (timeout / 1000);
-  it.it_value.tv_usec = (timeout % 1000) * 1000;
+  if (!queued_paths) {
 
-  setitimer(ITIMER_REAL, &it, NULL);
+    SAYF("\n" cLRD "[-] " cRST
+         "Looks like there are no valid test cases in the input directory! The fuzzer\n"
+         "    needs one or more test case to start with - ideally, a small file under\n"
+         "    1 kB or so. The cases must be stored as regular files directly in the\n"
+         "    input directory.\n");
 
-  /* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */
+    FATAL("No usable test cases in '%s'", in_dir);
 
-  if (dumb_mode == 1 || no_forkserver) {
+  }
 
-    if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+  last_path_time = 0;
+  queued_at_start = queued_paths;
 
-  } 
-  else {
+}
 
-    s32 res;
 
-    if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
+/* Helper function for load_extras. */
 
-      if (stop_soon) return 0;
-      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+static int compare_extras_len(const void* p1, const void* p2) {
+  struct extra_data *e1 = (struct extra_data*)p1,
+                    *e2 = (struct extra_data*)p2;
 
-    }
+  return e1->len - e2->len;
+}
 
-  }
+static int compare_extras_use_d(const void* p1, const void* p2) {
+  struct extra_data *e1 = (struct extra_data*)p1,
+                    *e2 = (struct extra_data*)p2;
 
-  if (!WIFSTOPPED(status)) child_pid = 0;
+  return e2->hit_cnt - e1->hit_cnt;
+}
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
 
-  setitimer(ITIMER_REAL, &it, NULL);
+/* Read extras from a file, sort by size. */
 
-  total_execs++;
+static void load_extras_file(u8* fname, u32* min_len, u32* max_len,
+                             u32 dict_level) {
 
-  /* Any subsequent operations on trace_bits must not be moved by the
-     compiler below this point. Past this location, trace_bits[] behave
-     very normally and do not have to be treated as volatile. */
+  FILE* f;
+  u8  buf[MAX_LINE];
+  u8  *lptr;
+  u32 cur_line = 0; 
 
-  MEM_BARRIER();
+  f = fopen(fname, "r");
 
-  tb4 = *(u32*)trace_bits;
+  if (!f) PFATAL("Unable to open '%s'", fname);
 
-#ifdef __x86_64__
-  classify_counts((u64*)trace_bits);
-#else
-  classify_counts((u32*)trace_bits);
-#endif /* ^__x86_64__ */
+  while ((lptr = fgets(buf, MAX_LINE, f))) {
 
-  prev_timed_out = child_timed_out;
+    u8 *rptr, *wptr;
+    u32 klen = 0;
 
-  /* Report outcome to caller. */
+    cur_line++;
 
-  if (WIFSIGNALED(status) && !stop_soon) {
+    /* Trim on left and right. */
 
-    kill_signal = WTERMSIG(status);
+    while (isspace(*lptr)) lptr++;
 
-    if (child_timed_out && kill_signal == SIGKILL) return FAULT_TMOUT;
+    rptr = lptr + strlen(lptr) - 1;
+    while (rptr >= lptr && isspace(*rptr)) rptr--;
+    rptr++;
+    *rptr = 0;
 
-    return FAULT_CRASH;
+    /* Skip empty lines and comments. */
 
-  }
+    if (!*lptr || *lptr == '#') continue;
 
-  /* A somewhat nasty hack for MSAN, which doesn't support abort_on_error and
-     must use a special exit code. */
+    /* All other lines must end with '"', which we can consume. */
 
-  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR) {
-    kill_signal = 0;
-    return FAULT_CRASH;
-  }
+    rptr--;
 
-  if ((dumb_mode == 1 || no_forkserver) && tb4 == EXEC_FAIL_SIG)
-    return FAULT_ERROR;
+    if (rptr < lptr || *rptr != '"')
+      FATAL("Malformed name=\"value\" pair in line %u.", cur_line);
 
-  return FAULT_NONE;
+    *rptr = 0;
 
-}
+    /* Skip alphanumerics and dashes (label). */
 
+    while (isalnum(*lptr) || *lptr == '_') lptr++;
 
-/* Write modified data to file for testing. If out_file is set, the old file
-   is unlinked and a new one is created. Otherwise, out_fd is rewound and
-   truncated. */
+    /* If @number follows, parse that. */
 
-static void write_to_testcase(void* mem, u32 len) {
+    if (*lptr == '@') {
 
-  s32 fd = out_fd;
+      lptr++;
+      if (atoi(lptr) > dict_level) continue;
+      while (isdigit(*lptr)) lptr++;
 
-  if (out_file) {
+    }
 
-    unlink(out_file); /* Ignore errors. */
+    /* Skip whitespace and = signs. */
 
-    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    while (isspace(*lptr) || *lptr == '=') lptr++;
 
-    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+    /* Consume opening '"'. */
 
-  } else lseek(fd, 0, SEEK_SET);
+    if (*lptr != '"')
+      FATAL("Malformed name=\"keyword\" pair in line %u.", cur_line);
 
-  ck_write(fd, mem, len, out_file);
+    lptr++;
 
-  if (!out_file) {
+    if (!*lptr) FATAL("Empty keyword in line %u.", cur_line);
 
-    if (ftruncate(fd, len)) PFATAL("ftruncate() failed");
-    lseek(fd, 0, SEEK_SET);
+    /* Okay, let's allocate memory and copy data between "...", handling
+       \xNN escaping, \\, and \". */
 
-  } else close(fd);
+    extras = ck_realloc_block(extras, (extras_cnt + 1) *
+               sizeof(struct extra_data));
 
-}
+    wptr = extras[extras_cnt].data = ck_alloc(rptr - lptr);
 
+    while (*lptr) {
 
-/* The same, but with an adjustable gap. Used for trimming. */
+      char* hexdigits = "0123456789abcdef";
 
-static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
+      switch (*lptr) {
 
-  s32 fd = out_fd;
-  u32 tail_len = len - skip_at - skip_len;
+        case 1 ... 31:
+        case 128 ... 255:
+          FATAL("Non-printable characters in line %u.", cur_line);
 
-  if (out_file) {
+        case '\\':
 
-    unlink(out_file); /* Ignore errors. */
-
-    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+          lptr++;
 
-    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+          if (*lptr == '\\' || *lptr == '"') {
+            *(wptr++) = *(lptr++);
+            klen++;
+            break;
+          }
 
-  } else lseek(fd, 0, SEEK_SET);
+          if (*lptr != 'x' || !isxdigit(lptr[1]) || !isxdigit(lptr[2]))
+            FATAL("Invalid escaping (not \\xNN) in line %u.", cur_line);
 
-  if (skip_at) ck_write(fd, mem, skip_at, out_file);
+          *(wptr++) =
+            ((strchr(hexdigits, tolower(lptr[1])) - hexdigits) << 4) |
+            (strchr(hexdigits, tolower(lptr[2])) - hexdigits);
 
-  if (tail_len) ck_write(fd, mem + skip_at + skip_len, tail_len, out_file);
+          lptr += 3;
+          klen++;
 
-  if (!out_file) {
+          break;
 
-    if (ftruncate(fd, len - skip_len)) PFATAL("ftruncate() failed");
-    lseek(fd, 0, SEEK_SET);
+        default:
 
-  } else close(fd);
+          *(wptr++) = *(lptr++);
+          klen++;
 
-}
+      }
 
+    }
 
-static void show_stats(void);
+    extras[extras_cnt].len = klen;
 
-/* Calibrate a new test case. This is done when processing the input directory
-   to warn about flaky or otherwise problematic test cases early on; and when
-   new paths are discovered to detect variable behavior and so on. */
+    if (extras[extras_cnt].len > MAX_DICT_FILE)
+      FATAL("Keyword too big in line %u (%s, limit is %s)", cur_line,
+            DMS(klen), DMS(MAX_DICT_FILE));
 
-static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
-                         u32 handicap, u8 from_queue) {
+    if (*min_len > klen) *min_len = klen;
+    if (*max_len < klen) *max_len = klen;
 
-  static u8 first_trace[MAP_SIZE];
+    extras_cnt++;
 
-  u8  fault = 0, new_bits = 0, var_detected = 0,
-      first_run = (q->exec_cksum == 0);
+  }
 
-  u64 start_us, stop_us;
+  fclose(f);
 
-  s32 old_sc = stage_cur, old_sm = stage_max;
-  u32 use_tmout = exec_tmout;
-  u8* old_sn = stage_name;
+  
 
-  /* Be a bit more generous about timeouts when resuming sessions, or when
-     trying to calibrate already-added finds. This helps avoid trouble due
-     to intermittent latency. */
+}
 
-  if (!from_queue || resuming_fuzz)
-    use_tmout = MAX(exec_tmout + CAL_TMOUT_ADD,
-                    exec_tmout * CAL_TMOUT_PERC / 100);
 
-  q->cal_failed++;
+/* Read extras from the extras directory and sort them by size. */
 
-  stage_name = "calibration";
-  stage_max  = fast_cal ? 3 : CAL_CYCLES;
+static void load_extras(u8* dir) {
 
-  /* Make sure the forkserver is up before we do anything, and let's not
-     count its spin-up time toward binary calibration. */
+  DIR* d;
+  struct dirent* de;
+  u32 min_len = MAX_DICT_FILE, max_len = 0, dict_level = 0;
+  u8* x;
 
-  if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
-    init_forkserver(argv);
+  /* If the name ends with @, extract level and continue. */
 
-  if (q->exec_cksum) memcpy(first_trace, trace_bits, MAP_SIZE);
+  if ((x = strchr(dir, '@'))) {
 
-  start_us = get_cur_time_us();
+    *x = 0;
+    dict_level = atoi(x + 1);
 
-  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
+  }
 
-    u32 cksum;
+  ACTF("Loading extra dictionary from '%s' (level %u)...", dir, dict_level);
 
-    if (!first_run && !(stage_cur % stats_update_freq)) show_stats();
+  d = opendir(dir);
 
-    write_to_testcase(use_mem, q->len);
+  if (!d) {
 
-    fault = run_target(argv, use_tmout);
+    if (errno == ENOTDIR) {
+      load_extras_file(dir, &min_len, &max_len, dict_level);
+      goto check_and_sort;
+    }
 
-    /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
-       we want to bail out quickly. */
+    PFATAL("Unable to open '%s'", dir);
 
-    if (stop_soon || fault != crash_mode) goto abort_calibration;
+  }
 
-    if (!dumb_mode && !stage_cur && !count_bytes(trace_bits)) {
-      fault = FAULT_NOINST;
-      goto abort_calibration;
-    }
+  if (x) FATAL("Dictionary levels not supported for directories.");
 
-    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  while ((de = readdir(d))) {
 
-    if (q->exec_cksum != cksum) {
+    struct stat st;
+    u8* fn = alloc_printf("%s/%s", dir, de->d_name);
+    s32 fd;
 
-      u8 hnb = has_new_bits(virgin_bits);
-      if (hnb > new_bits) new_bits = hnb;
+    if (lstat(fn, &st) || access(fn, R_OK))
+      PFATAL("Unable to access '%s'", fn);
 
-      if (q->exec_cksum) {
+    /* This also takes care of . and .. */
+    if (!S_ISREG(st.st_mode) || !st.st_size) {
 
-        u32 i;
+      ck_free(fn);
+      continue;
 
-        for (i = 0; i < MAP_SIZE; i++) {
+    }
 
-          if (!var_bytes[i] && first_trace[i] != trace_bits[i]) {
+    if (st.st_size > MAX_DICT_FILE)
+      FATAL("Extra '%s' is too big (%s, limit is %s)", fn,
+            DMS(st.st_size), DMS(MAX_DICT_FILE));
 
-            var_bytes[i] = 1;
-            stage_max    = CAL_CYCLES_LONG;
+    if (min_len > st.st_size) min_len = st.st_size;
+    if (max_len < st.st_size) max_len = st.st_size;
 
-          }
+    extras = ck_realloc_block(extras, (extras_cnt + 1) *
+               sizeof(struct extra_data));
 
-        }
+    extras[extras_cnt].data = ck_alloc(st.st_size);
+    extras[extras_cnt].len  = st.st_size;
 
-        var_detected = 1;
+    fd = open(fn, O_RDONLY);
 
-      } else {
+    if (fd < 0) PFATAL("Unable to open '%s'", fn);
 
-        q->exec_cksum = cksum;
-        memcpy(first_trace, trace_bits, MAP_SIZE);
+    ck_read(fd, extras[extras_cnt].data, st.st_size, fn);
 
-      }
+    close(fd);
+    ck_free(fn);
 
-    }
+    extras_cnt++;
 
   }
 
-  stop_us = get_cur_time_us();
+  closedir(d);
 
-  total_cal_us     += stop_us - start_us;
-  total_cal_cycles += stage_max;
+check_and_sort:
 
-  /* OK, let's collect some stats about the performance of this test case.
-     This is used for fuzzing air time calculations in calculate_score(). */
+  if (!extras_cnt) FATAL("No usable files in '%s'", dir);
 
-  q->exec_us     = (stop_us - start_us) / stage_max;
-  q->bitmap_size = count_bytes(trace_bits);
-  q->handicap    = handicap;
-  q->cal_failed  = 0;
+  qsort(extras, extras_cnt, sizeof(struct extra_data), compare_extras_len);
 
-  total_bitmap_size += q->bitmap_size;
-  total_bitmap_entries++;
+  OKF("Loaded %u extra tokens, size range %s to %s.", extras_cnt,
+      DMS(min_len), DMS(max_len));
 
-  update_bitmap_score(q);
+  if (max_len > 32)
+    WARNF("Some tokens are relatively large (%s) - consider trimming.",
+          DMS(max_len));
 
-  /* If this case didn't result in new output from the instrumentation, tell
-     parent. This is a non-critical problem, but something to warn the user
-     about. */
+  if (extras_cnt > MAX_DET_EXTRAS)
+    WARNF("More than %u tokens - will use them probabilistically.",
+          MAX_DET_EXTRAS);
 
-  if (!dumb_mode && first_run && !fault && !new_bits) fault = FAULT_NOBITS;
+}
 
-abort_calibration:
 
-  if (new_bits == 2 && !q->has_new_cov) {
-    q->has_new_cov = 1;
-    queued_with_cov++;
-  }
+/* Add the strcmp() / memcmp() constants that compare-transform-pass left in
+   the binary (one CMP_DICT_SIG block per module) to extras[], skipping the
+   ones we already have. */
 
-  /* Mark variable paths. */
+static void load_cmp_dict(u8* f_data, u32 f_len) {
 
-  if (var_detected) {
+  u32 sig_len = strlen(CMP_DICT_SIG) + 1, added = 0, i;
+  u8* end = f_data + f_len;
+  u8* p   = f_data;
 
-    var_byte_count = count_bytes(var_bytes);
+  while ((p = memmem(p, end - p, CMP_DICT_SIG, sig_len))) {
 
-    if (!q->var_behavior) {
-      mark_as_variable(q);
-      queued_variable++;
-    }
+    p += sig_len;
 
-  }
+    while (p < end && *p && p + 1 + *p <= end) {
 
-  stage_name = old_sn;
-  stage_cur  = old_sc;
-  stage_max  = old_sm;
+      u32 len = *p++;
 
-  if (!first_run) show_stats();
+      for (i = 0; i < extras_cnt; i++)
+        if (extras[i].len == len && !memcmp(extras[i].data, p, len)) break;
 
-  return fault;
+      if (i == extras_cnt && len <= MAX_DICT_FILE) {
 
-}
+        extras = ck_realloc_block(extras, (extras_cnt + 1) *
+                   sizeof(struct extra_data));
 
+        extras[extras_cnt].data = ck_memdup(p, len);
+        extras[extras_cnt].len  = len;
 
-/* Examine map coverage. Called once, for first test case. */
+        extras_cnt++;
+        added++;
 
-static void check_map_coverage(void) {
+      }
 
-  u32 i;
+      p += len;
 
-  if (count_bytes(trace_bits) < 100) return;
+    }
 
-  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
-    if (trace_bits[i]) return;
+  }
 
-  WARNF("Recompile binary with newer version of afl to improve coverage!");
+  if (!added) return;
+
+  qsort(extras, extras_cnt, sizeof(struct extra_data), compare_extras_len);
+
+  OKF(cPIN "Picked up %u compare constants from the binary.", added);
+
+  if (extras_cnt > MAX_DET_EXTRAS)
+    WARNF("More than %u tokens - will use them probabilistically.",
+          MAX_DET_EXTRAS);
 
 }
 
 
-/* Perform dry run of all test cases to confirm that the app is working as
-   expected. This is done only for the initial inputs, and only once. */
 
-static void perform_dry_run(char** argv) {
 
-  struct queue_entry* q = queue;
-  u32 cal_failures = 0;
-  u8* skip_crashes = getenv("AFL_SKIP_CRASHES");
+/* Helper function for maybe_add_auto() */
 
-  while (q) {
+static inline u8 memcmp_nocase(u8* m1, u8* m2, u32 len) {
 
-    u8* use_mem;
-    u8  res;
-    s32 fd;
+  while (len--) if (tolower(*(m1++)) ^ tolower(*(m2++))) return 1;
+  return 0;
 
-    u8* fn = strrchr(q->fname, '/') + 1;
+}
 
-    ACTF("Attempting dry run with '%s'...", fn);
 
-    fd = open(q->fname, O_RDONLY);
-    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+/* Maybe add automatic extra. */
 
-    use_mem = ck_alloc_nozero(q->len);
+static void maybe_add_auto(u8* mem, u32 len) {
 
-    if (read(fd, use_mem, q->len) != q->len)
-      FATAL("Short read from '%s'", q->fname);
+  u32 i;
 
-    close(fd);
+  /* Allow users to specify that they don't want auto dictionaries. */
 
-    res = calibrate_case(argv, q, use_mem, 0, 1);
-    ck_free(use_mem);
+  if (!MAX_AUTO_EXTRAS || !USE_AUTO_EXTRAS) return;
 
-    if (stop_soon) return;
+  /* Skip runs of identical bytes. */
 
-    if (res == crash_mode || res == FAULT_NOBITS)
-      SAYF(cGRA "    len = %u, map size = %u, exec speed = %llu us\n" cRST, 
-           q->len, q->bitmap_size, q->exec_us);
+  for (i = 1; i < len; i++)
+    if (mem[0] ^ mem[i]) break;
 
-    switch (res) {
+  if (i == len) return;
 
-      case FAULT_NONE:
+  /* Reject builtin interesting values. */
 
-        if (q == queue) check_map_coverage();
+  if (len == 2) {
 
-        if (crash_mode) FATAL("Test case '%s' does *NOT* crash", fn);
+    i = sizeof(interesting_16) >> 1;
 
-        break;
+    while (i--) 
+      if (*((u16*)mem) == interesting_16[i] ||
+          *((u16*)mem) == SWAP16(interesting_16[i])) return;
 
-      case FAULT_TMOUT:
+  }
 
-        if (timeout_given) {
+  if (len == 4) {
 
-          /* The -t nn+ syntax in the command line sets timeout_given to '2' and
-             instructs afl-fuzz to tolerate but skip queue entries that time
-             out. */
+    i = sizeof(interesting_32) >> 2;
 
-          if (timeout_given > 1) {
-            WARNF("Test case results in a timeout (skipping)");
-            q->cal_failed = CAL_CHANCES;
-            cal_failures++;
-            break;
-          }
-
-          SAYF("\n" cLRD "[-] " cRST
-               "The program took more than %u ms to process one of the initial test cases.\n"
-               "    Usually, the right thing to do is to relax the -t option - or to delete it\n"
-               "    altogether and allow the fuzzer to auto-calibrate. That said, if you know\n"
-               "    what you are doing and want to simply skip the unruly test cases, append\n"
-               "    '+' at the end of the value passed to -t ('-t %u+').\n", exec_tmout,
-               exec_tmout);
+    while (i--) 
+      if (*((u32*)mem) == interesting_32[i] ||
+          *((u32*)mem) == SWAP32(interesting_32[i])) return;
 
-          FATAL("Test case '%s' results in a timeout", fn);
+  }
 
-        } else {
+  /* Reject anything that matches existing extras. Do a case-insensitive
+     match. We optimize by exploiting the fact that extras[] are sorted
+     by size. */
 
-          SAYF("\n" cLRD "[-] " cRST
-               "The program took more than %u ms to process one of the initial test cases.\n"
-               "    This is bad news; raising the limit with the -t option is possible, but\n"
-               "    will probably make the fuzzing process extremely slow.\n\n"
+  for (i = 0; i < extras_cnt; i++)
+    if (extras[i].len >= len) break;
 
-               "    If this test case is just a fluke, the other option is to just avoid it\n"
-               "    altogether, and find one that is less of a CPU hog.\n", exec_tmout);
+  for (; i < extras_cnt && extras[i].len == len; i++)
+    if (!memcmp_nocase(extras[i].data, mem, len)) return;
 
-          FATAL("Test case '%s' results in a timeout", fn);
+  /* Last but not least, check a_extras[] for matches. There are no
+     guarantees of a particular sort order. */
 
-        }
+  auto_changed = 1;
 
-      case FAULT_CRASH:  
+  for (i = 0; i < a_extras_cnt; i++) {
 
-        if (crash_mode) break;
+    if (a_extras[i].len == len && !memcmp_nocase(a_extras[i].data, mem, len)) {
 
-        if (skip_crashes) {
-          WARNF("Test case results in a crash (skipping)");
-          q->cal_failed = CAL_CHANCES;
-          cal_failures++;
-          break;
-        }
+      a_extras[i].hit_cnt++;
+      goto sort_a_extras;
 
-        if (mem_limit) {
+    }
 
-          SAYF("\n" cLRD "[-] " cRST
-               "Oops, the program crashed with one of the test cases provided. There are\n"
-               "    several possible explanations:\n\n"
+  }
 
-               "    - The test case causes known crashes under normal working conditions. If\n"
-               "      so, please remove it. The fuzzer should be seeded with interesting\n"
-               "      inputs - but not ones that cause an outright crash.\n\n"
+  /* At this point, looks like we're dealing with a new entry. So, let's
+     append it if we have room. Otherwise, let's randomly evict some other
+     entry from the bottom half of the list. */
 
-               "    - The current memory limit (%s) is too low for this program, causing\n"
-               "      it to die due to OOM when parsing valid files. To fix this, try\n"
-               "      bumping it up with the -m setting in the command line. If in doubt,\n"
-               "      try something along the lines of:\n\n"
+  if (a_extras_cnt < MAX_AUTO_EXTRAS) {
 
-#ifdef RLIMIT_AS
-               "      ( ulimit -Sv $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
-#else
-               "      ( ulimit -Sd $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
-#endif /* ^RLIMIT_AS */
+    a_extras = ck_realloc_block(a_extras, (a_extras_cnt + 1) *
+                                sizeof(struct extra_data));
 
-               "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-               "      estimate the required amount of virtual memory for the binary. Also,\n"
-               "      if you are using ASAN, see %s/notes_for_asan.txt.\n\n"
+    a_extras[a_extras_cnt].data = ck_memdup(mem, len);
+    a_extras[a_extras_cnt].len  = len;
+    a_extras_cnt++;
 
-#ifdef __APPLE__
-  
-               "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-               "      break afl-fuzz performance optimizations when running platform-specific\n"
-               "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+  } else {
 
-#endif /* __APPLE__ */
+    i = MAX_AUTO_EXTRAS / 2 +
+        UR((MAX_AUTO_EXTRAS + 1) / 2);
 
-               "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
-               "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-               DMS(mem_limit << 20), mem_limit - 1, doc_path);
+    ck_free(a_extras[i].data);
 
-        } else {
+    a_extras[i].data    = ck_memdup(mem, len);
+    a_extras[i].len     = len;
+    a_extras[i].hit_cnt = 0;
 
-          SAYF("\n" cLRD "[-] " cRST
-               "Oops, the program crashed with one of the test cases provided. There are\n"
-               "    several possible explanations:\n\n"
+  }
 
-               "    - The test case causes known crashes under normal working conditions. If\n"
-               "      so, please remove it. The fuzzer should be seeded with interesting\n"
-               "      inputs - but not ones that cause an outright crash.\n\n"
+sort_a_extras:
 
-#ifdef __APPLE__
-  
-               "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-               "      break afl-fuzz performance optimizations when running platform-specific\n"
-               "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+  /* First, sort all auto extras by use count, descending order. */
 
-#endif /* __APPLE__ */
+  qsort(a_extras, a_extras_cnt, sizeof(struct extra_data),
+        compare_extras_use_d);
 
-               "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
-               "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+  /* Then, sort the top USE_AUTO_EXTRAS entries by size. */
 
-        }
+  qsort(a_extras, MIN(USE_AUTO_EXTRAS, a_extras_cnt),
+        sizeof(struct extra_data), compare_extras_len);
 
-        FATAL("Test case '%s' results in a crash", fn);
+}
 
-      case FAULT_ERROR:
 
-        FATAL("Unable to execute target application ('%s')", argv[0]);
+/* Save automatically generated extras. */
 
-      case FAULT_NOINST:
+static void save_auto(void) {
 
-        FATAL("No instrumentation detected");
+  u32 i;
 
-      case FAULT_NOBITS: 
+  if (!auto_changed) return;
+  auto_changed = 0;
 
-        useless_at_start++;
+  for (i = 0; i < MIN(USE_AUTO_EXTRAS, a_extras_cnt); i++) {
 
-        if (!in_bitmap && !shuffle_queue)
-          WARNF("No new instrumentation output, test case may be useless.");
+    u8* fn = alloc_printf("%s/queue/.state/auto_extras/auto_%06u", out_dir, i);
+    s32 fd;
 
-        break;
+    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-    }
+    if (fd < 0) PFATAL("Unable to create '%s'", fn);
 
-    if (q->var_behavior) WARNF("Instrumentation output varies across runs.");
+    ck_write(fd, a_extras[i].data, a_extras[i].len, fn);
 
-    q = q->next;
+    close(fd);
+    ck_free(fn);
 
   }
 
-  if (cal_failures) {
+}
 
-    if (cal_failures == queued_paths)
-      FATAL("All test cases time out%s, giving up!",
-            skip_crashes ? " or crash" : "");
 
-    WARNF("Skipped %u test cases (%0.02f%%) due to timeouts%s.", cal_failures,
-          ((double)cal_failures) * 100 / queued_paths,
-          skip_crashes ? " or crashes" : "");
+/* Load automatically generated extras. */
 
-    if (cal_failures * 5 > queued_paths)
-      WARNF(cLRD "High percentage of rejected test cases, check settings!");
+static void load_auto(void) {
 
-  }
+  u32 i;
 
-  OKF("All test cases processed.");
+  for (i = 0; i < USE_AUTO_EXTRAS; i++) {
 
-}
+    u8  tmp[MAX_AUTO_EXTRA + 1];
+    u8* fn = alloc_printf("%s/.state/auto_extras/auto_%06u", in_dir, i);
+    s32 fd, len;
 
+    fd = open(fn, O_RDONLY, 0600);
 
-/* Helper function: link() if possible, copy otherwise. */
+    if (fd < 0) {
 
-static void link_or_copy(u8* old_path, u8* new_path) {
+      if (errno != ENOENT) PFATAL("Unable to open '%s'", fn);
+      ck_free(fn);
+      break;
 
-  s32 i = link(old_path, new_path);
-  s32 sfd, dfd;
-  u8* tmp;
+    }
 
-  if (!i) return;
+    /* We read one byte more to cheaply detect tokens that are too
+       long (and skip them). */
 
-  sfd = open(old_path, O_RDONLY);
-  if (sfd < 0) PFATAL("Unable to open '%s'", old_path);
+    len = read(fd, tmp, MAX_AUTO_EXTRA + 1);
 
-  dfd = open(new_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (dfd < 0) PFATAL("Unable to create '%s'", new_path);
+    if (len < 0) PFATAL("Unable to read from '%s'", fn);
 
-  tmp = ck_alloc(64 * 1024);
+    if (len >= MIN_AUTO_EXTRA && len <= MAX_AUTO_EXTRA)
+      maybe_add_auto(tmp, len);
 
-  while ((i = read(sfd, tmp, 64 * 1024)) > 0) 
-    ck_write(dfd, tmp, i, new_path);
+    close(fd);
+    ck_free(fn);
 
-  if (i < 0) PFATAL("read() failed");
+  }
 
-  ck_free(tmp);
-  close(sfd);
-  close(dfd);
+  if (i) OKF("Loaded %u auto-discovered dictionary tokens.", i);
+  else OKF("No auto-generated dictionary tokens to reuse.");
 
 }
 
 
-static void nuke_resume_dir(void);
+/* Destroy extras. */
 
-/* Create hard links for input test cases in the output directory, choosing
-   good names and pivoting accordingly. */
+static void destroy_extras(void) {
 
-static void pivot_inputs(void) {
+  u32 i;
 
-  struct queue_entry* q = queue;
-  u32 id = 0;
+  for (i = 0; i < extras_cnt; i++) 
+    ck_free(extras[i].data);
 
-  ACTF("Creating hard links for all input files...");
+  ck_free(extras);
 
-  while (q) {
+  for (i = 0; i < a_extras_cnt; i++) 
+    ck_free(a_extras[i].data);
 
-    u8  *nfn, *rsl = strrchr(q->fname, '/');
-    u32 orig_id;
+  ck_free(a_extras);
 
-    if (!rsl) rsl = q->fname; else rsl++;
+}
 
-    /* If the original file name conforms to the syntax and the recorded
-       ID matches the one we'd assign, just use the original file name.
-       This is valuable for resuming fuzzing runs. */
 
-#ifndef SIMPLE_FILES
-#  define CASE_PREFIX "id:"
-#else
-#  define CASE_PREFIX "id_"
-#endif /* ^!SIMPLE_FILES */
+/* Spin up fork server (instrumented mode only). The idea is explained here:
 
-    if (!strncmp(rsl, CASE_PREFIX, 3) &&
-        sscanf(rsl + 3, "%06u", &orig_id) == 1 && orig_id == id) {
+   http://lcamtuf.blogspot.com/2014/10/fuzzing-binaries-without-execve.html
 
-      u8* src_str;
-      u32 src_id;
+   In essence, the instrumentation allows us to skip execve(), and just keep
+   cloning a stopped child. So, we just execute once, and then send commands
+   through a pipe. The other part of this logic is in afl-as.h. */
 
-      resuming_fuzz = 1;
-      nfn = alloc_printf("%s/queue/%s", out_dir, rsl);
+EXP_ST void init_forkserver(char** argv) {
 
-      /* Since we're at it, let's also try to find parent and figure out the
-         appropriate depth for this entry. */
+  static struct itimerval it;
+  int st_pipe[2], ctl_pipe[2];
+  int status;
+  s32 rlen;
 
-      src_str = strchr(rsl + 3, ':');
+  ACTF("Spinning up the fork server...");
 
-      if (src_str && sscanf(src_str + 1, "%06u", &src_id) == 1) {
+  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
 
-        struct queue_entry* s = queue;
-        while (src_id-- && s) s = s->next;
-        if (s) q->depth = s->depth + 1;
+  forksrv_pid = fork();
 
-        if (max_depth < q->depth) max_depth = q->depth;
+  if (forksrv_pid < 0) PFATAL("fork() failed");
 
-      }
+  if (!forksrv_pid) {
 
-    } else {
+    struct rlimit r;
 
-      /* No dice - invent a new name, capturing the original one as a
-         substring. */
+    /* Umpf. On OpenBSD, the default fd limit for root users is set to
+       soft 128. Let's try to fix that... */
 
-#ifndef SIMPLE_FILES
-
-      u8* use_name = strstr(rsl, ",orig:");
-
-      if (use_name) use_name += 6; else use_name = rsl;
-      nfn = alloc_printf("%s/queue/id:%06u,orig:%s", out_dir, id, use_name);
-
-#else
-
-      nfn = alloc_printf("%s/queue/id_%06u", out_dir, id);
+    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2) {
 
-#endif /* ^!SIMPLE_FILES */
+      r.rlim_cur = FORKSRV_FD + 2;
+      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
 
     }
 
-    /* Pivot to the new queue entry. */
+    if (mem_limit) {
 
-    link_or_copy(q->fname, nfn);
-    ck_free(q->fname);
-    q->fname = nfn;
+      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
 
-    /* Make sure that the passed_det value carries over, too. */
+#ifdef RLIMIT_AS
 
-    if (q->passed_det) mark_as_det_done(q);
+      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
 
-    q = q->next;
-    id++;
+#else
 
-  }
+      /* This takes care of OpenBSD, which doesn't have RLIMIT_AS, but
+         according to reliable sources, RLIMIT_DATA covers anonymous
+         maps - so we should be getting good protection against OOM bugs. */
 
-  if (in_place_resume) nuke_resume_dir();
+      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
 
-}
+#endif /* ^RLIMIT_AS */
 
 
-#ifndef SIMPLE_FILES
+    }
 
-/* Construct a file name for a new test case, capturing the operation
-   that led to its discovery. Uses a static buffer. */
+    /* Dumping cores is slow and can lead to anomalies if SIGKILL is delivered
+       before the dump is complete. */
 
-static u8* describe_op(u8 hnb) {
+    r.rlim_max = r.rlim_cur = 0;
 
-  static u8 ret[256];
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
 
-  if (syncing_party) {
+    /* Isolate the process and configure standard descriptors. If out_file is
+       specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
 
-    sprintf(ret, "sync:%s,src:%06u", syncing_party, syncing_case);
+    setsid();
 
-  } else {
+    dup2(dev_null_fd, 1);
+    dup2(dev_null_fd, 2);
 
-    sprintf(ret, "src:%06u", current_entry);
+    if (out_file) {
 
-    if (splicing_with >= 0)
-      sprintf(ret + strlen(ret), "+%06u", splicing_with);
+      dup2(dev_null_fd, 0);
 
-    sprintf(ret + strlen(ret), ",op:%s", stage_short);
+    } else {
 
-    if ((stage_cur_count > 0)&&(stage_cur_count <3)) {
+      dup2(out_fd, 0);
+      close(out_fd);
 
-      sprintf(ret + strlen(ret), ",pos:%u", stage_cur_byte);
-      sprintf(ret + strlen(ret), ",change_len:%u", char_str_count); 
- 
-      if(((diff_val_byte>=64)&&(diff_val_byte<90))||((diff_val_byte>=97)&&(diff_val_byte<122))||((diff_val_byte>=48)&&(diff_val_byte<57)))
-        sprintf(ret + strlen(ret), ",val_char:%c", diff_val_byte);
-      else
-        sprintf(ret + strlen(ret), ",val_hex:0x%x", diff_val_byte);
+    }
 
-    }  
+    /* Set up control and status pipes, close the unneeded original fds. */
 
-  }
- 
-  if(find_new_branch!=0){
-    strcat(ret, ",+cov");
-  } 
-  if(find_new_laf_branch!=0){
-    strcat(ret, ",+");
-    sprintf(ret + strlen(ret), "%d", extra_laf_count_orig);
-    if((find_new_laf_branch&1)!=0){
-      strcat(ret, ",swith");
-    }
-    if((find_new_laf_branch&2)!=0){
-      strcat(ret, ",cmp");
-    }
-    if((find_new_laf_branch&4)!=0){
-      strcat(ret, ",str");
-    }
-  }
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
+    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
 
-  return ret;
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
 
-}
+    close(out_dir_fd);
+    close(dev_null_fd);
+    close(dev_urandom_fd);
+    close(fileno(plot_file));
 
-#endif /* !SIMPLE_FILES */
+    /* This should improve performance a bit, since it stops the linker from
+       doing extra work post-fork(). */
 
+    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
 
-/* Write a message accompanying the crash directory :-) */
+    /* Set sane defaults for ASAN if nothing else specified. */
 
-static void write_crash_readme(void) {
+    setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                           "detect_leaks=0:"
+                           "symbolize=0:"
+                           "allocator_may_return_null=1", 0);
 
-  u8* fn = alloc_printf("%s/crashes/README.txt", out_dir);
-  s32 fd;
-  FILE* f;
+    /* MSAN is tricky, because it doesn't support abort_on_error=1 at this
+       point. So, we do this in a very hacky way. */
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  ck_free(fn);
+    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                           "symbolize=0:"
+                           "abort_on_error=1:"
+                           "allocator_may_return_null=1:"
+                           "msan_track_origins=0", 0);
 
-  /* Do not die on errors here - that would be impolite. */
+    execv(target_path, argv);
 
-  if (fd < 0) return;
+    /* Use a distinctive bitmap signature to tell the parent about execv()
+       falling through. */
 
-  f = fdopen(fd, "w");
+    *(u32*)trace_bits = EXEC_FAIL_SIG;
+    exit(0);
 
-  if (!f) {
-    close(fd);
-    return;
   }
 
-  fprintf(f, "Command line used to find this crash:\n\n"
+  /* Close the unneeded endpoints. */
 
-             "%s\n\n"
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
 
-             "If you can't reproduce a bug outside of afl-fuzz, be sure to set the same\n"
-             "memory limit. The limit used for this fuzzing session was %s.\n\n"
+  fsrv_ctl_fd = ctl_pipe[1];
+  fsrv_st_fd  = st_pipe[0];
 
-             "Need a tool to minimize test cases before investigating the crashes or sending\n"
-             "them to a vendor? Check out the afl-tmin that comes with the fuzzer!\n\n"
+  /* Wait for the fork server to come up, but don't wait too long. */
 
-             "Found any cool bugs in open-source tools using afl-fuzz? If yes, please drop\n"
-             "me a mail at <lcamtuf@coredump.cx> once the issues are fixed - I'd love to\n"
-             "add your finds to the gallery at:\n\n"
+  it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
+  it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
 
-             "  http://lcamtuf.coredump.cx/afl/\n\n"
+  setitimer(ITIMER_REAL, &it, NULL);
 
-             "Thanks :-)\n",
+  rlen = read(fsrv_st_fd, &status, 4);
 
-             orig_cmdline, DMS(mem_limit << 20)); /* ignore errors */
+  it.it_value.tv_sec = 0;
+  it.it_value.tv_usec = 0;
 
-  fclose(f);
+  setitimer(ITIMER_REAL, &it, NULL);
 
-}
+  /* If we have a four-byte "hello" message from the server, we're all set.
+     Otherwise, try to figure out what went wrong. */
 
-/* this function only save to queue the file when the file cause crase，time out or don't find a cov 
+  if (rlen == 4) {
 
-   0 represent don't need to sort,1 represent need to sort
+    laf_self_clean = (status & FS_OPT_MAPSIZE) == FS_OPT_MAPSIZE &&
+                     (status & FS_OPT_LAF_CLEAN);
 
-*/ 
- 
-static u8 test_if_interesting(char** argv, void* mem, u32 len, u8 fault){ 
+    /* Binaries built by afl-clang-fast report the size of their maps. If
+       that's not what we have set up (in which case they kept their hands
+       off ours), start over with maps of the right size. */
 
-  find_new_branch=0;
+    if ((status & FS_OPT_MAPSIZE) == FS_OPT_MAPSIZE &&
+        ((status & 0xff) < MAP_SIZE_MIN_POW2 ||
+         (status & 0xff) > MAP_SIZE_MAX_POW2))
+      FATAL("Fork server asked for a bad map size (2^%u)", status & 0xff);
 
-  u8  *fn = "";
-  u8  hnb;
-  s32 fd;
-  u8  keeping = 0, res;
+    if ((status & FS_OPT_MAPSIZE) == FS_OPT_MAPSIZE &&
+        FS_OPT_GET_MAPSIZE(status) != map_size) {
 
-  if (fault == crash_mode) {
+      u32 new_size = FS_OPT_GET_MAPSIZE(status);
 
-    if (!(hnb = test_has_new_bits(virgin_bits))) {
-      if (crash_mode) total_crashes++;
-      has_new_bits(virgin_bits);
-      return 0;
-    }    
+      ACTF("Target uses %s maps, reallocating...", DMS(new_size));
 
-#ifndef SIMPLE_FILES
+      kill(forksrv_pid, SIGKILL);
+      waitpid(forksrv_pid, NULL, 0);
+      close(fsrv_ctl_fd);
+      close(fsrv_st_fd);
+      forksrv_pid = 0;
 
-    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
-                      describe_op(hnb));
+      map_size = new_size;
+      setup_shm();
 
-#else
+      init_forkserver(argv);
+      return;
 
-    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+    }
 
-#endif /* ^!SIMPLE_FILES */
+    OKF("All right - fork server is up.");
+    return;
 
-    if (hnb==2) {  
-      ck_free(fn);
-      return keeping;
-    }  
-     
-    has_new_bits(virgin_bits);
+  }
 
-    add_to_queue(fn, len, 0);
+  if (child_timed_out)
+    FATAL("Timeout while initializing fork server (adjusting -t may help)");
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  if (waitpid(forksrv_pid, &status, 0) <= 0)
+    PFATAL("waitpid() failed");
 
-    /* Try to calibrate inline; this also calls update_bitmap_score() when
-       successful. */
+  if (WIFSIGNALED(status)) {
 
-    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
+    if (mem_limit && mem_limit < 500 && uses_asan) {
 
-    if (res == FAULT_ERROR)
-      FATAL("Unable to execute target application");
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! Since it seems to be built with ASAN and you have a\n"
+           "    restrictive memory limit configured, this is expected; please read\n"
+           "    %s/notes_for_asan.txt for help.\n", doc_path);
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    ck_write(fd, mem, len, fn);
-    close(fd);
+    } else if (!mem_limit) {
 
-    keeping = 1;
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! There are several probable explanations:\n\n"
 
+           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
+           "      need to fix the underlying problem or find a better replacement.\n\n"
 
-  }
+#ifdef __APPLE__
 
-  switch (fault) {
+           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+           "      break afl-fuzz performance optimizations when running platform-specific\n"
+           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
 
-    case FAULT_TMOUT:
+#endif /* __APPLE__ */
 
-      /* Timeouts are not very interesting, but we're still obliged to keep
-         a handful of samples. We use the presence of new bits in the
-         hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
-         just keep everything. */
+           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
 
-      total_tmouts++;
+    } else {
 
-      if (unique_hangs >= KEEP_UNIQUE_HANG) return keeping;
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! There are several probable explanations:\n\n"
 
-      if (!dumb_mode) {
+           "    - The current memory limit (%s) is too restrictive, causing the\n"
+           "      target to hit an OOM condition in the dynamic linker. Try bumping up\n"
+           "      the limit with the -m setting in the command line. A simple way confirm\n"
+           "      this diagnosis would be:\n\n"
 
-#ifdef __x86_64__
-        simplify_trace((u64*)trace_bits);
+#ifdef RLIMIT_AS
+           "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
 #else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^__x86_64__ */
+           "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#endif /* ^RLIMIT_AS */
 
-        if (!has_new_bits(virgin_tmout)) return keeping;
-
-      }
-
-      unique_tmouts++;
-
-      /* Before saving, we make sure that it's a genuine hang by re-running
-         the target with a more generous timeout (unless the default timeout
-         is already generous). */
-
-      if (exec_tmout < hang_tmout) {
+           "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+           "      estimate the required amount of virtual memory for the binary.\n\n"
 
-        u8 new_fault;
-        write_to_testcase(mem, len);
-        new_fault = run_target(argv, hang_tmout);
+           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
+           "      need to fix the underlying problem or find a better replacement.\n\n"
 
-        /* A corner case that one user reported bumping into: increasing the
-           timeout actually uncovers a crash. Make sure we don't discard it if
-           so. */
+#ifdef __APPLE__
 
-        if (!stop_soon && new_fault == FAULT_CRASH) goto keep_as_crash;
+           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+           "      break afl-fuzz performance optimizations when running platform-specific\n"
+           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
 
-        if (stop_soon || new_fault != FAULT_TMOUT) return keeping;
+#endif /* __APPLE__ */
 
-      }
+           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+           DMS(mem_limit << 20), mem_limit - 1);
 
-#ifndef SIMPLE_FILES
+    }
 
-      fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
-                        unique_hangs, describe_op(0));
+    FATAL("Fork server crashed with signal %d", WTERMSIG(status));
 
-#else
+  }
 
-      fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
-                        unique_hangs);
+  if (*(u32*)trace_bits == EXEC_FAIL_SIG)
+    FATAL("Unable to execute target application ('%s')", argv[0]);
 
-#endif /* ^!SIMPLE_FILES */
+  if (mem_limit && mem_limit < 500 && uses_asan) {
 
-      unique_hangs++;
+    SAYF("\n" cLRD "[-] " cRST
+           "Hmm, looks like the target binary terminated before we could complete a\n"
+           "    handshake with the injected code. Since it seems to be built with ASAN and\n"
+           "    you have a restrictive memory limit configured, this is expected; please\n"
+           "    read %s/notes_for_asan.txt for help.\n", doc_path);
 
-      last_hang_time = get_cur_time();
+  } else if (!mem_limit) {
 
-      break;
+    SAYF("\n" cLRD "[-] " cRST
+         "Hmm, looks like the target binary terminated before we could complete a\n"
+         "    handshake with the injected code. Perhaps there is a horrible bug in the\n"
+         "    fuzzer. Poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
 
-    case FAULT_CRASH:
+  } else {
 
-keep_as_crash:
+    SAYF("\n" cLRD "[-] " cRST
+         "Hmm, looks like the target binary terminated before we could complete a\n"
+         "    handshake with the injected code. There are %s probable explanations:\n\n"
 
-      /* This is handled in a manner roughly similar to timeouts,
-         except for slightly different limits and no need to re-run test
-         cases. */
+         "%s"
+         "    - The current memory limit (%s) is too restrictive, causing an OOM\n"
+         "      fault in the dynamic linker. This can be fixed with the -m option. A\n"
+         "      simple way to confirm the diagnosis may be:\n\n"
 
-      total_crashes++;
+#ifdef RLIMIT_AS
+         "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#else
+         "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#endif /* ^RLIMIT_AS */
 
-      if (unique_crashes >= KEEP_UNIQUE_CRASH) return keeping;
+         "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+         "      estimate the required amount of virtual memory for the binary.\n\n"
 
-      if (!dumb_mode) {
+         "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+         "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+         getenv(DEFER_ENV_VAR) ? "three" : "two",
+         getenv(DEFER_ENV_VAR) ?
+         "    - You are using deferred forkserver, but __AFL_INIT() is never\n"
+         "      reached before the program terminates.\n\n" : "",
+         DMS(mem_limit << 20), mem_limit - 1);
 
-#ifdef __x86_64__
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^__x86_64__ */
+  }
 
-        if (!has_new_bits(virgin_crash)) return keeping;
+  FATAL("Fork server handshake failed");
 
-      }
+}
 
-      if (!unique_crashes) write_crash_readme();
 
-#ifndef SIMPLE_FILES
+/* Clear laf_trace_bits before a run. When the binary keeps a list of the
+   laf bytes it touched, only those words (and word 0, which the runtime
+   sets at startup) need zeroing; an overflowed list means a full memset.
+   run_target() marks the list overflowed after a timeout, since the target
+   may have been killed between setting a byte and listing it. */
 
-      fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
-                        unique_crashes, kill_signal, describe_op(0));
+static inline void reset_laf_map(void) {
 
-#else
+  u32 cnt, i;
 
-      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
-                        kill_signal);
+  if (!laf_sparse) {
+    memset(laf_trace_bits, 0, map_size);
+    return;
+  }
 
-#endif /* ^!SIMPLE_FILES */
+  cnt = laf_touch[0];
 
-      unique_crashes++;
+  if (cnt > LAF_TOUCH_MAX) {
 
-      last_crash_time = get_cur_time();
-      last_crash_execs = total_execs;
+    memset(laf_trace_bits, 0, map_size);
 
-      break;
+  } else {
 
-    case FAULT_ERROR: FATAL("Unable to execute target application");
+    ((map_word*)laf_trace_bits)[0] = 0;
 
-    default: return keeping;
+    for (i = 0; i < cnt; i++)
+      ((map_word*)laf_trace_bits)[(laf_touch[i + 1] % map_size) /
+                                  sizeof(map_word)] = 0;
 
   }
 
-  /* If we're here, we apparently want to save the crash or hang
-     test case, too. */
+  laf_touch[0] = 0;
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (fd < 0) PFATAL("Unable to create '%s'", fn);
-  ck_write(fd, mem, len, fn);
-  close(fd);
+}
 
-  ck_free(fn);
 
-  return keeping;
+/* Clear trace_bits before a run. For binaries that flag the lines they
+   write to, only those lines (and line 0, which the runtime sets without
+   flagging it) need zeroing. A target killed on timeout may have been
+   stopped between the two stores, so that calls for a full memset. */
 
-}  
- 
+static inline void reset_trace_map(u8 full) {
 
-static void init_queue_new(struct queue_entry *q) {
+  u32 i;
 
-  u64 i=0;  
-  //计算当前种子新覆盖的数量
-  while (i < MAP_SIZE) {
+  if (!map_dirty || full) {
+    memset(trace_bits, 0, map_size);
+    if (map_dirty) memset(trace_dirty, 0, (map_size >> MAP_LINE_SHIFT));
+    return;
+  }
 
-    if(trace_bits[i]){ 
-      if(!(virgin_bit_mini[i>>3]&(1 << (i & 7))))
-      {
-         q->extra_edge_num+=1;
-      }
-       
-    }
-	  i+=1; 
-  }    
+  for (i = 0; i < (map_size >> MAP_LINE_SHIFT); i += sizeof(map_word)) {
 
-}  
+    u32 j;
 
-static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
+    if (likely(!*(map_word*)(trace_dirty + i))) continue;
 
-  u8  *fn = "";
-  u8  hnb;
-  s32 fd;
-  u8  keeping = 0, res; 
+    for (j = i; j < i + sizeof(map_word); j++)
+      if (trace_dirty[j]) memset(trace_bits + j * MAP_LINE, 0, MAP_LINE);
 
-  if (fault == crash_mode) {
+    *(map_word*)(trace_dirty + i) = 0;
 
-    /* Keep only if there are new bits in the map, add to queue for
-       future fuzzing, etc. */
+  }
 
-    if (!(hnb = has_new_bits(virgin_bits))) {
-      if (crash_mode) total_crashes++;
-      return 0;
-    }    
+  memset(trace_bits, 0, MAP_LINE);
 
-#ifndef SIMPLE_FILES
+}
 
-    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
-                      describe_op(hnb));
 
-#else
+/* Execute target application, monitoring for timeouts. Return status
+   information. The called program will update trace_bits[]. */
 
-    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+static u8 run_target(char** argv, u32 timeout) {
 
-#endif /* ^!SIMPLE_FILES */
+  static struct itimerval it;
+  static u32 prev_timed_out = 0;
 
-    add_to_queue(fn, len, 0);
+  int status = 0;
+  u32 tb4;
 
-    if (hnb == 2) {
-      queue_top->has_new_cov = 1; 
-      queued_with_cov++;  
-      init_queue_new(queue_top); 
-    }
+  child_timed_out = 0;
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  /* After this memset, trace_bits[] are effectively volatile, so we
+     must prevent any earlier operations from venturing into that
+     territory. Batched runs clear their per-input maps themselves, and
+     persistent binaries that say so clear their laf map when they resume
+     a stopped child. A fresh child could still leave laf bits behind
+     before it gets to the loop, so that case is ours. */
 
-    /* Try to calibrate inline; this also calls update_bitmap_score() when
-       successful. */
+  if (!batch_cnt) {
+    reset_trace_map(prev_timed_out);
+    if (!laf_self_clean || !child_pid) reset_laf_map();
+  }
 
-    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
+  MEM_BARRIER();
 
-    if (res == FAULT_ERROR)
-      FATAL("Unable to execute target application");
+  /* If we're running in "dumb" mode, we can't rely on the fork server
+     logic compiled into the target program, so we will just keep calling
+     execve(). There is a bit of code duplication between here and 
+     init_forkserver(), but c'est la vie. */
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    ck_write(fd, mem, len, fn);
-    close(fd);
+  if (dumb_mode == 1 || no_forkserver) {
 
-    keeping = 1;
+    child_pid = fork();
 
-  }
+    if (child_pid < 0) PFATAL("fork() failed");
 
-  switch (fault) {
+    if (!child_pid) {
 
-    case FAULT_TMOUT:
+      struct rlimit r;
 
-      /* Timeouts are not very interesting, but we're still obliged to keep
-         a handful of samples. We use the presence of new bits in the
-         hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
-         just keep everything. */
+      if (mem_limit) {
 
-      total_tmouts++;
+        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
 
-      if (unique_hangs >= KEEP_UNIQUE_HANG) return keeping;
+#ifdef RLIMIT_AS
 
-      if (!dumb_mode) {
+        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
 
-#ifdef __x86_64__
-        simplify_trace((u64*)trace_bits);
 #else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^__x86_64__ */
 
-        if (!has_new_bits(virgin_tmout)) return keeping;
+        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
 
       }
 
-      unique_tmouts++;
+      r.rlim_max = r.rlim_cur = 0;
 
-      /* Before saving, we make sure that it's a genuine hang by re-running
-         the target with a more generous timeout (unless the default timeout
-         is already generous). */
+      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
 
-      if (exec_tmout < hang_tmout) {
+      /* Isolate the process and configure standard descriptors. If out_file is
+         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
 
-        u8 new_fault;
-        write_to_testcase(mem, len);
-        new_fault = run_target(argv, hang_tmout);
+      setsid();
 
-        /* A corner case that one user reported bumping into: increasing the
-           timeout actually uncovers a crash. Make sure we don't discard it if
-           so. */
+      dup2(dev_null_fd, 1);
+      dup2(dev_null_fd, 2);
 
-        if (!stop_soon && new_fault == FAULT_CRASH) goto keep_as_crash;
+      if (out_file) {
 
-        if (stop_soon || new_fault != FAULT_TMOUT) return keeping;
+        dup2(dev_null_fd, 0);
 
-      }
+      } else {
 
-#ifndef SIMPLE_FILES
+        dup2(out_fd, 0);
+        close(out_fd);
 
-      fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
-                        unique_hangs, describe_op(0));
+      }
 
-#else
+      /* On Linux, would be faster to use O_CLOEXEC. Maybe TODO. */
 
-      fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
-                        unique_hangs);
+      close(dev_null_fd);
+      close(out_dir_fd);
+      close(dev_urandom_fd);
+      close(fileno(plot_file));
 
-#endif /* ^!SIMPLE_FILES */
+      /* Set sane defaults for ASAN if nothing else specified. */
 
-      unique_hangs++;
-
-      last_hang_time = get_cur_time();
+      setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                             "detect_leaks=0:"
+                             "symbolize=0:"
+                             "allocator_may_return_null=1", 0);
 
-      break;
+      setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                             "symbolize=0:"
+                             "msan_track_origins=0", 0);
 
-    case FAULT_CRASH:
+      execv(target_path, argv);
 
-keep_as_crash:
+      /* Use a distinctive bitmap value to tell the parent about execv()
+         falling through. */
 
-      /* This is handled in a manner roughly similar to timeouts,
-         except for slightly different limits and no need to re-run test
-         cases. */
+      *(u32*)trace_bits = EXEC_FAIL_SIG;
+      exit(0);
 
-      total_crashes++;
+    }
 
-      if (unique_crashes >= KEEP_UNIQUE_CRASH) return keeping;
+  } 
+  else {
 
-      if (!dumb_mode) {
+    s32 res;
 
-#ifdef __x86_64__
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^__x86_64__ */
+    /* In non-dumb mode, we have the fork server up and running, so simply
+       tell it to have at it, and then read back PID. */
 
-        if (!has_new_bits(virgin_crash)) return keeping;
+    if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4) {
 
-      }
+      if (stop_soon) return 0;
+      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
 
-      if (!unique_crashes) write_crash_readme();
+    }
 
-#ifndef SIMPLE_FILES
+    if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4) {
 
-      fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
-                        unique_crashes, kill_signal, describe_op(0));
+      if (stop_soon) return 0;
+      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
 
-#else
+    }
 
-      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
-                        kill_signal);
+    if (child_pid <= 0) FATAL("Fork server is misbehaving (OOM?)");
 
-#endif /* ^!SIMPLE_FILES */
+  }
 
-      unique_crashes++;
+  /* Configure timeout, as requested by user, then wait for child to terminate. */
 
-      last_crash_time = get_cur_time();
-      last_crash_execs = total_execs;
+  it.it_value.tv_sec = (timeout / 1000);
+  it.it_value.tv_usec = (timeout % 1000) * 1000;
 
-      break;
+  setitimer(ITIMER_REAL, &it, NULL);
 
-    case FAULT_ERROR: FATAL("Unable to execute target application");
+  /* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */
 
-    default: return keeping;
+  if (dumb_mode == 1 || no_forkserver) {
 
-  }
+    if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
 
-  /* If we're here, we apparently want to save the crash or hang
-     test case, too. */
+  } 
+  else {
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (fd < 0) PFATAL("Unable to create '%s'", fn);
-  ck_write(fd, mem, len, fn);
-  close(fd);
+    s32 res;
 
-  ck_free(fn);
+    if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
 
-  return keeping;
+      if (stop_soon) return 0;
+      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
 
-}
+    }
 
+  }
 
-/* When resuming, try to find the queue position to start from. This makes sense
-   only when resuming, and when we can find the original fuzzer_stats. */
+  if (!WIFSTOPPED(status)) child_pid = 0;
 
-static u32 find_start_position(void) {
+  it.it_value.tv_sec = 0;
+  it.it_value.tv_usec = 0;
 
-  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+  setitimer(ITIMER_REAL, &it, NULL);
 
-  u8  *fn, *off;
-  s32 fd, i;
-  u32 ret;
+  total_execs++;
 
-  if (!resuming_fuzz) return 0;
+  /* Any subsequent operations on trace_bits must not be moved by the
+     compiler below this point. Past this location, trace_bits[] behave
+     very normally and do not have to be treated as volatile. */
 
-  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+  MEM_BARRIER();
 
-  fd = open(fn, O_RDONLY);
-  ck_free(fn);
+  tb4 = *(u32*)trace_bits;
 
-  if (fd < 0) return 0;
+  /* Hit counts are bucketed lazily, by check_coverage() or classify_trace(),
+     so that the common path touches the map only once. */
 
-  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
-  close(fd);
+  trace_classified = 0;
 
-  off = strstr(tmp, "cur_path          : ");
-  if (!off) return 0;
+  prev_timed_out = child_timed_out;
 
-  ret = atoi(off + 20);
-  if (ret >= queued_paths) ret = 0;
-  return ret;
+  if (child_timed_out && laf_sparse) laf_touch[0] = LAF_TOUCH_MAX + 1;
 
-}
+  /* Report outcome to caller. */
 
+  if (WIFSIGNALED(status) && !stop_soon) {
 
-/* The same, but for timeouts. The idea is that when resuming sessions without
-   -t given, we don't want to keep auto-scaling the timeout over and over
-   again to prevent it from growing due to random flukes. */
+    kill_signal = WTERMSIG(status);
 
-static void find_timeout(void) {
+    if (child_timed_out && kill_signal == SIGKILL) return FAULT_TMOUT;
 
-  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+    return FAULT_CRASH;
 
-  u8  *fn, *off;
-  s32 fd, i;
-  u32 ret;
+  }
 
-  if (!resuming_fuzz) return;
+  /* A somewhat nasty hack for MSAN, which doesn't support abort_on_error and
+     must use a special exit code. */
 
-  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR) {
+    kill_signal = 0;
+    return FAULT_CRASH;
+  }
 
-  fd = open(fn, O_RDONLY);
-  ck_free(fn);
+  if ((dumb_mode == 1 || no_forkserver) && tb4 == EXEC_FAIL_SIG)
+    return FAULT_ERROR;
 
-  if (fd < 0) return;
+  return FAULT_NONE;
 
-  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
-  close(fd);
+}
 
-  off = strstr(tmp, "exec_timeout   : ");
-  if (!off) return;
 
-  ret = atoi(off + 17);
-  if (ret <= 4) return;
+/* Write modified data to file for testing. If out_file is set, the old file
+   is unlinked and a new one is created. Otherwise, out_fd is rewound and
+   truncated. */
 
-  exec_tmout = ret;
-  timeout_given = 3;
+static void write_to_testcase(void* mem, u32 len) {
 
-}
+  s32 fd = out_fd;
 
+  if (shm_fuzz) {
 
-/* Update stats file for unattended monitoring. */
+    /* The binary takes its input from shared memory. The region can't
+       hold more than MAX_FILE bytes. */
 
-static void write_stats_file(double bitmap_cvg, double stability, double eps) {
+    if (len > MAX_FILE) len = MAX_FILE;
 
-  static double last_bcvg, last_stab, last_eps;
+    memcpy(shm_fuzz + sizeof(u32), mem, len);
+    *(u32*)shm_fuzz = len;
+    return;
 
-  u8* fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  s32 fd;
-  FILE* f;
+  }
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (out_file) {
 
-  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+    unlink(out_file); /* Ignore errors. */
 
-  ck_free(fn);
+    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
 
-  f = fdopen(fd, "w");
+    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
 
-  if (!f) PFATAL("fdopen() failed");
+  } else lseek(fd, 0, SEEK_SET);
 
-  /* Keep last values in case we're called from another context
-     where exec/sec stats and such are not readily available. */
+  ck_write(fd, mem, len, out_file);
 
-  if (!bitmap_cvg && !stability && !eps) {
-    bitmap_cvg = last_bcvg;
-    stability  = last_stab;
-    eps        = last_eps;
-  } else {
-    last_bcvg = bitmap_cvg;
-    last_stab = stability;
-    last_eps  = eps;
-  }
+  if (!out_file) {
 
-  fprintf(f, "start_time        : %llu\n"
-             "last_update       : %llu\n"
-             "fuzzer_pid        : %u\n"
-             "cycles_done       : %llu\n"
-             "execs_done        : %llu\n"
-             "execs_per_sec     : %0.02f\n"
-             "paths_total       : %u\n"
-             "paths_favored     : %u\n"
-             "paths_found       : %u\n"
-             "paths_imported    : %u\n"
-             "max_depth         : %u\n"
-             "cur_path          : %u\n" /* Must match find_start_position() */
-             "pending_favs      : %u\n"
-             "pending_total     : %u\n"
-             "variable_paths    : %u\n"
-             "stability         : %0.02f%%\n"
-             "bitmap_cvg        : %0.02f%%\n"
-             "unique_crashes    : %llu\n"
-             "unique_hangs      : %llu\n"
-             "last_path         : %llu\n"
-             "last_crash        : %llu\n"
-             "last_hang         : %llu\n"
-             "execs_since_crash : %llu\n"
-             "exec_timeout      : %u\n"
-             "afl_banner        : %s\n"
-             "afl_version       : " VERSION "\n"
-             "target_mode       : %s%s%s%s%s%s%s\n"
-             //以下为添加的代码
-             "branch total      :%d:\n"
-             "branch byte       :%d:\n"
-             "byte_change msg   :%lu,%lu\n"
-             "byte_deter msg    :%lu,%lu\n"
-             "cluster msg       :%lu,%lu\n"           
-             //以上为添加的代码
-             //
-             "command_line      : %s\n",
-             start_time / 1000, get_cur_time() / 1000, getpid(),
-             queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
-             queued_paths, queued_favored, queued_discovered, queued_imported,
-             max_depth, current_entry, pending_favored, pending_not_fuzzed,
-             queued_variable, stability, bitmap_cvg, unique_crashes,
-             unique_hangs, last_path_time / 1000, last_crash_time / 1000,
-             last_hang_time / 1000, total_execs - last_crash_execs,
-             exec_tmout, use_banner,
-             qemu_mode ? "qemu " : "", dumb_mode ? " dumb " : "",
-             no_forkserver ? "no_forksrv " : "", crash_mode ? "crash " : "",
-             persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
-             (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
-              persistent_mode || deferred_mode) ? "" : "default",
-             get_branch_size(),
-             byte_deter_branch_count,
-             stage_finds[STAGE_BYTE_CHANGE],stage_cycles[STAGE_BYTE_CHANGE],
-             stage_finds[STAGE_BYTE_DETE],stage_cycles[STAGE_BYTE_DETE], 
-             stage_finds[STAGE_CLUSTER],stage_cycles[STAGE_CLUSTER],
-             orig_cmdline);
-             /* ignore errors */
+    if (ftruncate(fd, len)) PFATAL("ftruncate() failed");
+    lseek(fd, 0, SEEK_SET);
 
-  fclose(f);
+  } else close(fd);
 
 }
 
 
-/* Update the plot file if there is a reason to. */
+/* The same, but with an adjustable gap. Used for trimming. */
 
-static void maybe_update_plot_file(double bitmap_cvg, double eps) {
+static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
 
-  static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md;
-  static u64 prev_qc, prev_uc, prev_uh;
+  s32 fd = out_fd;
+  u32 tail_len = len - skip_at - skip_len;
 
-  if (prev_qp == queued_paths && prev_pf == pending_favored && 
+  if (shm_fuzz) {
+
+    if (skip_at > MAX_FILE) skip_at = MAX_FILE;
+    if (skip_at + tail_len > MAX_FILE) tail_len = MAX_FILE - skip_at;
+
+    memcpy(shm_fuzz + sizeof(u32), mem, skip_at);
+    memcpy(shm_fuzz + sizeof(u32) + skip_at, mem + skip_at + skip_len,
+           tail_len);
+    *(u32*)shm_fuzz = skip_at + tail_len;
+    return;
+
+  }
+
+  if (out_file) {
+
+    unlink(out_file); /* Ignore errors. */
+
+    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+
+  } else lseek(fd, 0, SEEK_SET);
+
+  if (skip_at) ck_write(fd, mem, skip_at, out_file);
+
+  if (tail_len) ck_write(fd, mem + skip_at + skip_len, tail_len, out_file);
+
+  if (!out_file) {
+
+    if (ftruncate(fd, len - skip_len)) PFATAL("ftruncate() failed");
+    lseek(fd, 0, SEEK_SET);
+
+  } else close(fd);
+
+}
+
+
+static void show_stats(void);
+
+/* Calibrate a new test case. This is done when processing the input directory
+   to warn about flaky or otherwise problematic test cases early on; and when
+   new paths are discovered to detect variable behavior and so on. */
+
+static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
+                         u32 handicap, u8 from_queue) {
+
+
+  u8  fault = 0, new_bits = 0, var_detected = 0,
+      first_run = (q->exec_cksum == 0);
+
+  u64 start_us, stop_us;
+
+  s32 old_sc = stage_cur, old_sm = stage_max;
+  u32 use_tmout = exec_tmout;
+  u8* old_sn = stage_name;
+
+  /* Be a bit more generous about timeouts when resuming sessions, or when
+     trying to calibrate already-added finds. This helps avoid trouble due
+     to intermittent latency. */
+
+  if (!from_queue || resuming_fuzz)
+    use_tmout = MAX(exec_tmout + CAL_TMOUT_ADD,
+                    exec_tmout * CAL_TMOUT_PERC / 100);
+
+  q->cal_failed++;
+
+  stage_name = "calibration";
+  stage_max  = fast_cal ? 3 : CAL_CYCLES;
+
+  /* Make sure the forkserver is up before we do anything, and let's not
+     count its spin-up time toward binary calibration. */
+
+  if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
+    init_forkserver(argv);
+
+  if (q->exec_cksum) {
+    classify_trace();
+    memcpy(first_trace, trace_bits, map_size);
+  }
+
+  start_us = get_cur_time_us();
+
+  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
+
+    u32 cksum;
+
+    if (!first_run && !(stage_cur % stats_update_freq)) show_stats();
+
+    write_to_testcase(use_mem, q->len);
+
+    fault = run_target(argv, use_tmout);
+
+    classify_trace();
+
+    /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
+       we want to bail out quickly. */
+
+    if (stop_soon || fault != crash_mode) goto abort_calibration;
+
+    if (!dumb_mode && !stage_cur && !count_bytes(trace_bits)) {
+      fault = FAULT_NOINST;
+      goto abort_calibration;
+    }
+
+    cksum = hash32(trace_bits, map_size, HASH_CONST);
+
+    if (q->exec_cksum != cksum) {
+
+      u8 hnb = has_new_bits(virgin_bits);
+      if (hnb > new_bits) new_bits = hnb;
+
+      if (q->exec_cksum) {
+
+        u32 i;
+
+        for (i = 0; i < map_size; i++) {
+
+          if (!var_bytes[i] && first_trace[i] != trace_bits[i]) {
+
+            var_bytes[i] = 1;
+            stage_max    = CAL_CYCLES_LONG;
+
+          }
+
+        }
+
+        var_detected = 1;
+
+      } else {
+
+        q->exec_cksum = cksum;
+        memcpy(first_trace, trace_bits, map_size);
+
+      }
+
+    }
+
+  }
+
+  stop_us = get_cur_time_us();
+
+  total_cal_us     += stop_us - start_us;
+  total_cal_cycles += stage_max;
+
+  /* OK, let's collect some stats about the performance of this test case.
+     This is used for fuzzing air time calculations in calculate_score(). */
+
+  qhot.exec_us[q->id]     = (stop_us - start_us) / stage_max;
+  qhot.bitmap_size[q->id] = count_bytes(trace_bits);
+  q->handicap    = handicap;
+  q->cal_failed  = 0;
+
+  total_bitmap_size += qhot.bitmap_size[q->id];
+  total_bitmap_entries++;
+
+  update_bitmap_score(q);
+
+  /* If this case didn't result in new output from the instrumentation, tell
+     parent. This is a non-critical problem, but something to warn the user
+     about. */
+
+  if (!dumb_mode && first_run && !fault && !new_bits) fault = FAULT_NOBITS;
+
+abort_calibration:
+
+  if (new_bits == 2 && !q->has_new_cov) {
+    q->has_new_cov = 1;
+    queued_with_cov++;
+  }
+
+  /* Mark variable paths. */
+
+  if (var_detected) {
+
+    var_byte_count = count_bytes(var_bytes);
+
+    if (!q->var_behavior) {
+      mark_as_variable(q);
+      queued_variable++;
+    }
+
+  }
+
+  stage_name = old_sn;
+  stage_cur  = old_sc;
+  stage_max  = old_sm;
+
+  if (!first_run) show_stats();
+
+  return fault;
+
+}
+
+
+/* Examine map coverage. Called once, for first test case. */
+
+static void check_map_coverage(void) {
+
+  u32 i;
+
+  if (count_bytes(trace_bits) < 100) return;
+
+  for (i = map_size / 2; i < map_size; i++)
+    if (trace_bits[i]) return;
+
+  WARNF("Recompile binary with newer version of afl to improve coverage!");
+
+}
+
+
+/* Perform dry run of all test cases to confirm that the app is working as
+   expected. This is done only for the initial inputs, and only once. */
+
+static void perform_dry_run(char** argv) {
+
+  struct queue_entry* q;
+  u32 cal_failures = 0, id;
+  u8* skip_crashes = getenv("AFL_SKIP_CRASHES");
+
+  for (id = 0; id < queued_paths; id++) {
+
+    u8* use_mem;
+    u8  res;
+    s32 fd;
+    u8* fn;
+
+    q  = queue_buf[id];
+    fn = strrchr(q->fname, '/') + 1;
+
+    ACTF("Attempting dry run with '%s'...", fn);
+
+    fd = open(q->fname, O_RDONLY);
+    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+
+    use_mem = ck_alloc_nozero(q->len);
+
+    if (read(fd, use_mem, q->len) != q->len)
+      FATAL("Short read from '%s'", q->fname);
+
+    close(fd);
+
+    res = calibrate_case(argv, q, use_mem, 0, 1);
+    note_byte_values(use_mem, q->len);
+    ck_free(use_mem);
+
+    if (stop_soon) return;
+
+    if (res == FAULT_NONE) save_coverage(q);
+
+    if (res == crash_mode || res == FAULT_NOBITS)
+      SAYF(cGRA "    len = %u, map size = %u, exec speed = %llu us\n" cRST, 
+           q->len, qhot.bitmap_size[q->id], qhot.exec_us[q->id]);
+
+    switch (res) {
+
+      case FAULT_NONE:
+
+        if (q == queue) check_map_coverage();
+
+        sched->new_find(q);
+
+        if (crash_mode) FATAL("Test case '%s' does *NOT* crash", fn);
+
+        break;
+
+      case FAULT_TMOUT:
+
+        if (timeout_given) {
+
+          /* The -t nn+ syntax in the command line sets timeout_given to '2' and
+             instructs afl-fuzz to tolerate but skip queue entries that time
+             out. */
+
+          if (timeout_given > 1) {
+            WARNF("Test case results in a timeout (skipping)");
+            q->cal_failed = CAL_CHANCES;
+            cal_failures++;
+            break;
+          }
+
+          SAYF("\n" cLRD "[-] " cRST
+               "The program took more than %u ms to process one of the initial test cases.\n"
+               "    Usually, the right thing to do is to relax the -t option - or to delete it\n"
+               "    altogether and allow the fuzzer to auto-calibrate. That said, if you know\n"
+               "    what you are doing and want to simply skip the unruly test cases, append\n"
+               "    '+' at the end of the value passed to -t ('-t %u+').\n", exec_tmout,
+               exec_tmout);
+
+          FATAL("Test case '%s' results in a timeout", fn);
+
+        } else {
+
+          SAYF("\n" cLRD "[-] " cRST
+               "The program took more than %u ms to process one of the initial test cases.\n"
+               "    This is bad news; raising the limit with the -t option is possible, but\n"
+               "    will probably make the fuzzing process extremely slow.\n\n"
+
+               "    If this test case is just a fluke, the other option is to just avoid it\n"
+               "    altogether, and find one that is less of a CPU hog.\n", exec_tmout);
+
+          FATAL("Test case '%s' results in a timeout", fn);
+
+        }
+
+      case FAULT_CRASH:  
+
+        if (crash_mode) break;
+
+        if (skip_crashes) {
+          WARNF("Test case results in a crash (skipping)");
+          q->cal_failed = CAL_CHANCES;
+          cal_failures++;
+          break;
+        }
+
+        if (mem_limit) {
+
+          SAYF("\n" cLRD "[-] " cRST
+               "Oops, the program crashed with one of the test cases provided. There are\n"
+               "    several possible explanations:\n\n"
+
+               "    - The test case causes known crashes under normal working conditions. If\n"
+               "      so, please remove it. The fuzzer should be seeded with interesting\n"
+               "      inputs - but not ones that cause an outright crash.\n\n"
+
+               "    - The current memory limit (%s) is too low for this program, causing\n"
+               "      it to die due to OOM when parsing valid files. To fix this, try\n"
+               "      bumping it up with the -m setting in the command line. If in doubt,\n"
+               "      try something along the lines of:\n\n"
+
+#ifdef RLIMIT_AS
+               "      ( ulimit -Sv $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
+#else
+               "      ( ulimit -Sd $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
+#endif /* ^RLIMIT_AS */
+
+               "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+               "      estimate the required amount of virtual memory for the binary. Also,\n"
+               "      if you are using ASAN, see %s/notes_for_asan.txt.\n\n"
+
+#ifdef __APPLE__
+  
+               "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+               "      break afl-fuzz performance optimizations when running platform-specific\n"
+               "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+               "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
+               "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+               DMS(mem_limit << 20), mem_limit - 1, doc_path);
+
+        } else {
+
+          SAYF("\n" cLRD "[-] " cRST
+               "Oops, the program crashed with one of the test cases provided. There are\n"
+               "    several possible explanations:\n\n"
+
+               "    - The test case causes known crashes under normal working conditions. If\n"
+               "      so, please remove it. The fuzzer should be seeded with interesting\n"
+               "      inputs - but not ones that cause an outright crash.\n\n"
+
+#ifdef __APPLE__
+  
+               "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+               "      break afl-fuzz performance optimizations when running platform-specific\n"
+               "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+               "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
+               "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+
+        }
+
+        FATAL("Test case '%s' results in a crash", fn);
+
+      case FAULT_ERROR:
+
+        FATAL("Unable to execute target application ('%s')", argv[0]);
+
+      case FAULT_NOINST:
+
+        FATAL("No instrumentation detected");
+
+      case FAULT_NOBITS: 
+
+        useless_at_start++;
+
+        if (!in_bitmap && !shuffle_queue)
+          WARNF("No new instrumentation output, test case may be useless.");
+
+        break;
+
+    }
+
+    if (q->var_behavior) WARNF("Instrumentation output varies across runs.");
+
+  }
+
+  if (cal_failures) {
+
+    if (cal_failures == queued_paths)
+      FATAL("All test cases time out%s, giving up!",
+            skip_crashes ? " or crash" : "");
+
+    WARNF("Skipped %u test cases (%0.02f%%) due to timeouts%s.", cal_failures,
+          ((double)cal_failures) * 100 / queued_paths,
+          skip_crashes ? " or crashes" : "");
+
+    if (cal_failures * 5 > queued_paths)
+      WARNF(cLRD "High percentage of rejected test cases, check settings!");
+
+  }
+
+  OKF("All test cases processed.");
+
+}
+
+
+/* Helper function: link() if possible, copy otherwise. */
+
+static void link_or_copy(u8* old_path, u8* new_path) {
+
+  s32 i = link(old_path, new_path);
+  s32 sfd, dfd;
+  u8* tmp;
+
+  if (!i) return;
+
+  sfd = open(old_path, O_RDONLY);
+  if (sfd < 0) PFATAL("Unable to open '%s'", old_path);
+
+  dfd = open(new_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (dfd < 0) PFATAL("Unable to create '%s'", new_path);
+
+  tmp = ck_alloc(64 * 1024);
+
+  while ((i = read(sfd, tmp, 64 * 1024)) > 0) 
+    ck_write(dfd, tmp, i, new_path);
+
+  if (i < 0) PFATAL("read() failed");
+
+  ck_free(tmp);
+  close(sfd);
+  close(dfd);
+
+}
+
+
+static void nuke_resume_dir(void);
+
+/* Create hard links for input test cases in the output directory, choosing
+   good names and pivoting accordingly. */
+
+static void pivot_inputs(void) {
+
+  struct queue_entry* q;
+  u32 id;
+
+  ACTF("Creating hard links for all input files...");
+
+  for (id = 0; id < queued_paths; id++) {
+
+    u8  *nfn, *rsl;
+
+    q   = queue_buf[id];
+    rsl = strrchr(q->fname, '/');
+    u32 orig_id;
+
+    if (!rsl) rsl = q->fname; else rsl++;
+
+    /* If the original file name conforms to the syntax and the recorded
+       ID matches the one we'd assign, just use the original file name.
+       This is valuable for resuming fuzzing runs. */
+
+#ifndef SIMPLE_FILES
+#  define CASE_PREFIX "id:"
+#else
+#  define CASE_PREFIX "id_"
+#endif /* ^!SIMPLE_FILES */
+
+    if (!strncmp(rsl, CASE_PREFIX, 3) &&
+        sscanf(rsl + 3, "%06u", &orig_id) == 1 && orig_id == id) {
+
+      u8* src_str;
+      u32 src_id;
+
+      resuming_fuzz = 1;
+      nfn = alloc_printf("%s/queue/%s", out_dir, rsl);
+
+      /* Since we're at it, let's also try to find parent and figure out the
+         appropriate depth for this entry. */
+
+      src_str = strchr(rsl + 3, ':');
+
+      if (src_str && sscanf(src_str + 1, "%06u", &src_id) == 1) {
+
+        if (src_id < queued_paths) qhot.depth[q->id] = qhot.depth[src_id] + 1;
+
+        if (max_depth < qhot.depth[q->id]) max_depth = qhot.depth[q->id];
+
+      }
+
+    } else {
+
+      /* No dice - invent a new name, capturing the original one as a
+         substring. */
+
+#ifndef SIMPLE_FILES
+
+      u8* use_name = strstr(rsl, ",orig:");
+
+      if (use_name) use_name += 6; else use_name = rsl;
+      nfn = alloc_printf("%s/queue/id:%06u,orig:%s", out_dir, id, use_name);
+
+#else
+
+      nfn = alloc_printf("%s/queue/id_%06u", out_dir, id);
+
+#endif /* ^!SIMPLE_FILES */
+
+    }
+
+    /* Pivot to the new queue entry. */
+
+    link_or_copy(q->fname, nfn);
+    ck_free(q->fname);
+    q->fname = nfn;
+
+    /* Make sure that the passed_det value carries over, too. */
+
+    if (q->passed_det) mark_as_det_done(q);
+
+  }
+
+  if (in_place_resume) nuke_resume_dir();
+
+}
+
+
+#ifndef SIMPLE_FILES
+
+/* Construct a file name for a new test case, capturing the operation
+   that led to its discovery. Uses a static buffer. */
+
+static u8* describe_op(u8 hnb) {
+
+  static u8 ret[256];
+
+  if (syncing_party) {
+
+    sprintf(ret, "sync:%s,src:%06u", syncing_party, syncing_case);
+
+  } else {
+
+    sprintf(ret, "src:%06u", current_entry);
+
+    if (splicing_with >= 0)
+      sprintf(ret + strlen(ret), "+%06u", splicing_with);
+
+    sprintf(ret + strlen(ret), ",op:%s", stage_short);
+
+    if ((stage_cur_count > 0)&&(stage_cur_count <3)) {
+
+      sprintf(ret + strlen(ret), ",pos:%u", stage_cur_byte);
+      sprintf(ret + strlen(ret), ",change_len:%u", char_str_count); 
+ 
+      if(((diff_val_byte>=64)&&(diff_val_byte<90))||((diff_val_byte>=97)&&(diff_val_byte<122))||((diff_val_byte>=48)&&(diff_val_byte<57)))
+        sprintf(ret + strlen(ret), ",val_char:%c", diff_val_byte);
+      else
+        sprintf(ret + strlen(ret), ",val_hex:0x%x", diff_val_byte);
+
+    }  
+
+  }
+ 
+  if(find_new_branch!=0){
+    strcat(ret, ",+cov");
+  } 
+  if(find_new_laf_branch!=0){
+    strcat(ret, ",+");
+    sprintf(ret + strlen(ret), "%d", extra_laf_count_orig);
+    if((find_new_laf_branch&1)!=0){
+      strcat(ret, ",swith");
+    }
+    if((find_new_laf_branch&2)!=0){
+      strcat(ret, ",cmp");
+    }
+    if((find_new_laf_branch&4)!=0){
+      strcat(ret, ",str");
+    }
+  }
+
+  return ret;
+
+}
+
+#endif /* !SIMPLE_FILES */
+
+
+/* Write a message accompanying the crash directory :-) */
+
+static void write_crash_readme(void) {
+
+  u8* fn = alloc_printf("%s/crashes/README.txt", out_dir);
+  s32 fd;
+  FILE* f;
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  ck_free(fn);
+
+  /* Do not die on errors here - that would be impolite. */
+
+  if (fd < 0) return;
+
+  f = fdopen(fd, "w");
+
+  if (!f) {
+    close(fd);
+    return;
+  }
+
+  fprintf(f, "Command line used to find this crash:\n\n"
+
+             "%s\n\n"
+
+             "If you can't reproduce a bug outside of afl-fuzz, be sure to set the same\n"
+             "memory limit. The limit used for this fuzzing session was %s.\n\n"
+
+             "Need a tool to minimize test cases before investigating the crashes or sending\n"
+             "them to a vendor? Check out the afl-tmin that comes with the fuzzer!\n\n"
+
+             "Found any cool bugs in open-source tools using afl-fuzz? If yes, please drop\n"
+             "me a mail at <lcamtuf@coredump.cx> once the issues are fixed - I'd love to\n"
+             "add your finds to the gallery at:\n\n"
+
+             "  http://lcamtuf.coredump.cx/afl/\n\n"
+
+             "Thanks :-)\n",
+
+             orig_cmdline, DMS(mem_limit << 20)); /* ignore errors */
+
+  fclose(f);
+
+}
+
+/* this function only save to queue the file when the file cause crase，time out or don't find a cov 
+
+   0 represent don't need to sort,1 represent need to sort
+
+*/ 
+ 
+static u8 test_if_interesting(char** argv, void* mem, u32 len, u8 fault){ 
+
+  find_new_branch=0;
+
+  u8  *fn = "";
+  u8  hnb;
+  u64 seq;
+  u8  keeping = 0, res, io_flags = 0;
+
+  if (fault == crash_mode) {
+
+    if (!(hnb = test_has_new_bits(virgin_bits))) {
+      if (crash_mode) total_crashes++;
+      has_new_bits(virgin_bits);
+      return 0;
+    }    
+
+#ifndef SIMPLE_FILES
+
+    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
+                      describe_op(hnb));
+
+#else
+
+    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+
+#endif /* ^!SIMPLE_FILES */
+
+    if (hnb==2) {  
+      ck_free(fn);
+      return keeping;
+    }  
+     
+    has_new_bits(virgin_bits);
+
+    add_to_queue(fn, len, 0);
+
+    queue_top->exec_cksum = hash32(trace_bits, map_size, HASH_CONST);
+
+    /* Try to calibrate inline; this also calls update_bitmap_score() when
+       successful. */
+
+    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
+
+    if (res == FAULT_ERROR)
+      FATAL("Unable to execute target application");
+
+    if (res == FAULT_NONE) save_coverage(queue_top);
+
+    sched->new_find(queue_top);
+
+    queue_top->io_seq = io_queue_copy(0, ck_strdup(fn), mem, len);
+
+    keeping = 1;
+
+
+  }
+
+  switch (fault) {
+
+    case FAULT_TMOUT:
+
+      /* Timeouts are not very interesting, but we're still obliged to keep
+         a handful of samples. We use the presence of new bits in the
+         hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
+         just keep everything. */
+
+      total_tmouts++;
+
+      if (unique_hangs >= KEEP_UNIQUE_HANG) return keeping;
+
+      if (!dumb_mode) {
+
+#ifdef __x86_64__
+        simplify_trace((u64*)trace_bits);
+#else
+        simplify_trace((u32*)trace_bits);
+#endif /* ^__x86_64__ */
+
+        if (!has_new_bits(virgin_tmout)) return keeping;
+
+      }
+
+      unique_tmouts++;
+
+      /* Before saving, we make sure that it's a genuine hang by re-running
+         the target with a more generous timeout (unless the default timeout
+         is already generous). */
+
+      if (exec_tmout < hang_tmout) {
+
+        u8 new_fault;
+        write_to_testcase(mem, len);
+        new_fault = run_target(argv, hang_tmout);
+
+        /* A corner case that one user reported bumping into: increasing the
+           timeout actually uncovers a crash. Make sure we don't discard it if
+           so. */
+
+        if (!stop_soon && new_fault == FAULT_CRASH) goto keep_as_crash;
+
+        if (stop_soon || new_fault != FAULT_TMOUT) return keeping;
+
+      }
+
+#ifndef SIMPLE_FILES
+
+      fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
+                        unique_hangs, describe_op(0));
+
+#else
+
+      fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
+                        unique_hangs);
+
+#endif /* ^!SIMPLE_FILES */
+
+      unique_hangs++;
+
+      last_hang_time = get_cur_time();
+
+      break;
+
+    case FAULT_CRASH:
+
+keep_as_crash:
+
+      if (crash_fsync) io_flags = IO_F_FSYNC;
+
+      /* This is handled in a manner roughly similar to timeouts,
+         except for slightly different limits and no need to re-run test
+         cases. */
+
+      total_crashes++;
+
+      if (unique_crashes >= KEEP_UNIQUE_CRASH) return keeping;
+
+      if (!dumb_mode) {
+
+#ifdef __x86_64__
+        simplify_trace((u64*)trace_bits);
+#else
+        simplify_trace((u32*)trace_bits);
+#endif /* ^__x86_64__ */
+
+        if (!has_new_bits(virgin_crash)) return keeping;
+
+      }
+
+      if (!unique_crashes) write_crash_readme();
+
+#ifndef SIMPLE_FILES
+
+      fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
+                        unique_crashes, kill_signal, describe_op(0));
+
+#else
+
+      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
+                        kill_signal);
+
+#endif /* ^!SIMPLE_FILES */
+
+      unique_crashes++;
+
+      last_crash_time = get_cur_time();
+      last_crash_execs = total_execs;
+
+      break;
+
+    case FAULT_ERROR: FATAL("Unable to execute target application");
+
+    default: return keeping;
+
+  }
+
+  /* If we're here, we apparently want to save the crash or hang
+     test case, too. With AFL_CRASH_FSYNC, crashes are on disk before we
+     move on. */
+
+  seq = io_queue_copy(io_flags, fn, mem, len);
+
+  if (io_flags) io_wait(seq);
+
+  return keeping;
+
+}  
+ 
+
+static void init_queue_new(struct queue_entry *q) {
+
+  u64 i=0;  
+  //计算当前种子新覆盖的数量
+  while (i < map_size) {
+
+    if(trace_bits[i]){ 
+      if(!(virgin_bit_mini[i>>3]&(1 << (i & 7))))
+      {
+         q->extra_edge_num+=1;
+      }
+       
+    }
+	  i+=1; 
+  }    
+
+}  
+
+static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
+
+  u8  *fn = "";
+  u8  hnb;
+  u64 seq;
+  u8  keeping = 0, res, io_flags = 0; 
+
+  if (fault == crash_mode) {
+
+    /* Keep only if there are new bits in the map, add to queue for
+       future fuzzing, etc. */
+
+    if (!(hnb = has_new_bits(virgin_bits))) {
+      if (crash_mode) total_crashes++;
+      return 0;
+    }    
+
+#ifndef SIMPLE_FILES
+
+    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
+                      describe_op(hnb));
+
+#else
+
+    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+
+#endif /* ^!SIMPLE_FILES */
+
+    add_to_queue(fn, len, 0);
+    note_byte_values(mem, len);
+
+    if (hnb == 2) {
+      queue_top->has_new_cov = 1; 
+      queued_with_cov++;  
+      init_queue_new(queue_top); 
+    }
+
+    queue_top->exec_cksum = hash32(trace_bits, map_size, HASH_CONST);
+
+    /* Try to calibrate inline; this also calls update_bitmap_score() when
+       successful. */
+
+    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
+
+    if (res == FAULT_ERROR)
+      FATAL("Unable to execute target application");
+
+    if (res == FAULT_NONE) save_coverage(queue_top);
+
+    sched->new_find(queue_top);
+
+    queue_top->io_seq = io_queue_copy(0, ck_strdup(fn), mem, len);
+
+    keeping = 1;
+
+  }
+
+  switch (fault) {
+
+    case FAULT_TMOUT:
+
+      /* Timeouts are not very interesting, but we're still obliged to keep
+         a handful of samples. We use the presence of new bits in the
+         hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
+         just keep everything. */
+
+      total_tmouts++;
+
+      if (unique_hangs >= KEEP_UNIQUE_HANG) return keeping;
+
+      if (!dumb_mode) {
+
+#ifdef __x86_64__
+        simplify_trace((u64*)trace_bits);
+#else
+        simplify_trace((u32*)trace_bits);
+#endif /* ^__x86_64__ */
+
+        if (!has_new_bits(virgin_tmout)) return keeping;
+
+      }
+
+      unique_tmouts++;
+
+      /* Before saving, we make sure that it's a genuine hang by re-running
+         the target with a more generous timeout (unless the default timeout
+         is already generous). */
+
+      if (exec_tmout < hang_tmout) {
+
+        u8 new_fault;
+        write_to_testcase(mem, len);
+        new_fault = run_target(argv, hang_tmout);
+
+        /* A corner case that one user reported bumping into: increasing the
+           timeout actually uncovers a crash. Make sure we don't discard it if
+           so. */
+
+        if (!stop_soon && new_fault == FAULT_CRASH) goto keep_as_crash;
+
+        if (stop_soon || new_fault != FAULT_TMOUT) return keeping;
+
+      }
+
+#ifndef SIMPLE_FILES
+
+      fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
+                        unique_hangs, describe_op(0));
+
+#else
+
+      fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
+                        unique_hangs);
+
+#endif /* ^!SIMPLE_FILES */
+
+      unique_hangs++;
+
+      last_hang_time = get_cur_time();
+
+      break;
+
+    case FAULT_CRASH:
+
+keep_as_crash:
+
+      if (crash_fsync) io_flags = IO_F_FSYNC;
+
+      /* This is handled in a manner roughly similar to timeouts,
+         except for slightly different limits and no need to re-run test
+         cases. */
+
+      total_crashes++;
+
+      if (unique_crashes >= KEEP_UNIQUE_CRASH) return keeping;
+
+      if (!dumb_mode) {
+
+#ifdef __x86_64__
+        simplify_trace((u64*)trace_bits);
+#else
+        simplify_trace((u32*)trace_bits);
+#endif /* ^__x86_64__ */
+
+        if (!has_new_bits(virgin_crash)) return keeping;
+
+      }
+
+      if (!unique_crashes) write_crash_readme();
+
+#ifndef SIMPLE_FILES
+
+      fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
+                        unique_crashes, kill_signal, describe_op(0));
+
+#else
+
+      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
+                        kill_signal);
+
+#endif /* ^!SIMPLE_FILES */
+
+      unique_crashes++;
+
+      last_crash_time = get_cur_time();
+      last_crash_execs = total_execs;
+
+      break;
+
+    case FAULT_ERROR: FATAL("Unable to execute target application");
+
+    default: return keeping;
+
+  }
+
+  /* If we're here, we apparently want to save the crash or hang
+     test case, too. With AFL_CRASH_FSYNC, crashes are on disk before we
+     move on. */
+
+  seq = io_queue_copy(io_flags, fn, mem, len);
+
+  if (io_flags) io_wait(seq);
+
+  return keeping;
+
+}
+
+
+/* When resuming, try to find the queue position to start from. This makes sense
+   only when resuming, and when we can find the original fuzzer_stats. */
+
+static u32 find_start_position(void) {
+
+  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+
+  u8  *fn, *off;
+  s32 fd, i;
+  u32 ret;
+
+  if (!resuming_fuzz) return 0;
+
+  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0) return 0;
+
+  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
+  close(fd);
+
+  off = strstr(tmp, "cur_path          : ");
+  if (!off) return 0;
+
+  ret = atoi(off + 20);
+  if (ret >= queued_paths) ret = 0;
+  return ret;
+
+}
+
+
+/* The same, but for timeouts. The idea is that when resuming sessions without
+   -t given, we don't want to keep auto-scaling the timeout over and over
+   again to prevent it from growing due to random flukes. */
+
+static void find_timeout(void) {
+
+  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+
+  u8  *fn, *off;
+  s32 fd, i;
+  u32 ret;
+
+  if (!resuming_fuzz) return;
+
+  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0) return;
+
+  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
+  close(fd);
+
+  off = strstr(tmp, "exec_timeout   : ");
+  if (!off) return;
+
+  ret = atoi(off + 17);
+  if (ret <= 4) return;
+
+  exec_tmout = ret;
+  timeout_given = 3;
+
+}
+
+
+/* Update stats file for unattended monitoring. */
+
+static void write_havoc_stats(FILE* f);
+
+static void write_stats_file(double bitmap_cvg, double stability, double eps) {
+
+  static double last_bcvg, last_stab, last_eps;
+
+  u8* fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  s32 fd;
+  FILE* f;
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+  ck_free(fn);
+
+  f = fdopen(fd, "w");
+
+  if (!f) PFATAL("fdopen() failed");
+
+  /* In a -j group, the maps also hold what the other workers found, so
+     the counters simply pick that up. */
+
+  recount_coverage(!group_virgin);
+
+  /* Keep last values in case we're called from another context
+     where exec/sec stats and such are not readily available. */
+
+  if (!bitmap_cvg && !stability && !eps) {
+    bitmap_cvg = last_bcvg;
+    stability  = last_stab;
+    eps        = last_eps;
+  } else {
+    last_bcvg = bitmap_cvg;
+    last_stab = stability;
+    last_eps  = eps;
+  }
+
+  fprintf(f, "start_time        : %llu\n"
+             "last_update       : %llu\n"
+             "fuzzer_pid        : %u\n"
+             "cycles_done       : %llu\n"
+             "execs_done        : %llu\n"
+             "execs_per_sec     : %0.02f\n"
+             "paths_total       : %u\n"
+             "paths_favored     : %u\n"
+             "paths_found       : %u\n"
+             "paths_imported    : %u\n"
+             "max_depth         : %u\n"
+             "cur_path          : %u\n" /* Must match find_start_position() */
+             "pending_favs      : %u\n"
+             "pending_total     : %u\n"
+             "variable_paths    : %u\n"
+             "stability         : %0.02f%%\n"
+             "bitmap_cvg        : %0.02f%%\n"
+             "unique_crashes    : %llu\n"
+             "unique_hangs      : %llu\n"
+             "last_path         : %llu\n"
+             "last_crash        : %llu\n"
+             "last_hang         : %llu\n"
+             "execs_since_crash : %llu\n"
+             "exec_timeout      : %u\n"
+             "afl_banner        : %s\n"
+             "afl_version       : " VERSION "\n"
+             "target_mode       : %s%s%s%s%s%s%s%s\n"
+             //以下为添加的代码
+             "branch total      :%d:\n"
+             "branch byte       :%d:\n"
+             "byte_change msg   :%lu,%lu\n"
+             "byte_deter msg    :%lu,%lu\n"
+             "cluster msg       :%lu,%lu\n"           
+             "cmplog msg        :%llu,%llu\n"
+             "frontier_edges    : %u\n"
+             "schedule          : %s\n"
+             "sync_skipped      : %u\n"
+             "byte_ascii_saved  : %llu\n"
+             "eff_skipped       : %llu\n"
+             //以上为添加的代码
+             //
+             "command_line      : %s\n",
+             start_time / 1000, get_cur_time() / 1000, getpid(),
+             queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
+             queued_paths, queued_favored, queued_discovered, queued_imported,
+             max_depth, current_entry, pending_favored, pending_not_fuzzed,
+             queued_variable, stability, bitmap_cvg, unique_crashes,
+             unique_hangs, last_path_time / 1000, last_crash_time / 1000,
+             last_hang_time / 1000, total_execs - last_crash_execs,
+             exec_tmout, use_banner,
+             qemu_mode ? "qemu " : "", dumb_mode ? " dumb " : "",
+             no_forkserver ? "no_forksrv " : "", crash_mode ? "crash " : "",
+             persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
+             snapshot_mode ? "snapshot " : "",
+             (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
+              persistent_mode || deferred_mode || snapshot_mode) ? "" : "default",
+             get_branch_size(),
+             byte_deter_branch_count,
+             stage_finds[STAGE_BYTE_CHANGE],stage_cycles[STAGE_BYTE_CHANGE],
+             stage_finds[STAGE_BYTE_DETE],stage_cycles[STAGE_BYTE_DETE], 
+             stage_finds[STAGE_CLUSTER],stage_cycles[STAGE_CLUSTER],
+             stage_finds[STAGE_CMPLOG],stage_cycles[STAGE_CMPLOG],
+             frontier_edges, sched->name, sync_skipped, byte_execs_saved,
+             eff_skipped, orig_cmdline);
+             /* ignore errors */
+
+  write_havoc_stats(f);
+
+  fclose(f);
+
+}
+
+
+/* Update the plot file if there is a reason to. */
+
+static void maybe_update_plot_file(double bitmap_cvg, double eps) {
+
+  static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md;
+  static u64 prev_qc, prev_uc, prev_uh;
+
+  if (prev_qp == queued_paths && prev_pf == pending_favored && 
       prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
       prev_qc == queue_cycle && prev_uc == unique_crashes &&
       prev_uh == unique_hangs && prev_md == max_depth) return;
 
-  prev_qp  = queued_paths;
-  prev_pf  = pending_favored;
-  prev_pnf = pending_not_fuzzed;
-  prev_ce  = current_entry;
-  prev_qc  = queue_cycle;
-  prev_uc  = unique_crashes;
-  prev_uh  = unique_hangs;
-  prev_md  = max_depth;
+  prev_qp  = queued_paths;
+  prev_pf  = pending_favored;
+  prev_pnf = pending_not_fuzzed;
+  prev_ce  = current_entry;
+  prev_qc  = queue_cycle;
+  prev_uc  = unique_crashes;
+  prev_uh  = unique_hangs;
+  prev_md  = max_depth;
+
+  /* Fields in the file:
+
+     unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
+     favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
+     execs_per_sec */
+
+  fprintf(plot_file, 
+          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f\n",
+          get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
+          pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
+          unique_hangs, max_depth, eps); /* ignore errors */
+
+  fflush(plot_file);
+
+}
+
+
+
+/* A helper function for maybe_delete_out_dir(), deleting all prefixed
+   files in a directory. */
+
+static u8 delete_files(u8* path, u8* prefix) {
+
+  DIR* d;
+  struct dirent* d_ent;
+
+  d = opendir(path);
+
+  if (!d) return 0;
+
+  while ((d_ent = readdir(d))) {
+
+    if (d_ent->d_name[0] != '.' && (!prefix ||
+        !strncmp(d_ent->d_name, prefix, strlen(prefix)))) {
+
+      u8* fname = alloc_printf("%s/%s", path, d_ent->d_name);
+      if (unlink(fname)) PFATAL("Unable to delete '%s'", fname);
+      ck_free(fname);
+
+    }
+
+  }
+
+  closedir(d);
+
+  return !!rmdir(path);
+
+}
+
+
+/* Get the number of runnable processes, with some simple smoothing. */
+
+static double get_runnable_processes(void) {
+
+  static double res;
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
+
+  /* I don't see any portable sysctl or so that would quickly give us the
+     number of runnable processes; the 1-minute load average can be a
+     semi-decent approximation, though. */
+
+  if (getloadavg(&res, 1) != 1) return 0;
+
+#else
+
+  /* On Linux, /proc/stat is probably the best way; load averages are
+     computed in funny ways and sometimes don't reflect extremely short-lived
+     processes well. */
+
+  FILE* f = fopen("/proc/stat", "r");
+  u8 tmp[1024];
+  u32 val = 0;
+
+  if (!f) return 0;
+
+  while (fgets(tmp, sizeof(tmp), f)) {
+
+    if (!strncmp(tmp, "procs_running ", 14) ||
+        !strncmp(tmp, "procs_blocked ", 14)) val += atoi(tmp + 14);
+
+  }
+ 
+  fclose(f);
+
+  if (!res) {
+
+    res = val;
+
+  } else {
+
+    res = res * (1.0 - 1.0 / AVG_SMOOTHING) +
+          ((double)val) * (1.0 / AVG_SMOOTHING);
+
+  }
+
+#endif /* ^(__APPLE__ || __FreeBSD__ || __OpenBSD__) */
+
+  return res;
+
+}
+
+
+/* Delete the temporary directory used for in-place session resume. */
+
+static void nuke_resume_dir(void) {
+
+  u8* fn;
+
+  fn = alloc_printf("%s/_resume/.state/deterministic_done", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/auto_extras", out_dir);
+  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/redundant_edges", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/variable_behavior", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/coverage", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state", out_dir);
+  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  return;
+
+dir_cleanup_failed:
+
+  FATAL("_resume directory cleanup failed");
+
+}
+
+
+/* Delete fuzzer output directory if we recognize it as ours, if the fuzzer
+   is not currently running, and if the last run time isn't too great. */
+
+static void maybe_delete_out_dir(void) {
+
+  FILE* f;
+  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
+
+  /* See if the output directory is locked. If yes, bail out. If not,
+     create a lock that will persist for the lifetime of the process
+     (this requires leaving the descriptor open).*/
+
+  out_dir_fd = open(out_dir, O_RDONLY);
+  if (out_dir_fd < 0) PFATAL("Unable to open '%s'", out_dir);
+
+#ifndef __sun
+
+  if (flock(out_dir_fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK) {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Looks like the job output directory is being actively used by another\n"
+         "    instance of afl-fuzz. You will need to choose a different %s\n"
+         "    or stop the other process first.\n",
+         sync_id ? "fuzzer ID" : "output location");
+
+    FATAL("Directory '%s' is in use", out_dir);
+
+  }
+
+#endif /* !__sun */
+
+  f = fopen(fn, "r");
+
+  if (f) {
+
+    u64 start_time, last_update;
+
+    if (fscanf(f, "start_time     : %llu\n"
+                  "last_update    : %llu\n", &start_time, &last_update) != 2)
+      FATAL("Malformed data in '%s'", fn);
+
+    fclose(f);
+
+    /* Let's see how much work is at stake. */
+
+    if (!in_place_resume && last_update - start_time > OUTPUT_GRACE * 60) {
+
+      SAYF("\n" cLRD "[-] " cRST
+           "The job output directory already exists and contains the results of more\n"
+           "    than %u minutes worth of fuzzing. To avoid data loss, afl-fuzz will *NOT*\n"
+           "    automatically delete this data for you.\n\n"
+
+           "    If you wish to start a new session, remove or rename the directory manually,\n"
+           "    or specify a different output location for this job. To resume the old\n"
+           "    session, put '-' as the input directory in the command line ('-i -') and\n"
+           "    try again.\n", OUTPUT_GRACE);
+
+       FATAL("At-risk data found in '%s'", out_dir);
+
+    }
+
+  }
+
+  ck_free(fn);
+
+  /* The idea for in-place resume is pretty simple: we temporarily move the old
+     queue/ to a new location that gets deleted once import to the new queue/
+     is finished. If _resume/ already exists, the current queue/ may be
+     incomplete due to an earlier abort, so we want to use the old _resume/
+     dir instead, and we let rename() fail silently. */
+
+  if (in_place_resume) {
+
+    u8* orig_q = alloc_printf("%s/queue", out_dir);
+
+    in_dir = alloc_printf("%s/_resume", out_dir);
+
+    rename(orig_q, in_dir); /* Ignore errors */
+
+    OKF("Output directory exists, will attempt session resume.");
+
+    ck_free(orig_q);
+
+  } else {
+
+    OKF("Output directory exists but deemed OK to reuse.");
+
+  }
+
+  ACTF("Deleting old session data...");
+
+  /* Okay, let's get the ball rolling! First, we need to get rid of the entries
+     in <out_dir>/.synced/.../id:*, if any are present. */
+
+  if (!in_place_resume) {
+
+    fn = alloc_printf("%s/.synced", out_dir);
+    if (delete_files(fn, NULL)) goto dir_cleanup_failed;
+    ck_free(fn);
+
+  }
+
+  /* Next, we need to clean up <out_dir>/queue/.state/ subdirectories: */
+
+  fn = alloc_printf("%s/queue/.state/deterministic_done", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/auto_extras", out_dir);
+  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/redundant_edges", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/variable_behavior", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/coverage", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  /* Then, get rid of the .state subdirectory itself (should be empty by now)
+     and everything matching <out_dir>/queue/id:*. */
+
+  fn = alloc_printf("%s/queue/.state", out_dir);
+  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  /* All right, let's do <out_dir>/crashes/id:* and <out_dir>/hangs/id:*. */
+
+  if (!in_place_resume) {
+
+    fn = alloc_printf("%s/crashes/README.txt", out_dir);
+    unlink(fn); /* Ignore errors */
+    ck_free(fn);
+
+  }
+
+  fn = alloc_printf("%s/crashes", out_dir);
+
+  /* Make backup of the crashes directory if it's not empty and if we're
+     doing in-place resume. */
+
+  if (in_place_resume && rmdir(fn)) {
+
+    time_t cur_t = time(0);
+    struct tm* t = localtime(&cur_t);
+
+#ifndef SIMPLE_FILES
+
+    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
+
+#else
+
+    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
 
-  /* Fields in the file:
+#endif /* ^!SIMPLE_FILES */
 
-     unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
-     favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
-     execs_per_sec */
+    rename(fn, nfn); /* Ignore errors. */
+    ck_free(nfn);
 
-  fprintf(plot_file, 
-          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f\n",
-          get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
-          pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
-          unique_hangs, max_depth, eps); /* ignore errors */
+  }
 
-  fflush(plot_file);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
 
-}
+  fn = alloc_printf("%s/hangs", out_dir);
 
+  /* Backup hangs, too. */
 
+  if (in_place_resume && rmdir(fn)) {
 
-/* A helper function for maybe_delete_out_dir(), deleting all prefixed
-   files in a directory. */
+    time_t cur_t = time(0);
+    struct tm* t = localtime(&cur_t);
 
-static u8 delete_files(u8* path, u8* prefix) {
+#ifndef SIMPLE_FILES
 
-  DIR* d;
-  struct dirent* d_ent;
+    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
 
-  d = opendir(path);
+#else
 
-  if (!d) return 0;
+    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
 
-  while ((d_ent = readdir(d))) {
+#endif /* ^!SIMPLE_FILES */
 
-    if (d_ent->d_name[0] != '.' && (!prefix ||
-        !strncmp(d_ent->d_name, prefix, strlen(prefix)))) {
+    rename(fn, nfn); /* Ignore errors. */
+    ck_free(nfn);
 
-      u8* fname = alloc_printf("%s/%s", path, d_ent->d_name);
-      if (unlink(fname)) PFATAL("Unable to delete '%s'", fname);
-      ck_free(fname);
+  }
 
-    }
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  /* And now, for some finishing touches. */
+
+  fn = alloc_printf("%s/.cur_input", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/fuzz_bitmap", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
 
+  if (!in_place_resume) {
+    fn  = alloc_printf("%s/fuzzer_stats", out_dir);
+    if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+    ck_free(fn);
   }
 
-  closedir(d);
+  fn = alloc_printf("%s/plot_data", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
 
-  return !!rmdir(path);
+  OKF("Output dir cleanup successful.");
+
+  /* Wow... is that all? If yes, celebrate! */
+
+  return;
+
+dir_cleanup_failed:
+
+  SAYF("\n" cLRD "[-] " cRST
+       "Whoops, the fuzzer tried to reuse your output directory, but bumped into\n"
+       "    some files that shouldn't be there or that couldn't be removed - so it\n"
+       "    decided to abort! This happened while processing this path:\n\n"
+
+       "    %s\n\n"
+       "    Please examine and manually delete the files, or specify a different\n"
+       "    output location for the tool.\n", fn);
+
+  FATAL("Output directory cleanup failed");
 
 }
 
 
-/* Get the number of runnable processes, with some simple smoothing. */
+static void check_term_size(void);
 
-static double get_runnable_processes(void) {
+/* Percentage of discovered laf bits, kept up to date by
+   laf_has_new_branch(). */
 
-  static double res;
+double get_laf_size(){
 
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
+  return virgin_laf_bits*100.0/8.0/map_size;
 
-  /* I don't see any portable sysctl or so that would quickly give us the
-     number of runnable processes; the 1-minute load average can be a
-     semi-decent approximation, though. */
+}
 
-  if (getloadavg(&res, 1) != 1) return 0;
 
-#else
+int get_mini_vir(){
 
-  /* On Linux, /proc/stat is probably the best way; load averages are
-     computed in funny ways and sometimes don't reflect extremely short-lived
-     processes well. */
+  int count=0;
+  u32 i;
 
-  FILE* f = fopen("/proc/stat", "r");
-  u8 tmp[1024];
-  u32 val = 0;
+  for (i = 0; i < queued_paths; i++) {
+    if(queue_buf[i]->trace_mini){
+      count+=1;
+    }
+  }
 
-  if (!f) return 0;
+  return count;
+}
 
-  while (fgets(tmp, sizeof(tmp), f)) {
+/* A spiffy retro stats screen! This is called every stats_update_freq
+   execve() calls, plus in several other circumstances. */
 
-    if (!strncmp(tmp, "procs_running ", 14) ||
-        !strncmp(tmp, "procs_blocked ", 14)) val += atoi(tmp + 14);
+static void show_stats(void) {
+
+  static u64 last_stats_ms, last_plot_ms, last_ms, last_execs;
+  static double avg_exec;
+  double t_byte_ratio, stab_ratio;
+
+  u64 cur_ms;
+  u32 t_bytes, t_bits;
+
+  u32 banner_len, banner_pad;
+  u8  tmp[256];
+
+  cur_ms = get_cur_time();
+
+  /* If not enough time has passed since last UI update, bail out. */
+
+  if (cur_ms - last_ms < 1000 / UI_TARGET_HZ) return;
+
+  /* Check if we're past the 10 minute mark. */
+
+  if (cur_ms - start_time > 10 * 60 * 1000) run_over10m = 1;
+
+  /* Calculate smoothed exec speed stats. */
+
+  if (!last_execs) {
+  
+    avg_exec = ((double)total_execs) * 1000 / (cur_ms - start_time);
+
+  } else {
+
+    double cur_avg = ((double)(total_execs - last_execs)) * 1000 /
+                     (cur_ms - last_ms);
+
+    /* If there is a dramatic (5x+) jump in speed, reset the indicator
+       more quickly. */
+
+    if (cur_avg * 5 < avg_exec || cur_avg / 5 > avg_exec)
+      avg_exec = cur_avg;
+
+    avg_exec = avg_exec * (1.0 - 1.0 / AVG_SMOOTHING) +
+               cur_avg * (1.0 / AVG_SMOOTHING);
+
+  }
+
+  last_ms = cur_ms;
+  last_execs = total_execs;
+
+  /* Tell the callers when to contact us (as measured in execs). */
+
+  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10);
+  if (!stats_update_freq) stats_update_freq = 1;
+
+  /* Do some bitmap stats. */
+
+  t_bytes = count_non_255_bytes(virgin_bits);
+  t_byte_ratio = ((double)t_bytes * 100) / map_size;
+
+  if (t_bytes) 
+    stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
+  else
+    stab_ratio = 100;
+
+  /* Roughly every minute, update fuzzer stats and save auto tokens. */
+
+  if (cur_ms - last_stats_ms > STATS_UPDATE_SEC * 1000) {
+
+    last_stats_ms = cur_ms;
+    write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
+    save_auto();
+    write_bitmap();
 
   }
+
+  /* Every now and then, write plot data. */
+
+  if (cur_ms - last_plot_ms > PLOT_UPDATE_SEC * 1000) {
+
+    last_plot_ms = cur_ms;
+    maybe_update_plot_file(t_byte_ratio, avg_exec);
  
-  fclose(f);
+  }
+
+  /* Honor AFL_EXIT_WHEN_DONE and AFL_BENCH_UNTIL_CRASH. */
+
+  if (!dumb_mode && cycles_wo_finds > 100 && !pending_not_fuzzed &&
+      getenv("AFL_EXIT_WHEN_DONE")) stop_soon = 2;
+
+  if (total_crashes && getenv("AFL_BENCH_UNTIL_CRASH")) stop_soon = 2;
+
+  /* If we're not on TTY, bail out. */
+
+  if (not_on_tty) return;
+
+  /* Compute some mildly useful bitmap stats. */
+
+  t_bits = (map_size << 3) - count_bits(virgin_bits);
+
+  /* Now, for the visuals... */
+
+  if (clear_screen) {
+
+    SAYF(TERM_CLEAR CURSOR_HIDE);
+    clear_screen = 0;
+
+    check_term_size();
+
+  }
+
+  SAYF(TERM_HOME);
+
+  if (term_too_small) {
+
+    SAYF(cBRI "Your terminal is too small to display the UI.\n"
+         "Please resize terminal window to at least 80x25.\n" cRST);
+
+    return;
+
+  }
+
+  /* Let's start by drawing a centered banner. */
+
+  banner_len = (crash_mode ? 24 : 22) + strlen(VERSION) + strlen(use_banner);
+  banner_pad = (80 - banner_len) / 2;
+  memset(tmp, ' ', banner_pad); 
+  
+
+  sprintf(tmp + banner_pad, "%s " cLCY "Lag" cLGN
+          " (%s)",  crash_mode ? cPIN "peruvian were-rabbit" : 
+          cYEL "AgileFuzz", use_banner);  
+
 
-  if (!res) {
 
-    res = val;
+  SAYF("\n%s\n\n", tmp);
 
-  } else {
+  /* "Handy" shortcuts for drawing boxes... */
 
-    res = res * (1.0 - 1.0 / AVG_SMOOTHING) +
-          ((double)val) * (1.0 / AVG_SMOOTHING);
+#define bSTG    bSTART cGRA
+#define bH2     bH bH
+#define bH5     bH2 bH2 bH
+#define bH10    bH5 bH5
+#define bH20    bH10 bH10
+#define bH30    bH20 bH10
+#define SP5     "     "
+#define SP10    SP5 SP5
+#define SP20    SP10 SP10
 
-  }
+  /* Lord, forgive me this. */
 
-#endif /* ^(__APPLE__ || __FreeBSD__ || __OpenBSD__) */
+  SAYF(SET_G1 bSTG bLT bH bSTOP cCYA " process timing " bSTG bH30 bH5 bH2 bHB
+       bH bSTOP cCYA " overall results " bSTG bH5 bRT "\n");
 
-  return res;
+  if (dumb_mode) {
 
-}
+    strcpy(tmp, cRST);
 
+  } else {
 
-/* Delete the temporary directory used for in-place session resume. */
+    u64 min_wo_finds = (cur_ms - last_path_time) / 1000 / 60;
 
-static void nuke_resume_dir(void) {
+    /* First queue cycle: don't stop now! */
+    if (queue_cycle == 1 || min_wo_finds < 15) strcpy(tmp, cMGN); else
 
-  u8* fn;
+    /* Subsequent cycles, but we're still making finds. */
+    if (cycles_wo_finds < 25 || min_wo_finds < 30) strcpy(tmp, cYEL); else
 
-  fn = alloc_printf("%s/_resume/.state/deterministic_done", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    /* No finds for a long time and no test cases to try. */
+    if (cycles_wo_finds > 100 && !pending_not_fuzzed && min_wo_finds > 120)
+      strcpy(tmp, cLGN);
 
-  fn = alloc_printf("%s/_resume/.state/auto_extras", out_dir);
-  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
-  ck_free(fn);
+    /* Default: cautiously OK to stop? */
+    else strcpy(tmp, cLBL);
 
-  fn = alloc_printf("%s/_resume/.state/redundant_edges", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  }
 
-  fn = alloc_printf("%s/_resume/.state/variable_behavior", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF(bV bSTOP "        run time : " cRST "%-34s " bSTG bV bSTOP
+       "  cycles done : %s%-5s  " bSTG bV "\n",
+       DTD(cur_ms, start_time), tmp, DI(queue_cycle - 1));
 
-  fn = alloc_printf("%s/_resume/.state", out_dir);
-  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+  /* We want to warn people about not seeing new paths after a full cycle,
+     except when resuming fuzzing or running in non-instrumented mode. */
 
-  fn = alloc_printf("%s/_resume", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  if (!dumb_mode && (last_path_time || resuming_fuzz || queue_cycle == 1 ||
+      in_bitmap || crash_mode)) {
 
-  return;
+    SAYF(bV bSTOP "   last new path : " cRST "%-34s ",
+         DTD(cur_ms, last_path_time));
 
-dir_cleanup_failed:
+  } else {
 
-  FATAL("_resume directory cleanup failed");
+    if (dumb_mode)
 
-}
+      SAYF(bV bSTOP "   last new path : " cPIN "n/a" cRST 
+           " (non-instrumented mode)        ");
 
+     else
 
-/* Delete fuzzer output directory if we recognize it as ours, if the fuzzer
-   is not currently running, and if the last run time isn't too great. */
+      SAYF(bV bSTOP "   last new path : " cRST "none yet " cLRD
+           "(odd, check syntax!)      ");
 
-static void maybe_delete_out_dir(void) {
+  }
 
-  FILE* f;
-  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  SAYF(bSTG bV bSTOP "  total paths : " cRST "%-5s  " bSTG bV "\n",
+       DI(queued_paths));
 
-  /* See if the output directory is locked. If yes, bail out. If not,
-     create a lock that will persist for the lifetime of the process
-     (this requires leaving the descriptor open).*/
+  /* Highlight crashes in red if found, denote going over the KEEP_UNIQUE_CRASH
+     limit with a '+' appended to the count. */
 
-  out_dir_fd = open(out_dir, O_RDONLY);
-  if (out_dir_fd < 0) PFATAL("Unable to open '%s'", out_dir);
+  sprintf(tmp, "%s%s", DI(unique_crashes),
+          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
 
-#ifndef __sun
+  SAYF(bV bSTOP " last uniq crash : " cRST "%-34s " bSTG bV bSTOP
+       " uniq crashes : %s%-6s " bSTG bV "\n",
+       DTD(cur_ms, last_crash_time), unique_crashes ? cLRD : cRST,
+       tmp);
 
-  if (flock(out_dir_fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK) {
+  sprintf(tmp, "%s%s", DI(unique_hangs),
+         (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Looks like the job output directory is being actively used by another\n"
-         "    instance of afl-fuzz. You will need to choose a different %s\n"
-         "    or stop the other process first.\n",
-         sync_id ? "fuzzer ID" : "output location");
+  SAYF(bV bSTOP "  last uniq hang : " cRST "%-34s " bSTG bV bSTOP 
+       "   uniq hangs : " cRST "%-6s " bSTG bV "\n",
+       DTD(cur_ms, last_hang_time), tmp);
 
-    FATAL("Directory '%s' is in use", out_dir);
+  SAYF(bVR bH bSTOP cCYA " cycle progress " bSTG bH20 bHB bH bSTOP cCYA
+       " map coverage " bSTG bH bHT bH20 bH2 bH bVL "\n");
 
-  }
+  /* This gets funny because we want to print several variable-length variables
+     together, but then cram them into a fixed-width field - so we need to
+     put them in a temporary buffer first. */
 
-#endif /* !__sun */
+  sprintf(tmp, "%s%s (%0.02f%%)", DI(current_entry),
+          qhot.favored[queue_cur->id] ? "" : "*",
+          ((double)current_entry * 100) / queued_paths);
 
-  f = fopen(fn, "r");
+  SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
 
-  if (f) {
+  sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)qhot.bitmap_size[queue_cur->id]) * 
+          100 / map_size, t_byte_ratio);
 
-    u64 start_time, last_update;
+  SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
+       ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
 
-    if (fscanf(f, "start_time     : %llu\n"
-                  "last_update    : %llu\n", &start_time, &last_update) != 2)
-      FATAL("Malformed data in '%s'", fn);
+  sprintf(tmp, "%s (%0.02f%%)", DI(cur_skipped_paths),
+          ((double)cur_skipped_paths * 100) / queued_paths);
 
-    fclose(f);
+  SAYF(bV bSTOP " paths timed out : " cRST "%-17s " bSTG bV, tmp);
 
-    /* Let's see how much work is at stake. */
+  sprintf(tmp, "%0.02f bits/tuple",
+          t_bytes ? (((double)t_bits) / t_bytes) : 0);
 
-    if (!in_place_resume && last_update - start_time > OUTPUT_GRACE * 60) {
+  SAYF(bSTOP " count coverage : " cRST "%-21s " bSTG bV "\n", tmp);
 
-      SAYF("\n" cLRD "[-] " cRST
-           "The job output directory already exists and contains the results of more\n"
-           "    than %u minutes worth of fuzzing. To avoid data loss, afl-fuzz will *NOT*\n"
-           "    automatically delete this data for you.\n\n"
+  SAYF(bVR bH bSTOP cCYA " stage progress " bSTG bH20 bX bH bSTOP cCYA
+       " findings in depth " bSTG bH20 bVL "\n");
 
-           "    If you wish to start a new session, remove or rename the directory manually,\n"
-           "    or specify a different output location for this job. To resume the old\n"
-           "    session, put '-' as the input directory in the command line ('-i -') and\n"
-           "    try again.\n", OUTPUT_GRACE);
+  sprintf(tmp, "%s (%0.02f%%)", DI(queued_favored),
+          ((double)queued_favored) * 100 / queued_paths);
 
-       FATAL("At-risk data found in '%s'", out_dir);
+  /* Yeah... it's still going on... halp? */
 
-    }
+  SAYF(bV bSTOP "  now trying : " cRST "%-21s " bSTG bV bSTOP 
+       " favored paths : " cRST "%-22s " bSTG bV "\n", stage_name, tmp);
 
-  }
+  if (!stage_max) {
 
-  ck_free(fn);
+    sprintf(tmp, "%s/-", DI(stage_cur));
 
-  /* The idea for in-place resume is pretty simple: we temporarily move the old
-     queue/ to a new location that gets deleted once import to the new queue/
-     is finished. If _resume/ already exists, the current queue/ may be
-     incomplete due to an earlier abort, so we want to use the old _resume/
-     dir instead, and we let rename() fail silently. */
+  } else {
 
-  if (in_place_resume) {
+    sprintf(tmp, "%s/%s (%0.02f%%)", DI(stage_cur), DI(stage_max),
+            ((double)stage_cur) * 100 / stage_max);
 
-    u8* orig_q = alloc_printf("%s/queue", out_dir);
+  }
 
-    in_dir = alloc_printf("%s/_resume", out_dir);
+  SAYF(bV bSTOP " stage execs : " cRST "%-21s " bSTG bV bSTOP, tmp);
 
-    rename(orig_q, in_dir); /* Ignore errors */
+  sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
+          ((double)queued_with_cov) * 100 / queued_paths);
 
-    OKF("Output directory exists, will attempt session resume.");
+  SAYF("  new edges on : " cRST "%-22s " bSTG bV "\n", tmp);
 
-    ck_free(orig_q);
+  sprintf(tmp, "%s (%s%s unique)", DI(total_crashes), DI(unique_crashes),
+          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+
+  if (crash_mode) {
+
+    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
+         "   new crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
+         unique_crashes ? cLRD : cRST, tmp);
 
   } else {
 
-    OKF("Output directory exists but deemed OK to reuse.");
+    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
+         " total crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
+         unique_crashes ? cLRD : cRST, tmp);
 
   }
 
-  ACTF("Deleting old session data...");
+  /* Show a warning about slow execution. */
 
-  /* Okay, let's get the ball rolling! First, we need to get rid of the entries
-     in <out_dir>/.synced/.../id:*, if any are present. */
+  if (avg_exec < 100) {
 
-  if (!in_place_resume) {
+    sprintf(tmp, "%s/sec (%s)", DF(avg_exec), avg_exec < 20 ?
+            "zzzz..." : "slow!");
 
-    fn = alloc_printf("%s/.synced", out_dir);
-    if (delete_files(fn, NULL)) goto dir_cleanup_failed;
-    ck_free(fn);
+    SAYF(bV bSTOP "  exec speed : " cLRD "%-21s ", tmp);
+
+  } else {
+
+    sprintf(tmp, "%s/sec", DF(avg_exec));
+    SAYF(bV bSTOP "  exec speed : " cRST "%-21s ", tmp);
 
   }
 
-  /* Next, we need to clean up <out_dir>/queue/.state/ subdirectories: */
+  sprintf(tmp, "%s (%s%s unique)", DI(total_tmouts), DI(unique_tmouts),
+          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
 
-  fn = alloc_printf("%s/queue/.state/deterministic_done", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF (bSTG bV bSTOP "  total tmouts : " cRST "%-22s " bSTG bV "\n", tmp);
 
-  fn = alloc_printf("%s/queue/.state/auto_extras", out_dir);
-  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
-  ck_free(fn);
+  /* Aaaalmost there... hold on! */
 
-  fn = alloc_printf("%s/queue/.state/redundant_edges", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF(bVR bH cCYA bSTOP " fuzzing strategy yields " bSTG bH10 bH bHT bH10
+       bH5 bHB bH bSTOP cCYA " path geometry " bSTG bH5 bH2 bH bVL "\n");
 
-  fn = alloc_printf("%s/queue/.state/variable_behavior", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
 
-  /* Then, get rid of the .state subdirectory itself (should be empty by now)
-     and everything matching <out_dir>/queue/id:*. */
+  u8 skip_deterministic_new=0;
+  if (skip_deterministic_new) {
 
-  fn = alloc_printf("%s/queue/.state", out_dir);
-  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+  strcpy(tmp, "n/a, n/a, n/a"); 
 
-  fn = alloc_printf("%s/queue", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  } else {
 
-  /* All right, let's do <out_dir>/crashes/id:* and <out_dir>/hangs/id:*. */
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_FLIP1]), DI(stage_cycles[STAGE_FLIP1]),
+            DI(stage_finds[STAGE_FLIP2]), DI(stage_cycles[STAGE_FLIP2]),
+            DI(stage_finds[STAGE_FLIP4]), DI(stage_cycles[STAGE_FLIP4]));
 
-  if (!in_place_resume) {
+  } 
 
-    fn = alloc_printf("%s/crashes/README.txt", out_dir);
-    unlink(fn); /* Ignore errors */
-    ck_free(fn);
+  SAYF(bV bSTOP "   bit flips : " cRST "%-37s " bSTG bV bSTOP "    levels : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(max_depth));
 
-  }
+  if (!skip_deterministic_new)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_FLIP8]), DI(stage_cycles[STAGE_FLIP8]),
+            DI(stage_finds[STAGE_FLIP16]), DI(stage_cycles[STAGE_FLIP16]),
+            DI(stage_finds[STAGE_FLIP32]), DI(stage_cycles[STAGE_FLIP32]));
 
-  fn = alloc_printf("%s/crashes", out_dir);
+  SAYF(bV bSTOP "  byte flips : " cRST "%-37s " bSTG bV bSTOP "branch total: "
+       cRST "%-9s " bSTG bV "\n", tmp, DI(get_branch_size()));
 
-  /* Make backup of the crashes directory if it's not empty and if we're
-     doing in-place resume. */
+  if (!skip_deterministic_new)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            // DI(stage_finds[STAGE_ARITH8]), DI(stage_cycles[STAGE_ARITH8]),
+            DI(stage_finds[STAGE_EXTRAS_UO]), DI(stage_cycles[STAGE_EXTRAS_UO]),
+            DI(stage_finds[STAGE_ARITH16]), DI(stage_cycles[STAGE_ARITH16]),
+            DI(stage_finds[STAGE_ARITH32]), DI(stage_cycles[STAGE_ARITH32]));
 
-  if (in_place_resume && rmdir(fn)) {
+  SAYF(bV bSTOP " arithmetics : " cRST "%-37s " bSTG bV bSTOP "  pend fav : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_favored));
 
-    time_t cur_t = time(0);
-    struct tm* t = localtime(&cur_t);
+  // SAYF(bV bSTOP "  known ints : " cRST "%-37s " bSTG bV bSTOP " branch byte : "
+  //      cRST "%-8s " bSTG bV "\n", tmp, DI(byte_deter_branch_count)); 
 
-#ifndef SIMPLE_FILES
+  if (!skip_deterministic_new)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_BYTE_CHANGE]), DI(stage_cycles[STAGE_BYTE_CHANGE]),
+            DI(stage_finds[STAGE_BYTE_DETE]), DI(stage_cycles[STAGE_BYTE_DETE]),
+            DI(stage_finds[STAGE_CLUSTER]), DI(stage_cycles[STAGE_CLUSTER])); 
+  
+  // sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
+  //         ((double)queued_with_cov) * 100 / queued_paths);
 
-    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+  SAYF(bV bSTOP "  byte deter : " cRST "%-37s " bSTG bV bSTOP
+       "  laf_branch :" cRST "%0.02f%%    " bSTG bV "\n", tmp,
+        get_laf_size() );
 
-#else
+  sprintf(tmp, "%s/%s, %s/%s",
+          DI(stage_finds[STAGE_HAVOC]), DI(stage_cycles[STAGE_HAVOC]),
+          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]));
 
-    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+  SAYF(bV bSTOP "       havoc : " cRST "%-37s " bSTG bV bSTOP, tmp);
 
-#endif /* ^!SIMPLE_FILES */
+  if (t_bytes) sprintf(tmp, "%0.02f%%", stab_ratio);
+    else strcpy(tmp, "n/a");
 
-    rename(fn, nfn); /* Ignore errors. */
-    ck_free(nfn);
+  SAYF(" stability : %s%-10s " bSTG bV "\n", (stab_ratio < 85 && var_byte_count > 40) 
+       ? cLRD : ((queued_variable && (!persistent_mode || var_byte_count > 20))
+       ? cMGN : cRST), tmp);
 
-  }
+  if (!bytes_trim_out) {
 
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    sprintf(tmp, "n/a, ");
 
-  fn = alloc_printf("%s/hangs", out_dir);
+  } else {
 
-  /* Backup hangs, too. */
+    sprintf(tmp, "%0.02f%%/%s, ",
+            ((double)(bytes_trim_in - bytes_trim_out)) * 100 / bytes_trim_in,
+            DI(trim_execs));
 
-  if (in_place_resume && rmdir(fn)) {
+  }
 
-    time_t cur_t = time(0);
-    struct tm* t = localtime(&cur_t);
+  if (!blocks_eff_total) {
 
-#ifndef SIMPLE_FILES
+    u8 tmp2[128];
 
-    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+    sprintf(tmp2, "n/a");
+    strcat(tmp, tmp2);
 
-#else
+  } else {
 
-    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+    u8 tmp2[128];
 
-#endif /* ^!SIMPLE_FILES */
+    sprintf(tmp2, "%0.02f%%",
+            ((double)(blocks_eff_total - blocks_eff_select)) * 100 /
+            blocks_eff_total);
 
-    rename(fn, nfn); /* Ignore errors. */
-    ck_free(nfn);
+    strcat(tmp, tmp2);
 
   }
 
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF(bV bSTOP "        trim : " cRST "%-37s " bSTG bVR bH20 bH2 bH2 bRB "\n"
+       bLB bH30 bH20 bH2 bH bRB bSTOP cRST RESET_G1, tmp);
 
-  /* And now, for some finishing touches. */
+  /* Provide some CPU utilization stats. */
 
-  fn = alloc_printf("%s/.cur_input", out_dir);
-  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+  if (cpu_core_count) {
 
-  fn = alloc_printf("%s/fuzz_bitmap", out_dir);
-  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+    double cur_runnable = get_runnable_processes();
+    u32 cur_utilization = cur_runnable * 100 / cpu_core_count;
 
-  if (!in_place_resume) {
-    fn  = alloc_printf("%s/fuzzer_stats", out_dir);
-    if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-    ck_free(fn);
-  }
+    u8* cpu_color = cCYA;
 
-  fn = alloc_printf("%s/plot_data", out_dir);
-  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+    /* If we could still run one or more processes, use green. */
 
-  OKF("Output dir cleanup successful.");
+    if (cpu_core_count > 1 && cur_runnable + 1 <= cpu_core_count)
+      cpu_color = cLGN;
 
-  /* Wow... is that all? If yes, celebrate! */
+    /* If we're clearly oversubscribed, use red. */
 
-  return;
+    if (!no_cpu_meter_red && cur_utilization >= 150) cpu_color = cLRD;
 
-dir_cleanup_failed:
+#ifdef HAVE_AFFINITY
 
-  SAYF("\n" cLRD "[-] " cRST
-       "Whoops, the fuzzer tried to reuse your output directory, but bumped into\n"
-       "    some files that shouldn't be there or that couldn't be removed - so it\n"
-       "    decided to abort! This happened while processing this path:\n\n"
+    if (cpu_aff >= 0) {
 
-       "    %s\n\n"
-       "    Please examine and manually delete the files, or specify a different\n"
-       "    output location for the tool.\n", fn);
+      SAYF(SP10 cGRA "[cpu%03u:%s%3u%%" cGRA "]\r" cRST, 
+           MIN(cpu_aff, 999), cpu_color,
+           MIN(cur_utilization, 999));
 
-  FATAL("Output directory cleanup failed");
+    } else {
 
-}
+      SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
+           cpu_color, MIN(cur_utilization, 999));
+ 
+   }
 
+#else
 
-static void check_term_size(void);
+    SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
+         cpu_color, MIN(cur_utilization, 999));
 
-double get_laf_size(){
-  int i=0,ii;
-  double count=0;
-  for(;i<MAP_SIZE;i++){
-    u8 temp=laf_virgin_bits[i];
-    for(ii=0;ii<8;ii++){
-      if(temp&1==1){ 
-        count+=1;
-      }
-      temp=temp>>1;
-    } 
-  }
-  return count*100.0/8.0/MAP_SIZE;
-  // return count;
+#endif /* ^HAVE_AFFINITY */
 
-}
+  } else SAYF("\r");
 
+  /* Hallelujah! */
 
-int get_mini_vir(){
+  fflush(0);
 
-  int count=0;
-  struct queue_entry* q; 
-  q = queue;
+} 
 
-  while (q) {
-    if(q->trace_mini){
-      count+=1;
-    }
-    q = q->next;
-  }
 
-  return count;
-}
+/* Display quick statistics at the end of processing the input directory,
+   plus a bunch of warnings. Some calibration stuff also ended up here,
+   along with several hardcoded constants. Maybe clean up eventually. */
 
-/* A spiffy retro stats screen! This is called every stats_update_freq
-   execve() calls, plus in several other circumstances. */
+static void show_init_stats(void) {
 
-static void show_stats(void) {
+  struct queue_entry* q;
+  u32 min_bits = 0, max_bits = 0, i;
+  u64 min_us = 0, max_us = 0;
+  u64 avg_us = 0;
+  u32 max_len = 0;
 
-  static u64 last_stats_ms, last_plot_ms, last_ms, last_execs;
-  static double avg_exec;
-  double t_byte_ratio, stab_ratio;
+  if (total_cal_cycles) avg_us = total_cal_us / total_cal_cycles;
 
-  u64 cur_ms;
-  u32 t_bytes, t_bits;
+  for (i = 0; i < queued_paths; i++) {
 
-  u32 banner_len, banner_pad;
-  u8  tmp[256];
+    q = queue_buf[i];
 
-  cur_ms = get_cur_time();
+    if (!min_us || qhot.exec_us[i] < min_us) min_us = qhot.exec_us[i];
+    if (qhot.exec_us[i] > max_us) max_us = qhot.exec_us[i];
 
-  /* If not enough time has passed since last UI update, bail out. */
+    if (!min_bits || qhot.bitmap_size[i] < min_bits)
+      min_bits = qhot.bitmap_size[i];
+    if (qhot.bitmap_size[i] > max_bits) max_bits = qhot.bitmap_size[i];
 
-  if (cur_ms - last_ms < 1000 / UI_TARGET_HZ) return;
+    if (q->len > max_len) max_len = q->len;
 
-  /* Check if we're past the 10 minute mark. */
+  }
 
-  if (cur_ms - start_time > 10 * 60 * 1000) run_over10m = 1;
+  SAYF("\n");
 
-  /* Calculate smoothed exec speed stats. */
+  if (avg_us > (qemu_mode ? 50000 : 10000)) 
+    WARNF(cLRD "The target binary is pretty slow! See %s/perf_tips.txt.",
+          doc_path);
 
-  if (!last_execs) {
-  
-    avg_exec = ((double)total_execs) * 1000 / (cur_ms - start_time);
+  /* Let's keep things moving with slow binaries. */
 
-  } else {
+  if (avg_us > 50000) havoc_div = 10;     /* 0-19 execs/sec   */
+  else if (avg_us > 20000) havoc_div = 5; /* 20-49 execs/sec  */
+  else if (avg_us > 10000) havoc_div = 2; /* 50-100 execs/sec */
 
-    double cur_avg = ((double)(total_execs - last_execs)) * 1000 /
-                     (cur_ms - last_ms);
+  if (!resuming_fuzz) {
 
-    /* If there is a dramatic (5x+) jump in speed, reset the indicator
-       more quickly. */
+    if (max_len > 50 * 1024)
+      WARNF(cLRD "Some test cases are huge (%s) - see %s/perf_tips.txt!",
+            DMS(max_len), doc_path);
+    else if (max_len > 10 * 1024)
+      WARNF("Some test cases are big (%s) - see %s/perf_tips.txt.",
+            DMS(max_len), doc_path);
 
-    if (cur_avg * 5 < avg_exec || cur_avg / 5 > avg_exec)
-      avg_exec = cur_avg;
+    if (useless_at_start && !in_bitmap)
+      WARNF(cLRD "Some test cases look useless. Consider using a smaller set.");
 
-    avg_exec = avg_exec * (1.0 - 1.0 / AVG_SMOOTHING) +
-               cur_avg * (1.0 / AVG_SMOOTHING);
+    if (queued_paths > 100)
+      WARNF(cLRD "You probably have far too many input files! Consider trimming down.");
+    else if (queued_paths > 20)
+      WARNF("You have lots of input files; try starting small.");
 
   }
 
-  last_ms = cur_ms;
-  last_execs = total_execs;
+  OKF("Here are some useful stats:\n\n"
 
-  /* Tell the callers when to contact us (as measured in execs). */
+      cGRA "    Test case count : " cRST "%u favored, %u variable, %u total\n"
+      cGRA "       Bitmap range : " cRST "%u to %u bits (average: %0.02f bits)\n"
+      cGRA "        Exec timing : " cRST "%s to %s us (average: %s us)\n",
+      queued_favored, queued_variable, queued_paths, min_bits, max_bits, 
+      ((double)total_bitmap_size) / (total_bitmap_entries ? total_bitmap_entries : 1),
+      DI(min_us), DI(max_us), DI(avg_us));
 
-  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10);
-  if (!stats_update_freq) stats_update_freq = 1;
+  if (!timeout_given) {
 
-  /* Do some bitmap stats. */
+    /* Figure out the appropriate timeout. The basic idea is: 5x average or
+       1x max, rounded up to EXEC_TM_ROUND ms and capped at 1 second.
 
-  t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+       If the program is slow, the multiplier is lowered to 2x or 3x, because
+       random scheduler jitter is less likely to have any impact, and because
+       our patience is wearing thin =) */
 
-  if (t_bytes) 
-    stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
-  else
-    stab_ratio = 100;
+    if (avg_us > 50000) exec_tmout = avg_us * 2 / 1000;
+    else if (avg_us > 10000) exec_tmout = avg_us * 3 / 1000;
+    else exec_tmout = avg_us * 5 / 1000;
 
-  /* Roughly every minute, update fuzzer stats and save auto tokens. */
+    exec_tmout = MAX(exec_tmout, max_us / 1000);
+    exec_tmout = (exec_tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
 
-  if (cur_ms - last_stats_ms > STATS_UPDATE_SEC * 1000) {
+    if (exec_tmout > EXEC_TIMEOUT) exec_tmout = EXEC_TIMEOUT;
 
-    last_stats_ms = cur_ms;
-    write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
-    save_auto();
-    write_bitmap();
+    ACTF("No -t option specified, so I'll use exec timeout of %u ms.", 
+         exec_tmout);
 
-  }
+    timeout_given = 1;
 
-  /* Every now and then, write plot data. */
+  } else if (timeout_given == 3) {
 
-  if (cur_ms - last_plot_ms > PLOT_UPDATE_SEC * 1000) {
+    ACTF("Applying timeout settings from resumed session (%u ms).", exec_tmout);
 
-    last_plot_ms = cur_ms;
-    maybe_update_plot_file(t_byte_ratio, avg_exec);
- 
   }
 
-  /* Honor AFL_EXIT_WHEN_DONE and AFL_BENCH_UNTIL_CRASH. */
+  /* In dumb mode, re-running every timing out test case with a generous time
+     limit is very expensive, so let's select a more conservative default. */
 
-  if (!dumb_mode && cycles_wo_finds > 100 && !pending_not_fuzzed &&
-      getenv("AFL_EXIT_WHEN_DONE")) stop_soon = 2;
+  if (dumb_mode && !getenv("AFL_HANG_TMOUT"))
+    hang_tmout = MIN(EXEC_TIMEOUT, exec_tmout * 2 + 100);
 
-  if (total_crashes && getenv("AFL_BENCH_UNTIL_CRASH")) stop_soon = 2;
+  OKF("All set and ready to roll!");
 
-  /* If we're not on TTY, bail out. */
+}
 
-  if (not_on_tty) return;
 
-  /* Compute some mildly useful bitmap stats. */
+/* Find first power of two greater or equal to val (assuming val under
+   2^31). */
 
-  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+static u32 next_p2(u32 val) {
 
-  /* Now, for the visuals... */
+  u32 ret = 1;
+  while (val > ret) ret <<= 1;
+  return ret;
 
-  if (clear_screen) {
+} 
 
-    SAYF(TERM_CLEAR CURSOR_HIDE);
-    clear_screen = 0;
 
-    check_term_size();
+/* Trim all new test cases to save cycles when doing deterministic checks. The
+   trimmer uses power-of-two increments somewhere between 1/16 and 1/1024 of
+   file size, to keep the stage short and sweet. */
 
-  }
+static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
-  SAYF(TERM_HOME);
+  static u8 tmp[64];
 
-  if (term_too_small) {
+  u8  needs_write = 0, fault = 0;
+  u32 trim_exec = 0;
+  u32 remove_len;
+  u32 len_p2;
 
-    SAYF(cBRI "Your terminal is too small to display the UI.\n"
-         "Please resize terminal window to at least 80x25.\n" cRST);
+  /* Although the trimmer will be less useful when variable behavior is
+     detected, it will still work to some extent, so we don't check for
+     this. */
 
-    return;
+  if (q->len < 5) return 0;
 
-  }
+  stage_name = tmp;
+  bytes_trim_in += q->len;
 
-  /* Let's start by drawing a centered banner. */
+  /* Select initial chunk len, starting with large steps. */
 
-  banner_len = (crash_mode ? 24 : 22) + strlen(VERSION) + strlen(use_banner);
-  banner_pad = (80 - banner_len) / 2;
-  memset(tmp, ' ', banner_pad); 
-  
+  len_p2 = next_p2(q->len);
 
-  sprintf(tmp + banner_pad, "%s " cLCY "Lag" cLGN
-          " (%s)",  crash_mode ? cPIN "peruvian were-rabbit" : 
-          cYEL "AgileFuzz", use_banner);  
+  remove_len = MAX(len_p2 / TRIM_START_STEPS, TRIM_MIN_BYTES);
 
+  /* Continue until the number of steps gets too high or the stepover
+     gets too small. */
 
+  while (remove_len >= MAX(len_p2 / TRIM_END_STEPS, TRIM_MIN_BYTES)) {
 
-  SAYF("\n%s\n\n", tmp);
+    u32 remove_pos = remove_len;
 
-  /* "Handy" shortcuts for drawing boxes... */
+    sprintf(tmp, "trim %s/%s", DI(remove_len), DI(remove_len));
 
-#define bSTG    bSTART cGRA
-#define bH2     bH bH
-#define bH5     bH2 bH2 bH
-#define bH10    bH5 bH5
-#define bH20    bH10 bH10
-#define bH30    bH20 bH10
-#define SP5     "     "
-#define SP10    SP5 SP5
-#define SP20    SP10 SP10
+    stage_cur = 0;
+    stage_max = q->len / remove_len;
 
-  /* Lord, forgive me this. */
+    while (remove_pos < q->len) {
 
-  SAYF(SET_G1 bSTG bLT bH bSTOP cCYA " process timing " bSTG bH30 bH5 bH2 bHB
-       bH bSTOP cCYA " overall results " bSTG bH5 bRT "\n");
+      u32 trim_avail = MIN(remove_len, q->len - remove_pos);
+      u32 cksum;
 
-  if (dumb_mode) {
+      write_with_gap(in_buf, q->len, remove_pos, trim_avail);
 
-    strcpy(tmp, cRST);
+      fault = run_target(argv, exec_tmout);
 
-  } else {
+      classify_trace();
+      trim_execs++;
 
-    u64 min_wo_finds = (cur_ms - last_path_time) / 1000 / 60;
+      if (stop_soon || fault == FAULT_ERROR) goto abort_trimming;
 
-    /* First queue cycle: don't stop now! */
-    if (queue_cycle == 1 || min_wo_finds < 15) strcpy(tmp, cMGN); else
+      /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-    /* Subsequent cycles, but we're still making finds. */
-    if (cycles_wo_finds < 25 || min_wo_finds < 30) strcpy(tmp, cYEL); else
+      cksum = hash32(trace_bits, map_size, HASH_CONST);
 
-    /* No finds for a long time and no test cases to try. */
-    if (cycles_wo_finds > 100 && !pending_not_fuzzed && min_wo_finds > 120)
-      strcpy(tmp, cLGN);
+      /* If the deletion had no impact on the trace, make it permanent. This
+         isn't perfect for variable-path inputs, but we're just making a
+         best-effort pass, so it's not a big deal if we end up with false
+         negatives every now and then. */
 
-    /* Default: cautiously OK to stop? */
-    else strcpy(tmp, cLBL);
+      if (cksum == q->exec_cksum) {
 
-  }
+        u32 move_tail = q->len - remove_pos - trim_avail;
 
-  SAYF(bV bSTOP "        run time : " cRST "%-34s " bSTG bV bSTOP
-       "  cycles done : %s%-5s  " bSTG bV "\n",
-       DTD(cur_ms, start_time), tmp, DI(queue_cycle - 1));
+        q->len -= trim_avail;
+        len_p2  = next_p2(q->len);
 
-  /* We want to warn people about not seeing new paths after a full cycle,
-     except when resuming fuzzing or running in non-instrumented mode. */
+        memmove(in_buf + remove_pos, in_buf + remove_pos + trim_avail, 
+                move_tail);
 
-  if (!dumb_mode && (last_path_time || resuming_fuzz || queue_cycle == 1 ||
-      in_bitmap || crash_mode)) {
+        /* Let's save a clean trace, which will be needed by
+           update_bitmap_score once we're done with the trimming stuff. */
 
-    SAYF(bV bSTOP "   last new path : " cRST "%-34s ",
-         DTD(cur_ms, last_path_time));
+        if (!needs_write) {
 
-  } else {
+          needs_write = 1;
+          memcpy(clean_trace, trace_bits, map_size);
 
-    if (dumb_mode)
+        }
 
-      SAYF(bV bSTOP "   last new path : " cPIN "n/a" cRST 
-           " (non-instrumented mode)        ");
+      } else remove_pos += remove_len;
 
-     else
+      /* Since this can be slow, update the screen every now and then. */
 
-      SAYF(bV bSTOP "   last new path : " cRST "none yet " cLRD
-           "(odd, check syntax!)      ");
+      if (!(trim_exec++ % stats_update_freq)) show_stats();
+      stage_cur++;
 
-  }
+    }
 
-  SAYF(bSTG bV bSTOP "  total paths : " cRST "%-5s  " bSTG bV "\n",
-       DI(queued_paths));
+    remove_len >>= 1;
 
-  /* Highlight crashes in red if found, denote going over the KEEP_UNIQUE_CRASH
-     limit with a '+' appended to the count. */
+  }
 
-  sprintf(tmp, "%s%s", DI(unique_crashes),
-          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+  /* If we have made changes to in_buf, we also need to update the on-disk
+     version of the test case. */
 
-  SAYF(bV bSTOP " last uniq crash : " cRST "%-34s " bSTG bV bSTOP
-       " uniq crashes : %s%-6s " bSTG bV "\n",
-       DTD(cur_ms, last_crash_time), unique_crashes ? cLRD : cRST,
-       tmp);
+  if (needs_write) {
 
-  sprintf(tmp, "%s%s", DI(unique_hangs),
-         (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+    s32 fd;
 
-  SAYF(bV bSTOP "  last uniq hang : " cRST "%-34s " bSTG bV bSTOP 
-       "   uniq hangs : " cRST "%-6s " bSTG bV "\n",
-       DTD(cur_ms, last_hang_time), tmp);
+    io_wait(q->io_seq);
 
-  SAYF(bVR bH bSTOP cCYA " cycle progress " bSTG bH20 bHB bH bSTOP cCYA
-       " map coverage " bSTG bH bHT bH20 bH2 bH bVL "\n");
+    unlink(q->fname); /* ignore errors */
 
-  /* This gets funny because we want to print several variable-length variables
-     together, but then cram them into a fixed-width field - so we need to
-     put them in a temporary buffer first. */
+    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
 
-  sprintf(tmp, "%s%s (%0.02f%%)", DI(current_entry),
-          queue_cur->favored ? "" : "*",
-          ((double)current_entry * 100) / queued_paths);
+    if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
 
-  SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
+    ck_write(fd, in_buf, q->len, q->fname);
+    close(fd);
 
-  sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
-          100 / MAP_SIZE, t_byte_ratio);
+    memcpy(trace_bits, clean_trace, map_size);
+    mark_trace_dirty();
+    trace_classified = 1;
+    update_bitmap_score(q);
 
-  SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
-       ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
+  } 
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(cur_skipped_paths),
-          ((double)cur_skipped_paths * 100) / queued_paths);
+abort_trimming:
 
-  SAYF(bV bSTOP " paths timed out : " cRST "%-17s " bSTG bV, tmp);
+  bytes_trim_out += q->len;
+  return fault;
 
-  sprintf(tmp, "%0.02f bits/tuple",
-          t_bytes ? (((double)t_bits) / t_bytes) : 0);
+}
 
-  SAYF(bSTOP " count coverage : " cRST "%-21s " bSTG bV "\n", tmp);
+ 
+EXP_ST u8 test_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
-  SAYF(bVR bH bSTOP cCYA " stage progress " bSTG bH20 bX bH bSTOP cCYA
-       " findings in depth " bSTG bH20 bVL "\n");
+  u8 fault;
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(queued_favored),
-          ((double)queued_favored) * 100 / queued_paths);
+  if (post_handler) {
 
-  /* Yeah... it's still going on... halp? */
+    out_buf = post_handler(out_buf, &len);
+    if (!out_buf || !len) return 0;
 
-  SAYF(bV bSTOP "  now trying : " cRST "%-21s " bSTG bV bSTOP 
-       " favored paths : " cRST "%-22s " bSTG bV "\n", stage_name, tmp);
+  }
 
-  if (!stage_max) {
+  write_to_testcase(out_buf, len);
 
-    sprintf(tmp, "%s/-", DI(stage_cur));
+  fault = run_target(argv, exec_tmout);
 
-  } else {
 
-    sprintf(tmp, "%s/%s (%0.02f%%)", DI(stage_cur), DI(stage_max),
-            ((double)stage_cur) * 100 / stage_max);
+  if (stop_soon) return 1;
 
-  }
+  if (fault == FAULT_TMOUT) {
 
-  SAYF(bV bSTOP " stage execs : " cRST "%-21s " bSTG bV bSTOP, tmp);
+    if (subseq_tmouts++ > TMOUT_LIMIT) {
+      cur_skipped_paths++;
+      return 1;
+    }
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
-          ((double)queued_with_cov) * 100 / queued_paths);
+  } else subseq_tmouts = 0;
 
-  SAYF("  new edges on : " cRST "%-22s " bSTG bV "\n", tmp);
 
-  sprintf(tmp, "%s (%s%s unique)", DI(total_crashes), DI(unique_crashes),
-          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+  /* Users can hit us with SIGUSR1 to request the current input
+     to be abandoned. */
 
-  if (crash_mode) {
+  if (skip_requested) {
 
-    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-         "   new crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
-         unique_crashes ? cLRD : cRST, tmp);
+     skip_requested = 0;
+     cur_skipped_paths++;
+     return 1;
 
-  } else {
+  }  
+ 
+  queued_discovered += test_if_interesting(argv, out_buf, len, fault);
 
-    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-         " total crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
-         unique_crashes ? cLRD : cRST, tmp);
+  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+    show_stats();
 
-  }
+  return 0;
 
-  /* Show a warning about slow execution. */
+} 
+ 
 
-  if (avg_exec < 100) {
+/* Write a modified test case, run program, process results. Handle
+   error conditions, returning 1 if it's time to bail out. This is
+   a helper function for fuzz_one(). */
 
-    sprintf(tmp, "%s/sec (%s)", DF(avg_exec), avg_exec < 20 ?
-            "zzzz..." : "slow!");
+EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
-    SAYF(bV bSTOP "  exec speed : " cLRD "%-21s ", tmp);
+  u8 fault;
 
-  } else {
+  if (post_handler) {
 
-    sprintf(tmp, "%s/sec", DF(avg_exec));
-    SAYF(bV bSTOP "  exec speed : " cRST "%-21s ", tmp);
+    out_buf = post_handler(out_buf, &len);
+    if (!out_buf || !len) return 0;
 
   }
 
-  sprintf(tmp, "%s (%s%s unique)", DI(total_tmouts), DI(unique_tmouts),
-          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+  write_to_testcase(out_buf, len);
 
-  SAYF (bSTG bV bSTOP "  total tmouts : " cRST "%-22s " bSTG bV "\n", tmp);
+  fault = run_target(argv, exec_tmout);
 
-  /* Aaaalmost there... hold on! */
 
-  SAYF(bVR bH cCYA bSTOP " fuzzing strategy yields " bSTG bH10 bH bHT bH10
-       bH5 bHB bH bSTOP cCYA " path geometry " bSTG bH5 bH2 bH bVL "\n");
+  if (stop_soon) return 1;
 
+  if (fault == FAULT_TMOUT) {
 
-  u8 skip_deterministic_new=0;
-  if (skip_deterministic_new) {
+    if (subseq_tmouts++ > TMOUT_LIMIT) {
+      cur_skipped_paths++;
+      return 1;
+    }
 
-  strcpy(tmp, "n/a, n/a, n/a"); 
+  } else subseq_tmouts = 0; 
 
-  } else {
+  /* Users can hit us with SIGUSR1 to request the current input
+     to be abandoned. */
 
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_FLIP1]), DI(stage_cycles[STAGE_FLIP1]),
-            DI(stage_finds[STAGE_FLIP2]), DI(stage_cycles[STAGE_FLIP2]),
-            DI(stage_finds[STAGE_FLIP4]), DI(stage_cycles[STAGE_FLIP4]));
+  if (skip_requested) {
 
-  } 
+     skip_requested = 0;
+     cur_skipped_paths++;
+     return 1;
 
-  SAYF(bV bSTOP "   bit flips : " cRST "%-37s " bSTG bV bSTOP "    levels : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(max_depth));
+  }  
 
-  if (!skip_deterministic_new)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_FLIP8]), DI(stage_cycles[STAGE_FLIP8]),
-            DI(stage_finds[STAGE_FLIP16]), DI(stage_cycles[STAGE_FLIP16]),
-            DI(stage_finds[STAGE_FLIP32]), DI(stage_cycles[STAGE_FLIP32]));
+  /* This handles FAULT_ERROR for us: */
+  
+  queued_discovered += save_if_interesting(argv, out_buf, len, fault);
 
-  SAYF(bV bSTOP "  byte flips : " cRST "%-37s " bSTG bV bSTOP "branch total: "
-       cRST "%-9s " bSTG bV "\n", tmp, DI(get_branch_size()));
 
-  if (!skip_deterministic_new)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            // DI(stage_finds[STAGE_ARITH8]), DI(stage_cycles[STAGE_ARITH8]),
-            DI(stage_finds[STAGE_EXTRAS_UO]), DI(stage_cycles[STAGE_EXTRAS_UO]),
-            DI(stage_finds[STAGE_ARITH16]), DI(stage_cycles[STAGE_ARITH16]),
-            DI(stage_finds[STAGE_ARITH32]), DI(stage_cycles[STAGE_ARITH32]));
+  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+    show_stats();
 
-  SAYF(bV bSTOP " arithmetics : " cRST "%-37s " bSTG bV bSTOP "  pend fav : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_favored));
+  return 0;
 
-  // SAYF(bV bSTOP "  known ints : " cRST "%-37s " bSTG bV bSTOP " branch byte : "
-  //      cRST "%-8s " bSTG bV "\n", tmp, DI(byte_deter_branch_count)); 
+}
 
-  if (!skip_deterministic_new)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_BYTE_CHANGE]), DI(stage_cycles[STAGE_BYTE_CHANGE]),
-            DI(stage_finds[STAGE_BYTE_DETE]), DI(stage_cycles[STAGE_BYTE_DETE]),
-            DI(stage_finds[STAGE_CLUSTER]), DI(stage_cycles[STAGE_CLUSTER])); 
-  
-  // sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
-  //         ((double)queued_with_cov) * 100 / queued_paths);
 
-  SAYF(bV bSTOP "  byte deter : " cRST "%-37s " bSTG bV bSTOP
-       "  laf_branch :" cRST "%0.02f%%    " bSTG bV "\n", tmp,
-        get_laf_size() );
+/* Pick the byte for a single-byte havoc tweak. While the input is as long
+   as queue_cur, a pick that queue_cur's effect map says is dead gets
+   rerolled once, which tilts havoc towards the bytes that matter. */
 
-  sprintf(tmp, "%s/%s, %s/%s",
-          DI(stage_finds[STAGE_HAVOC]), DI(stage_cycles[STAGE_HAVOC]),
-          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]));
+static inline u32 havoc_byte(u32 temp_len) {
 
-  SAYF(bV bSTOP "       havoc : " cRST "%-37s " bSTG bV bSTOP, tmp);
+  u32 pos = UR(temp_len);
 
-  if (t_bytes) sprintf(tmp, "%0.02f%%", stab_ratio);
-    else strcpy(tmp, "n/a");
+  if (queue_cur->eff && temp_len == queue_cur->len &&
+      eff_get(queue_cur, pos) == EFF_DEAD) pos = UR(temp_len);
 
-  SAYF(" stability : %s%-10s " bSTG bV "\n", (stab_ratio < 85 && var_byte_count > 40) 
-       ? cLRD : ((queued_variable && (!persistent_mode || var_byte_count > 20))
-       ? cMGN : cRST), tmp);
+  return pos;
 
-  if (!bytes_trim_out) {
+}
 
-    sprintf(tmp, "n/a, ");
 
-  } else {
+/* Try buf[pos] = vals[0] .. vals[n - 1], as a series of common_fuzz_stuff()
+   calls. When the target supports it, up to BATCH_MAX variants go out in a
+   single fork server round trip, each recording coverage into its own maps;
+   those are then copied back and judged one by one as if they had just run.
+   With stop_laf set, we stop at the first value that adds a queue entry
+   with new laf bits. Each input of a batch gets exec_tmout (see
+   handle_timeout()), and once a batch times out, the rest of the values go
+   one at a time. The number of values run, judged or not, goes to *tried.
+   buf[pos] is left modified. */
 
-    sprintf(tmp, "%0.02f%%/%s, ",
-            ((double)(bytes_trim_in - bytes_trim_out)) * 100 / bytes_trim_in,
-            DI(trim_execs));
+static u8 fuzz_byte_values(char** argv, u8* buf, u32 len, u32 pos, u8* vals,
+                           u32 n, u8 stop_laf, u32* tried) {
 
-  }
+  u32* hdr = (u32*)shm_batch;
+  u8*  maps;
+  u32  v = 0, cnt, done, i, q0;
+  u8   hung;
 
-  if (!blocks_eff_total) {
+  *tried = 0;
 
-    u8 tmp2[128];
+/* Did the value just judged open up a new laf branch? */
 
-    sprintf(tmp2, "n/a");
-    strcat(tmp, tmp2);
+#define LAF_HIT() (stop_laf && queued_paths != q0 && \
+                   queue_top->find_new_laf_branch)
 
-  } else {
+  if (!shm_batch || !hdr[0] || post_handler || dumb_mode || no_forkserver ||
+      !len || len > BATCH_DATA) goto run_singly;
 
-    u8 tmp2[128];
+  maps = shm_batch + BATCH_MAPS_OFF;
 
-    sprintf(tmp2, "%0.02f%%",
-            ((double)(blocks_eff_total - blocks_eff_select)) * 100 /
-            blocks_eff_total);
+  while (v < n) {
 
-    strcat(tmp, tmp2);
+    cnt = MIN(MIN(BATCH_MAX * MAP_SIZE / map_size, BATCH_DATA / len),
+              MIN(BATCH_MAX, n - v));
 
-  }
+    if (cnt < 2) break;
 
-  SAYF(bV bSTOP "        trim : " cRST "%-37s " bSTG bVR bH20 bH2 bH2 bRB "\n"
-       bLB bH30 bH20 bH2 bH bRB bSTOP cRST RESET_G1, tmp);
+    for (i = 0; i < cnt; i++) {
+      buf[pos] = vals[v + i];
+      memcpy(shm_batch + BATCH_HDR_SIZE + i * len, buf, len);
+      hdr[4 + i] = len;
+    }
 
-  /* Provide some CPU utilization stats. */
+    memset(maps, 0, 2 * cnt * map_size);
 
-  if (cpu_core_count) {
+    hdr[1] = batch_cnt = cnt;
+    hdr[2] = batch_seen = 0;
 
-    double cur_runnable = get_runnable_processes();
-    u32 cur_utilization = cur_runnable * 100 / cpu_core_count;
+    run_target(argv, exec_tmout);
 
-    u8* cpu_color = cCYA;
+    hdr[1] = batch_cnt = 0;
+    done   = MIN(hdr[2], cnt);
+    hung   = child_timed_out;
 
-    /* If we could still run one or more processes, use green. */
+    if (stop_soon) return 1;
 
-    if (cpu_core_count > 1 && cur_runnable + 1 <= cpu_core_count)
-      cpu_color = cLGN;
+    for (i = 0; i < done; i++) {
 
-    /* If we're clearly oversubscribed, use red. */
+      if (i) total_execs++;
 
-    if (!no_cpu_meter_red && cur_utilization >= 150) cpu_color = cLRD;
+      /* The laf touch list and the dirty line flags cover the whole batch,
+         so they are of no use for any single input; scan (and later clear)
+         both maps in full. */
 
-#ifdef HAVE_AFFINITY
+      memcpy(trace_bits, maps + 2 * i * map_size, map_size);
+      memcpy(laf_trace_bits, maps + (2 * i + 1) * map_size, map_size);
+      laf_touch[0] = LAF_TOUCH_MAX + 1;
+      mark_trace_dirty();
+      trace_classified = 0;
 
-    if (cpu_aff >= 0) {
+      buf[pos] = diff_val_byte = vals[v + i];
+      subseq_tmouts = 0;
 
-      SAYF(SP10 cGRA "[cpu%03u:%s%3u%%" cGRA "]\r" cRST, 
-           MIN(cpu_aff, 999), cpu_color,
-           MIN(cur_utilization, 999));
+      if (skip_requested) {
 
-    } else {
+         skip_requested = 0;
+         cur_skipped_paths++;
+         return 1;
 
-      SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
-           cpu_color, MIN(cur_utilization, 999));
- 
-   }
+      }
 
-#else
+      q0 = queued_paths;
+      queued_discovered += save_if_interesting(argv, buf, len, FAULT_NONE);
+      (*tried)++;
 
-    SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
-         cpu_color, MIN(cur_utilization, 999));
+      if (!(stage_cur % stats_update_freq)) show_stats();
 
-#endif /* ^HAVE_AFFINITY */
+      /* The rest of the batch has run already, but its results would only
+         be worth as much as the other values are after a hit. They still
+         count as execs. */
 
-  } else SAYF("\r");
+      if (LAF_HIT()) {
+        laf_touch[0] = LAF_TOUCH_MAX + 1;
+        total_execs += done - i - 1;
+        *tried      += done - i - 1;
+        return 0;
+      }
 
-  /* Hallelujah! */
+    }
 
-  fflush(0);
+    laf_touch[0] = LAF_TOUCH_MAX + 1;
 
-} 
+    v += done;
 
+    /* Whatever stopped the batch (crash, hang, or the loop count running
+       out) gets a run of its own. */
 
-/* Display quick statistics at the end of processing the input directory,
-   plus a bunch of warnings. Some calibration stuff also ended up here,
-   along with several hardcoded constants. Maybe clean up eventually. */
+    if (done < cnt) {
 
-static void show_init_stats(void) {
+      buf[pos] = diff_val_byte = vals[v++];
+      q0 = queued_paths;
+      if (common_fuzz_stuff(argv, buf, len)) return 1;
+      (*tried)++;
+      if (LAF_HIT()) return 0;
 
-  struct queue_entry* q = queue;
-  u32 min_bits = 0, max_bits = 0;
-  u64 min_us = 0, max_us = 0;
-  u64 avg_us = 0;
-  u32 max_len = 0;
+    }
 
-  if (total_cal_cycles) avg_us = total_cal_us / total_cal_cycles;
+    /* Values that hang tend to come in runs; don't pay for a batch and a
+       single run for each. */
 
-  while (q) {
+    if (hung) break;
 
-    if (!min_us || q->exec_us < min_us) min_us = q->exec_us;
-    if (q->exec_us > max_us) max_us = q->exec_us;
+  }
 
-    if (!min_bits || q->bitmap_size < min_bits) min_bits = q->bitmap_size;
-    if (q->bitmap_size > max_bits) max_bits = q->bitmap_size;
+run_singly:
 
-    if (q->len > max_len) max_len = q->len;
+  for (; v < n; v++) {
 
-    q = q->next;
+    buf[pos] = diff_val_byte = vals[v];
+    q0 = queued_paths;
+    if (common_fuzz_stuff(argv, buf, len)) return 1;
+    (*tried)++;
+    if (LAF_HIT()) return 0;
 
   }
 
-  SAYF("\n");
+#undef LAF_HIT
 
-  if (avg_us > (qemu_mode ? 50000 : 10000)) 
-    WARNF(cLRD "The target binary is pretty slow! See %s/perf_tips.txt.",
-          doc_path);
+  return 0;
 
-  /* Let's keep things moving with slow binaries. */
+}
 
-  if (avg_us > 50000) havoc_div = 10;     /* 0-19 execs/sec   */
-  else if (avg_us > 20000) havoc_div = 5; /* 20-49 execs/sec  */
-  else if (avg_us > 10000) havoc_div = 2; /* 50-100 execs/sec */
 
-  if (!resuming_fuzz) {
+/* The byte_ascii stage: find a value for buf[pos] that gets further than
+   the current one. Rather than sweep first .. last in order, we start with
+   the values most likely to matter there: the next byte of any dictionary
+   token that the preceding bytes spell out, the bytes of the compare
+   operands logged by the cmplog stage, the other token bytes, the values
+   other queue entries have at this offset, and the values in the same
+   ASCII class as the current one. The rest of first .. last follows, unless
+   sweeps at this offset have kept coming up empty. When laf_class says the
+   byte goes to a compare or string compare, there is only one value to
+   find, and we stop as soon as a value opens up a new laf branch; switches
+   can have several, so for those we keep going. Bytes that queue_cur's
+   effect map says are dead are skipped, and bytes known to reach laf
+   compares always get the full sweep. buf[pos] is restored; the number of
+   execs goes to *execs. */
+
+static u8 fuzz_byte_adaptive(char** argv, u8* buf, u32 len, u32 pos,
+                             u32 first, u32 last, u8 laf_class, u32* execs) {
+
+  u8  vals[256], picked[256] = { 0 }, orig = buf[pos], stop_laf, full,
+      eff = eff_get(queue_cur, pos);
+  u32 n = 0, tried, i, j, k, orig_paths = queued_paths;
+  u64 orig_hit_cnt = queued_paths + unique_crashes;
+
+  *execs = 0;
+
+  if (eff == EFF_DEAD) {
+    eff_skipped++;
+    return 0;
+  }
+
+#define PICK(_v) do { \
+    u8 _b = (_v); \
+    if (_b >= first && _b <= last && _b != orig && !picked[_b]) { \
+      picked[_b] = 1; vals[n++] = _b; \
+    } \
+  } while (0)
 
-    if (max_len > 50 * 1024)
-      WARNF(cLRD "Some test cases are huge (%s) - see %s/perf_tips.txt!",
-            DMS(max_len), doc_path);
-    else if (max_len > 10 * 1024)
-      WARNF("Some test cases are big (%s) - see %s/perf_tips.txt.",
-            DMS(max_len), doc_path);
+  for (i = 0; i < extras_cnt + a_extras_cnt; i++) {
 
-    if (useless_at_start && !in_bitmap)
-      WARNF(cLRD "Some test cases look useless. Consider using a smaller set.");
+    struct extra_data* e = i < extras_cnt ? &extras[i] : &a_extras[i - extras_cnt];
 
-    if (queued_paths > 100)
-      WARNF(cLRD "You probably have far too many input files! Consider trimming down.");
-    else if (queued_paths > 20)
-      WARNF("You have lots of input files; try starting small.");
+    for (k = 1; k < e->len && k <= pos; k++)
+      if (!memcmp(buf + pos - k, e->data, k)) PICK(e->data[k]);
 
   }
 
-  OKF("Here are some useful stats:\n\n"
-
-      cGRA "    Test case count : " cRST "%u favored, %u variable, %u total\n"
-      cGRA "       Bitmap range : " cRST "%u to %u bits (average: %0.02f bits)\n"
-      cGRA "        Exec timing : " cRST "%s to %s us (average: %s us)\n",
-      queued_favored, queued_variable, queued_paths, min_bits, max_bits, 
-      ((double)total_bitmap_size) / (total_bitmap_entries ? total_bitmap_entries : 1),
-      DI(min_us), DI(max_us), DI(avg_us));
-
-  if (!timeout_given) {
+  if (cmplog) {
 
-    /* Figure out the appropriate timeout. The basic idea is: 5x average or
-       1x max, rounded up to EXEC_TM_ROUND ms and capped at 1 second.
+    u32 cnt = MIN(cmplog->cnt, CMPLOG_MAX);
 
-       If the program is slow, the multiplier is lowered to 2x or 3x, because
-       random scheduler jitter is less likely to have any impact, and because
-       our patience is wearing thin =) */
+    for (i = 0; i < cnt; i++) {
 
-    if (avg_us > 50000) exec_tmout = avg_us * 2 / 1000;
-    else if (avg_us > 10000) exec_tmout = avg_us * 3 / 1000;
-    else exec_tmout = avg_us * 5 / 1000;
+      struct cmplog_entry* e = &cmplog->log[i];
 
-    exec_tmout = MAX(exec_tmout, max_us / 1000);
-    exec_tmout = (exec_tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
+      for (j = 0; j < 2; j++)
+        for (k = 0; k < e->size && k < CMPLOG_BUF; k++) PICK(e->op[j][k]);
 
-    if (exec_tmout > EXEC_TIMEOUT) exec_tmout = EXEC_TIMEOUT;
+    }
 
-    ACTF("No -t option specified, so I'll use exec timeout of %u ms.", 
-         exec_tmout);
+  }
 
-    timeout_given = 1;
+  for (i = 0; i < extras_cnt + a_extras_cnt; i++) {
 
-  } else if (timeout_given == 3) {
+    struct extra_data* e = i < extras_cnt ? &extras[i] : &a_extras[i - extras_cnt];
 
-    ACTF("Applying timeout settings from resumed session (%u ms).", exec_tmout);
+    for (k = 0; k < e->len; k++) PICK(e->data[k]);
 
   }
 
-  /* In dumb mode, re-running every timing out test case with a generous time
-     limit is very expensive, so let's select a more conservative default. */
+  if (pos < BYTE_SEEN_MAX)
+    for (k = 0; k < 256; k++)
+      if (byte_seen[pos][k >> 3] & (1 << (k & 7))) PICK(k);
 
-  if (dumb_mode && !getenv("AFL_HANG_TMOUT"))
-    hang_tmout = MIN(EXEC_TIMEOUT, exec_tmout * 2 + 100);
+  for (k = 0; k < 256; k++) {
 
-  OKF("All set and ready to roll!");
+    if (isdigit(orig) ? isdigit(k) :
+        isalpha(orig) ? isalpha(k) :
+        ispunct(orig) ? ispunct(k) :
+        isspace(orig) ? isspace(k) : 0) PICK(k);
 
-}
+  }
 
+  full = pos >= BYTE_SEEN_MAX || byte_idle[pos] < BYTE_IDLE_MAX ||
+         eff == EFF_LAF;
 
-/* Find first power of two greater or equal to val (assuming val under
-   2^31). */
+  if (full)
+    for (k = first; k <= last; k++) PICK(k);
 
-static u32 next_p2(u32 val) {
+#undef PICK
 
-  u32 ret = 1;
-  while (val > ret) ret <<= 1;
-  return ret;
+  stop_laf = laf_class && laf_class != 0b1;
 
-} 
+  if (fuzz_byte_values(argv, buf, len, pos, vals, n, stop_laf, &tried))
+    return 1;
 
+  buf[pos] = orig;
+  *execs   = tried;
 
-/* Trim all new test cases to save cycles when doing deterministic checks. The
-   trimmer uses power-of-two increments somewhere between 1/16 and 1/1024 of
-   file size, to keep the stage short and sweet. */
+  if (queued_paths != orig_paths)
+    eff_note(queue_cur, pos, queue_top->find_new_laf_branch ? EFF_LAF : EFF_PATH);
 
-static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
+  if (pos < BYTE_SEEN_MAX) {
 
-  static u8 tmp[64];
-  static u8 clean_trace[MAP_SIZE];
+    if (queued_paths + unique_crashes != orig_hit_cnt) byte_idle[pos] = 0;
+    else if (full && byte_idle[pos] < 255) byte_idle[pos]++;
 
-  u8  needs_write = 0, fault = 0;
-  u32 trim_exec = 0;
-  u32 remove_len;
-  u32 len_p2;
+  }
 
-  /* Although the trimmer will be less useful when variable behavior is
-     detected, it will still work to some extent, so we don't check for
-     this. */
+  byte_execs_saved += last - first + 1 - tried;
 
-  if (q->len < 5) return 0;
+  return 0;
 
-  stage_name = tmp;
-  bytes_trim_in += q->len;
+}
 
-  /* Select initial chunk len, starting with large steps. */
 
-  len_p2 = next_p2(q->len);
+/* Cmplog stage helpers. Patches already tried for the current entry are
+   remembered in a small hash set, so that a value compared in many places
+   (or against several switch cases at the same spot) costs one exec. */
 
-  remove_len = MAX(len_p2 / TRIM_START_STEPS, TRIM_MIN_BYTES);
+static u32 cmplog_tried[CMPLOG_MAX_EXECS * 2];
 
-  /* Continue until the number of steps gets too high or the stepover
-     gets too small. */
+static u8 cmplog_new_patch(u32 pos, u8* val, u32 n) {
 
-  while (remove_len >= MAX(len_p2 / TRIM_END_STEPS, TRIM_MIN_BYTES)) {
+  /* hash32() only looks at whole 64-bit words. */
 
-    u32 remove_pos = remove_len;
+  u32 key[2 + CMPLOG_BUF / 4] = { pos, n }, h, i;
 
-    sprintf(tmp, "trim %s/%s", DI(remove_len), DI(remove_len));
+  memcpy(key + 2, val, n);
 
-    stage_cur = 0;
-    stage_max = q->len / remove_len;
+  h = hash32(key, sizeof(key), HASH_CONST) | 1;
+  i = h % (CMPLOG_MAX_EXECS * 2);
 
-    while (remove_pos < q->len) {
+  while (cmplog_tried[i]) {
+    if (cmplog_tried[i] == h) return 0;
+    i = (i + 1) % (CMPLOG_MAX_EXECS * 2);
+  }
 
-      u32 trim_avail = MIN(remove_len, q->len - remove_pos);
-      u32 cksum;
+  cmplog_tried[i] = h;
+  return 1;
 
-      write_with_gap(in_buf, q->len, remove_pos, trim_avail);
+}
 
-      fault = run_target(argv, exec_tmout);
-      trim_execs++;
 
-      if (stop_soon || fault == FAULT_ERROR) goto abort_trimming;
+/* Write n bytes of val at pos, run the target, and put the old bytes back.
+   Returns 1 if the entry should be abandoned, 2 if the stage has used up its
+   exec budget. */
 
-      /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
+static u8 cmplog_try(char** argv, u8* buf, u32 len, u32 pos, u8* val, u32 n) {
 
-      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  u8 saved[CMPLOG_BUF];
 
-      /* If the deletion had no impact on the trace, make it permanent. This
-         isn't perfect for variable-path inputs, but we're just making a
-         best-effort pass, so it's not a big deal if we end up with false
-         negatives every now and then. */
+  if (stage_cur >= CMPLOG_MAX_EXECS) return 2;
 
-      if (cksum == q->exec_cksum) {
+  if (!memcmp(buf + pos, val, n) || !cmplog_new_patch(pos, val, n)) return 0;
 
-        u32 move_tail = q->len - remove_pos - trim_avail;
+  memcpy(saved, buf + pos, n);
+  memcpy(buf + pos, val, n);
 
-        q->len -= trim_avail;
-        len_p2  = next_p2(q->len);
+  stage_cur_byte  = pos;
+  stage_cur_count = n;
 
-        memmove(in_buf + remove_pos, in_buf + remove_pos + trim_avail, 
-                move_tail);
+  if (common_fuzz_stuff(argv, buf, len)) return 1;
 
-        /* Let's save a clean trace, which will be needed by
-           update_bitmap_score once we're done with the trimming stuff. */
+  memcpy(buf + pos, saved, n);
+  stage_cur++;
 
-        if (!needs_write) {
+  return 0;
 
-          needs_write = 1;
-          memcpy(clean_trace, trace_bits, MAP_SIZE);
+}
 
-        }
 
-      } else remove_pos += remove_len;
+/* Look for one operand of an integer compare in the input, as a value of
+   the compare's width in either byte order, and put the other operand (and
+   the values right next to it) in its place. Operands of 0 or ~0 would
+   match all over most inputs, so we leave those to the other stages. */
 
-      /* Since this can be slow, update the screen every now and then. */
+static u8 cmplog_ins(char** argv, u8* buf, u32 len, u64 pattern, u64 repl,
+                     u32 size) {
 
-      if (!(trim_exec++ % stats_update_freq)) show_stats();
-      stage_cur++;
+  u64 mask = size == 8 ? ~0ULL : (1ULL << (size * 8)) - 1, v;
+  u8  pat_le[8], pat_be[8], val[8];
+  u32 pos, i;
+  s32 d;
+  u8  r;
 
-    }
+  pattern &= mask;
 
-    remove_len >>= 1;
+  if (!pattern || pattern == mask || size > len) return 0;
 
+  for (i = 0; i < size; i++) {
+    pat_le[i] = pattern >> (i * 8);
+    pat_be[size - 1 - i] = pat_le[i];
   }
 
-  /* If we have made changes to in_buf, we also need to update the on-disk
-     version of the test case. */
-
-  if (needs_write) {
+  for (pos = 0; pos <= len - size; pos++) {
 
-    s32 fd;
+    u8 le = !memcmp(buf + pos, pat_le, size),
+       be = !memcmp(buf + pos, pat_be, size);
 
-    unlink(q->fname); /* ignore errors */
+    if (!le && !be) continue;
 
-    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    for (d = 0; d <= 2; d++) {
 
-    if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
+      v = (repl + (d == 1 ? 1 : d == 2 ? -1 : 0)) & mask;
 
-    ck_write(fd, in_buf, q->len, q->fname);
-    close(fd);
+      for (i = 0; i < size; i++) {
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
-    update_bitmap_score(q);
+        u8 b = v >> (i * 8);
 
-  } 
+        if (be) val[size - 1 - i] = b; else val[i] = b;
 
-abort_trimming:
+      }
 
-  bytes_trim_out += q->len;
-  return fault;
+      if ((r = cmplog_try(argv, buf, len, pos, val, size))) return r;
 
-}
+      /* A palindromic pattern matches both ways; try the other order too. */
 
- 
-EXP_ST u8 test_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
+      if (le && be) {
 
-  u8 fault;
+        for (i = 0; i < size; i++) val[i] = v >> (i * 8);
+        if ((r = cmplog_try(argv, buf, len, pos, val, size))) return r;
 
-  if (post_handler) {
+      }
 
-    out_buf = post_handler(out_buf, &len);
-    if (!out_buf || !len) return 0;
+    }
 
   }
 
-  write_to_testcase(out_buf, len);
+  return 0;
 
-  fault = run_target(argv, exec_tmout);
+}
 
 
-  if (stop_soon) return 1;
+/* Same for memory compares: wherever the input holds at least the first
+   two bytes of one buffer, write out the other one. */
 
-  if (fault == FAULT_TMOUT) {
+static u8 cmplog_rtn(char** argv, u8* buf, u32 len, u8* pattern, u8* repl,
+                     u32 size) {
 
-    if (subseq_tmouts++ > TMOUT_LIMIT) {
-      cur_skipped_paths++;
-      return 1;
-    }
+  u32 pos, n;
+  u8  r;
 
-  } else subseq_tmouts = 0;
+  for (pos = 0; pos + 2 <= len; pos++) {
 
+    if (buf[pos] != pattern[0] || buf[pos + 1] != pattern[1]) continue;
 
-  /* Users can hit us with SIGUSR1 to request the current input
-     to be abandoned. */
+    n = MIN(size, len - pos);
 
-  if (skip_requested) {
+    if ((r = cmplog_try(argv, buf, len, pos, repl, n))) return r;
 
-     skip_requested = 0;
-     cur_skipped_paths++;
-     return 1;
+  }
 
-  }  
- 
-  queued_discovered += test_if_interesting(argv, out_buf, len, fault);
+  return 0;
 
-  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
-    show_stats();
+}
 
-  return 0;
 
-} 
- 
+/* The cmplog stage: run the entry once with the comparison log switched
+   on, then patch every logged operand found in the input with the value it
+   was compared against. This gets past magic numbers and checksums in a
+   handful of execs, where byte_ascii would need 256 per byte. Returns 1 if
+   the entry should be abandoned. */
 
-/* Write a modified test case, run program, process results. Handle
-   error conditions, returning 1 if it's time to bail out. This is
-   a helper function for fuzz_one(). */
+static u8 cmplog_stage(char** argv, u8* buf, u32 len) {
 
-EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
+  u64 orig_hit_cnt = queued_paths + unique_crashes;
+  u32 i, cnt;
+  u8  r = 0;
 
-  u8 fault;
+  if (!len) return 0;
 
-  if (post_handler) {
+  memset(cmplog->hits, 0, CMPLOG_IDS);
+  cmplog->cnt = 0;
+  cmplog->on  = 1;
 
-    out_buf = post_handler(out_buf, &len);
-    if (!out_buf || !len) return 0;
+  write_to_testcase(buf, len);
+  run_target(argv, exec_tmout);
 
-  }
+  cmplog->on = 0;
 
-  write_to_testcase(out_buf, len);
+  if (stop_soon) return 1;
 
-  fault = run_target(argv, exec_tmout);
+  cnt = MIN(cmplog->cnt, CMPLOG_MAX);
+  if (!cnt) return 0;
 
+  stage_short = "cmplog";
+  stage_name  = "cmplog";
+  stage_cur   = 0;
+  stage_max   = MIN(cnt * 6, CMPLOG_MAX_EXECS);
+  stage_cur_byte = -1;
+  stage_val_type = STAGE_VAL_NONE;
 
-  if (stop_soon) return 1;
+  memset(cmplog_tried, 0, sizeof(cmplog_tried));
 
-  if (fault == FAULT_TMOUT) {
+  for (i = 0; i < cnt && !r; i++) {
 
-    if (subseq_tmouts++ > TMOUT_LIMIT) {
-      cur_skipped_paths++;
-      return 1;
-    }
+    struct cmplog_entry* e = &cmplog->log[i];
 
-  } else subseq_tmouts = 0; 
+    if (e->type == CMPLOG_INS) {
 
-  /* Users can hit us with SIGUSR1 to request the current input
-     to be abandoned. */
+      u64 a, b;
 
-  if (skip_requested) {
+      if (e->size != 2 && e->size != 4 && e->size != 8) continue;
 
-     skip_requested = 0;
-     cur_skipped_paths++;
-     return 1;
+      memcpy(&a, e->op[0], sizeof(u64));
+      memcpy(&b, e->op[1], sizeof(u64));
 
-  }  
+      r = cmplog_ins(argv, buf, len, a, b, e->size);
+      if (!r) r = cmplog_ins(argv, buf, len, b, a, e->size);
 
-  /* This handles FAULT_ERROR for us: */
-  
-  queued_discovered += save_if_interesting(argv, out_buf, len, fault);
+    } else if (e->type == CMPLOG_RTN) {
 
+      if (e->size < 2 || e->size > CMPLOG_BUF) continue;
 
-  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
-    show_stats();
+      r = cmplog_rtn(argv, buf, len, e->op[0], e->op[1], e->size);
+      if (!r) r = cmplog_rtn(argv, buf, len, e->op[1], e->op[0], e->size);
 
-  return 0;
+    }
+
+  }
+
+  stage_finds[STAGE_CMPLOG]  += queued_paths + unique_crashes - orig_hit_cnt;
+  stage_cycles[STAGE_CMPLOG] += stage_cur;
+
+  stage_cur_byte  = -1;
+  stage_cur_count = 0;
+
+  return r == 1;
 
 }
 
@@ -5616,299 +7812,476 @@ static u32 choose_block_len(u32 limit) {
 } 
 
 
-/* Calculate case desirability score to adjust the length of havoc fuzzing.
-   A helper function for fuzz_one(). Maybe some of these constants should
-   go into config.h. */
+/* Flip bit _b of array _ar. */
 
-static u32 calculate_score(struct queue_entry* q) {
+#define FLIP_BIT(_ar, _b) do { \
+    u8* _arf = (u8*)(_ar); \
+    u32 _bf = (_b); \
+    _arf[(_bf) >> 3] ^= (128 >> ((_bf) & 7)); \
+  } while (0)
 
-  u32 avg_exec_us = total_cal_us / total_cal_cycles;
-  u32 avg_bitmap_size = total_bitmap_size / total_bitmap_entries;
-  u32 perf_score = 100;
 
-  /* Adjust score based on execution speed of this path, compared to the
-     global average. Multiplier ranges from 0.1x to 3x. Fast inputs are
-     less expensive to fuzz, so we're giving them more air time. */
+/* Havoc mutators. Each takes the buffer and its length and returns the new
+   length; the ones that grow the buffer replace it. havoc_ops[] makes sure
+   that len is at least min_len, and that there are extras for the ones that
+   need them. */
 
-  if (q->exec_us * 0.1 > avg_exec_us) perf_score = 10;
-  else if (q->exec_us * 0.25 > avg_exec_us) perf_score = 25;
-  else if (q->exec_us * 0.5 > avg_exec_us) perf_score = 50;
-  else if (q->exec_us * 0.75 > avg_exec_us) perf_score = 75;
-  else if (q->exec_us * 4 < avg_exec_us) perf_score = 300;
-  else if (q->exec_us * 3 < avg_exec_us) perf_score = 200;
-  else if (q->exec_us * 2 < avg_exec_us) perf_score = 150;
+static u32 havoc_flip1(u8** bufp, u32 len) {
 
-  /* Adjust score based on bitmap size. The working theory is that better
-     coverage translates to better targets. Multiplier from 0.25x to 3x. */ 
- 
-  int q_score=q->extra_edge_num; 
+  /* Flip a single bit somewhere. Spooky! */
 
-  perf_score*=(0.2*log2(q_score+1)+0.2);    
+  FLIP_BIT(*bufp, (havoc_byte(len) << 3) + UR(8));
+  return len;
 
-  if (q->handicap >= 4) {
+}
 
-    perf_score *= 4;
-    q->handicap -= 4;
+static u32 havoc_int8(u8** bufp, u32 len) {
 
-  } else if (q->handicap) {
+  /* Set byte to interesting value. */
 
-    perf_score *= 2;
-    q->handicap--;
+  (*bufp)[havoc_byte(len)] = interesting_8[UR(sizeof(interesting_8))];
+  return len;
 
-  }  
+}
 
-  switch (q->depth) {
+static u32 havoc_int16(u8** bufp, u32 len) {
 
-    case 0 ... 3:   break;
-    case 4 ... 7:   perf_score *= 2; break;
-    case 8 ... 13:  perf_score *= 3; break;
-    case 14 ... 25: perf_score *= 4; break;
-    default:        perf_score *= 5;
+  /* Set word to interesting value, randomly choosing endian. */
+
+  u16 v = interesting_16[UR(sizeof(interesting_16) >> 1)];
+
+  *(u16*)(*bufp + UR(len - 1)) = UR(2) ? v : SWAP16(v);
+  return len;
+
+}
+
+static u32 havoc_int32(u8** bufp, u32 len) {
+
+  /* Set dword to interesting value, randomly choosing endian. */
+
+  u32 v = interesting_32[UR(sizeof(interesting_32) >> 2)];
+
+  *(u32*)(*bufp + UR(len - 3)) = UR(2) ? v : SWAP32(v);
+  return len;
+
+}
+
+static u32 havoc_arith8(u8** bufp, u32 len) {
+
+  /* Randomly subtract from or add to byte. */
+
+  u8 num = 1 + UR(ARITH_MAX);
+
+  if (UR(2)) (*bufp)[havoc_byte(len)] -= num;
+  else (*bufp)[havoc_byte(len)] += num;
+
+  return len;
+
+}
+
+static u32 havoc_arith16(u8** bufp, u32 len) {
+
+  /* Randomly subtract from or add to word, random endian. */
+
+  u16* p   = (u16*)(*bufp + UR(len - 1));
+  u16  num = 1 + UR(ARITH_MAX);
+
+  if (UR(2)) num = -num;
+
+  if (UR(2)) *p += num;
+  else *p = SWAP16(SWAP16(*p) + num);
+
+  return len;
+
+}
+
+static u32 havoc_arith32(u8** bufp, u32 len) {
+
+  /* Randomly subtract from or add to dword, random endian. */
+
+  u32* p   = (u32*)(*bufp + UR(len - 3));
+  u32  num = 1 + UR(ARITH_MAX);
+
+  if (UR(2)) num = -num;
+
+  if (UR(2)) *p += num;
+  else *p = SWAP32(SWAP32(*p) + num);
+
+  return len;
+
+}
+
+static u32 havoc_rand8(u8** bufp, u32 len) {
+
+  /* Just set a random byte to a random value. Because,
+     why not. We use XOR with 1-255 to eliminate the
+     possibility of a no-op. */
+
+  (*bufp)[havoc_byte(len)] ^= 1 + UR(255);
+  return len;
+
+}
+
+static u32 havoc_delete(u8** bufp, u32 len) {
+
+  /* Delete bytes. This has twice the weight of insertion (the next
+     option) in hopes of keeping files reasonably small. Don't delete
+     too much. */
+
+  u32 del_len  = choose_block_len(len - 1),
+      del_from = UR(len - del_len + 1);
+
+  memmove(*bufp + del_from, *bufp + del_from + del_len,
+          len - del_from - del_len);
+
+  return len - del_len;
+
+}
+
+static u32 havoc_clone(u8** bufp, u32 len) {
+
+  /* Clone bytes (75%) or insert a block of constant bytes (25%). */
+
+  u8* buf = *bufp;
+  u8  actually_clone = UR(4);
+  u32 clone_from, clone_to, clone_len;
+  u8* new_buf;
+
+  if (len + HAVOC_BLK_XL >= MAX_FILE) return len;
+
+  if (actually_clone) {
+
+    clone_len  = choose_block_len(len);
+    clone_from = UR(len - clone_len + 1);
+
+  } else {
+
+    clone_len = choose_block_len(HAVOC_BLK_XL);
+    clone_from = 0;
 
   }
 
-  /* Make sure that we don't go over limit. */
+  clone_to = UR(len);
 
-  if (perf_score > HAVOC_MAX_MULT * 100) perf_score = HAVOC_MAX_MULT * 100;
+  new_buf = ck_alloc_nozero(len + clone_len);
 
-  return perf_score;
+  /* Head */
+
+  memcpy(new_buf, buf, clone_to);
+
+  /* Inserted part */
+
+  if (actually_clone)
+    memcpy(new_buf + clone_to, buf + clone_from, clone_len);
+  else
+    memset(new_buf + clone_to, UR(2) ? UR(256) : buf[UR(len)], clone_len);
+
+  /* Tail */
+
+  memcpy(new_buf + clone_to + clone_len, buf + clone_to, len - clone_to);
+
+  ck_free(buf);
+  *bufp = new_buf;
+
+  return len + clone_len;
 
 }
 
+static u32 havoc_overwrite(u8** bufp, u32 len) {
 
-/* Helper function to see if a particular change (xor_val = old ^ new) could
-   be a product of deterministic bit flips with the lengths and stepovers
-   attempted by afl-fuzz. This is used to avoid dupes in some of the
-   deterministic fuzzing operations that follow bit flips. We also
-   return 1 if xor_val is zero, which implies that the old and attempted new
-   values are identical and the exec would be a waste of time. */
+  /* Overwrite bytes with a randomly selected chunk (75%) or fixed
+     bytes (25%). */
 
-static u8 could_be_bitflip(u32 xor_val) {
+  u8* buf = *bufp;
+  u32 copy_len  = choose_block_len(len - 1),
+      copy_from = UR(len - copy_len + 1),
+      copy_to   = UR(len - copy_len + 1);
 
-  u32 sh = 0;
+  if (UR(4)) {
 
-  if (!xor_val) return 1;
+    if (copy_from != copy_to)
+      memmove(buf + copy_to, buf + copy_from, copy_len);
 
-  /* Shift left until first bit set. */
+  } else memset(buf + copy_to, UR(2) ? UR(256) : buf[UR(len)], copy_len);
 
-  while (!(xor_val & 1)) { sh++; xor_val >>= 1; }
+  return len;
 
-  /* 1-, 2-, and 4-bit patterns are OK anywhere. */
+}
 
-  if (xor_val == 1 || xor_val == 3 || xor_val == 15) return 1;
+/* Pick a dictionary token: an auto-detected one if there are no
+   user-specified ones or if the odds say so, else a user-specified one. */
 
-  /* 8-, 16-, and 32-bit patterns are OK only if shift factor is
-     divisible by 8, since that's the stepover for these ops. */
+static struct extra_data* havoc_extra(void) {
 
-  if (sh & 7) return 0;
+  if (!extras_cnt || (a_extras_cnt && UR(2)))
+    return &a_extras[UR(a_extras_cnt)];
 
-  if (xor_val == 0xff || xor_val == 0xffff || xor_val == 0xffffffff)
-    return 1;
+  return &extras[UR(extras_cnt)];
 
-  return 0;
+}
+
+static u32 havoc_extra_over(u8** bufp, u32 len) {
+
+  /* Overwrite bytes with an extra. */
+
+  struct extra_data* e = havoc_extra();
+
+  if (e->len > len) return len;
+
+  memcpy(*bufp + UR(len - e->len + 1), e->data, e->len);
+  return len;
 
 }
 
+static u32 havoc_extra_ins(u8** bufp, u32 len) {
 
-/* Helper function to see if a particular value is reachable through
-   arithmetic operations. Used for similar purposes. */
+  /* Insert an extra. */
 
-static u8 could_be_arith(u32 old_val, u32 new_val, u8 blen) {
+  struct extra_data* e = havoc_extra();
+  u32 insert_at = UR(len + 1);
+  u8* new_buf;
 
-  u32 i, ov = 0, nv = 0, diffs = 0;
+  if (len + e->len >= MAX_FILE) return len;
 
-  if (old_val == new_val) return 1;
+  new_buf = ck_alloc_nozero(len + e->len);
 
-  /* See if one-byte adjustments to any byte could produce this result. */
+  memcpy(new_buf, *bufp, insert_at);
+  memcpy(new_buf + insert_at, e->data, e->len);
+  memcpy(new_buf + insert_at + e->len, *bufp + insert_at, len - insert_at);
 
-  for (i = 0; i < blen; i++) {
+  ck_free(*bufp);
+  *bufp = new_buf;
 
-    u8 a = old_val >> (8 * i),
-       b = new_val >> (8 * i);
+  return len + e->len;
 
-    if (a != b) { diffs++; ov = a; nv = b; }
+}
 
-  }
 
-  /* If only one byte differs and the values are within range, return 1. */
+/* The havoc mutator table. Operators are picked with probability
+   proportional to their weight, which starts out at 'base' (giving the
+   same odds as the old hardcoded switch) and is then adjusted every
+   HAVOC_ADAPT_EXECS havoc execs by how productive each operator has been
+   per unit of 'cost', a rough measure of the CPU time it takes. The ones
+   that need extras go last, so that they can simply be left out of the
+   draw when there are none. */
 
-  if (diffs == 1) {
+struct havoc_op {
 
-    if ((u8)(ov - nv) <= ARITH_MAX ||
-        (u8)(nv - ov) <= ARITH_MAX) return 1;
+  u8* name;                           /* Name for fuzzer_stats            */
+  u32 (*fn)(u8**, u32);               /* Mutator                          */
+  u32 min_len;                        /* Skipped on shorter inputs        */
+  u8  needs_extras;                   /* Needs dictionary tokens          */
+  u8  cost;                           /* Relative cost per use            */
+  u32 base;                           /* Starting weight                  */
 
-  }
+};
 
-  if (blen == 1) return 0;
+static struct havoc_op havoc_ops[] = {
+
+  { "flip1",      havoc_flip1,      1, 0, 1, 16 },
+  { "int8",       havoc_int8,       1, 0, 1, 16 },
+  { "int16",      havoc_int16,      2, 0, 1, 16 },
+  { "int32",      havoc_int32,      4, 0, 1, 16 },
+  { "arith8",     havoc_arith8,     1, 0, 1, 32 },
+  { "arith16",    havoc_arith16,    2, 0, 1, 32 },
+  { "arith32",    havoc_arith32,    4, 0, 1, 32 },
+  { "rand8",      havoc_rand8,      1, 0, 1, 16 },
+  { "delete",     havoc_delete,     2, 0, 2, 32 },
+  { "clone",      havoc_clone,      1, 0, 4, 16 },
+  { "overwrite",  havoc_overwrite,  2, 0, 2, 16 },
+  { "extra_over", havoc_extra_over, 1, 1, 1, 16 },
+  { "extra_ins",  havoc_extra_ins,  1, 1, 4, 16 },
 
-  /* See if two-byte adjustments to any byte would produce this result. */
+};
 
-  diffs = 0;
+#define HAVOC_OPS       (sizeof(havoc_ops) / sizeof(struct havoc_op))
+#define HAVOC_OPS_PLAIN (HAVOC_OPS - 2)
 
-  for (i = 0; i < blen / 2; i++) {
+static u32 havoc_cum[HAVOC_OPS];      /* Running sums of the weights      */
 
-    u16 a = old_val >> (16 * i),
-        b = new_val >> (16 * i);
+static u64 havoc_uses[HAVOC_OPS],     /* Havoc execs each op was part of  */
+           havoc_finds[HAVOC_OPS];    /* ...and finds credited to it      */
 
-    if (a != b) { diffs++; ov = a; nv = b; }
+static u32 havoc_win_uses[HAVOC_OPS], /* Same, decayed for adaptation     */
+           havoc_win_finds[HAVOC_OPS];
 
-  }
+static u32 havoc_adapt_cnt;           /* Havoc execs since last update    */
 
-  /* If only one word differs and the values are within range, return 1. */
+static u8  havoc_fixed;               /* Don't adapt (AFL_HAVOC_FIXED)    */
 
-  if (diffs == 1) {
 
-    if ((u16)(ov - nv) <= ARITH_MAX ||
-        (u16)(nv - ov) <= ARITH_MAX) return 1;
+/* Recompute the weights. Once the window holds at least
+   HAVOC_ADAPT_MIN_FINDS finds, each operator's weight is its base weight
+   times its finds per unit of cost over the average, within a factor of
+   HAVOC_ADAPT_RANGE either way; HAVOC_ADAPT_PRIOR units of cost at the
+   average rate are thrown in to keep rarely used operators from swinging
+   wildly. Without enough finds to go by, the base weights apply. The
+   window counts are then halved, so that the weights follow the fuzzer as
+   it moves on to new territory. Also called once to set things up. */
 
-    ov = SWAP16(ov); nv = SWAP16(nv);
+static void havoc_update_weights(void) {
 
-    if ((u16)(ov - nv) <= ARITH_MAX ||
-        (u16)(nv - ov) <= ARITH_MAX) return 1;
+  u64 finds = 0, spent = 0;
+  double avg = 0;
+  u32 i, sum = 0;
 
+  for (i = 0; i < HAVOC_OPS; i++) {
+    finds += havoc_win_finds[i];
+    spent += (u64)havoc_win_uses[i] * havoc_ops[i].cost;
   }
 
-  /* Finally, let's do the same thing for dwords. */
+  if (!havoc_fixed && finds >= HAVOC_ADAPT_MIN_FINDS)
+    avg = (double)finds / spent;
 
-  if (blen == 4) {
+  for (i = 0; i < HAVOC_OPS; i++) {
 
-    if ((u32)(old_val - new_val) <= ARITH_MAX ||
-        (u32)(new_val - old_val) <= ARITH_MAX) return 1;
+    double w = havoc_ops[i].base;
 
-    new_val = SWAP32(new_val);
-    old_val = SWAP32(old_val);
+    if (avg) {
 
-    if ((u32)(old_val - new_val) <= ARITH_MAX ||
-        (u32)(new_val - old_val) <= ARITH_MAX) return 1;
+      w *= (havoc_win_finds[i] + HAVOC_ADAPT_PRIOR * avg) /
+           ((double)havoc_win_uses[i] * havoc_ops[i].cost + HAVOC_ADAPT_PRIOR) /
+           avg;
+
+      w = MIN(w, (double)havoc_ops[i].base * HAVOC_ADAPT_RANGE);
+      w = MAX(w, (double)havoc_ops[i].base / HAVOC_ADAPT_RANGE);
+
+    }
+
+    sum += MAX((u32)w, 1);
+    havoc_cum[i] = sum;
+
+    havoc_win_uses[i]  >>= 1;
+    havoc_win_finds[i] >>= 1;
 
   }
 
-  return 0;
+  havoc_adapt_cnt = 0;
 
 }
 
 
-/* Last but not least, a similar helper to see if insertion of an 
-   interesting integer is redundant given the insertions done for
-   shorter blen. The last param (check_le) is set if the caller
-   already executed LE insertion for current blen and wants to see
-   if BE variant passed in new_val is unique. */
+/* Pick a havoc operator. */
 
-static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le) {
+static inline u32 havoc_pick(void) {
 
-  u32 i, j;
+  u32 total = havoc_cum[(extras_cnt + a_extras_cnt) ? HAVOC_OPS - 1 :
+                                                      HAVOC_OPS_PLAIN - 1],
+      r = UR(total), i = 0;
 
-  if (old_val == new_val) return 1;
+  while (havoc_cum[i] <= r) i++;
 
-  /* See if one-byte insertions from interesting_8 over old_val could
-     produce new_val. */
+  return i;
 
-  for (i = 0; i < blen; i++) {
+}
 
-    for (j = 0; j < sizeof(interesting_8); j++) {
 
-      u32 tval = (old_val & ~(0xff << (i * 8))) |
-                 (((u8)interesting_8[j]) << (i * 8));
+/* Book a havoc exec that used the ops flagged in used[] and led to finds
+   new queue entries or crashes. */
 
-      if (new_val == tval) return 1;
+static void havoc_credit(u8* used, u32 finds) {
 
-    }
+  u32 i;
 
-  }
+  for (i = 0; i < HAVOC_OPS; i++) {
 
-  /* Bail out unless we're also asked to examine two-byte LE insertions
-     as a preparation for BE attempts. */
+    if (!used[i]) continue;
 
-  if (blen == 2 && !check_le) return 0;
+    havoc_uses[i]++;
+    havoc_finds[i] += finds;
+    havoc_win_uses[i]++;
+    havoc_win_finds[i] += finds;
 
-  /* See if two-byte insertions over old_val could give us new_val. */
+  }
 
-  for (i = 0; i < blen - 1; i++) {
+  if (++havoc_adapt_cnt >= HAVOC_ADAPT_EXECS) havoc_update_weights();
 
-    for (j = 0; j < sizeof(interesting_16) / 2; j++) {
+}
 
-      u32 tval = (old_val & ~(0xffff << (i * 8))) |
-                 (((u16)interesting_16[j]) << (i * 8));
 
-      if (new_val == tval) return 1;
+/* Finds and havoc execs per operator, for fuzzer_stats. */
 
-      /* Continue here only if blen > 2. */
+static void write_havoc_stats(FILE* f) {
 
-      if (blen > 2) {
+  u32 i;
 
-        tval = (old_val & ~(0xffff << (i * 8))) |
-               (SWAP16(interesting_16[j]) << (i * 8));
+  fprintf(f, "havoc_ops         :");
 
-        if (new_val == tval) return 1;
+  for (i = 0; i < HAVOC_OPS; i++)
+    fprintf(f, " %s=%llu/%llu", havoc_ops[i].name, havoc_finds[i],
+            havoc_uses[i]);
 
-      }
+  fprintf(f, "\n");
 
-    }
+}
 
-  }
 
-  if (blen == 4 && check_le) {
+/* Calculate case desirability score to adjust the length of havoc fuzzing.
+   A helper function for fuzz_one(). Maybe some of these constants should
+   go into config.h. */
 
-    /* See if four-byte insertions could produce the same result
-       (LE only). */
+static u32 calculate_score(struct queue_entry* q) {
 
-    for (j = 0; j < sizeof(interesting_32) / 4; j++)
-      if (new_val == (u32)interesting_32[j]) return 1;
+  u32 avg_exec_us = total_cal_us / total_cal_cycles;
+  u32 avg_bitmap_size = total_bitmap_size / total_bitmap_entries;
+  u32 perf_score = 100;
 
-  }
+  /* Adjust score based on execution speed of this path, compared to the
+     global average. Multiplier ranges from 0.1x to 3x. Fast inputs are
+     less expensive to fuzz, so we're giving them more air time. */
 
-  return 0;
+  if (qhot.exec_us[q->id] * 0.1 > avg_exec_us) perf_score = 10;
+  else if (qhot.exec_us[q->id] * 0.25 > avg_exec_us) perf_score = 25;
+  else if (qhot.exec_us[q->id] * 0.5 > avg_exec_us) perf_score = 50;
+  else if (qhot.exec_us[q->id] * 0.75 > avg_exec_us) perf_score = 75;
+  else if (qhot.exec_us[q->id] * 4 < avg_exec_us) perf_score = 300;
+  else if (qhot.exec_us[q->id] * 3 < avg_exec_us) perf_score = 200;
+  else if (qhot.exec_us[q->id] * 2 < avg_exec_us) perf_score = 150;
 
-}  
+  /* Adjust score based on bitmap size. The working theory is that better
+     coverage translates to better targets. Multiplier from 0.25x to 3x. */ 
+ 
+  int q_score=q->extra_edge_num; 
+
+  perf_score*=(0.2*log2(q_score+1)+0.2);    
 
-int init_diff_point(u8 *father,u8*son,u32 len1,u32 len2){
+  if (q->handicap >= 4) {
 
-  init_point(ORIGIN_POINT);
+    perf_score *= 4;
+    q->handicap -= 4;
 
-  u32 min_len=len1; 
+  } else if (q->handicap) {
 
-  if(min_len>len2)
-    min_len=len2;
-  int diff_len=0; 
+    perf_score *= 2;
+    q->handicap--;
 
-  for(int i=0;i<min_len;i++){
-    if(origin_points.size==4000){
-      return 0;
-    }
-    if(father[i]!=son[i]){
-      add_point(ORIGIN_POINT,i);
-    }
   }  
 
-  return 1;
-
-}   
+  switch (qhot.depth[q->id]) {
 
-/* Take the current entry from the queue, fuzz it for a while. This
-   function is a tad too long... returns 0 if fuzzed successfully, 1 if
-   skipped or bailed out. */
+    case 0 ... 3:   break;
+    case 4 ... 7:   perf_score *= 2; break;
+    case 8 ... 13:  perf_score *= 3; break;
+    case 14 ... 25: perf_score *= 4; break;
+    default:        perf_score *= 5;
 
-static u8 fuzz_one(char** argv) {
+  }
 
+  perf_score = sched->energy(q, perf_score);
 
-  s32 len, fd, temp_len, i, j;
-  u8  *in_buf, *out_buf,*test_buf=NULL, *orig_in,  *eff_map = 0;
-  u64 havoc_queued,  orig_hit_cnt, new_hit_cnt;
-  u32 splice_cycle = 0, perf_score = 100, orig_perf, prev_cksum, eff_cnt = 1;
+  /* Make sure that we don't go over limit. */
 
-  u8  ret_val = 1, doing_det = 0;
+  if (perf_score > HAVOC_MAX_MULT * 100) perf_score = HAVOC_MAX_MULT * 100;
 
-  u8  a_collect[MAX_AUTO_EXTRA];
-  u32 a_len = 0; 
+  return perf_score;
 
-#ifdef IGNORE_FINDS
+}
 
-  /* In IGNORE_FINDS mode, skip any entries that weren't in the
-     initial data set. */
 
-  if (queue_cur->depth > 1) return 1;
+/* Default seed selection: prefer favored, not yet fuzzed entries and skip
+   the rest with some probability. */
 
-#else
+static u8 sched_default_skip(struct queue_entry* q) {
 
   if (pending_favored) {
 
@@ -5916,16 +8289,16 @@ static u8 fuzz_one(char** argv) {
        possibly skip to them at the expense of already-fuzzed or non-favored
        cases. */
 
-    if ((queue_cur->was_fuzzed || !queue_cur->favored) &&
+    if ((qhot.was_fuzzed[q->id] || !qhot.favored[q->id]) &&
         UR(100) < SKIP_TO_NEW_PROB) return 1;
 
-  } else if (!dumb_mode && !queue_cur->favored && queued_paths > 10) {
+  } else if (!dumb_mode && !qhot.favored[q->id] && queued_paths > 10) {
 
     /* Otherwise, still possibly skip non-favored cases, albeit less often.
        The odds of skipping stuff are higher for already-fuzzed inputs and
        lower for never-fuzzed entries. */
 
-    if (queue_cycle > 1 && !queue_cur->was_fuzzed) {
+    if (queue_cycle > 1 && !qhot.was_fuzzed[q->id]) {
 
       if (UR(100) < SKIP_NFAV_NEW_PROB) return 1;
 
@@ -5936,635 +8309,722 @@ static u8 fuzz_one(char** argv) {
     }
 
   } 
- 
-  //  queue_cur->select_count+=1;
-#endif /* ^IGNORE_FINDS */
-  
 
-  if (not_on_tty) {
-    ACTF("Fuzzing test case #%u (%u total, %llu uniq crashes found)...",
-         current_entry, queued_paths, unique_crashes);
-    fflush(stdout);
-  } 
+  return 0;
 
-  /* Map the test case into memory. */
+}
 
-  fd = open(queue_cur->fname, O_RDONLY);
+static u32 sched_default_energy(struct queue_entry* q, u32 perf_score) {
 
-  if (fd < 0) PFATAL("Unable to open '%s'", queue_cur->fname);
+  return perf_score;
 
-  len = queue_cur->len;
+}
 
-  orig_in = in_buf = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+static void sched_default_new_find(struct queue_entry* q) {
 
-  if (orig_in == MAP_FAILED) PFATAL("Unable to mmap '%s'", queue_cur->fname);
+}
 
-  close(fd);
 
-  /* We could mmap() out_buf as MAP_PRIVATE, but we end up clobbering every
-     single byte anyway, so it wouldn't give us any performance or memory usage
-     benefits. */
+/* Remember the least exercised edge of a new entry; fast and rare judge the
+   entry by how often that edge has been hit since. */
 
-  out_buf = ck_alloc_nozero(len); 
+static void sched_note_rare_edge(struct queue_entry* q) {
 
-  subseq_tmouts = 0;
+  u64 best = ~0ULL;
+  u32 i;
 
-  cur_depth = queue_cur->depth;
+  for (i = 1; i < map_size; i++)
+    if (trace_bits[i] && chose_nums[i] < best) {
+      best = chose_nums[i];
+      q->rare_edge = i;
+    }
 
-  /*******************************************
-   * CALIBRATION (only if failed earlier on) *
-   *******************************************/
+}
 
-  if (queue_cur->cal_failed) {
 
-    u8 res = FAULT_TMOUT;
+/* Exponential schedule in the style of AFLFast's FAST: the energy doubles
+   every time an entry is picked, and is divided by how often its rarest
+   edge has been hit. Entries on well-trodden paths sink to HAVOC_MIN. */
 
-    if (queue_cur->cal_failed < CAL_CHANCES) {
+static u32 sched_fast_energy(struct queue_entry* q, u32 perf_score) {
 
-      res = calibrate_case(argv, queue_cur, in_buf, queue_cycle - 1, 0);
+  u64 hits = MAX(chose_nums[q->rare_edge], 1);
+  double factor = (double)(1ULL << MIN(q->fuzz_level, 16)) / hits;
 
-      if (res == FAULT_ERROR)
-        FATAL("Unable to execute target application");
+  if (factor > SCHED_MAX_FACTOR) factor = SCHED_MAX_FACTOR;
 
-    }
+  return MAX(perf_score * factor, 1);
 
-    if (stop_soon || res != crash_mode) {
-      cur_skipped_paths++;
-      goto abandon_entry;
-    }
+}
 
-  }
 
-  /************
-   * TRIMMING *
-   ************/
+/* Rare-edge schedule, after FairFuzz: an edge is rare if its hit count is
+   at most the smallest power of two not below the lowest hit count of any
+   covered edge. min_chose_nums holds that cutoff. */
 
-  memcpy(out_buf, in_buf, len);
-  if (!dumb_mode && !queue_cur->trim_done) {
+static void update_rare_cutoff(void) {
 
-    u8 res = trim_case(argv, queue_cur, in_buf);
+  u64 lowest = ~0ULL;
+  u32 i;
 
-    if (res == FAULT_ERROR)
-      FATAL("Unable to execute target application");
+  for (i = 1; i < map_size; i++)
+    if (chose_nums[i] && chose_nums[i] < lowest) lowest = chose_nums[i];
 
-    if (stop_soon) {
-      cur_skipped_paths++;
-      goto abandon_entry;
-    }
+  min_chose_nums = 1;
+  while (min_chose_nums < lowest && min_chose_nums < (1ULL << 63))
+    min_chose_nums <<= 1;
 
-    /* Don't retry trimming, even if it failed. */
+}
 
-    queue_cur->trim_done = 1;
+static u8 sched_rare_skip(struct queue_entry* q) {
 
-    if (len != queue_cur->len) len = queue_cur->len;
+  update_rare_cutoff();
+
+  if (chose_nums[q->rare_edge] <= min_chose_nums) return 0;
+
+  return sched_default_skip(q) || UR(100) < SKIP_NFAV_NEW_PROB;
+
+}
+
+static u32 sched_rare_energy(struct queue_entry* q, u32 perf_score) {
+
+  if (chose_nums[q->rare_edge] <= min_chose_nums) return perf_score * 2;
+
+  return MAX(perf_score / 4, 1);
+
+}
+
+
+/* Frontier schedule: seeds that reach edges with still-virgin children are
+   the ones most likely to get past them. Multiplier from 1x to 3x. */
+
+static u32 sched_frontier_energy(struct queue_entry* q, u32 perf_score) {
+
+  if (q->frontier_hits)
+    perf_score = perf_score * (4 + MIN(q->frontier_hits, 8)) / 4;
+
+  return perf_score;
+
+}
+
+
+static struct seed_sched schedulers[] = {
+
+  { "explore",  0, sched_default_skip, sched_default_energy,
+    sched_default_new_find },
+
+  { "fast",     1, sched_default_skip, sched_fast_energy,
+    sched_note_rare_edge },
+
+  { "rare",     1, sched_rare_skip,    sched_rare_energy,
+    sched_note_rare_edge },
+
+  { "frontier", 0, sched_default_skip, sched_frontier_energy,
+    sched_default_new_find },
+
+  { 0 }
+
+};
+
+
+/* Pick the scheduler requested with -p. */
+
+static void setup_sched(void) {
 
+  if (!sched_name) {
+    sched = &schedulers[0];
+    return;
   }
 
-  if((queue_cur->was_fuzzed==0)&&(queue_cur->father_diff<len)&&(queue_cur->father_diff_count>0)&&(queue_cur->father_diff_count<=2)){ 
+  for (sched = schedulers; sched->name; sched++)
+    if (!strcmp(sched->name, sched_name)) return;
 
-    int str_start,str_end;
-   
-    queue_cur->was_fuzzed=1;
-    if (extras_cnt){
+  FATAL("Unknown power schedule '%s' (try explore, fast, rare or frontier)",
+        sched_name);
 
-      int extras_count=0;
-      stage_short = "agile-dict"; 
-      stage_name  = "agile-dict";
-      orig_hit_cnt = queued_paths + unique_crashes;  
-      for(;extras_count<extras_cnt;extras_count+=1){  
-        int index=extras[extras_count].len-1;
-        for(;;index--){
-          if(extras[extras_count].data[index]==out_buf[queue_cur->father_diff]){  
-            int tem_size=index+1;
-            u8 *tem=malloc(tem_size); 
-            u8 *tem_sav=malloc(tem_size); 
-            int ii=0;
-            for(;ii<tem_size;ii++){
-              tem[ii]=extras[extras_count].data[ii];
-            }  
+}
+
+
+/* Helper function to see if a particular change (xor_val = old ^ new) could
+   be a product of deterministic bit flips with the lengths and stepovers
+   attempted by afl-fuzz. This is used to avoid dupes in some of the
+   deterministic fuzzing operations that follow bit flips. We also
+   return 1 if xor_val is zero, which implies that the old and attempted new
+   values are identical and the exec would be a waste of time. */
 
-            memcpy(tem_sav, out_buf + queue_cur->father_diff, tem_size);
-            memcpy(out_buf + queue_cur->father_diff, tem, tem_size);
-            
-            if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;  
-            new_hit_cnt = queued_paths + unique_crashes; 
-            stage_finds[STAGE_EXTRAS_UO]  += new_hit_cnt - orig_hit_cnt;
-            stage_cycles[STAGE_EXTRAS_UO] += 1;
-            orig_hit_cnt = new_hit_cnt;
+static u8 could_be_bitflip(u32 xor_val) {
 
-            memcpy(out_buf + queue_cur->father_diff, tem_sav, tem_size);  
-            
-            free(tem);
-            free(tem_sav);
-          }
-          if(index==1){
-            break;
-          }
-        } 
-      }   
-    }else{
+  u32 sh = 0;
 
-      stage_short = "byte_ascii"; 
-      stage_name  = "byte_ascii";
+  if (!xor_val) return 1;
 
-      str_start=queue_cur->father_diff+1;
-      if(str_start<0)
-        str_start=0; 
-      
-      if(queue_cur->father_diff+3<len){
-        str_end=queue_cur->father_diff+3;
-      }else{
-        str_end=len-1;
-      }
+  /* Shift left until first bit set. */
 
-      int old_branch=get_branch_size();
+  while (!(xor_val & 1)) { sh++; xor_val >>= 1; }
 
-      for(;str_start<str_end;str_start++){ 
+  /* 1-, 2-, and 4-bit patterns are OK anywhere. */
 
-        orig_hit_cnt = queued_paths + unique_crashes; 
-        stage_cur_count=1;
-        int ascall_start,ascall_end;
-        if(queue_cur->find_new_laf_branch==4){
-          ascall_start=34;
-          ascall_end=126; 
-        }else{ 
-          ascall_start=0;
-          ascall_end=255; 
-        } 
-        stage_cur_byte=str_start;
-        for(;ascall_start<ascall_end;ascall_start++){
-          diff_val_byte=ascall_start;
-          out_buf[str_start]=ascall_start; 
-          if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry; 
-          out_buf[str_start]=in_buf[str_start];
-        }
+  if (xor_val == 1 || xor_val == 3 || xor_val == 15) return 1;
 
-        stage_cycles[STAGE_BYTE_CHANGE] += 255; 
-        new_hit_cnt = queued_paths + unique_crashes;
-        stage_finds[STAGE_BYTE_CHANGE]  += new_hit_cnt - orig_hit_cnt; 
+  /* 8-, 16-, and 32-bit patterns are OK only if shift factor is
+     divisible by 8, since that's the stepover for these ops. */
 
-      }
-      byte_deter_branch_count+=(get_branch_size()-old_branch);
+  if (sh & 7) return 0;
 
-      if(queue_cur->has_new_cov==0){
-        goto abandon_entry;
-      }
-    } 
+  if (xor_val == 0xff || xor_val == 0xffff || xor_val == 0xffffffff)
+    return 1;
 
-  } 
+  return 0;
 
+}
 
-  /*********************
-   * PERFORMANCE SCORE *
-   *********************/
 
-  orig_perf = perf_score = calculate_score(queue_cur);
+/* Helper function to see if a particular value is reachable through
+   arithmetic operations. Used for similar purposes. */
 
-  /* Skip right away if -d is given, if we have done deterministic fuzzing on
-     this entry ourselves (was_fuzzed), or if it has gone through deterministic
-     testing in earlier, resumed runs (passed_det). */
+static u8 could_be_arith(u32 old_val, u32 new_val, u8 blen) {
 
-  if (skip_deterministic || queue_cur->was_fuzzed || queue_cur->passed_det)
-    goto havoc_stage;
+  u32 i, ov = 0, nv = 0, diffs = 0;
 
-  /* Skip deterministic fuzzing if exec path checksum puts this out of scope
-     for this master instance. */
+  if (old_val == new_val) return 1;
 
-  if (master_max && (queue_cur->exec_cksum % master_max) != master_id - 1)
-    goto havoc_stage;
+  /* See if one-byte adjustments to any byte could produce this result. */
 
-  doing_det = 1;
+  for (i = 0; i < blen; i++) {
 
+    u8 a = old_val >> (8 * i),
+       b = new_val >> (8 * i);
 
-#define FLIP_BIT(_ar, _b) do { \
-    u8* _arf = (u8*)(_ar); \
-    u32 _bf = (_b); \
-    _arf[(_bf) >> 3] ^= (128 >> ((_bf) & 7)); \
-  } while (0)
+    if (a != b) { diffs++; ov = a; nv = b; }
 
- 
+  }
 
-  /****************
-   * RANDOM HAVOC *
-   ****************/
+  /* If only one byte differs and the values are within range, return 1. */
 
-havoc_stage:
+  if (diffs == 1) {
 
-  stage_cur_byte = 0;
-  diff_val_byte=0;
+    if ((u8)(ov - nv) <= ARITH_MAX ||
+        (u8)(nv - ov) <= ARITH_MAX) return 1;
 
-  /* The havoc stage mutation code is also invoked when splicing files; if the
-     splice_cycle variable is set, generate different descriptions and such. */
+  }
 
-  if (!splice_cycle) {
+  if (blen == 1) return 0;
 
-    stage_name  = "agile-havoc";
-    stage_short = "agile-havoc";
-    stage_max   = (doing_det ? HAVOC_CYCLES_INIT : HAVOC_CYCLES) *
-                  perf_score / havoc_div / 100;
+  /* See if two-byte adjustments to any byte would produce this result. */
 
-  } else {
+  diffs = 0;
 
-    static u8 tmp[32];
+  for (i = 0; i < blen / 2; i++) {
 
-    perf_score = orig_perf;
+    u16 a = old_val >> (16 * i),
+        b = new_val >> (16 * i);
 
-    sprintf(tmp, "splice %u", splice_cycle);
-    stage_name  = tmp;
-    stage_short = "splice";
-    stage_max   = SPLICE_HAVOC * perf_score / havoc_div / 100;
+    if (a != b) { diffs++; ov = a; nv = b; }
 
   }
 
-  if (stage_max < HAVOC_MIN) stage_max = HAVOC_MIN;
+  /* If only one word differs and the values are within range, return 1. */
 
-  temp_len = len;
+  if (diffs == 1) {
 
-  orig_hit_cnt = queued_paths + unique_crashes;
+    if ((u16)(ov - nv) <= ARITH_MAX ||
+        (u16)(nv - ov) <= ARITH_MAX) return 1;
 
-  havoc_queued = queued_paths; 
-  
+    ov = SWAP16(ov); nv = SWAP16(nv);
 
-  /* We essentially just do several thousand runs (depending on perf_score)
-     where we take the input file and make random stacked tweaks. */
+    if ((u16)(ov - nv) <= ARITH_MAX ||
+        (u16)(nv - ov) <= ARITH_MAX) return 1;
 
-  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
+  }
 
-    u32 use_stacking = 1 << (1 + UR(HAVOC_STACK_POW2));
+  /* Finally, let's do the same thing for dwords. */
 
-    stage_cur_val = use_stacking;
- 
-    for (i = 0; i < use_stacking; i++) {
+  if (blen == 4) {
 
-      switch (UR(15 + ((extras_cnt + a_extras_cnt) ? 2 : 0))) {
+    if ((u32)(old_val - new_val) <= ARITH_MAX ||
+        (u32)(new_val - old_val) <= ARITH_MAX) return 1;
 
-        case 0:
+    new_val = SWAP32(new_val);
+    old_val = SWAP32(old_val);
 
-          /* Flip a single bit somewhere. Spooky! */
+    if ((u32)(old_val - new_val) <= ARITH_MAX ||
+        (u32)(new_val - old_val) <= ARITH_MAX) return 1;
 
-          FLIP_BIT(out_buf, UR(temp_len << 3));
-          break;
+  }
 
-        case 1: 
+  return 0;
 
-          /* Set byte to interesting value. */
+}
 
-          out_buf[UR(temp_len)] = interesting_8[UR(sizeof(interesting_8))];
-          break;
 
-        case 2:
+/* Last but not least, a similar helper to see if insertion of an 
+   interesting integer is redundant given the insertions done for
+   shorter blen. The last param (check_le) is set if the caller
+   already executed LE insertion for current blen and wants to see
+   if BE variant passed in new_val is unique. */
 
-          /* Set word to interesting value, randomly choosing endian. */
+static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le) {
 
-          if (temp_len < 2) break;
+  u32 i, j;
 
-          if (UR(2)) {
+  if (old_val == new_val) return 1;
 
-            *(u16*)(out_buf + UR(temp_len - 1)) =
-              interesting_16[UR(sizeof(interesting_16) >> 1)];
+  /* See if one-byte insertions from interesting_8 over old_val could
+     produce new_val. */
 
-          } else {
+  for (i = 0; i < blen; i++) {
 
-            *(u16*)(out_buf + UR(temp_len - 1)) = SWAP16(
-              interesting_16[UR(sizeof(interesting_16) >> 1)]);
+    for (j = 0; j < sizeof(interesting_8); j++) {
 
-          }
+      u32 tval = (old_val & ~(0xff << (i * 8))) |
+                 (((u8)interesting_8[j]) << (i * 8));
 
-          break;
+      if (new_val == tval) return 1;
 
-        case 3:
+    }
 
-          /* Set dword to interesting value, randomly choosing endian. */
+  }
 
-          if (temp_len < 4) break;
+  /* Bail out unless we're also asked to examine two-byte LE insertions
+     as a preparation for BE attempts. */
 
-          if (UR(2)) {
-  
-            *(u32*)(out_buf + UR(temp_len - 3)) =
-              interesting_32[UR(sizeof(interesting_32) >> 2)];
+  if (blen == 2 && !check_le) return 0;
 
-          } else {
+  /* See if two-byte insertions over old_val could give us new_val. */
 
-            *(u32*)(out_buf + UR(temp_len - 3)) = SWAP32(
-              interesting_32[UR(sizeof(interesting_32) >> 2)]);
+  for (i = 0; i < blen - 1; i++) {
 
-          }
+    for (j = 0; j < sizeof(interesting_16) / 2; j++) {
 
-          break;
+      u32 tval = (old_val & ~(0xffff << (i * 8))) |
+                 (((u16)interesting_16[j]) << (i * 8));
 
-        case 4:
+      if (new_val == tval) return 1;
 
-          /* Randomly subtract from byte. */
+      /* Continue here only if blen > 2. */
 
-          out_buf[UR(temp_len)] -= 1 + UR(ARITH_MAX);
-          break;
+      if (blen > 2) {
 
-        case 5:
+        tval = (old_val & ~(0xffff << (i * 8))) |
+               (SWAP16(interesting_16[j]) << (i * 8));
 
-          /* Randomly add to byte. */
+        if (new_val == tval) return 1;
 
-          out_buf[UR(temp_len)] += 1 + UR(ARITH_MAX);
-          break;
+      }
 
-        case 6:
+    }
 
-          /* Randomly subtract from word, random endian. */
+  }
 
-          if (temp_len < 2) break;
+  if (blen == 4 && check_le) {
 
-          if (UR(2)) {
+    /* See if four-byte insertions could produce the same result
+       (LE only). */
 
-            u32 pos = UR(temp_len - 1);
+    for (j = 0; j < sizeof(interesting_32) / 4; j++)
+      if (new_val == (u32)interesting_32[j]) return 1;
 
-            *(u16*)(out_buf + pos) -= 1 + UR(ARITH_MAX);
+  }
 
-          } else {
+  return 0;
 
-            u32 pos = UR(temp_len - 1);
-            u16 num = 1 + UR(ARITH_MAX);
+}  
 
-            *(u16*)(out_buf + pos) =
-              SWAP16(SWAP16(*(u16*)(out_buf + pos)) - num);
+/* Collect the offsets where son differs from father. Returns 0 if there
+   are too many of them to be worth clustering. */
 
-          }
+static u8 init_diff_point(u8* father, u8* son, u32 len1, u32 len2) {
 
-          break;
+  ms_reset();
 
-        case 7:
+  return ms_add_diffs(father, son, MIN(len1, len2));
 
-          /* Randomly add to word, random endian. */
+}
 
-          if (temp_len < 2) break;
+/* Count an entry as fuzzed without fuzzing it here, because another worker
+   of the -j group has done or is doing so. */
 
-          if (UR(2)) {
+static void group_mark_fuzzed(struct queue_entry* q) {
 
-            u32 pos = UR(temp_len - 1);
+  if (qhot.was_fuzzed[q->id]) return;
 
-            *(u16*)(out_buf + pos) += 1 + UR(ARITH_MAX);
+  qhot.was_fuzzed[q->id] = 1;
+  pending_not_fuzzed--;
 
-          } else {
+  if (qhot.favored[q->id] && pending_favored) pending_favored--;
 
-            u32 pos = UR(temp_len - 1);
-            u16 num = 1 + UR(ARITH_MAX);
+}
 
-            *(u16*)(out_buf + pos) =
-              SWAP16(SWAP16(*(u16*)(out_buf + pos)) + num);
 
-          }
+/* Workers of a -j group walk their queues independently, but every entry
+   has a claim word in shared memory, indexed by the worker that found it
+   and its ID there, so that the copies the others import map to the same
+   word. The word holds the last round the entry was fuzzed in, with
+   GROUP_BUSY set while someone is at it. A worker fuzzes an entry only if
+   it can move the word up to its own round; entries that are busy or were
+   already taken in this round are left to whoever has them. A worker that
+   finds its pass mostly done by others reaches the end of its queue early
+   and starts the next round, taking entries before slower workers get to
+   them, so that the work evens out. Returns 0 to skip the entry. */
 
-          break;
+static u8 group_claim(struct queue_entry* q) {
 
-        case 8:
+  u32 *c, old;
 
-          /* Randomly subtract from dword, random endian. */
+  if (q->group_id >= GROUP_QUEUE_MAX) return 1;
 
-          if (temp_len < 4) break;
+  c = group_claims + (u64)q->group_src * GROUP_QUEUE_MAX + q->group_id;
 
-          if (UR(2)) {
+  do {
 
-            u32 pos = UR(temp_len - 3);
+    old = *(volatile u32*)c;
 
-            *(u32*)(out_buf + pos) -= 1 + UR(ARITH_MAX);
+    if (old & GROUP_BUSY) {
+      group_waited = 1;
+      group_mark_fuzzed(q);
+      return 0;
+    }
 
-          } else {
+    if (old >= group_round) {
+      group_ahead = 1;
+      group_mark_fuzzed(q);
+      return 0;
+    }
 
-            u32 pos = UR(temp_len - 3);
-            u32 num = 1 + UR(ARITH_MAX);
+  } while (!__sync_bool_compare_and_swap(c, old, group_round | GROUP_BUSY));
 
-            *(u32*)(out_buf + pos) =
-              SWAP32(SWAP32(*(u32*)(out_buf + pos)) - num);
+  group_held    = c;
+  group_claimed = 1;
 
-          }
+  /* Fuzzed elsewhere in an earlier round: the deterministic and once-only
+     stages have been done. */
 
-          break;
+  if (old) {
+    group_mark_fuzzed(q);
+    q->cmplog_done = 1;
+  }
 
-        case 9:
+  return 1;
 
-          /* Randomly add to dword, random endian. */
+}
 
-          if (temp_len < 4) break;
 
-          if (UR(2)) {
+/* Let go of the entry taken by group_claim(). */
 
-            u32 pos = UR(temp_len - 3);
+static void group_release(void) {
 
-            *(u32*)(out_buf + pos) += 1 + UR(ARITH_MAX);
+  if (!group_held) return;
 
-          } else {
+  __sync_fetch_and_and(group_held, ~GROUP_BUSY);
+  group_held = NULL;
 
-            u32 pos = UR(temp_len - 3);
-            u32 num = 1 + UR(ARITH_MAX);
+}
 
-            *(u32*)(out_buf + pos) =
-              SWAP32(SWAP32(*(u32*)(out_buf + pos)) + num);
 
-          }
+/* Take the current entry from the queue, fuzz it for a while. This
+   function is a tad too long... returns 0 if fuzzed successfully, 1 if
+   skipped or bailed out. */
 
-          break;
+static u8 fuzz_one(char** argv) {
+
+
+  s32 len, fd, temp_len, i, j;
+  u8  *in_buf, *out_buf,*test_buf=NULL, *orig_in,  *eff_map = 0;
+  u64 havoc_queued,  orig_hit_cnt, new_hit_cnt;
+  u32 splice_cycle = 0, perf_score = 100, orig_perf, prev_cksum, eff_cnt = 1;
+
+  u8  ret_val = 1, doing_det = 0;
+  u32 byte_execs;
+
+  u8  a_collect[MAX_AUTO_EXTRA];
+  u32 a_len = 0; 
+
+#ifdef IGNORE_FINDS
+
+  /* In IGNORE_FINDS mode, skip any entries that weren't in the
+     initial data set. */
+
+  if (qhot.depth[queue_cur->id] > 1) return 1;
+
+#else
 
-        case 10:
+  if (sched->skip_seed(queue_cur)) return 1;
+ 
+  //  queue_cur->select_count+=1;
+#endif /* ^IGNORE_FINDS */
 
-          /* Just set a random byte to a random value. Because,
-             why not. We use XOR with 1-255 to eliminate the
-             possibility of a no-op. */
+  if (group_size && !group_claim(queue_cur)) return 1;
+  
 
-          out_buf[UR(temp_len)] ^= 1 + UR(255);
-          break;
+  if (not_on_tty) {
+    ACTF("Fuzzing test case #%u (%u total, %llu uniq crashes found)...",
+         current_entry, queued_paths, unique_crashes);
+    fflush(stdout);
+  } 
 
-        case 11 ... 12: {
+  /* Map the test case into memory. */
 
-            /* Delete bytes. We're making this a bit more likely
-               than insertion (the next option) in hopes of keeping
-               files reasonably small. */
+  io_wait(queue_cur->io_seq);
 
-            u32 del_from, del_len;
+  fd = open(queue_cur->fname, O_RDONLY);
 
-            if (temp_len < 2) break;
+  if (fd < 0) PFATAL("Unable to open '%s'", queue_cur->fname);
 
-            /* Don't delete too much. */
+  len = queue_cur->len;
 
-            del_len = choose_block_len(temp_len - 1);
+  orig_in = in_buf = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
 
-            del_from = UR(temp_len - del_len + 1);
+  if (orig_in == MAP_FAILED) PFATAL("Unable to mmap '%s'", queue_cur->fname);
 
-            memmove(out_buf + del_from, out_buf + del_from + del_len,
-                    temp_len - del_from - del_len);
+  close(fd);
 
-            temp_len -= del_len;
+  /* We could mmap() out_buf as MAP_PRIVATE, but we end up clobbering every
+     single byte anyway, so it wouldn't give us any performance or memory usage
+     benefits. */
 
-            break;
+  out_buf = ck_alloc_nozero(len); 
 
-          }
+  subseq_tmouts = 0;
 
-        case 13:
+  cur_depth = qhot.depth[queue_cur->id];
 
-          if (temp_len + HAVOC_BLK_XL < MAX_FILE) {
+  /*******************************************
+   * CALIBRATION (only if failed earlier on) *
+   *******************************************/
 
-            /* Clone bytes (75%) or insert a block of constant bytes (25%). */
+  if (queue_cur->cal_failed) {
 
-            u8  actually_clone = UR(4);
-            u32 clone_from, clone_to, clone_len;
-            u8* new_buf;
+    u8 res = FAULT_TMOUT;
 
-            if (actually_clone) {
+    if (queue_cur->cal_failed < CAL_CHANCES) {
 
-              clone_len  = choose_block_len(temp_len);
-              clone_from = UR(temp_len - clone_len + 1);
+      res = calibrate_case(argv, queue_cur, in_buf, queue_cycle - 1, 0);
 
-            } else {
+      if (res == FAULT_ERROR)
+        FATAL("Unable to execute target application");
 
-              clone_len = choose_block_len(HAVOC_BLK_XL);
-              clone_from = 0;
+    }
 
-            }
+    if (stop_soon || res != crash_mode) {
+      cur_skipped_paths++;
+      goto abandon_entry;
+    }
 
-            clone_to   = UR(temp_len);
+  }
 
-            new_buf = ck_alloc_nozero(temp_len + clone_len);
+  /************
+   * TRIMMING *
+   ************/
 
-            /* Head */
+  memcpy(out_buf, in_buf, len);
+  if (!dumb_mode && !queue_cur->trim_done) {
 
-            memcpy(new_buf, out_buf, clone_to);
+    u8 res = trim_case(argv, queue_cur, in_buf);
 
-            /* Inserted part */
+    if (res == FAULT_ERROR)
+      FATAL("Unable to execute target application");
 
-            if (actually_clone)
-              memcpy(new_buf + clone_to, out_buf + clone_from, clone_len);
-            else
-              memset(new_buf + clone_to,
-                     UR(2) ? UR(256) : out_buf[UR(temp_len)], clone_len);
+    if (stop_soon) {
+      cur_skipped_paths++;
+      goto abandon_entry;
+    }
 
-            /* Tail */
-            memcpy(new_buf + clone_to + clone_len, out_buf + clone_to,
-                   temp_len - clone_to);
+    /* Don't retry trimming, even if it failed. */
 
-            ck_free(out_buf);
-            out_buf = new_buf;
-            temp_len += clone_len;
+    queue_cur->trim_done = 1;
 
-          }
+    if (len != queue_cur->len) len = queue_cur->len;
 
-          break;
+  }
 
-        case 14: {
+  /**********
+   * CMPLOG *
+   **********/
 
-            /* Overwrite bytes with a randomly selected chunk (75%) or fixed
-               bytes (25%). */
+  if (cmplog && !queue_cur->cmplog_done) {
 
-            u32 copy_from, copy_to, copy_len;
+    queue_cur->cmplog_done = 1;
 
-            if (temp_len < 2) break;
+    memcpy(out_buf, in_buf, len);
+    if (cmplog_stage(argv, out_buf, len)) goto abandon_entry;
 
-            copy_len  = choose_block_len(temp_len - 1);
+  }
 
-            copy_from = UR(temp_len - copy_len + 1);
-            copy_to   = UR(temp_len - copy_len + 1);
+  if((qhot.was_fuzzed[queue_cur->id]==0)&&(queue_cur->father_diff<len)&&(queue_cur->father_diff_count>0)&&(queue_cur->father_diff_count<=2)){ 
 
-            if (UR(4)) {
+    int str_start,str_end;
+   
+    qhot.was_fuzzed[queue_cur->id]=1;
+    if (qhot.favored[queue_cur->id] && pending_favored) pending_favored--;
+    if (extras_cnt){
 
-              if (copy_from != copy_to)
-                memmove(out_buf + copy_to, out_buf + copy_from, copy_len);
+      int extras_count=0;
+      stage_short = "agile-dict"; 
+      stage_name  = "agile-dict";
+      orig_hit_cnt = queued_paths + unique_crashes;  
+      for(;extras_count<extras_cnt;extras_count+=1){  
+        int index=extras[extras_count].len-1;
+        for(;;index--){
+          if(extras[extras_count].data[index]==out_buf[queue_cur->father_diff]){  
+            int tem_size=index+1;
+            u8 *tem=malloc(tem_size); 
+            u8 *tem_sav=malloc(tem_size); 
+            int ii=0;
+            for(;ii<tem_size;ii++){
+              tem[ii]=extras[extras_count].data[ii];
+            }  
 
-            } else memset(out_buf + copy_to,
-                          UR(2) ? UR(256) : out_buf[UR(temp_len)], copy_len);
+            memcpy(tem_sav, out_buf + queue_cur->father_diff, tem_size);
+            memcpy(out_buf + queue_cur->father_diff, tem, tem_size);
+            
+            if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;  
+            new_hit_cnt = queued_paths + unique_crashes; 
+            stage_finds[STAGE_EXTRAS_UO]  += new_hit_cnt - orig_hit_cnt;
+            stage_cycles[STAGE_EXTRAS_UO] += 1;
+            orig_hit_cnt = new_hit_cnt;
 
+            memcpy(out_buf + queue_cur->father_diff, tem_sav, tem_size);  
+            
+            free(tem);
+            free(tem_sav);
+          }
+          if(index==1){
             break;
-
           }
+        } 
+      }   
+    }else{
+
+      stage_short = "byte_ascii"; 
+      stage_name  = "byte_ascii";
+
+      str_start=queue_cur->father_diff+1;
+      if(str_start<0)
+        str_start=0; 
+      
+      if(queue_cur->father_diff+3<len){
+        str_end=queue_cur->father_diff+3;
+      }else{
+        str_end=len-1;
+      }
 
-        /* Values 15 and 16 can be selected only if there are any extras
-           present in the dictionaries. */
+      int old_branch=get_branch_size();
 
-        case 15: {
+      for(;str_start<str_end;str_start++){ 
 
-            /* Overwrite bytes with an extra. */
+        orig_hit_cnt = queued_paths + unique_crashes; 
+        stage_cur_count=1;
+        int ascall_start,ascall_end;
+        if(queue_cur->find_new_laf_branch==4){
+          ascall_start=34;
+          ascall_end=126; 
+        }else{ 
+          ascall_start=0;
+          ascall_end=255; 
+        } 
+        stage_cur_byte=str_start;
+        if (fuzz_byte_adaptive(argv, out_buf, len, str_start,
+                               ascall_start, ascall_end - 1,
+                               queue_cur->find_new_laf_branch, &byte_execs))
+          goto abandon_entry;
+        out_buf[str_start]=in_buf[str_start];
 
-            if (!extras_cnt || (a_extras_cnt && UR(2))) {
+        stage_cycles[STAGE_BYTE_CHANGE] += byte_execs; 
+        new_hit_cnt = queued_paths + unique_crashes;
+        stage_finds[STAGE_BYTE_CHANGE]  += new_hit_cnt - orig_hit_cnt; 
 
-              /* No user-specified extras or odds in our favor. Let's use an
-                 auto-detected one. */
+      }
+      byte_deter_branch_count+=(get_branch_size()-old_branch);
 
-              u32 use_extra = UR(a_extras_cnt);
-              u32 extra_len = a_extras[use_extra].len;
-              u32 insert_at;
+      if(queue_cur->has_new_cov==0){
+        goto abandon_entry;
+      }
+    } 
 
-              if (extra_len > temp_len) break;
+  } 
 
-              insert_at = UR(temp_len - extra_len + 1);
-              memcpy(out_buf + insert_at, a_extras[use_extra].data, extra_len);
 
-            } else {
+  /*********************
+   * PERFORMANCE SCORE *
+   *********************/
 
-              /* No auto extras or odds in our favor. Use the dictionary. */
+  orig_perf = perf_score = calculate_score(queue_cur);
+  queue_cur->fuzz_level++;
 
-              u32 use_extra = UR(extras_cnt);
-              u32 extra_len = extras[use_extra].len;
-              u32 insert_at;
+  /* Skip right away if -d is given, if we have done deterministic fuzzing on
+     this entry ourselves (was_fuzzed), or if it has gone through deterministic
+     testing in earlier, resumed runs (passed_det). */
 
-              if (extra_len > temp_len) break;
+  if (skip_deterministic || qhot.was_fuzzed[queue_cur->id] || queue_cur->passed_det)
+    goto havoc_stage;
 
-              insert_at = UR(temp_len - extra_len + 1);
-              memcpy(out_buf + insert_at, extras[use_extra].data, extra_len);
+  /* Skip deterministic fuzzing if exec path checksum puts this out of scope
+     for this master instance. */
 
-            }
+  if (master_max && (queue_cur->exec_cksum % master_max) != master_id - 1)
+    goto havoc_stage;
 
-            break;
+  doing_det = 1;
 
-          }
+  /****************
+   * RANDOM HAVOC *
+   ****************/
 
-        case 16: {
+havoc_stage:
 
-            u32 use_extra, extra_len, insert_at = UR(temp_len + 1);
-            u8* new_buf;
+  stage_cur_byte = 0;
+  diff_val_byte=0;
 
-            /* Insert an extra. Do the same dice-rolling stuff as for the
-               previous case. */
+  /* The havoc stage mutation code is also invoked when splicing files; if the
+     splice_cycle variable is set, generate different descriptions and such. */
 
-            if (!extras_cnt || (a_extras_cnt && UR(2))) {
+  if (!splice_cycle) {
 
-              use_extra = UR(a_extras_cnt);
-              extra_len = a_extras[use_extra].len;
+    stage_name  = "agile-havoc";
+    stage_short = "agile-havoc";
+    stage_max   = (doing_det ? HAVOC_CYCLES_INIT : HAVOC_CYCLES) *
+                  perf_score / havoc_div / 100;
 
-              if (temp_len + extra_len >= MAX_FILE) break;
+  } else {
 
-              new_buf = ck_alloc_nozero(temp_len + extra_len);
+    static u8 tmp[32];
 
-              /* Head */
-              memcpy(new_buf, out_buf, insert_at);
+    perf_score = orig_perf;
 
-              /* Inserted part */
-              memcpy(new_buf + insert_at, a_extras[use_extra].data, extra_len);
+    sprintf(tmp, "splice %u", splice_cycle);
+    stage_name  = tmp;
+    stage_short = "splice";
+    stage_max   = SPLICE_HAVOC * perf_score / havoc_div / 100;
 
-            } else {
+  }
 
-              use_extra = UR(extras_cnt);
-              extra_len = extras[use_extra].len;
+  if (stage_max < HAVOC_MIN) stage_max = HAVOC_MIN;
 
-              if (temp_len + extra_len >= MAX_FILE) break;
+  temp_len = len;
 
-              new_buf = ck_alloc_nozero(temp_len + extra_len);
+  orig_hit_cnt = queued_paths + unique_crashes;
 
-              /* Head */
-              memcpy(new_buf, out_buf, insert_at);
+  havoc_queued = queued_paths; 
+  
 
-              /* Inserted part */
-              memcpy(new_buf + insert_at, extras[use_extra].data, extra_len);
+  /* We essentially just do several thousand runs (depending on perf_score)
+     where we take the input file and make random stacked tweaks. */
 
-            }
+  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
 
-            /* Tail */
-            memcpy(new_buf + insert_at + extra_len, out_buf + insert_at,
-                   temp_len - insert_at);
+    u32 use_stacking = 1 << (1 + UR(HAVOC_STACK_POW2));
+    u8  ops_used[HAVOC_OPS] = { 0 };
 
-            ck_free(out_buf);
-            out_buf   = new_buf;
-            temp_len += extra_len;
+    stage_cur_val = use_stacking;
+ 
+    for (i = 0; i < use_stacking; i++) {
 
-            break;
+      u32 op = havoc_pick();
 
-          }
+      if (temp_len < havoc_ops[op].min_len) continue;
 
-      }
+      temp_len = havoc_ops[op].fn(&out_buf, temp_len);
+      ops_used[op] = 1;
 
     } 
 
@@ -6582,6 +9042,8 @@ havoc_stage:
 
     new_hit_cnt = queued_paths + unique_crashes;
 
+    havoc_credit(ops_used, new_hit_cnt - orig_hit_cnt);
+
     if (!splice_cycle) {
       stage_finds[STAGE_HAVOC]  += new_hit_cnt - orig_hit_cnt;
       stage_cycles[STAGE_HAVOC] += 1;
@@ -6594,43 +9056,28 @@ havoc_stage:
 
     int state=init_diff_point(in_buf,out_buf,len,temp_len);
     if(state)
-    if (((find_new_branch!=0)||(find_new_laf_branch!=0))&&(origin_points.size<1000)) {  
+    if (((find_new_branch!=0)||(find_new_laf_branch!=0))&&(ms.size<1000)) {  
  
-      // if(queue_cur->byte_analyse==NULL){
-      //   int tem_len=queue_cur->len/8+1;
-      //   queue_cur->byte_analyse=malloc(tem_len);
-      //   for(int ri=0;ri<tem_len;ri++){
-      //     queue_cur->byte_analyse[ri]=0;
-      //   }
-      // }
-
-      init_clusters(); 
       //进行聚类操作 
-      start_ShiftPoint();  
-      start_cluster(); 
-      trmi_cluster(); 
+      ms_cluster(); 
 
       test_buf=ck_alloc_nozero(len);
 
       //****************  log  **************************************************************************
 
       // if((logfile!=NULL)){ 
-      //   fprintf(logfile, "diff_point-%d:",origin_points.size);
-      //   for(int i=0;i<origin_points.size;i++){
-      //     fprintf(logfile, "%d,",origin_points.values[i]);
+      //   fprintf(logfile, "diff_point-%d:",ms.size);
+      //   for(int i=0;i<ms.size;i++){
+      //     fprintf(logfile, "%d,",ms.points[i]);
       //   }  
       //   fprintf(logfile, "\n"); 
 
-      //   fprintf(logfile, "\tcluster-%d:",clusters_size);
-      //   for(int i=0;i<clusters_size;i++){
-      //     if(clusters[i].size==1){
-      //       start=clusters[i].original_points[0];
-      //       end=start; 
-      //       fprintf(logfile, "%d,",start);
-      //     }else if(clusters[i].size>1){
-      //       start=clusters[i].original_points[0];
-      //       end=clusters[i].original_points[clusters[i].size-1]; 
-      //       fprintf(logfile, "(%d:%d,%d),",clusters[i].size,start,end);
+      //   fprintf(logfile, "\tcluster-%d:",ms.clusters_size);
+      //   for(int i=0;i<ms.clusters_size;i++){
+      //     if(ms.clusters[i].size>0){
+      //       start=ms.points[ms.clusters[i].start];
+      //       end=ms.points[ms.clusters[i].end-1]; 
+      //       fprintf(logfile, "(%d:%d,%d),",ms.clusters[i].end-ms.clusters[i].start,start,end);
       //     }
       //   }  
       //   fprintf(logfile, "\n"); 
@@ -6638,11 +9085,11 @@ havoc_stage:
       //****************  log  **************************************************************************
 
       //根据聚类结果，生成新的种子  
-      for (int i = 0; i < clusters_size; i++) {
+      for (int i = 0; i < ms.clusters_size; i++) {
 
-        if(clusters[i].size>0){ 
-          start=clusters[i].original_points[0];
-          end=clusters[i].original_points[clusters[i].size-1]; 
+        if(ms.clusters[i].size>0){ 
+          start=ms.points[ms.clusters[i].start];
+          end=ms.points[ms.clusters[i].end-1]; 
         }else{
           continue;
         }
@@ -6682,15 +9129,15 @@ havoc_stage:
             for(;stage_cur_byte<=end;stage_cur_byte++){
 
               if(in_buf[stage_cur_byte]!=out_buf[stage_cur_byte]){
-                // int index=stage_cur_byte/8;
-                // int padding=stage_cur_byte%8;
-                // if(end<queue_cur->len){
-                //   if((queue_cur->byte_analyse[index]&(1<<padding))==0){
-                //     queue_cur->byte_analyse[index]|=(1<<padding); 
-                //   }else{ 
-                //     continue;
-                //   }
-                // } 
+
+                /* Bytes that an earlier probe of this entry found to make
+                   no difference aren't worth another one. */
+
+                if (eff_get(queue_cur, stage_cur_byte) == EFF_DEAD) {
+                  eff_skipped++;
+                  continue;
+                }
+
                 stage_cycles[STAGE_BYTE_DETE] += 1;
                 u8 temp=in_buf[stage_cur_byte];
                 diff_val_byte=out_buf[stage_cur_byte];
@@ -6698,6 +9145,7 @@ havoc_stage:
                 if (common_fuzz_stuff(argv, in_buf, len))
                   goto abandon_entry; 
                 in_buf[stage_cur_byte]=temp;
+                eff_note(queue_cur, stage_cur_byte, eff_verdict());
 
                 if ((find_new_branch!=0)||(find_new_laf_branch!=0)) {
 
@@ -6705,15 +9153,13 @@ havoc_stage:
                     stage_short = "byte_ascii"; 
                     stage_name  = "byte_ascii";   
                     
-                    for(diff_val_byte=0;;diff_val_byte++){ 
-                      in_buf[stage_cur_byte]=diff_val_byte; 
-                      if (common_fuzz_stuff(argv, in_buf, len)) goto abandon_entry; 
-                      if(diff_val_byte==255)
-                        break;
-                    } 
+                    if (fuzz_byte_adaptive(argv, in_buf, len, stage_cur_byte,
+                                           0, 255, find_new_laf_branch,
+                                           &byte_execs))
+                      goto abandon_entry;
                     in_buf[stage_cur_byte]=temp;
 
-                    stage_cycles[STAGE_BYTE_CHANGE] += 255; 
+                    stage_cycles[STAGE_BYTE_CHANGE] += byte_execs; 
                     new_hit_cnt = queued_paths + unique_crashes;
                     stage_finds[STAGE_BYTE_CHANGE]  += new_hit_cnt - orig_hit_cnt;
                 }
@@ -6820,22 +9266,21 @@ retry_splicing:
     do { tid = UR(queued_paths); } while (tid == current_entry);
 
     splicing_with = tid;
-    target = queue;
-
-    while (tid >= 100) { target = target->next_100; tid -= 100; }
-    while (tid--) target = target->next;
+    target = queue_buf[tid];
 
     /* Make sure that the target has a reasonable length. */
 
     while (target && (target->len < 2 || target == queue_cur)) {
-      target = target->next;
       splicing_with++;
+      target = splicing_with < queued_paths ? queue_buf[splicing_with] : NULL;
     }
 
     if (!target) goto retry_splicing;
 
     /* Read the testcase into a new buffer. */
 
+    io_wait(target->io_seq);
+
     fd = open(target->fname, O_RDONLY);
 
     if (fd < 0) PFATAL("Unable to open '%s'", target->fname);
@@ -6887,30 +9332,148 @@ abandon_entry:
   /* Update pending_not_fuzzed count if we made it through the calibration
      cycle and have not seen this entry before. */
 
-  if (!stop_soon && !queue_cur->cal_failed && !queue_cur->was_fuzzed) {
-    queue_cur->was_fuzzed = 1;
-    pending_not_fuzzed--;
-    if (queue_cur->favored) {
-      if(pending_favored>0)
-        pending_favored--;
-    }
-  }
+  if (!stop_soon && !queue_cur->cal_failed && !qhot.was_fuzzed[queue_cur->id]) {
+    qhot.was_fuzzed[queue_cur->id] = 1;
+    pending_not_fuzzed--;
+    if (qhot.favored[queue_cur->id]) {
+      if(pending_favored>0)
+        pending_favored--;
+    }
+  }
+
+  munmap(orig_in, queue_cur->len);
+
+  if (in_buf != orig_in) ck_free(in_buf);
+  ck_free(out_buf); 
+  ck_free(eff_map); 
+  
+  if(test_buf!=NULL){
+    ck_free(test_buf); 
+    test_buf=NULL;
+  }
+
+
+  return ret_val;
+
+
+}
+
+
+/* Is this sync directory another worker of our -j group? Returns its
+   index in the group, or -1. */
+
+static s32 group_peer(u8* name) {
+
+  u32 k, n;
+
+  if (!group_size) return -1;
+
+  n = strlen(group_base);
+
+  if (strncmp(name, group_base, n) || sscanf(name + n, "_%u", &k) != 1 ||
+      k >= group_size) return -1;
+
+  return k;
+
+}
+
+
+/* Did a worker of our group take this queue entry over from another one?
+   Then that other worker has it as well, and so do we by now. */
+
+static u8 group_copy(u8* fname) {
+
+#ifndef SIMPLE_FILES
+
+  u8* p = strstr(fname, ",sync:");
+
+  return p && group_peer(p + 6) >= 0;
+
+#else
+
+  return !!strstr(fname, "_sync");
+
+#endif /* ^!SIMPLE_FILES */
+
+}
+
+
+/* Queue a find of another worker of our -j group without running it. The
+   shared virgin maps already have its coverage, and its coverage file tells
+   us the rest of what calibration would. The file's bytes are unpacked into
+   trace_bits and laf_trace_bits for scoring and the coverage file of our
+   copy, and both maps are left zeroed. Returns 0 if there is no usable
+   coverage file. */
+
+static u8 import_group_case(u8* peer, u32 worker, u8* fname, u8* mem,
+                            u32 len) {
+
+  struct cov_file_hdr h;
+  u32* buf = read_cov_file(peer, fname, &h);
+  u32 i;
+  u8* fn;
+
+  if (!buf) return 0;
+
+  memset(trace_bits, 0, map_size);
+  memset(laf_trace_bits, 0, map_size);
+
+  for (i = 0; i < h.edges + h.laf_bytes; i++)
+    (i < h.edges ? trace_bits : laf_trace_bits)
+      [(buf[i] >> 8) & (map_size - 1)] = buf[i];
+
+  ck_free(buf);
+
+#ifndef SIMPLE_FILES
+
+  fn = alloc_printf("%s/queue/id:%06u,sync:%s,src:%06u", out_dir,
+                    queued_paths, peer, syncing_case);
+
+#else
+
+  fn = alloc_printf("%s/queue/id_%06u_sync", out_dir, queued_paths);
+
+#endif /* ^!SIMPLE_FILES */
+
+  add_to_queue(fn, len, 0);
+  note_byte_values(mem, len);
+
+  queue_top->group_src = worker;
+  queue_top->group_id  = syncing_case;
+
+  /* Not a variant of whatever we were fuzzing. */
+
+  queue_top->father              = NULL;
+  queue_top->father_diff         = -1;
+  queue_top->father_diff_count   = 0;
+  queue_top->char_str_count      = 1;
+  queue_top->find_new_laf_branch = h.flags & 0xff;
+
+  queue_top->exec_cksum = h.cksum;
+  queue_top->handicap   = queue_cycle - 1;
 
-  munmap(orig_in, queue_cur->len);
+  qhot.exec_us[queue_top->id]     = h.exec_us;
+  qhot.bitmap_size[queue_top->id] = h.edges;
 
-  if (in_buf != orig_in) ck_free(in_buf);
-  ck_free(out_buf); 
-  ck_free(eff_map); 
-  
-  if(test_buf!=NULL){
-    ck_free(test_buf); 
-    test_buf=NULL;
+  total_bitmap_size += h.edges;
+  total_bitmap_entries++;
+
+  if (h.flags & COV_FLAG_NEW_COV) {
+    queue_top->has_new_cov = 1;
+    queued_with_cov++;
+    init_queue_new(queue_top);
   }
 
+  update_bitmap_score(queue_top);
+  save_coverage(queue_top);
+  sched->new_find(queue_top);
 
-  return ret_val;
+  queue_top->io_seq = io_queue_copy(0, ck_strdup(fn), mem, len);
+
+  memset(trace_bits, 0, map_size);
+  memset(laf_trace_bits, 0, map_size);
 
-#undef FLIP_BIT
+  return 1;
 
 }
 
@@ -6939,6 +9502,7 @@ static void sync_fuzzers(char** argv) {
     struct dirent* qd_ent;
     u8 *qd_path, *qd_synced_path;
     u32 min_accept = 0, next_min_accept;
+    s32 peer;
 
     s32 id_fd;
 
@@ -6946,6 +9510,12 @@ static void sync_fuzzers(char** argv) {
 
     if (sd_ent->d_name[0] == '.' || !strcmp(sync_id, sd_ent->d_name)) continue;
 
+    /* Finds of other workers in our -j group were new to the shared maps
+       when they were saved, so running them again would tell us nothing.
+       They are queued straight from their coverage files instead. */
+
+    peer = group_peer(sd_ent->d_name);
+
     /* Skip anything that doesn't have a queue/ subdirectory. */
 
     qd_path = alloc_printf("%s/%s/queue", sync_dir, sd_ent->d_name);
@@ -6993,6 +9563,10 @@ static void sync_fuzzers(char** argv) {
       if (syncing_case >= next_min_accept)
         next_min_accept = syncing_case + 1;
 
+      /* A peer's copy of another peer's find is one we have already. */
+
+      if (peer >= 0 && group_copy(qd_ent->d_name)) continue;
+
       path = alloc_printf("%s/%s", qd_path, qd_ent->d_name);
 
       /* Allow this to fail in case the other fuzzer is resuming or so... */
@@ -7008,7 +9582,33 @@ static void sync_fuzzers(char** argv) {
 
       /* Ignore zero-sized or oversized files. */
 
-      if (st.st_size && st.st_size <= MAX_FILE) {
+      if (!st.st_size || st.st_size > MAX_FILE) {
+
+        ck_free(path);
+        close(fd);
+        continue;
+
+      }
+
+      if (peer >= 0) {
+
+        /* A peer's find without a coverage file (it failed calibration, or
+           is a test case the peer has not got to yet) stays the peer's. */
+
+        u8* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mem == MAP_FAILED) PFATAL("Unable to mmap '%s'", path);
+
+        queued_imported += import_group_case(sd_ent->d_name, peer,
+                                             qd_ent->d_name, mem, st.st_size);
+
+        munmap(mem, st.st_size);
+
+      } else if (!cov_file_has_new_bits(sd_ent->d_name, qd_ent->d_name)) {
+
+        sync_skipped++;
+
+      } else {
 
         u8  fault;
         u8* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
@@ -7077,6 +9677,26 @@ static void handle_skipreq(int sig) {
 
 static void handle_timeout(int sig) {
 
+  /* A batch gets exec_tmout per input: as long as the target has finished
+     another input since the last alarm, let it go on for one more. */
+
+  if (batch_cnt && child_pid > 0) {
+
+    u32 done = ((volatile u32*)shm_batch)[2];
+
+    if (done != batch_seen) {
+
+      struct itimerval it = { { 0, 0 }, { exec_tmout / 1000,
+                                          (exec_tmout % 1000) * 1000 } };
+
+      batch_seen = done;
+      setitimer(ITIMER_REAL, &it, NULL);
+      return;
+
+    }
+
+  }
+
   if (child_pid > 0) {
 
     child_timed_out = 1; 
@@ -7244,6 +9864,52 @@ EXP_ST void check_binary(u8* fname) {
 
   }
 
+  /* Snapshot mode is for targets that can't loop on their own; the runtime
+     then rewinds the process after every run instead of forking anew. */
+
+  if (getenv("AFL_SNAPSHOT") && !persistent_mode) {
+
+    OKF("Asking the target to run from a memory snapshot (AFL_SNAPSHOT).");
+    setenv(SNAPSHOT_ENV_VAR, "1", 1);
+    snapshot_mode = 1;
+
+  }
+
+  if (memmem(f_data, f_len, LAF_TOUCH_SIG, strlen(LAF_TOUCH_SIG) + 1)) {
+
+    OKF(cPIN "Binary records touched laf bytes, using sparse laf scans.");
+    setenv(LAF_TOUCH_ENV_VAR, "1", 1);
+    laf_sparse = 1;
+
+  }
+
+  if (memmem(f_data, f_len, MAP_DIRTY_SIG, strlen(MAP_DIRTY_SIG) + 1)) {
+
+    OKF(cPIN "Binary flags dirty map lines, clearing only those.");
+    setenv(MAP_DIRTY_ENV_VAR, "1", 1);
+    map_dirty = 1;
+
+  }
+
+  if (memmem(f_data, f_len, SHM_FUZZ_SIG, strlen(SHM_FUZZ_SIG) + 1)) {
+
+    OKF(cPIN "Binary reads test cases from shared memory.");
+    setup_shm_fuzz();
+
+    if (persistent_mode && !getenv("AFL_NO_BATCH")) setup_shm_batch();
+
+  }
+
+  if (!getenv("AFL_NO_CMP_DICT")) load_cmp_dict(f_data, f_len);
+
+  if (memmem(f_data, f_len, CMPLOG_SIG, strlen(CMPLOG_SIG) + 1) &&
+      !dumb_mode && !getenv("AFL_NO_CMPLOG")) {
+
+    OKF(cPIN "Binary logs comparison operands, enabling the cmplog stage.");
+    setup_shm_cmplog();
+
+  }
+
   if (memmem(f_data, f_len, DEFER_SIG, strlen(DEFER_SIG) + 1)) {
 
     OKF(cPIN "Deferred forkserver binary detected.");
@@ -7354,12 +10020,15 @@ static void usage(u8* argv0) {
 
        "  -d            - quick & dirty mode (skips deterministic steps)\n"
        "  -n            - fuzz without instrumentation (dumb mode)\n"
-       "  -x dir        - optional fuzzer dictionary (see README)\n\n"
+       "  -x dir        - optional fuzzer dictionary (see README)\n"
+       "  -p schedule   - power schedule: explore (default), fast, rare or\n"
+       "                  frontier (needs -b)\n\n"
 
        "Other stuff:\n\n"
 
        "  -T text       - text banner to show on the screen\n"
        "  -M / -S id    - distributed mode (see parallel_fuzzing.txt)\n"
+       "  -j count      - fork workers sharing coverage (parallel_fuzzing.txt)\n"
        "  -C            - crash exploration mode (the peruvian rabbit thing)\n\n"
 
        "For additional tips, please consult %s/README.\n\n",
@@ -7443,6 +10112,12 @@ EXP_ST void setup_dirs_fds(void) {
   if (mkdir(tmp, 0700)) PFATAL("Unable to create '%s'", tmp);
   ck_free(tmp);
 
+  /* Coverage of each entry, for other instances to check before syncing. */
+
+  tmp = alloc_printf("%s/queue/.state/coverage/", out_dir);
+  if (mkdir(tmp, 0700)) PFATAL("Unable to create '%s'", tmp);
+  ck_free(tmp);
+
   /* Sync directory for keeping track of cooperating fuzzers. */
 
   if (sync_id) {
@@ -7729,14 +10404,10 @@ static void fix_up_sync(void) {
   if (dumb_mode)
     FATAL("-S / -M and -n are mutually exclusive");
 
-  if (skip_deterministic) {
+  /* Deterministic stages are off by default here, so there is no -d to
+     complain about; -M turns them back on. */
 
-    if (force_deterministic)
-      FATAL("use -S instead of -M -d");
-    else
-      FATAL("-S already implies -d");
-
-  }
+  if (force_deterministic) skip_deterministic = 0;
 
   while (*x) {
 
@@ -7762,6 +10433,101 @@ static void fix_up_sync(void) {
 }
 
 
+/* Start the other workers of a -j group. Each one is a full instance with
+   a sync ID of its own (<base>_<n>), its own fork server and shm, and its
+   own share of the input test cases. What they share lives in a region
+   mapped before forking: the virgin maps, so that every find is saved by
+   one worker only and never needs to be run again by the others (they pick
+   it up from its coverage file when they sync), and the claim words that
+   let them split the fuzzing of the queue between them (group_claim()).
+   Workers other than 0 log to <out_dir>/<id>.log, and stop when worker 0
+   goes away. */
+
+static void setup_group(void) {
+
+  u32 k;
+
+  if (dumb_mode) FATAL("-j and -n are mutually exclusive");
+  if (master_max) FATAL("-j splits the work by itself, drop the :id/max from -M");
+
+  if (!sync_id) sync_id = ck_strdup("worker");
+
+  group_base = sync_id;
+
+  group_virgin = mmap(NULL, 4 * MAP_SIZE_MAX + GROUP_CPUS +
+                      (u64)group_size * GROUP_QUEUE_MAX * sizeof(u32),
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (group_virgin == MAP_FAILED) PFATAL("mmap() failed");
+
+  memset(group_virgin, 255, 3 * MAP_SIZE_MAX);
+
+  group_cpus   = group_virgin + 4 * MAP_SIZE_MAX;
+  group_claims = (u32*)(group_cpus + GROUP_CPUS);
+
+  if (mkdir(out_dir, 0700) && errno != EEXIST)
+    PFATAL("Unable to create '%s'", out_dir);
+
+  group_pids = ck_alloc(group_size * sizeof(s32));
+
+  for (k = 1; k < group_size; k++) {
+
+    s32 pid = fork();
+
+    if (pid < 0) PFATAL("fork() failed");
+
+    if (!pid) {
+
+      u8* fn = alloc_printf("%s/%s_%u.log", out_dir, group_base, k);
+      s32 fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+      if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+      dup2(fd, 1);
+      dup2(fd, 2);
+      close(fd);
+      ck_free(fn);
+
+#ifdef __linux__
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif /* __linux__ */
+
+      /* random() was seeded before we forked; give each worker a sequence
+         of its own. */
+
+      srandom(random() ^ getpid());
+
+      /* Same for UR(): make the first call reseed. */
+
+      rand_cnt = 0;
+      rand_pos = RAND_BUF;
+
+      ck_free(group_pids);
+      group_pids   = NULL;
+      group_worker = k;
+      break;
+
+    }
+
+    group_pids[k] = pid;
+
+  }
+
+  sync_id = alloc_printf("%s_%u", group_base, group_worker);
+
+  /* An explicit -f file would be shared by every worker otherwise. */
+
+  if (out_file && group_worker)
+    out_file = alloc_printf("%s.%u", out_file, group_worker);
+
+  if (group_pids)
+    OKF("Started %u more workers, logging to '%s/%s_*.log'.", group_size - 1,
+        out_dir, group_base);
+
+}
+
+
 /* Handle screen resize (SIGWINCH). */
 
 static void handle_resize(int sig) {
@@ -7993,78 +10759,226 @@ static void save_cmdline(u32 argc, char** argv) {
 } 
  
 
-int parse_branch_msg(char *file_name){ 
-    size_t len = 0;
-    u64 i,start,num_count;
+/* On-disk cache of the parsed branch graph, written next to the -b file as
+   <file>.cache. It is only trusted if the header matches the current
+   source file and map size. */
 
-    u64 branch_read[3];
+#define BRANCH_CACHE_MAGIC "AFLBRGR"
+#define BRANCH_CACHE_VER   1
 
-    char *str = NULL;
-    size_t read;
-    for(i=0;i<MAP_SIZE;i++){
-        branch_msg_list[i].count=0;
-        branch_msg_list[i].next=NULL;
-    }
+struct branch_cache_hdr {
 
-    FILE *fp = fopen(file_name,"rt");
-    if(fp == NULL) {
-        printf("can't open file:%s\n",file_name);
-        return 1;
-    }
+  u8  magic[8];                       /* BRANCH_CACHE_MAGIC               */
+  u32 version,                        /* BRANCH_CACHE_VER                 */
+      map_size,                       /* map_size it was built for        */
+      msg_cnt,                        /* Number of child records          */
+      pad;
+  u64 src_size,                       /* Size of the source file          */
+      src_mtime;                      /* Modification time of the source  */
 
-    read = getline(&str,&len,fp); 
-    while((read = getline(&str,&len,fp)) != -1)
-    {
-        start=0;
-        num_count=0;
-        i=0;
-        while(1){ 
-
-            if(str[i]=='\t'){ 
-                char *branch_id_str=malloc(i-start+1);
-                for(int ii=0;ii<(i-start);ii++){
-                    branch_id_str[ii]=str[start+ii];
-                }
-                branch_id_str[i-start]='\0';
-                branch_read[num_count]=atoi(branch_id_str); 
-                free(branch_id_str);
-                start=i+1;
-                num_count+=1;
-            }
-            if(num_count==3)
-                break;
-            i+=1;
-        } 
+};
 
-        if(branch_read[0]==65538)
-          return 1;
-        
-        if(branch_msg_list[branch_read[0]].count==0){
-            branch_msg_list[branch_read[0]].son1_branch_id=branch_read[1];
-            branch_msg_list[branch_read[0]].son2_branch_id=branch_read[2];
-        }else{
-            struct branch_msg *next,*next_front;
-            next=malloc(sizeof(struct branch_msg));
-            next->son1_branch_id=branch_read[1];
-            next->son2_branch_id=branch_read[2];
-            if(branch_msg_list[branch_read[0]].count==1){
-                branch_msg_list[branch_read[0]].next=next; 
-            }else{
-
-                next_front=branch_msg_list[branch_read[0]].next;
-
-                for(int ii=2;ii<branch_msg_list[branch_read[0]].count;ii++){
-                    next_front=next_front->next;
-                }
-                next_front->next=next; 
-            }
+/* Try to map an up-to-date cache. Returns 1 on success. */
 
-        }
-        branch_msg_list[branch_read[0]].count=branch_msg_list[branch_read[0]].count+1; 
-    
+static u8 load_branch_cache(u8* cache_fn, struct stat* src) {
+
+  struct branch_cache_hdr* hdr;
+  struct stat st;
+  u8* map;
+  s32 fd = open(cache_fn, O_RDONLY);
+
+  if (fd < 0) return 0;
+
+  if (fstat(fd, &st) || st.st_size < sizeof(struct branch_cache_hdr)) {
+    close(fd);
+    return 0;
+  }
+
+  map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) return 0;
+
+  hdr = (struct branch_cache_hdr*)map;
+
+  if (memcmp(hdr->magic, BRANCH_CACHE_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != BRANCH_CACHE_VER || hdr->map_size != map_size ||
+      hdr->src_size != src->st_size || hdr->src_mtime != src->st_mtime ||
+      st.st_size != sizeof(struct branch_cache_hdr) +
+                    (map_size + 1) * sizeof(u32) +
+                    (u64)hdr->msg_cnt * sizeof(struct branch_msg)) {
+
+    munmap(map, st.st_size);
+    return 0;
+
+  }
+
+  branch_msg_off  = (u32*)(map + sizeof(struct branch_cache_hdr));
+  branch_msg_list = (struct branch_msg*)(branch_msg_off + map_size + 1);
+  branch_msg_cnt  = hdr->msg_cnt;
+
+  return 1;
+
+}
+
+/* Write the cache. Failing to do so is not a big deal. */
+
+static void save_branch_cache(u8* cache_fn, struct stat* src) {
+
+  struct branch_cache_hdr hdr;
+  u8* tmp_fn = alloc_printf("%s.%u", cache_fn, getpid());
+  s32 fd = open(tmp_fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+  if (fd < 0) {
+    WARNF("Unable to write branch graph cache '%s'", cache_fn);
+    ck_free(tmp_fn);
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BRANCH_CACHE_MAGIC, sizeof(hdr.magic));
+  hdr.version   = BRANCH_CACHE_VER;
+  hdr.map_size  = map_size;
+  hdr.msg_cnt   = branch_msg_cnt;
+  hdr.src_size  = src->st_size;
+  hdr.src_mtime = src->st_mtime;
+
+  ck_write(fd, &hdr, sizeof(hdr), tmp_fn);
+  ck_write(fd, branch_msg_off, (map_size + 1) * sizeof(u32), tmp_fn);
+  ck_write(fd, branch_msg_list, branch_msg_cnt * sizeof(struct branch_msg),
+           tmp_fn);
+
+  close(fd);
+
+  if (rename(tmp_fn, cache_fn)) unlink(tmp_fn);
+
+  ck_free(tmp_fn);
+
+}
+
+/* Parse one tab-terminated decimal field. Returns 0 if the line ends
+   first. */
+
+static u8 read_branch_field(u8** pos, u8* end, u32* val) {
+
+  u8* p = *pos;
+  u32 v = 0;
+
+  while (p < end && *p != '\t' && *p != '\n') {
+    if (isdigit(*p)) v = v * 10 + (*p - '0');
+    p++;
+  }
+
+  if (p == end || *p != '\t') return 0;
+
+  *val = v;
+  *pos = p + 1;
+  return 1;
+
+}
+
+/* Load the static branch graph. The text file has a header line followed by
+   "edge<TAB>son1<TAB>son2<TAB>" records; an edge of 65538 ends the list. The
+   records are read in one pass, then scattered by edge into CSR arrays. */
+
+static void load_branch_msg(u8* fname) {
+
+  struct stat st;
+  u8 *cache_fn, *data, *pos, *end;
+  u32 *edges, cap = 1024, i;
+  struct branch_msg* sons;
+  s32 fd;
+
+  /* Values from 65536 up are markers in the file format. */
+
+  if (map_size > MAP_SIZE)
+    FATAL("Branch graphs (-b) need a map of at most %u bytes", MAP_SIZE);
+
+  fd = open(fname, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) PFATAL("Unable to open '%s'", fname);
+
+  cache_fn = alloc_printf("%s.cache", fname);
+
+  if (load_branch_cache(cache_fn, &st)) {
+
+    OKF("Loaded %u branch records from cache.", branch_msg_cnt);
+    ck_free(cache_fn);
+    close(fd);
+    return;
+
+  }
+
+  data = st.st_size ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+  if (data == MAP_FAILED) PFATAL("Unable to mmap '%s'", fname);
+  close(fd);
+
+  pos = data;
+  end = data + st.st_size;
+
+  /* Skip the header line. */
+
+  while (pos < end && *(pos++) != '\n');
+
+  edges = ck_alloc(cap * sizeof(u32));
+  sons  = ck_alloc(cap * sizeof(struct branch_msg));
+
+  branch_msg_cnt = 0;
+  branch_msg_off = ck_alloc((map_size + 1) * sizeof(u32));
+
+  while (pos < end) {
+
+    u32 edge, son1, son2;
+    u8 ok = read_branch_field(&pos, end, &edge) &&
+            read_branch_field(&pos, end, &son1) &&
+            read_branch_field(&pos, end, &son2);
+
+    while (pos < end && *(pos++) != '\n');
+
+    if (!ok) continue;
+    if (edge == 65538) break;
+    if (edge >= map_size) continue;
+
+    if (branch_msg_cnt == cap) {
+      cap *= 2;
+      edges = ck_realloc(edges, cap * sizeof(u32));
+      sons  = ck_realloc(sons, cap * sizeof(struct branch_msg));
     }
-    fclose(fp); 
-    return 1;
+
+    edges[branch_msg_cnt] = edge;
+    sons[branch_msg_cnt].son1_branch_id = son1;
+    sons[branch_msg_cnt].son2_branch_id = son2;
+    branch_msg_cnt++;
+
+    branch_msg_off[edge + 1]++;
+
+  }
+
+  if (data) munmap(data, st.st_size);
+
+  for (i = 0; i < map_size; i++) branch_msg_off[i + 1] += branch_msg_off[i];
+
+  /* Stable scatter, so records keep their file order within an edge. */
+
+  branch_msg_list = ck_alloc(MAX(branch_msg_cnt, 1) * sizeof(struct branch_msg));
+
+  {
+
+    u32* fill = ck_alloc(map_size * sizeof(u32));
+
+    for (i = 0; i < branch_msg_cnt; i++)
+      branch_msg_list[branch_msg_off[edges[i]] + fill[edges[i]]++] = sons[i];
+
+    ck_free(fill);
+
+  }
+
+  ck_free(edges);
+  ck_free(sons);
+
+  OKF("Parsed %u branch records from '%s'.", branch_msg_cnt, fname);
+
+  save_branch_cache(cache_fn, &st);
+  ck_free(cache_fn);
 
 }
 
@@ -8076,8 +10990,6 @@ int parse_branch_msg(char *file_name){
 
 int main(int argc, char** argv) { 
  
-  memset(chose_nums,0,MAP_SIZE);      
-
   s32 opt;
   u64 prev_queued = 0;
   u32 sync_interval_cnt = 0, seek_to;
@@ -8096,7 +11008,7 @@ int main(int argc, char** argv) {
   gettimeofday(&tv, &tz);
   srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
 
-  while ((opt = getopt(argc, argv, "+i:l:o:b:hnCB:gnCB:rnCB:znCB:f:m:t:T:dnCB:S:M:x:Q")) > 0)
+  while ((opt = getopt(argc, argv, "+i:l:o:b:p:hnCB:gnCB:rnCB:znCB:f:m:t:T:dnCB:S:M:x:Qj:")) > 0)
 
     switch (opt) {
  
@@ -8111,7 +11023,12 @@ int main(int argc, char** argv) {
 
         if (branch_filepath) FATAL("Multiple -b options not supported");
         branch_filepath = optarg;  
-        parse_branch_msg(branch_filepath); 
+        break;
+
+      case 'p': /* power schedule */
+
+        if (sched_name) FATAL("Multiple -p options not supported");
+        sched_name = optarg;
         break;
 
       case 'i': /* input dir */
@@ -8158,6 +11075,17 @@ int main(int argc, char** argv) {
         sync_id = ck_strdup(optarg);
         break;
 
+      case 'j': /* worker count */
+
+        if (group_size) FATAL("Multiple -j options not supported");
+
+        if (sscanf(optarg, "%u", &group_size) < 1 || group_size < 1 ||
+            group_size > 1024) FATAL("Bad syntax used for -j");
+
+        if (group_size == 1) group_size = 0;
+
+        break;
+
       case 'f': /* target file */
 
         if (out_file) FATAL("Multiple -f options not supported");
@@ -8236,7 +11164,6 @@ int main(int argc, char** argv) {
         if (in_bitmap) FATAL("Multiple -B options not supported");
 
         in_bitmap = optarg;
-        read_bitmap(in_bitmap);
         break;
 
       case 'C': /* crash mode */
@@ -8278,6 +11205,8 @@ int main(int argc, char** argv) {
   setup_signal_handlers();
   check_asan_opts();
 
+  if (group_size) setup_group();
+
   if (sync_id) fix_up_sync();
 
   if (!strcmp(in_dir, out_dir))
@@ -8295,6 +11224,9 @@ int main(int argc, char** argv) {
   if (getenv("AFL_NO_ARITH"))      no_arith         = 1;
   if (getenv("AFL_SHUFFLE_QUEUE")) shuffle_queue    = 1;
   if (getenv("AFL_FAST_CAL"))      fast_cal         = 1;
+  if (getenv("AFL_HAVOC_FIXED"))   havoc_fixed      = 1;
+
+  havoc_update_weights();
 
   if (getenv("AFL_HANG_TMOUT")) {
     hang_tmout = atoi(getenv("AFL_HANG_TMOUT"));
@@ -8328,10 +11260,12 @@ int main(int argc, char** argv) {
   check_cpu_governor();
 
   setup_post();
+  setup_sched();
   setup_shm();
   init_count_class16();
 
   setup_dirs_fds();
+  start_io_thread();
   read_testcases(); 
   load_auto();
 
@@ -8354,6 +11288,15 @@ int main(int argc, char** argv) {
   else
     use_argv = argv + optind;
 
+  /* Bring up the fork server before anything looks at the maps: binaries
+     built for another map size say so in the hello message, and get maps
+     of the right size before we go on. */
+
+  if (dumb_mode != 1 && !no_forkserver) init_forkserver(use_argv);
+
+  if (branch_filepath) load_branch_msg(branch_filepath);
+  setup_frontier();
+
   perform_dry_run(use_argv);
 
   cull_queue_orig();
@@ -8382,15 +11325,41 @@ int main(int argc, char** argv) {
     cull_queue_orig(); 
 
     if (!queue_cur) {   
+
+      /* A -j worker that could claim nothing only because the rest of the
+         group is busy with it waits a bit, picks up their finds and goes
+         over the same round. */
+
+      if (group_size && !group_claimed && group_waited && !group_ahead) {
+
+        show_stats();
+        usleep(GROUP_STALL_WAIT * 1000);
+        sync_fuzzers(use_argv);
+
+        group_waited  = 0;
+        current_entry = 0;
+        queue_cur     = queue;
+        continue;
+
+      }
+
+      group_round++;
+      group_claimed = group_waited = group_ahead = 0;
+
       queue_cycle++;
       current_entry     = 0;
       cur_skipped_paths = 0;
       queue_cur         = queue;
 
-      while (seek_to) {
-        current_entry++;
-        seek_to--;
-        queue_cur = queue_cur->next;
+      /* Different entries can have unrelated fields at the same offset, so
+         an offset that went idle gets full sweeps again every cycle. */
+
+      memset(byte_idle, 0, sizeof(byte_idle));
+
+      if (seek_to) {
+        current_entry = seek_to;
+        queue_cur     = queue_buf[seek_to];
+        seek_to       = 0;
       }
 
       show_stats();
@@ -8418,6 +11387,8 @@ int main(int argc, char** argv) {
 
     skipped_fuzz = fuzz_one(use_argv);
 
+    group_release();
+
     if (!stop_soon && sync_id && !skipped_fuzz) {
       
       if (!(sync_interval_cnt++ % SYNC_INTERVAL))
@@ -8429,8 +11400,8 @@ int main(int argc, char** argv) {
 
     if (stop_soon) break;
 
-    queue_cur = queue_cur->next;
     current_entry++;
+    queue_cur = current_entry < queued_paths ? queue_buf[current_entry] : NULL;
 
   }
 
@@ -8442,6 +11413,8 @@ int main(int argc, char** argv) {
 
 stop_fuzzing:
 
+  stop_io_thread();
+
   if(logfile!=NULL)
     fclose(logfile);
 
@@ -8459,10 +11432,25 @@ stop_fuzzing:
   }
 
   fclose(plot_file);
+
+  /* Worker 0 takes the rest of the group down with it. */
+
+  if (group_pids) {
+
+    u32 k;
+
+    for (k = 1; k < group_size; k++) kill(group_pids[k], SIGTERM);
+    for (k = 1; k < group_size; k++) waitpid(group_pids[k], NULL, 0);
+
+    ck_free(group_pids);
+
+  }
+
   destroy_queue();
   destroy_extras();
   ck_free(target_path);
   ck_free(sync_id);
+  ck_free(group_base);
 
   alloc_report();
 
@@ -74,6 +74,11 @@
 #define KEEP_UNIQUE_HANG    500
 #define KEEP_UNIQUE_CRASH   5000
 
+/* Writes that can be queued for the background writer thread before the
+   fuzzer has to wait for it: */
+
+#define WRITE_QUEUE_MAX     256
+
 /* Baseline number of random tweaks during a single 'havoc' stage: */
 
 #define HAVOC_CYCLES        256
@@ -99,6 +104,18 @@
 
 #define HAVOC_STACK_POW2    7
 
+/* Havoc operator weights are updated every HAVOC_ADAPT_EXECS havoc execs,
+   provided that the recent ones turned up at least HAVOC_ADAPT_MIN_FINDS
+   finds. HAVOC_ADAPT_PRIOR is how much (in units of operator cost) each
+   operator is assumed to have been used at the average rate of finds, and
+   no weight goes further than HAVOC_ADAPT_RANGE times away from its base
+   value, either way: */
+
+#define HAVOC_ADAPT_EXECS   5000
+#define HAVOC_ADAPT_MIN_FINDS 4
+#define HAVOC_ADAPT_PRIOR   500
+#define HAVOC_ADAPT_RANGE   4
+
 /* Caps on block sizes for cloning and deletion operations. Each of these
    ranges has a 33% probability of getting picked, except for the first
    two cycles where smaller blocks are favored: */
@@ -118,6 +135,10 @@
 #define SKIP_NFAV_OLD_PROB  95 /* ...no new favs, cur entry already fuzzed */
 #define SKIP_NFAV_NEW_PROB  75 /* ...no new favs, cur entry not fuzzed yet */
 
+/* Cap on the energy multiplier of the fast power schedule (-p fast): */
+
+#define SCHED_MAX_FACTOR    32
+
 /* Splicing cycle count: */
 
 #define SPLICE_CYCLES       10
@@ -130,6 +151,20 @@
 
 #define ARITH_MAX           35
 
+/* The byte_ascii stage remembers, for each of the first BYTE_SEEN_MAX
+   offsets, which values queue entries have had there, and how many sweeps
+   in a row have found nothing. Once an offset has been idle for
+   BYTE_IDLE_MAX sweeps, only the likely candidates are tried there until
+   the next queue cycle: */
+
+#define BYTE_SEEN_MAX       4096
+#define BYTE_IDLE_MAX       2
+
+/* Size of the slabs that per-entry effect maps (2 bits per input byte) are
+   carved out of; larger maps get allocations of their own: */
+
+#define EFF_SLAB_SIZE       (1024 * 1024)
+
 /* Limits for the test case trimmer. The absolute minimum chunk size; and
    the starting and ending divisors for chopping up the input file: */
 
@@ -204,6 +239,28 @@
 
 #define SYNC_INTERVAL       5
 
+/* Number of CPU cores that afl-fuzz knows how to bind to, and that the
+   workers of a -j group keep track of among themselves: */
+
+#define GROUP_CPUS          4096
+
+/* Queue entries per -j worker that the group coordinates the fuzzing of
+   (later ones are fuzzed by every worker), the bit that marks an entry as
+   being fuzzed, and how long (ms) a worker waits when all it could take is
+   being fuzzed by the others: */
+
+#define GROUP_QUEUE_MAX     (1 << 18)
+#define GROUP_BUSY          0x80000000
+#define GROUP_STALL_WAIT    50
+
+/* Each queue entry gets a coverage file in queue/.state/coverage/ when -M or
+   -S is in use, so that other instances can skip syncing cases that would
+   bring nothing new, and workers of a -j group can take each other's finds
+   without running them. Entries are packed as (offset << 8 | value), which
+   needs MAP_SIZE_MAX_POW2 <= 24. */
+
+#define COV_FILE_MAGIC      0x56434642
+
 /* Output directory reuse grace period (minutes): */
 
 #define OUTPUT_GRACE        25
@@ -253,8 +310,10 @@
  *                                                         *
  ***********************************************************/
 
-/* Call count interval between reseeding the libc PRNG from /dev/urandom: */
+/* Numbers generated per refill of the PRNG buffer behind UR(), and the
+   number of refills between reseeding the PRNG from /dev/urandom: */
 
+#define RAND_BUF            256
 #define RESEED_RNG          10000
 
 /* Maximum line length passed from GCC to 'as' and used for parsing
@@ -268,17 +327,120 @@
 
 #define LAF_SHM_ENV_VAR         "__LAF_AFL_SHM_ID"
 
+/* Binaries built with AFL_LAF_TOUCH append the index of every laf map byte
+   that goes from zero to non-zero to a list right after the laf map, so
+   that afl-fuzz can scan and clear just those words. Runs that touch more
+   bytes than this fall back to full scans: */
+
+#define LAF_TOUCH_MAX       4096
+#define LAF_TOUCH_SIZE      ((LAF_TOUCH_MAX + 1) * 4)
+
+/* Binaries built with AFL_CMPLOG record the operands of their comparisons
+   in a third SHM region, passed in CMPLOG_SHM_ENV_VAR. Each comparison site
+   gets a random ID below CMPLOG_IDS, and at most CMPLOG_PER_ID entries are
+   kept per ID and CMPLOG_MAX overall. Memory compares keep up to CMPLOG_BUF
+   bytes of each operand, and switches are logged for their first
+   CMPLOG_CASES cases: */
+
+#define CMPLOG_SHM_ENV_VAR  "__AFL_CMPLOG_SHM_ID"
+#define CMPLOG_IDS          65536
+#define CMPLOG_PER_ID       4
+#define CMPLOG_MAX          4096
+#define CMPLOG_BUF          32
+#define CMPLOG_CASES        32
+
+/* Maximum number of execs the cmplog stage may spend on a single queue
+   entry: */
+
+#define CMPLOG_MAX_EXECS    4096
+
+/* Layout of the cmplog region. Integer compares (type CMPLOG_INS) keep
+   their operands as little-endian values of 'size' bytes; memory compares
+   (CMPLOG_RTN) keep 'size' bytes of each buffer. The pass sets CMPLOG_STR
+   in the length it hands the runtime for strcmp() and strncmp(). */
+
+#define CMPLOG_INS          1
+#define CMPLOG_RTN          2
+#define CMPLOG_STR          0x80000000
+
+struct cmplog_entry {
+
+  u32 id;                             /* Comparison site ID               */
+  u8  type;                           /* CMPLOG_INS or CMPLOG_RTN         */
+  u8  size;                           /* Operand size in bytes            */
+  u16 pad;
+  u8  op[2][CMPLOG_BUF];              /* Operand values or buffers        */
+
+};
+
+struct cmplog_map {
+
+  volatile u32 on;                    /* Set by afl-fuzz to start logging */
+  u32 cnt;                            /* Entries used                     */
+  u8  hits[CMPLOG_IDS];               /* Entries logged per ID            */
+  struct cmplog_entry log[CMPLOG_MAX];
+
+};
+
+/* Binaries built with AFL_MAP_DIRTY also flag every MAP_LINE-byte line of
+   the trace map that they write to, in a byte map that follows it, so that
+   afl-fuzz can clear and scan just those lines: */
+
+#define MAP_LINE_SHIFT      6
+#define MAP_LINE            (1 << MAP_LINE_SHIFT)
+
+/* Persistent-mode binaries that take test cases from shared memory can run
+   a batch of inputs per fork server round trip. The batch region starts
+   with four u32 words (runtime ready flag, inputs queued, inputs finished,
+   padding) and BATCH_MAX lengths, then BATCH_DATA bytes of input data, and
+   finally a trace map and a laf map per input, back to back. There is room
+   for BATCH_MAX pairs of MAP_SIZE maps; targets with larger maps get fewer
+   inputs per batch: */
+
+#define BATCH_MAX           64
+#define BATCH_DATA          (1 * 1024 * 1024)
+
+#define BATCH_HDR_SIZE      ((4 + BATCH_MAX) * 4)
+#define BATCH_MAPS_OFF      (BATCH_HDR_SIZE + BATCH_DATA)
+#define BATCH_SIZE          (BATCH_MAPS_OFF + 2 * BATCH_MAX * MAP_SIZE)
+
+/* Snapshot mode (AFL_SNAPSHOT): the runtime keeps a copy of all writable
+   memory, and after each run puts back the pages that the kernel's
+   soft-dirty bits say were written. Limits on the number of mappings and
+   file descriptors tracked, and the size of the scratch area used while
+   restoring (it also serves as the stack for that): */
+
+#define SNAPSHOT_MAX_MAPS   8192
+#define SNAPSHOT_MAX_FDS    1024
+#define SNAPSHOT_SCRATCH    (2 * 1024 * 1024)
+
 /* Other less interesting, internal-only variables. */
 
 #define CLANG_ENV_VAR       "__AFL_CLANG_MODE"
 #define AS_LOOP_ENV_VAR     "__AFL_AS_LOOPCHECK"
 #define PERSIST_ENV_VAR     "__AFL_PERSISTENT"
 #define DEFER_ENV_VAR       "__AFL_DEFER_FORKSRV"
-
-/* In-code signatures for deferred and persistent mode. */
+#define LAF_TOUCH_ENV_VAR   "__AFL_LAF_TOUCH"
+#define SHM_FUZZ_ENV_VAR    "__AFL_SHM_FUZZ_ID"
+#define SHM_BATCH_ENV_VAR   "__AFL_SHM_BATCH_ID"
+#define MAP_DIRTY_ENV_VAR   "__AFL_MAP_DIRTY"
+#define MAP_SIZE_ENV_VAR    "__AFL_MAP_SIZE"
+#define SNAPSHOT_ENV_VAR    "__AFL_SNAPSHOT"
+
+/* In-code signatures for deferred and persistent mode, for binaries that
+   keep a touched-byte list for the laf map or flag dirty trace map lines,
+   for harnesses that take test cases from shared memory, for the
+   strcmp() / memcmp() constants left behind by compare-transform-pass, and
+   for binaries that can log comparison operands. The CMP_DICT_SIG one is
+   followed by (length, bytes) records and a zero length. */
 
 #define PERSIST_SIG         "##SIG_AFL_PERSISTENT##"
 #define DEFER_SIG           "##SIG_AFL_DEFER_FORKSRV##"
+#define LAF_TOUCH_SIG       "##SIG_AFL_LAF_TOUCH##"
+#define SHM_FUZZ_SIG        "##SIG_AFL_SHM_FUZZ##"
+#define MAP_DIRTY_SIG       "##SIG_AFL_MAP_DIRTY##"
+#define CMP_DICT_SIG        "##SIG_AFL_CMP_DICT##"
+#define CMPLOG_SIG          "##SIG_AFL_CMPLOG##"
 
 /* Distinctive bitmap signature used to indicate failed execution: */
 
@@ -293,6 +455,17 @@
 
 #define FORKSRV_FD          198
 
+/* Binaries built with afl-clang-fast report the size of their maps in the
+   fork server hello message, as FS_OPT_MAPSIZE ORed with its log2: */
+
+#define FS_OPT_MAPSIZE      0x40000000
+#define FS_OPT_GET_MAPSIZE(_x) (1U << ((_x) & 0xff))
+
+/* Persistent mode binaries also set FS_OPT_LAF_CLEAN: they clear the laf
+   map between iterations themselves, so afl-fuzz does not have to. */
+
+#define FS_OPT_LAF_CLEAN    0x20000000
+
 /* Fork server init timeout multiplier: we'll wait the user-selected
    timeout plus this much for the fork server to spin up. */
 
@@ -313,11 +486,21 @@
    2; you probably want to keep it under 18 or so for performance reasons
    (adjusting AFL_INST_RATIO when compiling is probably a better way to solve
    problems with complex programs). You need to recompile the target binary
-   after changing this - otherwise, SEGVs may ensue. */
+   after changing this - otherwise, SEGVs may ensue.
+
+   This is the default; afl-clang-fast builds a binary for another size
+   when AFL_MAP_SIZE is set, and afl-fuzz picks that up from the fork server.
+   The edge map and the laf map are always the same size. */
 
 #define MAP_SIZE_POW2       16
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
 
+/* Range of map sizes that can be chosen at build time: */
+
+#define MAP_SIZE_MIN_POW2   10
+#define MAP_SIZE_MAX_POW2   22
+#define MAP_SIZE_MAX        (1 << MAP_SIZE_MAX_POW2)
+
 /* Maximum allocator request size (keep well under INT_MAX): */
 
 #define MAX_ALLOC           0x40000000
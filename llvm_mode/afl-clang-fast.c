@@ -119,6 +119,16 @@ static void edit_params(u32 argc, char** argv) {
 
      http://clang.llvm.org/docs/SanitizerCoverage.html#tracing-pcs-with-guards */
 
+  /* The cmplog pass goes first, so that it sees comparisons before the laf
+     passes below split them up. */
+
+  if (getenv("AFL_CMPLOG")) {
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-load";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = alloc_printf("%s/cmplog-pass.so", obj_path);
+  }
+
   // laf
   if (getenv("LAF_SPLIT_SWITCHES")) {
     cc_params[cc_par_cnt++] = "-Xclang";
@@ -294,6 +304,27 @@ static void edit_params(u32 argc, char** argv) {
 #endif /* ^__APPLE__ */
     "_I(); } while (0)";
 
+  /* Harnesses that take their input from shared memory use these, plus
+     __AFL_FUZZ_INIT() once at file scope. The signature works like the
+     one in __AFL_LOOP(). */
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_INIT()="
+    "extern unsigned char *__afl_fuzz_ptr";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_BUF=__afl_fuzz_ptr";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_LEN="
+    "({ static volatile char *_S __attribute__((used)); "
+    " _S = (char*)\"" SHM_FUZZ_SIG "\"; "
+#ifdef __APPLE__
+    "__attribute__((visibility(\"default\"))) "
+    "unsigned int _F(void) __asm__(\"___afl_fuzz_testcase_len\"); "
+#else
+    "__attribute__((visibility(\"default\"))) "
+    "unsigned int _F(void) __asm__(\"__afl_fuzz_testcase_len\"); "
+#endif /* ^__APPLE__ */
+    "_F(); })";
+
   if (maybe_linking) {
 
     if (x_set) {
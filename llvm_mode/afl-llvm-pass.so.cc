@@ -32,11 +32,14 @@
 #include <unistd.h>
 
 #include "llvm/ADT/Statistic.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include "llvm/ADT/DAGDeltaAlgorithm.h"
 #include "llvm/ADT/DeltaAlgorithm.h"
@@ -44,8 +47,12 @@
 #include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <fcntl.h>
 #include <string.h> 
 #include <cstring> 
+#include <algorithm>
+#include <string>
+#include <vector>
 
 using namespace llvm;
 
@@ -99,6 +106,103 @@ bool AFLCoverage::runOnModule(Module &M) {
 
   }
 
+  /* Decide map size. Both the edge map and the laf map get map_size bytes;
+     the laf map is addressed by bit, and split into quarters by compare
+     type (see below). The size goes into the __afl_map_size section, where
+     the runtime picks it up and reports it to afl-fuzz. */
+
+  char* map_size_str = getenv("AFL_MAP_SIZE");
+  unsigned int map_size = MAP_SIZE;
+
+  if (map_size_str) {
+
+    if (sscanf(map_size_str, "%u", &map_size) != 1 ||
+        map_size < (1U << MAP_SIZE_MIN_POW2) || map_size > MAP_SIZE_MAX ||
+        (map_size & (map_size - 1)))
+      FATAL("Bad value of AFL_MAP_SIZE (must be a power of two between %u "
+            "and %u)", 1U << MAP_SIZE_MIN_POW2, MAP_SIZE_MAX);
+
+  }
+
+  GlobalVariable *MapSizeVar = new GlobalVariable(M, Int32Ty, true,
+    GlobalValue::PrivateLinkage, ConstantInt::get(Int32Ty, map_size),
+    "__afl_map_size_entry");
+
+  MapSizeVar->setSection("__afl_map_size");
+  MapSizeVar->setAlignment(4);
+  appendToUsed(M, MapSizeVar);
+
+  /* With AFL_LAF_TOUCH, every laf byte that goes from zero to non-zero is
+     also reported to __afl_laf_touch(), so that afl-fuzz can scan and clear
+     only the touched words. A signature string tells afl-fuzz about it. */
+
+  bool laf_touch = !!getenv("AFL_LAF_TOUCH");
+
+  Constant *LafTouch = NULL;
+
+  if (laf_touch) {
+
+    LafTouch = M.getOrInsertFunction("__afl_laf_touch",
+      FunctionType::get(Type::getVoidTy(C), Int32Ty, false));
+
+    Constant *Sig = ConstantDataArray::getString(C, LAF_TOUCH_SIG);
+    GlobalVariable *SigVar = new GlobalVariable(M, Sig->getType(), true,
+      GlobalValue::PrivateLinkage, Sig, "__afl_laf_touch_sig");
+
+    appendToUsed(M, SigVar);
+
+  }
+
+  /* With AFL_MAP_DIRTY, every update of the trace map also flags its line
+     in __afl_dirty_ptr, so that afl-fuzz can clear and scan only those. */
+
+  bool map_dirty = !!getenv("AFL_MAP_DIRTY");
+
+  GlobalVariable *AFLDirtyPtr = NULL;
+
+  if (map_dirty) {
+
+    AFLDirtyPtr =
+        new GlobalVariable(M, PointerType::get(Int8Ty, 0), false,
+                           GlobalValue::ExternalLinkage, 0, "__afl_dirty_ptr");
+
+    Constant *Sig = ConstantDataArray::getString(C, MAP_DIRTY_SIG);
+    GlobalVariable *SigVar = new GlobalVariable(M, Sig->getType(), true,
+      GlobalValue::PrivateLinkage, Sig, "__afl_map_dirty_sig");
+
+    appendToUsed(M, SigVar);
+
+  }
+
+  /* With AFL_EDGE_IDS, IDs are handed out in sequence instead of at random:
+     every edge (not block) gets a counter of its own in the edge map, and
+     every laf block a bit of its own in the laf map. IDs are local to the
+     module; a constructor asks the runtime for the module's place in the
+     maps at load time, so that modules linked together don't overlap.
+     AFL_EDGE_MANIFEST names a file to append the ID -> (function, block)
+     table to. */
+
+  bool edge_ids = !!getenv("AFL_EDGE_IDS");
+  char* manifest_fn = getenv("AFL_EDGE_MANIFEST");
+
+  GlobalVariable *AFLEdgeBase = NULL, *AFLLafBase = NULL;
+
+  if (edge_ids) {
+
+    AFLEdgeBase = new GlobalVariable(M, Int32Ty, false,
+      GlobalValue::PrivateLinkage, ConstantInt::get(Int32Ty, 0),
+      "__afl_edge_base");
+
+    AFLLafBase = new GlobalVariable(M, Int32Ty, false,
+      GlobalValue::PrivateLinkage, ConstantInt::get(Int32Ty, 0),
+      "__afl_laf_base");
+
+  }
+
+  unsigned int edge_cnt = 0, laf_cnt = 0;
+  std::vector<BasicBlock*> edge_blocks;
+  std::string manifest;
+
   /* Get globals for the SHM region and the previous location. Note that
      __afl_prev_loc is thread-local. */
 
@@ -118,6 +222,58 @@ bool AFLCoverage::runOnModule(Module &M) {
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__laf_afl_prev_loc",
       0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
 
+  /* Bump the edge map counter at index Edge. */
+
+  auto bumpEdge = [&](IRBuilder<> &IRB, Value *Edge) {
+
+    /* Load SHM pointer */
+
+    LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
+    MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    Value *MapPtrIdx = IRB.CreateGEP(MapPtr, Edge);
+
+    /* Flag the line first, so that a line is never left non-zero
+       without its flag. */
+
+    if (map_dirty) {
+
+      LoadInst *DirtyPtr = IRB.CreateLoad(AFLDirtyPtr);
+      DirtyPtr->setMetadata(M.getMDKindID("nosanitize"),
+                            MDNode::get(C, None));
+      Value *DirtyIdx = IRB.CreateGEP(DirtyPtr,
+          IRB.CreateLShr(Edge, ConstantInt::get(Int32Ty, MAP_LINE_SHIFT)));
+      IRB.CreateStore(ConstantInt::get(Int8Ty, 1), DirtyIdx)
+          ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+    }
+
+    /* Update bitmap */
+
+    LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
+    Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
+    IRB.CreateStore(Incr, MapPtrIdx)
+        ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  };
+
+  /* Blocks split off by AFL_LAF_TOUCH are unnamed; the manifest shows
+     those as "-". */
+
+  auto blockName = [](BasicBlock *BB) {
+    return BB->hasName() ? BB->getName().str() : std::string("-");
+  };
+
+  /* Load a module base and add a local ID to it. */
+
+  auto rebase = [&](IRBuilder<> &IRB, GlobalVariable *Base, unsigned int id) {
+
+    LoadInst *BaseVal = IRB.CreateLoad(Base);
+    BaseVal->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    return IRB.CreateAdd(BaseVal, ConstantInt::get(Int32Ty, id));
+
+  };
+
   /* Instrument all the things! */
 
   int inst_blocks = 0;
@@ -136,7 +292,15 @@ bool AFLCoverage::runOnModule(Module &M) {
 
       if((BB.getName().str().find("normal_basicblock")!=std::string::npos)){   
 
-        unsigned int cur_loc = AFL_R(MAP_SIZE);
+        /* Edges are counted once all blocks are done, since that can mean
+           splitting the edges into this block. */
+
+        if (edge_ids) {
+          edge_blocks.push_back(&BB);
+          continue;
+        }
+
+        unsigned int cur_loc = AFL_R(map_size);
 
         ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
 
@@ -146,20 +310,7 @@ bool AFLCoverage::runOnModule(Module &M) {
         PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
         Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
 
-        /* Load SHM pointer */
-
-        LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
-        MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-        Value *MapPtrIdx =
-            IRB.CreateGEP(MapPtr, IRB.CreateXor(PrevLocCasted, CurLoc));
-
-        /* Update bitmap */
-
-        LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
-        Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-        Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
-        IRB.CreateStore(Incr, MapPtrIdx)
-            ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+        bumpEdge(IRB, IRB.CreateXor(PrevLocCasted, CurLoc));
 
         /* Set prev_loc to cur_loc >> 1 */
 
@@ -191,37 +342,57 @@ bool AFLCoverage::runOnModule(Module &M) {
         // errs()<<"block name: "<<BB.getName()<<"\n";
 
         // 1. 生成当前随机数
-        unsigned int block_id = AFL_R(MAP_SIZE*8); 
+        unsigned int block_id = AFL_R(map_size*8); 
         ConstantInt *CurLoc = ConstantInt::get(Int32Ty, block_id);
 
-        // 2. 加载前一个基本块随机数 
-        LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLafLoc); 
-        PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-        Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());  
-
         // 3. 加载共享内存
         LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtrLaf);
         MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
         
         // 4. 计算前边和后边异或的结果-->边ID 
-        Value *branch_id=IRB.CreateZExt(IRB.CreateXor(PrevLocCasted, CurLoc),IRB.getInt32Ty()); 
+        Value *branch_id;
+
+        /* Laf blocks mostly form chains with one way in, so with
+           AFL_EDGE_IDS the block gets an ID of its own. The IDs stay below
+           map_size*2 bits, which leaves the type tags below intact. */
+
+        if (edge_ids) {
+
+          branch_id = rebase(IRB, AFLLafBase, laf_cnt);
+
+          if (manifest_fn)
+            manifest += "laf " + std::to_string(laf_cnt) + " " +
+                        F.getName().str() + " " + blockName(&BB) + "\n";
+
+          laf_cnt++;
+
+        } else {
+
+          // 2. 加载前一个基本块随机数 
+          LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLafLoc); 
+          PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+          Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());  
+
+          branch_id=IRB.CreateZExt(IRB.CreateXor(PrevLocCasted, CurLoc),IRB.getInt32Ty()); 
+
+        }
 
         Value *branch_id_type; 
 
         if(split_type==1){ 
           
-          branch_id_type=IRB.CreateZExt(IRB.CreateOr(branch_id, ConstantInt::get(Int32Ty, 0x40000)), IRB.getInt32Ty());  
+          branch_id_type=IRB.CreateZExt(IRB.CreateOr(branch_id, ConstantInt::get(Int32Ty, map_size*4)), IRB.getInt32Ty());  
 
         }else if(split_type==2){
  
-          unsigned int temp = 0x3FFFF;
+          unsigned int temp = map_size*4-1;
           Value * branch_id_type2=IRB.CreateZExt(IRB.CreateAnd(branch_id, ConstantInt::get(Int32Ty, temp)), IRB.getInt32Ty());
-          ConstantInt *type2 = ConstantInt::get(Int32Ty, 0x20000);
+          ConstantInt *type2 = ConstantInt::get(Int32Ty, map_size*2);
           branch_id_type=IRB.CreateZExt(IRB.CreateOr(branch_id_type2, type2), IRB.getInt32Ty());
 
         }else{
 
-          ConstantInt * type = ConstantInt::get(Int32Ty, 0x1FFFF);
+          ConstantInt * type = ConstantInt::get(Int32Ty, map_size*2-1);
           branch_id_type=IRB.CreateZExt(IRB.CreateAnd(branch_id, type), IRB.getInt32Ty()); 
 
         } 
@@ -246,14 +417,125 @@ bool AFLCoverage::runOnModule(Module &M) {
             ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
 
         /* 将当前基本块右移一位，然后保存 */ 
-        StoreInst *Store =
-            IRB.CreateStore(ConstantInt::get(Int32Ty, block_id >> 1), AFLPrevLafLoc);
-        Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+        if (!edge_ids) {
+          StoreInst *Store =
+              IRB.CreateStore(ConstantInt::get(Int32Ty, block_id >> 1), AFLPrevLafLoc);
+          Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+        }
+
+        /* First bit set in this byte during the run? Record the byte. The
+           split-off blocks are unnamed, so the loop skips them later. */
+
+        if (laf_touch) {
+
+          Value *Fresh = IRB.CreateICmpEQ(Counter, ConstantInt::get(Int8Ty, 0));
+          TerminatorInst *Then = SplitBlockAndInsertIfThen(Fresh, &*IP, false);
+          IRBuilder<> TouchIRB(Then);
+          TouchIRB.CreateCall(LafTouch, branch_id_high16);
+
+        }
+
         extra_blocks++; 
       }  
 
     }
 
+  /* Now the edges into the blocks put aside above. A block with a single
+     way in (or the function entry) is counted in place. Otherwise, every
+     incoming edge gets a counter: at the end of the predecessor if that has
+     nowhere else to go, or in a new block split off the edge if it does.
+     Edges that can't be split (indirectbr, EH pads) fall back to counting
+     the block. */
+
+  for (BasicBlock *BB : edge_blocks) {
+
+    std::vector<BasicBlock*> preds;
+    bool split_ok = !BB->isEHPad();
+
+    for (BasicBlock *P : predecessors(BB)) {
+      if (std::find(preds.begin(), preds.end(), P) != preds.end()) continue;
+      if (isa<IndirectBrInst>(P->getTerminator())) split_ok = false;
+      preds.push_back(P);
+    }
+
+    if (preds.size() < 2 || !split_ok) preds.assign(1, (BasicBlock*)NULL);
+
+    for (BasicBlock *P : preds) {
+
+      Instruction *IP;
+
+      if (!P) IP = &*BB->getFirstInsertionPt();
+      else if (P->getTerminator()->getNumSuccessors() == 1)
+        IP = P->getTerminator();
+      else
+        IP = &*SplitCriticalEdge(P, BB,
+               CriticalEdgeSplittingOptions().setMergeIdenticalEdges())
+               ->getFirstInsertionPt();
+
+      IRBuilder<> IRB(IP);
+
+      bumpEdge(IRB, rebase(IRB, AFLEdgeBase, edge_cnt));
+
+      if (manifest_fn)
+        manifest += "edge " + std::to_string(edge_cnt) + " " +
+                    BB->getParent()->getName().str() + " " +
+                    (P ? blockName(P) : "*") + " " + blockName(BB) + "\n";
+
+      edge_cnt++;
+      inst_blocks++;
+
+    }
+
+  }
+
+  /* Have the module placed in the maps before any of its code runs: the
+     constructor hands our ID counts to __afl_edge_ids() in the runtime and
+     gets the bases back. */
+
+  if (edge_ids) {
+
+    if (edge_cnt >= map_size || laf_cnt >= map_size * 2)
+      FATAL("Too many IDs for %u-byte maps (%u edges, %u laf blocks), "
+            "raise AFL_MAP_SIZE", map_size, edge_cnt, laf_cnt);
+
+    Type *Int32PtrTy = PointerType::get(Int32Ty, 0);
+
+    Constant *EdgeIds = M.getOrInsertFunction("__afl_edge_ids",
+      FunctionType::get(Type::getVoidTy(C), { Int32PtrTy, Int32Ty, Int32PtrTy,
+                        Int32Ty, PointerType::get(Int8Ty, 0) }, false));
+
+    Function *Ctor = Function::Create(
+      FunctionType::get(Type::getVoidTy(C), false),
+      GlobalValue::InternalLinkage, "__afl_edge_ids_init", &M);
+
+    IRBuilder<> IRB(BasicBlock::Create(C, "", Ctor));
+
+    IRB.CreateCall(EdgeIds, { AFLEdgeBase, ConstantInt::get(Int32Ty, edge_cnt),
+                              AFLLafBase, ConstantInt::get(Int32Ty, laf_cnt),
+                              IRB.CreateGlobalStringPtr(
+                                M.getModuleIdentifier()) });
+    IRB.CreateRetVoid();
+
+    appendToGlobalCtors(M, Ctor, 0);
+
+    if (manifest_fn) {
+
+      s32 fd = open(manifest_fn, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+      manifest = "module " + M.getModuleIdentifier() + " " +
+                 std::to_string(edge_cnt) + " " + std::to_string(laf_cnt) +
+                 "\n" + manifest;
+
+      if (fd < 0 || write(fd, manifest.data(), manifest.size()) !=
+                    (ssize_t)manifest.size())
+        PFATAL("Unable to write '%s'", manifest_fn);
+
+      close(fd);
+
+    }
+
+  }
+
   /* Say something nice. */
 
   if (!be_quiet) {
@@ -262,6 +544,11 @@ bool AFLCoverage::runOnModule(Module &M) {
     OKF("total %d strcmp_blocks !",strcmp_blocks);
     OKF("total %d compare_blocks !",compare_blocks);
     OKF("total %d switch_blocks !",switch_blocks);
+    if (laf_touch) OKF("Recording touched laf bytes (AFL_LAF_TOUCH).");
+    if (map_dirty) OKF("Flagging dirty map lines (AFL_MAP_DIRTY).");
+    if (map_size != MAP_SIZE) OKF("Using %u-byte maps (AFL_MAP_SIZE).", map_size);
+    if (edge_ids) OKF("Numbered %u edges and %u laf blocks (AFL_EDGE_IDS).",
+                      edge_cnt, laf_cnt);
     if (!inst_blocks){
       WARNF("No instrumentation targets found.");
     } 
@@ -25,14 +25,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <setjmp.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
 
 #include <sys/mman.h>
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 
 /* This is a somewhat ugly hack for the experimental 'trace-pc-guard' mode.
    Basically, we need to make sure that the forkserver is initialized after
@@ -47,14 +50,56 @@
 
 /* Globals needed by the injected instrumentation. The __afl_area_initial region
    is used for instrumentation output before __afl_map_shm() has a chance to run.
-   It will end up as .comm, so it shouldn't be too wasteful. */
+   It will end up as .comm, so it shouldn't be too wasteful. It is sized for
+   the largest map a binary can be built with, since a binary that does not
+   fit the region handed over by afl-fuzz keeps writing here. */
 
-u8  __afl_area_initial[MAP_SIZE];
+u8  __afl_area_initial[MAP_SIZE_MAX];
 u8* __afl_area_ptr = __afl_area_initial;
 
-u8  __afl_laf_area_initial[MAP_SIZE];
+/* Dirty line flags for binaries built with AFL_MAP_DIRTY. */
+
+u8  __afl_dirty_initial[MAP_SIZE_MAX >> MAP_LINE_SHIFT];
+u8* __afl_dirty_ptr = __afl_dirty_initial;
+
+u8  __afl_laf_area_initial[MAP_SIZE_MAX];
 u8* __afl_laf_area_ptr = __afl_laf_area_initial;
 
+/* Touched-byte list for binaries built with AFL_LAF_TOUCH: entry 0 is the
+   number of bytes recorded, followed by up to LAF_TOUCH_MAX indices. */
+
+u32  __afl_laf_touch_initial[LAF_TOUCH_MAX + 1];
+u32* __afl_laf_touch_ptr = __afl_laf_touch_initial;
+
+/* Test case for harnesses using __AFL_FUZZ_TESTCASE_BUF and _LEN. Under
+   afl-fuzz, both point into a shared memory region that it fills before
+   every run; otherwise, __afl_fuzz_testcase_len() reads stdin into
+   __afl_fuzz_alt. */
+
+u8   __afl_fuzz_alt[MAX_FILE];
+u8*  __afl_fuzz_ptr = __afl_fuzz_alt;
+
+static u32 __afl_fuzz_alt_len;
+u32* __afl_fuzz_len = &__afl_fuzz_alt_len;
+
+static u8 __afl_fuzz_shm;
+
+/* Comparison log for binaries built with AFL_CMPLOG; only attached when
+   afl-fuzz hands us a region. The instrumentation checks the flag that
+   __afl_cmplog_on_ptr points to before calling in. */
+
+static struct cmplog_map* __afl_cmplog;
+
+static u32 __afl_cmplog_off;
+u32* __afl_cmplog_on_ptr = &__afl_cmplog_off;
+
+/* Batch region set up by afl-fuzz for persistent shared memory harnesses
+   (see BATCH_* in config.h), and the state of the batch being run. */
+
+static u8*  __afl_batch;
+static u32  __afl_batch_cnt, __afl_batch_cur, __afl_batch_off;
+static u8  *__afl_batch_area, *__afl_batch_laf_area;
+
 
 __thread u32 __afl_prev_loc;
 
@@ -65,9 +110,55 @@ __thread u32 __laf_afl_prev_loc;
 
 static u8 is_persistent;
 
+/* Running in snapshot mode (see __afl_snap_take())? */
+
+static u8 is_snapshot;
+
+
+/* Size of our maps: every module built by afl-llvm-pass puts the size it
+   was built for into the __afl_map_size section, and we take the largest.
+   Set up by __afl_get_map_size(). */
+
+extern u32 __start___afl_map_size[] __attribute__((weak));
+extern u32 __stop___afl_map_size[] __attribute__((weak));
+
+static u32 __afl_map_size = MAP_SIZE;
+
+/* Next free IDs in the edge and laf maps, for modules built with
+   AFL_EDGE_IDS. ID 0 is left alone in both: byte 0 of each map is the one
+   we set to 1 to tell afl-fuzz that we are alive. */
+
+static u32 __afl_edge_next = 1, __afl_laf_next = 1;
+
 
 /* SHM setup. */
 
+static void __afl_get_map_size(void) {
+
+  u32 *p, size = 0;
+
+  if (!__start___afl_map_size) return;
+
+  for (p = __start___afl_map_size; p < __stop___afl_map_size; p++)
+    if (*p > size && *p <= MAP_SIZE_MAX) size = *p;
+
+  if (size) __afl_map_size = size;
+
+}
+
+
+/* Does the region afl-fuzz gave us have room for our maps? Tools that
+   don't say use MAP_SIZE. */
+
+static u8 __afl_map_fits(void) {
+
+  u8* size_str = getenv(MAP_SIZE_ENV_VAR);
+  u32 shm_size = size_str ? atoi(size_str) : MAP_SIZE;
+
+  return __afl_map_size <= shm_size;
+
+}
+
 static void __afl_map_laf_shm(void) {
 
   u8 *id_str = getenv(LAF_SHM_ENV_VAR);
@@ -86,6 +177,11 @@ static void __afl_map_laf_shm(void) {
 
     if (__afl_laf_area_ptr == (void *)-1) _exit(1);
 
+    /* afl-fuzz only sets this when it allocated room for the list. */
+
+    if (getenv(LAF_TOUCH_ENV_VAR))
+      __afl_laf_touch_ptr = (u32*)(__afl_laf_area_ptr + __afl_map_size);
+
     /* Write something into the bitmap so that even with low AFL_INST_RATIO,
        our parent doesn't give up on us. */
 
@@ -95,10 +191,62 @@ static void __afl_map_laf_shm(void) {
 
 }
 
+static void __afl_map_shm_fuzz(void) {
+
+  u8 *id_str = getenv(SHM_FUZZ_ENV_VAR);
+  u8 *map;
+
+  if (!id_str) return;
+
+  map = shmat(atoi(id_str), NULL, 0);
+
+  if (map == (void *)-1) _exit(1);
+
+  __afl_fuzz_len = (u32*)map;
+  __afl_fuzz_ptr = map + sizeof(u32);
+  __afl_fuzz_shm = 1;
+
+  id_str = getenv(SHM_BATCH_ENV_VAR);
+
+  if (!id_str) return;
+
+  __afl_batch = shmat(atoi(id_str), NULL, 0);
+
+  if (__afl_batch == (void *)-1) _exit(1);
+
+  /* Let afl-fuzz know that we will honor batch requests. */
+
+  ((u32*)__afl_batch)[0] = 1;
+
+}
+
+static void __afl_map_cmplog_shm(void) {
+
+  u8 *id_str = getenv(CMPLOG_SHM_ENV_VAR);
+  struct cmplog_map* map;
+
+  if (!id_str) return;
+
+  map = shmat(atoi(id_str), NULL, 0);
+
+  if (map == (void *)-1) _exit(1);
+
+  __afl_cmplog = map;
+  __afl_cmplog_on_ptr = (u32*)&map->on;
+
+}
+
 static void __afl_map_shm(void) {
 
   u8 *id_str = getenv(SHM_ENV_VAR);
 
+  /* If our maps are too big for the region, stay on the private ones; the
+     fork server hello will tell afl-fuzz what size we need. */
+
+  __afl_get_map_size();
+
+  if (!__afl_map_fits()) return;
+
   /* If we're running under AFL, attach to the appropriate region, replacing the
      early-stage __afl_area_initial region that is needed to allow some really
      hacky .init code to work correctly in projects such as OpenSSL. */
@@ -113,6 +261,11 @@ static void __afl_map_shm(void) {
 
     if (__afl_area_ptr == (void *)-1) _exit(1);
 
+    /* afl-fuzz only sets this when it allocated room for the flags. */
+
+    if (getenv(MAP_DIRTY_ENV_VAR))
+      __afl_dirty_ptr = __afl_area_ptr + __afl_map_size;
+
     /* Write something into the bitmap so that even with low AFL_INST_RATIO,
        our parent doesn't give up on us. */
 
@@ -120,23 +273,376 @@ static void __afl_map_shm(void) {
 
   }
   __afl_map_laf_shm();
+  __afl_map_shm_fuzz();
+  __afl_map_cmplog_shm();
+
+}
+
+
+/* Snapshot mode (Linux only). Instead of a fresh fork() per execution, the
+   fork server child copies all of its writable memory once, runs the input,
+   and at exit() puts back the pages that the soft-dirty bits in
+   /proc/self/pagemap say were written. It then rewinds to the fork server
+   and stops itself, like a persistent mode child would. Mappings created
+   during the run are dropped, the break is reset and new file descriptors
+   are closed; other kernel state (signal handlers, file offsets, threads)
+   is not restored. */
+
+#ifdef __linux__
+
+struct snap_map {
+  u8* start;
+  u8* end;
+  u8* copy;                           /* Saved contents (if writable)     */
+  u8  writable;                       /* Private and writable?            */
+  u8  stack;                          /* The [stack] mapping?             */
+};
+
+static sigjmp_buf __afl_snap_env;
+
+/* Our own areas are shared anonymous mappings, so that the kernel never
+   merges them with the target's. The scratch area holds the text of
+   /proc/self/maps, the current mappings, a pagemap buffer and the stack
+   used for restoring; the table of saved mappings follows it. */
+
+#define SNAP_CUR_OFF        (SNAPSHOT_SCRATCH / 2)
+#define SNAP_PM_OFF         (SNAP_CUR_OFF + SNAPSHOT_MAX_MAPS * \
+                             sizeof(struct snap_map))
+#define SNAP_PM_PAGES       (SNAPSHOT_SCRATCH / 64)
+#define SNAP_STACK_SIZE     (SNAPSHOT_SCRATCH / 8)
+
+static u8*  __afl_snap_scratch;
+static u8*  __afl_snap_data;
+static struct snap_map* __afl_snap_maps;
+static u32  __afl_snap_cnt;
+static u8*  __afl_snap_brk;
+static u32  __afl_snap_page;
+static s32  __afl_snap_pagemap_fd;
+static u8   __afl_snap_fds[SNAPSHOT_MAX_FDS];
+
+
+/* Parse a hex number, moving *p past it. */
+
+static u8* __afl_snap_hex(u8** p) {
+
+  uintptr_t v = 0;
+
+  while (1) {
+
+    u8 c = **p;
+
+    if (c >= '0' && c <= '9') v = (v << 4) | (c - '0');
+    else if (c >= 'a' && c <= 'f') v = (v << 4) | (c - 'a' + 10);
+    else break;
+
+    (*p)++;
+
+  }
+
+  return (u8*)v;
 
 }
 
 
+/* Read /proc/self/maps into out[], leaving out our own areas. Runs with the
+   heap in an unknown state, so it only uses the scratch area. Returns the
+   number of entries, or 0 on failure. */
+
+static u32 __afl_snap_read_maps(struct snap_map* out) {
+
+  u8  *buf = __afl_snap_scratch, *p, *end;
+  u32 len = 0, cnt = 0;
+  s32 fd = open("/proc/self/maps", O_RDONLY), i;
+
+  if (fd < 0) return 0;
+
+  while ((i = read(fd, buf + len, SNAP_CUR_OFF - len)) > 0) len += i;
+  close(fd);
+
+  if (len == SNAP_CUR_OFF) return 0;
+
+  p   = buf;
+  end = buf + len;
+
+  while (p < end) {
+
+    u8 *start, *stop, *perm;
+
+    start = __afl_snap_hex(&p); p++;
+    stop  = __afl_snap_hex(&p); p++;
+    perm  = p;
+
+    while (p < end && *p != '\n') p++;
+
+    if (start != __afl_snap_scratch && start != __afl_snap_data) {
+
+      if (cnt == SNAPSHOT_MAX_MAPS) return 0;
+
+      out[cnt].start    = start;
+      out[cnt].end      = stop;
+      out[cnt].copy     = NULL;
+      out[cnt].writable = perm[1] == 'w' && perm[3] == 'p';
+      out[cnt].stack    = p - perm > 7 && !memcmp(p - 7, "[stack]", 7);
+      cnt++;
+
+    }
+
+    p++;
+
+  }
+
+  return cnt;
+
+}
+
+
+static void __afl_snap_clear_refs(void) {
+
+  s32 fd = open("/proc/self/clear_refs", O_WRONLY);
+
+  if (fd < 0 || write(fd, "4", 1) != 1) _exit(1);
+  close(fd);
+
+}
+
+
+/* Can we get soft-dirty bits here? Clear them, write to the stack, and see
+   if it shows up. Run once in the fork server. */
+
+static u8 __afl_snap_supported(void) {
+
+  volatile u8 probe = 0;
+  u64 e = 0;
+  s32 fd = open("/proc/self/clear_refs", O_WRONLY), pm;
+
+  if (fd < 0) return 0;
+  if (write(fd, "4", 1) != 1) { close(fd); return 0; }
+  close(fd);
+
+  probe = 1;
+
+  pm = open("/proc/self/pagemap", O_RDONLY);
+  if (pm < 0) return 0;
+
+  if (pread(pm, &e, 8, (uintptr_t)&probe / getpagesize() * 8) != 8) e = 0;
+  close(pm);
+
+  return probe && ((e >> 55) & 1);
+
+}
+
+
+/* Entered through SIGRTMAX, so that we run on the scratch area and can put
+   back the regular stack while nothing uses it. */
+
+static void __afl_snap_restore(int sig) {
+
+  struct snap_map* cur = (struct snap_map*)(__afl_snap_scratch + SNAP_CUR_OFF);
+  u64* pm = (u64*)(__afl_snap_scratch + SNAP_PM_OFF);
+  u32 cnt, i, j;
+
+  (void)sig;
+
+  /* The heap goes back to its old end first. */
+
+  syscall(SYS_brk, __afl_snap_brk);
+
+  /* Drop whatever got mapped during the run, i.e. any part of a current
+     mapping not covered by a saved one. The stack is left to grow. Both
+     lists are sorted by address. */
+
+  cnt = __afl_snap_read_maps(cur);
+  if (!cnt) _exit(1);
+
+  for (i = 0; i < cnt; i++) {
+
+    u8* p = cur[i].start;
+
+    if (cur[i].stack) continue;
+
+    for (j = 0; j < __afl_snap_cnt && p < cur[i].end; j++) {
+
+      struct snap_map* m = &__afl_snap_maps[j];
+
+      if (m->end <= p || m->start >= cur[i].end) continue;
+      if (m->start > p) munmap(p, m->start - p);
+      p = m->end;
+
+    }
+
+    if (p < cur[i].end) munmap(p, cur[i].end - p);
+
+  }
+
+  /* Put back the written pages. A saved mapping that is gone or no longer
+     writable in places is mapped again and restored in full. */
+
+  cnt = __afl_snap_read_maps(cur);
+  if (!cnt) _exit(1);
+
+  for (j = 0; j < __afl_snap_cnt; j++) {
+
+    struct snap_map* m = &__afl_snap_maps[j];
+    u8* p = m->start;
+
+    if (!m->copy) continue;
+
+    for (i = 0; i < cnt && p < m->end; i++)
+      if (cur[i].start <= p && cur[i].end > p && cur[i].writable)
+        p = cur[i].end;
+
+    if (p < m->end) {
+
+      if (mmap(m->start, m->end - m->start, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        _exit(1);
+
+      memcpy(m->start, m->copy, m->end - m->start);
+      continue;
+
+    }
+
+    for (p = m->start; p < m->end; ) {
+
+      u32 pages = MIN((m->end - p) / __afl_snap_page, SNAP_PM_PAGES);
+
+      if (pread(__afl_snap_pagemap_fd, pm, pages * 8,
+                (uintptr_t)p / __afl_snap_page * 8) != pages * 8) _exit(1);
+
+      for (i = 0; i < pages; i++, p += __afl_snap_page)
+        if ((pm[i] >> 55) & 1)
+          memcpy(p, m->copy + (p - m->start), __afl_snap_page);
+
+    }
+
+  }
+
+  for (i = 0; i < SNAPSHOT_MAX_FDS; i++)
+    if (!__afl_snap_fds[i] && fcntl(i, F_GETFD) != -1) close(i);
+
+  __afl_snap_clear_refs();
+
+  siglongjmp(__afl_snap_env, 1);
+
+}
+
+
+/* atexit() handler: switch to the scratch stack and restore. */
+
+static void __afl_snap_exit(void) {
+
+  stack_t ss;
+  struct sigaction sa;
+  sigset_t set;
+
+  ss.ss_sp    = __afl_snap_scratch + SNAPSHOT_SCRATCH - SNAP_STACK_SIZE;
+  ss.ss_size  = SNAP_STACK_SIZE;
+  ss.ss_flags = 0;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = __afl_snap_restore;
+  sa.sa_flags   = SA_ONSTACK;
+  sigfillset(&sa.sa_mask);
+
+  if (sigaltstack(&ss, NULL) || sigaction(SIGRTMAX, &sa, NULL)) _exit(1);
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGRTMAX);
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+  raise(SIGRTMAX);
+
+}
+
+
+/* Take the snapshot in a fresh fork server child. Returns 0 right away,
+   and 1 every time the child has been rewound to this point. */
+
+static u8 __afl_snap_take(void) {
+
+  u64 len = 0;
+  u32 i;
+  u8* p;
+
+  if (sigsetjmp(__afl_snap_env, 1)) return 1;
+
+  __afl_snap_page = getpagesize();
+
+  __afl_snap_pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  if (__afl_snap_pagemap_fd < 0) _exit(1);
+
+  __afl_snap_scratch = mmap(NULL, SNAPSHOT_SCRATCH + SNAPSHOT_MAX_MAPS *
+                            sizeof(struct snap_map), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (__afl_snap_scratch == MAP_FAILED) _exit(1);
+
+  __afl_snap_maps = (struct snap_map*)(__afl_snap_scratch + SNAPSHOT_SCRATCH);
+
+  for (i = 0; i < SNAPSHOT_MAX_FDS; i++)
+    __afl_snap_fds[i] = fcntl(i, F_GETFD) != -1;
+
+  __afl_snap_brk = (u8*)syscall(SYS_brk, 0);
+
+  if (atexit(__afl_snap_exit)) _exit(1);
+
+  /* The data area goes in last, and is left out of the table by address
+     when it is next read. */
+
+  __afl_snap_cnt = __afl_snap_read_maps(__afl_snap_maps);
+  if (!__afl_snap_cnt) _exit(1);
+
+  for (i = 0; i < __afl_snap_cnt; i++)
+    if (__afl_snap_maps[i].writable)
+      len += __afl_snap_maps[i].end - __afl_snap_maps[i].start;
+
+  __afl_snap_data = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (__afl_snap_data == MAP_FAILED) _exit(1);
+
+  for (i = 0, p = __afl_snap_data; i < __afl_snap_cnt; i++) {
+
+    struct snap_map* m = &__afl_snap_maps[i];
+
+    if (!m->writable) continue;
+
+    m->copy = p;
+    memcpy(p, m->start, m->end - m->start);
+    p += m->end - m->start;
+
+  }
+
+  __afl_snap_clear_refs();
+
+  return 0;
+
+}
+
+#endif /* __linux__ */
+
+
 /* Fork server logic. */
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
+  u32 hello = FS_OPT_MAPSIZE;
   s32 child_pid;
 
   u8  child_stopped = 0;
 
-  /* Phone home and tell the parent that we're OK. If parent isn't there,
-     assume we're not running in forkserver mode and just execute program. */
+  while (FS_OPT_GET_MAPSIZE(hello) < __afl_map_size) hello++;
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (is_persistent) hello |= FS_OPT_LAF_CLEAN;
+
+  /* Phone home and tell the parent that we're OK, and how big our maps are.
+     If parent isn't there, assume we're not running in forkserver mode and
+     just execute program. */
+
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return;
+
+#ifdef __linux__
+  is_snapshot = getenv(SNAPSHOT_ENV_VAR) && !is_persistent &&
+                __afl_snap_supported();
+#endif /* __linux__ */
 
   while (1) {
 
@@ -169,6 +675,16 @@ static void __afl_start_forkserver(void) {
 
         close(FORKSRV_FD);
         close(FORKSRV_FD + 1);
+
+#ifdef __linux__
+
+        /* Every time we get rewound, report the run as done, and wait to
+           be woken up for the next one. */
+
+        if (is_snapshot && __afl_snap_take()) raise(SIGSTOP);
+
+#endif /* __linux__ */
+
         return;
   
       }
@@ -187,12 +703,13 @@ static void __afl_start_forkserver(void) {
 
     if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
 
-    if (waitpid(child_pid, &status, is_persistent ? WUNTRACED : 0) < 0)
+    if (waitpid(child_pid, &status,
+                (is_persistent || is_snapshot) ? WUNTRACED : 0) < 0)
       _exit(1);
 
-    /* In persistent mode, the child stops itself with SIGSTOP to indicate
-       a successful run. In this case, we want to wake it up without forking
-       again. */
+    /* In persistent and snapshot mode, the child stops itself with SIGSTOP
+       to indicate a successful run. In this case, we want to wake it up
+       without forking again. */
 
     if (WIFSTOPPED(status)) child_stopped = 1;
 
@@ -205,6 +722,115 @@ static void __afl_start_forkserver(void) {
 }
 
 
+/* Load input number __afl_batch_cur of the current batch into the test case
+   buffer and point the instrumentation at its own pair of maps. */
+
+static void __afl_batch_load(void) {
+
+  u32* hdr = (u32*)__afl_batch;
+  u32  len = hdr[4 + __afl_batch_cur];
+  u8*  maps = __afl_batch + BATCH_MAPS_OFF + 2 * __afl_batch_cur * __afl_map_size;
+
+  memcpy(__afl_fuzz_ptr, __afl_batch + BATCH_HDR_SIZE + __afl_batch_off, len);
+  *__afl_fuzz_len = len;
+  __afl_batch_off += len;
+
+  __afl_area_ptr = maps;
+  __afl_laf_area_ptr = maps + __afl_map_size;
+
+  __afl_area_ptr[0] = 1;
+  __afl_prev_loc = 0;
+  __afl_laf_area_ptr[0] = 1;
+  __laf_afl_prev_loc = 0;
+
+}
+
+
+/* Called whenever we are woken up: if afl-fuzz queued a batch, start on its
+   first input. */
+
+static void __afl_batch_start(void) {
+
+  u32* hdr;
+
+  if (!__afl_batch) return;
+
+  hdr = (u32*)__afl_batch;
+  if (!hdr[1] || hdr[1] > BATCH_MAX ||
+      (u64)hdr[1] * __afl_map_size > (u64)BATCH_MAX * MAP_SIZE) return;
+
+  __afl_batch_cnt = hdr[1];
+  __afl_batch_cur = 0;
+  __afl_batch_off = 0;
+
+  __afl_batch_area = __afl_area_ptr;
+  __afl_batch_laf_area = __afl_laf_area_ptr;
+
+  __afl_batch_load();
+
+}
+
+
+/* Go back to the regular maps once a batch is over. */
+
+static void __afl_batch_stop(void) {
+
+  if (!__afl_batch_cnt) return;
+
+  __afl_area_ptr = __afl_batch_area;
+  __afl_laf_area_ptr = __afl_batch_laf_area;
+  __afl_batch_cnt = 0;
+
+}
+
+
+/* Called at the end of every iteration. Counts the input that just finished
+   and moves on to the next one, returning 0 if the batch (if any) is done. */
+
+static u8 __afl_batch_next(void) {
+
+  if (!__afl_batch_cnt) return 0;
+
+  ((u32*)__afl_batch)[2] = ++__afl_batch_cur;
+
+  if (__afl_batch_cur < __afl_batch_cnt) {
+    __afl_batch_load();
+    return 1;
+  }
+
+  __afl_batch_stop();
+  return 0;
+
+}
+
+
+/* Clear the laf map between persistent iterations. With a touched-byte
+   list, only the listed bytes (and byte 0) can be set; without one, or if
+   it overflowed, the whole map goes. afl-fuzz leaves this to us when the
+   fork server hello carries FS_OPT_LAF_CLEAN. */
+
+static void __afl_laf_reset(void) {
+
+  u32 cnt = __afl_laf_touch_ptr[0], i;
+
+  if (__afl_laf_touch_ptr == __afl_laf_touch_initial || cnt > LAF_TOUCH_MAX) {
+
+    memset(__afl_laf_area_ptr, 0, __afl_map_size);
+
+  } else {
+
+    for (i = 0; i < cnt; i++)
+      __afl_laf_area_ptr[__afl_laf_touch_ptr[i + 1] & (__afl_map_size - 1)] = 0;
+
+  }
+
+  __afl_laf_touch_ptr[0] = 0;
+  __afl_laf_area_ptr[0] = 1;
+  __laf_afl_prev_loc = 0;
+
+}
+
+
 /* A simplified persistent mode handler, used as explained in README.llvm. */
 
 int __afl_persistent_loop(unsigned int max_cnt) {
@@ -221,31 +847,42 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (is_persistent) {
 
-      memset(__afl_area_ptr, 0, MAP_SIZE);
+      memset(__afl_area_ptr, 0, __afl_map_size);
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
 
-      memset(__afl_laf_area_ptr, 0, MAP_SIZE);
+      memset(__afl_laf_area_ptr, 0, __afl_map_size);
       __afl_laf_area_ptr[0] = 1;
+      __afl_laf_touch_ptr[0] = 0;
       __laf_afl_prev_loc = 0;
     }
 
     cycle_cnt  = max_cnt;
     first_pass = 0;
+
+    if (is_persistent) __afl_batch_start();
+
     return 1;
 
   }
 
   if (is_persistent) {
 
+    /* Inputs from a batch are run back to back without stopping. */
+
+    u8 batch_more = __afl_batch_next();
+
     if (--cycle_cnt) {
 
+      if (batch_more) return 1;
+
       raise(SIGSTOP);
 
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
-      __afl_laf_area_ptr[0] = 1;
-      __laf_afl_prev_loc = 0;
+      __afl_laf_reset();
+
+      __afl_batch_start();
 
       return 1;
 
@@ -255,7 +892,10 @@ int __afl_persistent_loop(unsigned int max_cnt) {
          follows the loop is not traced. We do that by pivoting back to the
          dummy output region. */
 
+      __afl_batch_stop();
       __afl_area_ptr = __afl_area_initial;
+      __afl_laf_area_ptr = __afl_laf_area_initial;
+      __afl_laf_touch_ptr = __afl_laf_touch_initial;
 
     }
 
@@ -266,6 +906,143 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 }
 
 
+/* Called by AFL_LAF_TOUCH instrumentation when a laf map byte goes from
+   zero to non-zero. Past LAF_TOUCH_MAX entries we just keep counting, which
+   tells afl-fuzz to fall back to a full scan. */
+
+void __afl_laf_touch(u32 idx) {
+
+  u32 cnt = __afl_laf_touch_ptr[0]++;
+
+  if (cnt < LAF_TOUCH_MAX) __afl_laf_touch_ptr[cnt + 1] = idx;
+
+}
+
+
+/* Called by AFL_CMPLOG instrumentation before comparisons. Nothing is
+   logged unless afl-fuzz has switched the log on for this run; equal
+   operands tell it nothing, and each site gets at most CMPLOG_PER_ID
+   entries so that a hot loop can't fill the log. */
+
+static struct cmplog_entry* __afl_cmplog_slot(u32 id) {
+
+  struct cmplog_map* map = __afl_cmplog;
+
+  if (!map || !map->on || map->cnt >= CMPLOG_MAX) return NULL;
+
+  id &= CMPLOG_IDS - 1;
+
+  if (map->hits[id] >= CMPLOG_PER_ID) return NULL;
+
+  map->hits[id]++;
+
+  return &map->log[map->cnt++];
+
+}
+
+void __afl_cmplog_ins(u32 id, u64 a, u64 b, u32 size) {
+
+  struct cmplog_entry* e;
+
+  if (a == b || !(e = __afl_cmplog_slot(id))) return;
+
+  e->id   = id;
+  e->type = CMPLOG_INS;
+  e->size = size;
+
+  memcpy(e->op[0], &a, sizeof(u64));
+  memcpy(e->op[1], &b, sizeof(u64));
+
+}
+
+/* String compares come with CMPLOG_STR set in len, and we stop after the
+   first NUL in either string, since callers like to pass strncmp() a bound
+   larger than the strings; strcmp() has no bound at all. */
+
+void __afl_cmplog_rtn(u32 id, u8* a, u8* b, u32 len) {
+
+  struct cmplog_entry* e;
+  u8 str = !!(len & CMPLOG_STR);
+  u32 i;
+
+  if (!__afl_cmplog || !__afl_cmplog->on || !a || !b || a == b) return;
+
+  len &= ~CMPLOG_STR;
+
+  if ((str && !len) || len > CMPLOG_BUF) len = CMPLOG_BUF;
+
+  if (str) {
+
+    for (i = 0; i < len; i++)
+      if (!a[i] || !b[i]) { i++; break; }
+
+  } else i = len;
+
+  if (!memcmp(a, b, i) || !(e = __afl_cmplog_slot(id))) return;
+
+  e->id   = id;
+  e->type = CMPLOG_RTN;
+  e->size = i;
+
+  memcpy(e->op[0], a, i);
+  memcpy(e->op[1], b, i);
+
+}
+
+
+/* Called from the constructor of every module built with AFL_EDGE_IDS,
+   before any of its code runs: give the module the next edges IDs in the
+   edge map and laf_edges bits in the laf map. If a map runs out of room,
+   start over from 1; modules then share IDs, as they would without
+   AFL_EDGE_IDS. Setting AFL_EDGE_BASES to a file name makes us append the
+   bases there, to go with the manifest written by the pass. */
+
+void __afl_edge_ids(u32* edge_base, u32 edges, u32* laf_base, u32 laf_edges,
+                    const char* module) {
+
+  u8* bases_fn = getenv("AFL_EDGE_BASES");
+
+  __afl_get_map_size();
+
+  if (__afl_edge_next + edges > __afl_map_size) __afl_edge_next = 1;
+  if (__afl_laf_next + laf_edges > __afl_map_size * 2) __afl_laf_next = 1;
+
+  *edge_base = __afl_edge_next;
+  *laf_base  = __afl_laf_next;
+
+  __afl_edge_next += edges;
+  __afl_laf_next  += laf_edges;
+
+  if (bases_fn) {
+
+    FILE* f = fopen(bases_fn, "a");
+
+    if (f) {
+      fprintf(f, "%s %u %u\n", module, *edge_base, *laf_base);
+      fclose(f);
+    }
+
+  }
+
+}
+
+
+/* Length of the current test case, for __AFL_FUZZ_TESTCASE_LEN. */
+
+u32 __afl_fuzz_testcase_len(void) {
+
+  s32 len;
+
+  if (__afl_fuzz_shm) return *__afl_fuzz_len;
+
+  len = read(0, __afl_fuzz_alt, MAX_FILE);
+  __afl_fuzz_alt_len = len < 0 ? 0 : len;
+
+  return __afl_fuzz_alt_len;
+
+}
+
+
 /* This one can be called from user code when deferred forkserver mode
     is enabled. */
 
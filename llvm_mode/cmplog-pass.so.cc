@@ -0,0 +1,267 @@
+/*
+   american fuzzy lop - LLVM-mode comparison operand logging
+   ---------------------------------------------------------
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Loaded by afl-clang-fast when AFL_CMPLOG is set, ahead of the laf passes
+   so that it still sees comparisons whole. Every integer comparison (16 to
+   64 bits wide), every switch on such a value, and every strcmp(),
+   strncmp(), memcmp() and bcmp() call gets a call into afl-llvm-rt.o that
+   records both operands. afl-fuzz turns logging on only while it runs its
+   cmplog stage; the rest of the time, each site costs an inline load and
+   a branch around the call.
+
+ */
+
+#define AFL_LLVM_PASS
+
+#include "../config.h"
+#include "../debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+  class CmpLog : public ModulePass {
+
+    public:
+
+      static char ID;
+      CmpLog() : ModulePass(ID) { }
+
+      bool runOnModule(Module &M) override;
+
+  };
+
+}
+
+
+char CmpLog::ID = 0;
+
+
+/* Only integers from 16 to 64 bits are worth logging: single bytes are
+   what the laf passes already break everything down to. */
+
+static bool loggable(Type *T) {
+
+  IntegerType *IT = dyn_cast<IntegerType>(T);
+
+  return IT && IT->getBitWidth() >= 16 && IT->getBitWidth() <= 64;
+
+}
+
+
+/* Wrap whatever is inserted before I in "if (*__afl_cmplog_on_ptr)", and
+   return the instruction to insert it before. */
+
+static TerminatorInst *ifLogging(Module &M, Instruction *I, Value *OnPtr) {
+
+  LLVMContext &C = M.getContext();
+  MDNode *NoSan = MDNode::get(C, None);
+  IRBuilder<> IRB(I);
+
+  LoadInst *Ptr = IRB.CreateLoad(OnPtr);
+  Ptr->setMetadata(M.getMDKindID("nosanitize"), NoSan);
+
+  LoadInst *On = IRB.CreateLoad(Ptr);
+  On->setMetadata(M.getMDKindID("nosanitize"), NoSan);
+
+  return SplitBlockAndInsertIfThen(
+    IRB.CreateICmpNE(On, ConstantInt::get(IRB.getInt32Ty(), 0)), I, false,
+    MDBuilder(C).createBranchWeights(1, 1000));
+
+}
+
+
+bool CmpLog::runOnModule(Module &M) {
+
+  LLVMContext &C = M.getContext();
+
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+  IntegerType *Int64Ty = IntegerType::getInt64Ty(C);
+  PointerType *Int8PtrTy = Type::getInt8PtrTy(C);
+
+  char be_quiet = !isatty(2) || getenv("AFL_QUIET");
+
+  struct timeval tv;
+  struct timezone tz;
+
+  gettimeofday(&tv, &tz);
+  srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
+
+  Constant *LogIns = M.getOrInsertFunction("__afl_cmplog_ins",
+    FunctionType::get(Type::getVoidTy(C),
+                      { Int32Ty, Int64Ty, Int64Ty, Int32Ty }, false));
+
+  Constant *LogRtn = M.getOrInsertFunction("__afl_cmplog_rtn",
+    FunctionType::get(Type::getVoidTy(C),
+                      { Int32Ty, Int8PtrTy, Int8PtrTy, Int32Ty }, false));
+
+  GlobalVariable *OnPtr =
+      new GlobalVariable(M, PointerType::get(Int32Ty, 0), false,
+                         GlobalValue::ExternalLinkage, 0, "__afl_cmplog_on_ptr");
+
+  std::vector<ICmpInst*>   cmps;
+  std::vector<SwitchInst*> switches;
+  std::vector<CallInst*>   calls;
+
+  for (auto &F : M) {
+
+    if (F.getName().startswith("__afl_")) continue;
+
+    for (auto &BB : F)
+      for (auto &IN : BB) {
+
+        if (ICmpInst *Cmp = dyn_cast<ICmpInst>(&IN)) {
+
+          if (loggable(Cmp->getOperand(0)->getType()) &&
+              !(isa<Constant>(Cmp->getOperand(0)) &&
+                isa<Constant>(Cmp->getOperand(1))))
+            cmps.push_back(Cmp);
+
+        } else if (SwitchInst *Sw = dyn_cast<SwitchInst>(&IN)) {
+
+          if (loggable(Sw->getCondition()->getType()) && Sw->getNumCases() &&
+              !isa<Constant>(Sw->getCondition()))
+            switches.push_back(Sw);
+
+        } else if (CallInst *Call = dyn_cast<CallInst>(&IN)) {
+
+          Function *Callee = Call->getCalledFunction();
+
+          if (!Callee || Call->getCallingConv() != CallingConv::C) continue;
+
+          StringRef Name = Callee->getName();
+          FunctionType *FT = Callee->getFunctionType();
+          unsigned args = Name == "strcmp" ? 2 :
+                          (Name == "strncmp" || Name == "memcmp" ||
+                           Name == "bcmp") ? 3 : 0;
+
+          if (!args || FT->getNumParams() != args ||
+              !FT->getParamType(0)->isPointerTy() ||
+              !FT->getParamType(1)->isPointerTy() ||
+              (args == 3 && !FT->getParamType(2)->isIntegerTy()))
+            continue;
+
+          calls.push_back(Call);
+
+        }
+
+      }
+
+  }
+
+  for (auto Cmp : cmps) {
+
+    IRBuilder<> IRB(ifLogging(M, Cmp, OnPtr));
+    unsigned bytes = Cmp->getOperand(0)->getType()->getIntegerBitWidth() / 8;
+
+    IRB.CreateCall(LogIns, {
+      ConstantInt::get(Int32Ty, random() % CMPLOG_IDS),
+      IRB.CreateZExt(Cmp->getOperand(0), Int64Ty),
+      IRB.CreateZExt(Cmp->getOperand(1), Int64Ty),
+      ConstantInt::get(Int32Ty, bytes) });
+
+  }
+
+  /* A switch is logged as a compare against each of its cases, up to
+     CMPLOG_CASES of them. Each case gets an ID of its own, counting up from
+     a random base, so that the CMPLOG_PER_ID cap doesn't cut the list
+     short. */
+
+  for (auto Sw : switches) {
+
+    IRBuilder<> IRB(ifLogging(M, Sw, OnPtr));
+    Value *Cond = IRB.CreateZExt(Sw->getCondition(), Int64Ty);
+    unsigned bytes = Sw->getCondition()->getType()->getIntegerBitWidth() / 8,
+             base = random() % CMPLOG_IDS, n = 0;
+
+    for (auto Case : Sw->cases()) {
+
+      if (n == CMPLOG_CASES) break;
+
+      Constant *Id = ConstantInt::get(Int32Ty, (base + n++) % CMPLOG_IDS);
+
+      IRB.CreateCall(LogIns, { Id, Cond,
+        ConstantInt::get(Int64Ty, Case.getCaseValue()->getZExtValue()),
+        ConstantInt::get(Int32Ty, bytes) });
+
+    }
+
+  }
+
+  /* String compares get CMPLOG_STR ORed into the length, which strcmp()
+     doesn't have, so that the runtime stops at the first NUL. */
+
+  for (auto Call : calls) {
+
+    IRBuilder<> IRB(ifLogging(M, Call, OnPtr));
+    StringRef Name = Call->getCalledFunction()->getName();
+    Value *Len = Call->getNumArgOperands() == 3 ?
+      IRB.CreateZExtOrTrunc(Call->getArgOperand(2), Int32Ty) :
+      (Value*)ConstantInt::get(Int32Ty, 0);
+
+    if (Name == "strcmp" || Name == "strncmp")
+      Len = IRB.CreateOr(Len, ConstantInt::get(Int32Ty, CMPLOG_STR));
+
+    IRB.CreateCall(LogRtn, {
+      ConstantInt::get(Int32Ty, random() % CMPLOG_IDS),
+      IRB.CreatePointerCast(Call->getArgOperand(0), Int8PtrTy),
+      IRB.CreatePointerCast(Call->getArgOperand(1), Int8PtrTy),
+      Len });
+
+  }
+
+  /* Let afl-fuzz know that the binary can log comparisons. */
+
+  Constant *Sig = ConstantDataArray::getString(C, CMPLOG_SIG);
+  GlobalVariable *SigVar = new GlobalVariable(M, Sig->getType(), true,
+    GlobalValue::PrivateLinkage, Sig, "__afl_cmplog_sig");
+
+  appendToUsed(M, SigVar);
+
+  if (!be_quiet)
+    OKF("Logging %u compares, %u switches and %u memory compares (AFL_CMPLOG).",
+        (unsigned)cmps.size(), (unsigned)switches.size(),
+        (unsigned)calls.size());
+
+  return true;
+
+}
+
+
+static void registerCmpLogPass(const PassManagerBuilder &,
+                               legacy::PassManagerBase &PM) {
+
+  PM.add(new CmpLog());
+
+}
+
+
+static RegisterStandardPasses RegisterCmpLogPass(
+    PassManagerBuilder::EP_OptimizerLast, registerCmpLogPass);
+
+static RegisterStandardPasses RegisterCmpLogPass0(
+    PassManagerBuilder::EP_EnabledOnOptLevel0, registerCmpLogPass);
+
@@ -18,6 +18,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "../config.h"
+
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
@@ -26,11 +28,14 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Pass.h"
 #include "llvm/Analysis/ValueTracking.h"
 
+#include <algorithm>
 #include <set>
+#include <string>
 
 using namespace llvm;
 
@@ -144,6 +149,10 @@ bool CompareTransform::transformCmps(Module &M, const bool processStrcmp, const
   if (calls.size()==0)
     return false;
   errs() << "Replacing " << calls.size() << " calls to strcmp/memcmp\n";
+
+  /* the constants are also left in the binary, for afl-fuzz to pick up as
+   * dictionary tokens */
+  std::set<std::string> tokens;
   
   for (auto &callInst: calls) {
 
@@ -174,6 +183,10 @@ bool CompareTransform::transformCmps(Module &M, const bool processStrcmp, const
 
     errs() << "len " << constLen << ": " << ConstStr << "\n";
 
+    uint64_t tokenLen = std::min<uint64_t>(constLen, ConstStr.size());
+    if (tokenLen)
+      tokens.insert(ConstStr.substr(0, std::min<uint64_t>(tokenLen, 255)).str());
+
     /* split before the call instruction */
     BasicBlock *bb = callInst->getParent();
     BasicBlock *end_bb = bb->splitBasicBlock(BasicBlock::iterator(callInst)); 
@@ -227,6 +240,24 @@ bool CompareTransform::transformCmps(Module &M, const bool processStrcmp, const
     ReplaceInstWithInst(callInst->getParent()->getInstList(), ii, PN);
   }
 
+  if (!tokens.empty()) {
+
+    std::string dict(CMP_DICT_SIG);
+    dict.push_back('\0');
+
+    for (auto &t: tokens) {
+      dict.push_back((char)t.size());
+      dict += t;
+    }
+    dict.push_back('\0');
+
+    Constant *Dict = ConstantDataArray::getString(C, dict, false);
+    GlobalVariable *DictVar = new GlobalVariable(M, Dict->getType(), true,
+      GlobalValue::PrivateLinkage, Dict, "__afl_cmp_dict");
+    appendToUsed(M, DictVar);
+
+  }
+
 
   return true;
 }